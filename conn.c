@@ -27,7 +27,10 @@
 #include "log.h"
 #include "frame.h"
 #include "rx.h"
+#include "tx.h"
 #include "ll.h"
+#include "trace.h"
+#include "reactor.h"
 
 /* convert a name into a connection ID
    this internal funtion can ignore the 'initialized' flag for connection types */
@@ -341,14 +344,15 @@ EXPORT int xbee_conNew(struct xbee *xbee, struct xbee_con **retCon, unsigned cha
 	con->userData = userData;
 	ll_init(&con->rxList);
 	xsys_sem_init(&con->callbackSem);
+	xsys_mutex_init(&con->callbackMutex);
 	xsys_mutex_init(&con->txMutex);
 
-	/* this mapping is implemented as an extension, therefore it is entirely optional! */
+	/* this mapping is implemented as an extension, therefore it is entirely optional!
+	   it is given the new connection, before it is added to the list */
 	if (xbee->f->conNew) {
-		int ret;
-		if ((ret = xbee->f->conNew(xbee, retCon, id, address, userData)) != 0) {
+		if ((ret = xbee->f->conNew(xbee, &con, id, address, userData)) != 0) {
 			/* ret should be either 0 / XBEE_ESTALE */;
-			return ret;
+			goto die2;
 		}
 	}
 	
@@ -362,6 +366,8 @@ EXPORT int xbee_conNew(struct xbee *xbee, struct xbee_con **retCon, unsigned cha
 	xbee_conLogAddress(xbee, address);
 
 	goto done;
+die2:
+	xbee_conFree(xbee, con);
 die1:
 done:
 	return ret;
@@ -434,6 +440,7 @@ EXPORT int xbee_connTx(struct xbee *xbee, struct xbee_con *con, char *data, int
 	struct bufData *buf;
 	struct xbee_conType *conType;
 	int waitForAckEnabled;
+	int frameIdHeld = 0;
 	
 	/* check parameters */
 	if (!xbee) {
@@ -476,6 +483,7 @@ EXPORT int xbee_connTx(struct xbee *xbee, struct xbee_con *con, char *data, int
 		} else {
 			/* mark the FrameID as present */
 			con->frameID_enabled = 1;
+			frameIdHeld = 1;
 		}
 	}
 	
@@ -499,8 +507,13 @@ EXPORT int xbee_connTx(struct xbee *xbee, struct xbee_con *con, char *data, int
 	
 	if (!xbee->f->connTx) {
 		/* if there is no connTx mapped, then add the packet to libxbee's txlist, and prod the tx thread */
+		xbee_trace4(tx_enqueue, xbee, con, buf, buf->len);
+		/* a sender that is waiting for the ACK doesn't want the frame once it has given up, anything else is kept for as long
+		   as it takes */
+		if (frameIdHeld) xbee_txSetDeadline(buf, con->frameID);
 		ll_add_tail(&xbee->txList, buf);
 		xsys_sem_post(&xbee->txSem);
+		if (xbee->reactor) xbee_reactorTxWake(xbee);
 	} else {
 		/* same as before, if a mapping is registered, then the packet isn't queued for Tx, at least not here
 		   instead we execute the mapped function */
@@ -508,21 +521,28 @@ EXPORT int xbee_connTx(struct xbee *xbee, struct xbee_con *con, char *data, int
 	}
 	
 	/* if we should be waiting for an Ack, we now need to wait */
-	if (waitForAckEnabled && con->frameID) {
+	if (frameIdHeld) {
 		xbee_log(4,"Waiting for txSem for con @ %p", con);
 		/* the wait occurs inside xbee_frameIdGetACK() */
 		ret = xbee_frameIdGetACK(xbee, con, con->frameID);
 		if (ret) xbee_log(4,"--- xbee_frameIdGetACK() returned: %d",ret);
+		/* disable the frameID - this must happen before the unlock, or it could clear the next transmitter's */
+		con->frameID_enabled = 0;
 		/* unlock the connection so that other transmitters may follow on */
 		xbee_log(4,"Unlocking txMutex for con @ %p", con);
 		xsys_mutex_unlock(&con->txMutex);
 	}
-	/* disable the frameID */
-	con->frameID_enabled = 0;
 	
 	goto done;
 die2:
 	free(buf);
+	/* nothing is going to ACK the FrameID now, so give it back and let the next transmitter in */
+	if (frameIdHeld) {
+		xbee->frameIds[con->frameID].con = NULL;
+		con->frameID_enabled = 0;
+		xbee_log(4,"Unlocking txMutex for con @ %p (failed)", con);
+		xsys_mutex_unlock(&con->txMutex);
+	}
 die1:
 done:
 	return ret;
@@ -533,6 +553,7 @@ done:
 int xbee_conFree(struct xbee *xbee, struct xbee_con *con) {
 	if (!xbee) return XBEE_ENOXBEE;
 	xsys_mutex_destroy(&con->txMutex);
+	xsys_mutex_destroy(&con->callbackMutex);
 	xsys_sem_destroy(&con->callbackSem);
 	ll_destroy(&con->rxList, (void(*)(void*))xbee_pktFree);
 	free(con);
@@ -544,6 +565,7 @@ int xbee_conFree(struct xbee *xbee, struct xbee_con *con) {
 EXPORT int xbee_conEnd(struct xbee *xbee, struct xbee_con *con, void **userData) {
 	struct xbee_conType *conType;
 	struct xbee_pkt *pkt;
+	int ret;
 	int i;
 	
 	/* check parameters */
@@ -557,8 +579,11 @@ EXPORT int xbee_conEnd(struct xbee *xbee, struct xbee_con *con, void **userData)
 	/* check the connection */
 	if (_xbee_conValidate(xbee, con, &conType)) return XBEE_EINVAL;
 	
-	/* remove the connection from the list */
-	if (ll_ext_item(&(conType->conList), con)) return XBEE_EINVAL;
+	/* remove the connection from the list, once any packet that is being delivered to it has arrived */
+	xsys_mutex_lock(&conType->conMutex);
+	ret = ll_ext_item(&(conType->conList), con);
+	xsys_mutex_unlock(&conType->conMutex);
+	if (ret) return XBEE_EINVAL;
 	
 	/* chop up any queued packets */
 	for (i = 0; (pkt = ll_ext_head(&(con->rxList))) != NULL; i++) {
@@ -569,14 +594,22 @@ EXPORT int xbee_conEnd(struct xbee *xbee, struct xbee_con *con, void **userData)
 	/* if the userData parameter is provided, then give the con's userData back to the caller */
 	if (userData) *userData = con->userData;
 
-	/* if there is a callback thread running, then kill it off */
+	/* if there is a callback thread running, then kill it off
+	   the lock stops it from deciding to stop (without tidying up) while we aren't looking */
+	xsys_mutex_lock(&con->callbackMutex);
 	if (con->callbackRunning) {
+		__atomic_add_fetch(&xbee->conEnding, 1, __ATOMIC_ACQ_REL);
+		con->ended = 1;
 		con->destroySelf = 1;
 		xsys_sem_post(&con->callbackSem);
+		xsys_mutex_unlock(&con->callbackMutex);
 		
 		/* inform the caller that we are waiting for the callback to complete */
 		return XBEE_ECALLBACK;
 	}
+	/* and make sure that a new one isn't started */
+	con->destroySelf = 1;
+	xsys_mutex_unlock(&con->callbackMutex);
 
 	/* it is only safe to call _xbee_conEnd2() once the callback thread has completed, this will finish tidying up the connection */
 	return _xbee_conEnd2(xbee, con);
@@ -0,0 +1,188 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "internal.h"
+#include "escape.h"
+
+#if !defined(XBEE_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define XBEE_ESCAPE_SSE2
+const char xbee_escapeKernels[] = "sse2";
+#elif !defined(XBEE_NO_SIMD) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define XBEE_ESCAPE_NEON
+const char xbee_escapeKernels[] = "neon";
+#else
+const char xbee_escapeKernels[] = "scalar";
+#endif
+
+/* for the bytes that are left over (or everything, without SIMD) */
+#define XBEE_ESCAPE_TX 0x01
+#define XBEE_ESCAPE_RX 0x02
+static const unsigned char xbee_escapeTable[256] = {
+	[0x11] = XBEE_ESCAPE_TX,
+	[0x13] = XBEE_ESCAPE_TX,
+	[0x7D] = XBEE_ESCAPE_TX | XBEE_ESCAPE_RX,
+	[0x7E] = XBEE_ESCAPE_TX | XBEE_ESCAPE_RX,
+};
+
+#ifdef XBEE_ESCAPE_NEON
+/* NEON has no movemask, so narrow the 0x00 / 0xFF comparison to 4 bits a byte, the first set nibble is the first match */
+static inline int xbee_escapeNeonFirst(uint8x16_t m) {
+	uint64_t bits;
+	bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+	if (!bits) return -1;
+	return __builtin_ctzll(bits) >> 2;
+}
+#endif
+
+int xbee_escapeFind(const unsigned char *data, int len) {
+	int i = 0;
+#if defined(XBEE_ESCAPE_SSE2)
+	const __m128i d = _mm_set1_epi8(0x7E);
+	const __m128i e = _mm_set1_epi8(0x7D);
+	const __m128i x = _mm_set1_epi8(0x11);
+	const __m128i y = _mm_set1_epi8(0x13);
+	__m128i v, m;
+	int bits;
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&data[i]);
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, d), _mm_cmpeq_epi8(v, e)),
+		                 _mm_or_si128(_mm_cmpeq_epi8(v, x), _mm_cmpeq_epi8(v, y)));
+		if ((bits = _mm_movemask_epi8(m)) != 0) return i + __builtin_ctz(bits);
+	}
+#elif defined(XBEE_ESCAPE_NEON)
+	uint8x16_t v, m;
+	int n;
+	for (; i + 16 <= len; i += 16) {
+		v = vld1q_u8(&data[i]);
+		m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(0x7E)), vceqq_u8(v, vdupq_n_u8(0x7D))),
+		             vorrq_u8(vceqq_u8(v, vdupq_n_u8(0x11)), vceqq_u8(v, vdupq_n_u8(0x13))));
+		if ((n = xbee_escapeNeonFirst(m)) != -1) return i + n;
+	}
+#endif
+	for (; i < len; i++) {
+		if (xbee_escapeTable[data[i]] & XBEE_ESCAPE_TX) return i;
+	}
+	return len;
+}
+
+int xbee_escapeFindRx(const unsigned char *data, int len) {
+	int i = 0;
+#if defined(XBEE_ESCAPE_SSE2)
+	const __m128i d = _mm_set1_epi8(0x7E);
+	const __m128i e = _mm_set1_epi8(0x7D);
+	__m128i v;
+	int bits;
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&data[i]);
+		if ((bits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, d), _mm_cmpeq_epi8(v, e)))) != 0) return i + __builtin_ctz(bits);
+	}
+#elif defined(XBEE_ESCAPE_NEON)
+	uint8x16_t v;
+	int n;
+	for (; i + 16 <= len; i += 16) {
+		v = vld1q_u8(&data[i]);
+		if ((n = xbee_escapeNeonFirst(vorrq_u8(vceqq_u8(v, vdupq_n_u8(0x7E)), vceqq_u8(v, vdupq_n_u8(0x7D))))) != -1) return i + n;
+	}
+#endif
+	for (; i < len; i++) {
+		if (xbee_escapeTable[data[i]] & XBEE_ESCAPE_RX) return i;
+	}
+	return len;
+}
+
+unsigned char xbee_escapeSum(const unsigned char *data, int len) {
+	unsigned int sum = 0;
+	int i = 0;
+#if defined(XBEE_ESCAPE_SSE2)
+	/* psadbw against zero adds up 8 bytes into each 64-bit half */
+	const __m128i z = _mm_setzero_si128();
+	__m128i acc = z;
+	for (; i + 16 <= len; i += 16) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)&data[i]), z));
+	}
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#elif defined(XBEE_ESCAPE_NEON)
+	/* the 16-bit lanes wrap, but only the bottom 8 bits of the sum matter */
+	uint16x8_t acc = vdupq_n_u16(0);
+	uint64x2_t s;
+	for (; i + 16 <= len; i += 16) {
+		acc = vpadalq_u8(acc, vld1q_u8(&data[i]));
+	}
+	s = vpaddlq_u32(vpaddlq_u16(acc));
+	sum = vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1);
+#endif
+	for (; i < len; i++) {
+		sum += data[i];
+	}
+	return sum & 0xFF;
+}
+
+/* ######################################################################### */
+
+int xbee_escapeEncode(const unsigned char *in, int len, unsigned char *out) {
+	int i, o, n;
+	
+	for (i = o = 0; i < len; ) {
+		/* copy everything up to the next byte that needs escaping */
+		n = xbee_escapeFind(&in[i], len - i);
+		memcpy(&out[o], &in[i], n);
+		i += n;
+		o += n;
+		if (i >= len) break;
+		out[o++] = 0x7D;
+		out[o++] = in[i++] ^ 0x20;
+	}
+	
+	return o;
+}
+
+int xbee_escapeDecode(unsigned char *out, int max, const unsigned char *in, int len, int *outLen, char *escaped) {
+	int i, o, n;
+	
+	for (i = o = 0; i < len && o < max; ) {
+		/* an unescaped start delimiter always ends the frame, even straight after an escape character */
+		if (in[i] == 0x7E) break;
+		if (*escaped) {
+			out[o++] = in[i++] ^ 0x20;
+			*escaped = 0;
+			continue;
+		}
+		/* copy everything up to the next escape character (or delimiter) */
+		n = len - i;
+		if (n > max - o) n = max - o;
+		if ((n = xbee_escapeFindRx(&in[i], n)) > 0) {
+			memmove(&out[o], &in[i], n);
+			i += n;
+			o += n;
+			continue;
+		}
+		if (in[i] == 0x7D) {
+			*escaped = 1;
+			i++;
+		}
+	}
+	
+	*outLen = o;
+	return i;
+}
@@ -0,0 +1,48 @@
+#ifndef __XBEE_ESCAPE_H
+#define __XBEE_ESCAPE_H
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* API mode 2 escaping, a block at a time
+   the start delimiter (0x7E), the escape character (0x7D), XON (0x11) and XOFF (0x13) are sent as 0x7D followed by the
+   byte XOR'ed with 0x20. these look for the bytes that need attention 16 at a time (SSE2 or NEON), copying the runs
+   between them in one go, with a plain C version for everything else (or if XBEE_NO_SIMD is defined) */
+
+/* which kernels were built in - "sse2", "neon" or "scalar" */
+extern const char xbee_escapeKernels[];
+
+/* the index of the first byte that must be escaped on the way out, or 'len' if there are none */
+int xbee_escapeFind(const unsigned char *data, int len);
+/* the index of the first start delimiter or escape character on the way in, or 'len' if there are none */
+int xbee_escapeFindRx(const unsigned char *data, int len);
+
+/* the 8-bit sum of 'len' bytes - a frame's checksum is 0xFF minus the sum of its data */
+unsigned char xbee_escapeSum(const unsigned char *data, int len);
+
+/* escape 'len' bytes into 'out', which must have room for 2 * len. returns the number of bytes written */
+int xbee_escapeEncode(const unsigned char *in, int len, unsigned char *out);
+
+/* unescape 'in' into 'out', stopping before a start delimiter, or once 'max' bytes have been written
+   'out' may be the same as 'in' to unescape in place. an escape character at the end of 'in' is remembered in *escaped,
+   and applied to the first byte of the next call. returns the number of bytes of 'in' used, with *outLen written */
+int xbee_escapeDecode(unsigned char *out, int max, const unsigned char *in, int len, int *outLen, char *escaped);
+
+#endif /* __XBEE_ESCAPE_H */
@@ -28,6 +28,10 @@
 #include "rx.h"
 #include "tx.h"
 #include "io.h"
+#include "replay.h"
+#include "remote.h"
+#include "reactor.h"
+#include "uring.h"
 
 /* this is the default function map, used by all SERIAL xbee units */
 const struct xbee_fmap xbee_fmap_serial = {
@@ -39,6 +43,9 @@ const struct xbee_fmap xbee_fmap_serial = {
 
 	.postInit = NULL,
 	.shutdown = NULL,
+	.baudrateSet = xbee_baudrateSet,
+	.lowLatencySet = xbee_lowLatencySet,
+	.apiModeSet = xbee_apiModeSet,
 
 	/* these don't need extending / redirecting at all */
 	.conValidate = NULL,
@@ -53,5 +60,118 @@ const struct xbee_fmap xbee_fmap_serial = {
 	.pluginUnload = xbee_pluginUnload,
 
 	.netStart = xbee_netStart,
+	.netStartUnix = xbee_netStartUnix,
 	.netStop = xbee_netStop,
 };
+
+/* this function map replays a capture file (see replay.c), anything transmitted is discarded */
+const struct xbee_fmap xbee_fmap_replay = {
+	.io_open = xbee_replayIoOpen,
+	.io_close = xbee_replayIoClose,
+
+	.tx = xbee_replayTx,
+	.rx = xbee_rxSerialXBee,
+
+	.postInit = NULL,
+	.shutdown = NULL,
+	.baudrateSet = NULL, /* there is no serial port */
+	.lowLatencySet = NULL,
+	.apiModeSet = xbee_replayApiModeSet,
+
+	.conValidate = NULL,
+	.conNew = NULL,
+	.connTx = NULL,
+	.conEnd = NULL,
+	.conOptions = NULL,
+	.conSleep = NULL,
+	.conWake = NULL,
+
+	.pluginLoad = xbee_pluginLoad,
+	.pluginUnload = xbee_pluginUnload,
+
+	.netStart = xbee_netStart,
+	.netStartUnix = xbee_netStartUnix,
+	.netStop = xbee_netStop,
+};
+
+/* this function map uses the module of a libxbee network server (see remote.c), everything is forwarded over the network */
+const struct xbee_fmap xbee_fmap_remote = {
+	.io_open = xbee_remoteIoOpen,
+	.io_close = xbee_remoteIoClose,
+	.tx = NULL, /* connTx() sends everything */
+	.rx = xbee_remoteRx,
+	.postInit = xbee_remotePostInit,
+	.shutdown = NULL,
+	.baudrateSet = NULL, /* the server's module is the server's business */
+	.lowLatencySet = NULL,
+	.apiModeSet = NULL,
+	.conValidate = NULL,
+	.conNew = xbee_remoteConNew,
+	.connTx = xbee_remoteConnTx,
+	.conEnd = xbee_remoteConEnd,
+	.conOptions = xbee_remoteConOptions,
+	.conSleep = xbee_remoteConSleep,
+	.conWake = xbee_remoteConWake,
+	.pluginLoad = xbee_pluginLoad,
+	.pluginUnload = xbee_pluginUnload,
+	.netStart = xbee_netStart,
+	.netStartUnix = xbee_netStartUnix,
+	.netStop = xbee_netStop,
+};
+
+/* the device is handled by the reactor's threads (see reactor.c), so there is no rx or tx thread */
+const struct xbee_fmap xbee_fmap_reactor = {
+	.io_open = xbee_io_open,
+	.io_close = xbee_io_close,
+	.tx = NULL,
+	.rx = NULL,
+	.postInit = xbee_reactorPostInit,
+	.shutdown = NULL,
+	.baudrateSet = xbee_baudrateSet,
+	.lowLatencySet = xbee_lowLatencySet,
+	.apiModeSet = xbee_apiModeSet,
+	.conValidate = NULL,
+	.conNew = NULL,
+	.connTx = NULL,
+	.conEnd = NULL,
+	.conOptions = NULL,
+	.conSleep = NULL,
+	.conWake = NULL,
+	.pluginLoad = xbee_pluginLoad,
+	.pluginUnload = xbee_pluginUnload,
+	.netStart = xbee_netStart,
+	.netStartUnix = xbee_netStartUnix,
+	.netStop = xbee_netStop,
+};
+
+#ifdef XBEE_HAVE_URING
+/* this function map is the serial function map, with the device read and written through io_uring (see uring.c) */
+const struct xbee_fmap xbee_fmap_uring = {
+	.io_open = xbee_uringIoOpen,
+	.io_close = xbee_uringIoClose,
+
+	.tx = xbee_uringTx,
+	.rx = xbee_rxSerialXBee,
+
+	.postInit = NULL,
+	.shutdown = NULL,
+	.baudrateSet = xbee_baudrateSet,
+	.lowLatencySet = xbee_lowLatencySet,
+	.apiModeSet = xbee_apiModeSet,
+
+	.conValidate = NULL,
+	.conNew = NULL,
+	.connTx = NULL,
+	.conEnd = NULL,
+	.conOptions = NULL,
+	.conSleep = NULL,
+	.conWake = NULL,
+
+	.pluginLoad = xbee_pluginLoad,
+	.pluginUnload = xbee_pluginUnload,
+
+	.netStart = xbee_netStart,
+	.netStartUnix = xbee_netStartUnix,
+	.netStop = xbee_netStop,
+};
+#endif /* XBEE_HAVE_URING */
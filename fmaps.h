@@ -22,5 +22,9 @@
 */
 
 extern const struct xbee_fmap xbee_fmap_serial;
+extern const struct xbee_fmap xbee_fmap_replay;
+extern const struct xbee_fmap xbee_fmap_remote;
+extern const struct xbee_fmap xbee_fmap_reactor;
+extern const struct xbee_fmap xbee_fmap_uring;
 
 #endif /* __XBEE_FUNC_MAP_H */
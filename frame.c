@@ -22,9 +22,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include "internal.h"
 #include "frame.h"
+#include "stats.h"
+#include "trace.h"
 
 /* get a free FrameID for message transmission */
 unsigned char xbee_frameIdGet(struct xbee *xbee, struct xbee_con *con) {
@@ -49,8 +52,10 @@ unsigned char xbee_frameIdGet(struct xbee *xbee, struct xbee_con *con) {
 			/* set the ack state to unknown, and aquire the FrameId */
 			xbee->frameIds[i].ack = XBEE_EUNKNOWN;
 			xbee->frameIds[i].con = con;
+			clock_gettime(CLOCK_MONOTONIC, &xbee->frameIds[i].start);
 			/* update the last, so that future hunting should be quicker */
 			xbee->frameIdLast = i;
+			xbee_trace3(frameid_alloc, xbee, con, i);
 			/* return the FrameID assigned */
 			ret = i;
 			break;
@@ -73,11 +78,31 @@ void xbee_frameIdGiveACK(struct xbee *xbee, unsigned char frameID, unsigned char
 	if (!info->con)       return;
 	
 	/* provide the ACK value */
+	xbee_trace3(frameid_ack, xbee, frameID, ack);
+	xbee_statsRtt(xbee, &info->start);
 	info->ack = ack;
 	/* and prod the waiter */
 	xsys_sem_post(&info->sem);
 }
 
+/* the frame that a FrameID was given out for won't be sent, give the waiter 'err' instead of an ACK
+   only if the FrameID was given out before 'before' - once the waiter has timed out, it may belong to somebody else */
+void xbee_frameIdGiveError(struct xbee *xbee, unsigned char frameID, struct timespec *before, int err) {
+	struct xbee_frameIdInfo *info;
+	if (!xbee)            return;
+	info = &(xbee->frameIds[frameID]);
+	
+	xsys_mutex_lock(&xbee->frameIdMutex);
+	if (info->con &&
+	    (info->start.tv_sec < before->tv_sec ||
+	     (info->start.tv_sec == before->tv_sec && info->start.tv_nsec <= before->tv_nsec))) {
+		xbee_trace3(frameid_ack, xbee, frameID, err);
+		info->ack = err;
+		xsys_sem_post(&info->sem);
+	}
+	xsys_mutex_unlock(&xbee->frameIdMutex);
+}
+
 /* wait for an ACK, and retrieve it */
 int xbee_frameIdGetACK(struct xbee *xbee, struct xbee_con *con, unsigned char frameID) {
 	struct xbee_frameIdInfo *info;
@@ -91,6 +116,7 @@ int xbee_frameIdGetACK(struct xbee *xbee, struct xbee_con *con, unsigned char fr
 	/* wait for AT MOST 1 second! that should REALLY be enough, but also prevent blocking indefinately */
 	if (xsys_sem_timedwait(&info->sem,1,0)) {
 		if (errno == ETIMEDOUT) {
+			xbee_trace3(frameid_timeout, xbee, con, frameID);
 			ret = XBEE_ETIMEOUT;
 		} else {
 			ret = XBEE_ESEMAPHORE;
@@ -23,6 +23,7 @@
 
 unsigned char xbee_frameIdGet(struct xbee *xbee, struct xbee_con *con);
 void xbee_frameIdGiveACK(struct xbee *xbee, unsigned char frameID, unsigned char ack);
+void xbee_frameIdGiveError(struct xbee *xbee, unsigned char frameID, struct timespec *before, int err);
 int xbee_frameIdGetACK(struct xbee *xbee, struct xbee_con *con, unsigned char frameID);
 
 #endif /* __XBEE_FRAME_H */
@@ -27,6 +27,9 @@
 
 struct bufData;
 struct xbee_conType;
+struct xbee_recordInfo;
+struct xbee_reactorInst;
+struct xbee_uringInfo;
 
 extern struct xbee *xbee_default;
 
@@ -35,26 +38,93 @@ extern struct xbee *xbee_default;
 struct xbee_netInfo {
 	int fd;
 	int listenPort;
-	xsys_thread listenThread;
+	int family;    /* AF_INET or AF_UNIX */
+	int sockType;  /* SOCK_STREAM or SOCK_SEQPACKET */
+	char *unixPath; /* the socket file to remove at xbee_netStop(), NULL for AF_INET or abstract names */
+	int epfd;
+	int wakeFd; /* an eventfd in the epoll set, xbee_netStop() uses it to tell the loop to return */
+	xsys_thread loopThread;
 	struct ll_head clientList;
+	struct xbee *xbee;
+
+	/* requests waiting for a worker (struct xbee_netJob), and the workers that run them */
+	xsys_mutex jobMutex;
+	struct ll_head jobList;
+	xsys_sem jobSem;
+	xsys_thread *workers;
+	int workerCount;
+	volatile char workersStop;
 };
+/* bytes are read from the device in chunks of up to this many */
+#define XBEE_IO_CHUNKLEN 256
+/* the longest frame (API identifier, data and checksum) */
+#define XBEE_MAX_PACKETLEN 128
+
 struct xbee_device {
 	char *path;
-	int fd;
-	FILE *f;
+	int fd; /* O_NONBLOCK, see xbee_io_open() */
 	int baudrate;
 	int ready;
+	
+	int apiMode;      /* 1 (unescaped) or 2 (escaped) framing, see xbee_apiModeSet() */
+	int lowLatency;   /* see xbee_lowLatencySet() */
+	int latencyTimer; /* the USB adapter's latency timer (ms) from before low latency was applied, or -1 */
+	
+	/* data that has been read, but not yet handed out by xbee_io_getRawByte(), only touched by the rx thread */
+	unsigned char rxChunk[XBEE_IO_CHUNKLEN];
+	int rxChunkLen;
+	int rxChunkPos;
+	/* bytes of a bad frame that are parsed again (API mode 1), before the chunk - they have already been counted and recorded
+	   a bad frame's length and data (up to XBEE_MAX_PACKETLEN) is the most that can be waiting, see xbee_rxRescan() */
+	unsigned char rxRescan[XBEE_MAX_PACKETLEN + 2];
+	int rxRescanLen;
+	int rxRescanPos;
+	
+	xsys_mutex recordMutex;
+	struct xbee_recordInfo *record; /* if not NULL, everything read from the device is captured (see replay.c) */
+	
+	struct xbee_uringInfo *uring; /* if not NULL, the device is read through io_uring (see uring.c) */
+	
+	int watchFd; /* while the device has gone, this waits for it to come back (see xbee_io_reconnect()), otherwise -1 */
 };
 struct xbee_frameIdInfo {
 	struct xbee_con *con;
 	xsys_sem sem;
 	int ack;
+	struct timespec start; /* when the FrameID was given out, for the round trip time */
+};
+/* see struct xbee_stats, and stats.c */
+struct xbee_statsInfo {
+	unsigned long long rxReads;
+	unsigned long long rxBytes;
+	
+	unsigned long long rttCount;
+	unsigned long long rttTotal;
+	unsigned int rttLast;
+	unsigned int rttMin;
+	unsigned int rttMax;
+	
+	unsigned long long txFrames;
+	unsigned long long txBytes;
+	unsigned long long txStalls;
+	unsigned long long txStallTime;
+	unsigned long long txExpired;
+	
+	unsigned long long rxCorrupt;
+	
+	unsigned long long reconnects;
+	unsigned int reconnectLast;
+	unsigned int reconnectMax;
+	unsigned long long threadRestarts;
+	unsigned int threadRestartLast;
+	unsigned int threadRestartMax;
 };
 struct xbee {
 	int running;
 	struct xbee_device device;
 	struct xbee_mode *mode;
 	const struct xbee_fmap *f;
+	void *fmapData; /* private storage for the function map */
 	
 	struct ll_head txList; /* data is struct bufData containing 'Frame Data' (no start delim, length or checksum) */
 	xsys_thread txThread;
@@ -67,7 +137,9 @@ struct xbee {
 	
 	struct ll_head threadList;
 	xsys_thread threadMonitor;
-	xsys_sem semMonitor;
+	int threadMonitorStarted; /* the monitor is started by the first xbee_threadStartMonitored() */
+	xsys_sem semMonitor;      /* posted by a monitored thread as it goes */
+	xsys_mutex threadMutex;   /* held by the monitor while it joins / restarts threads */
 	
 	xsys_thread rxThread;
 	void *rxBuf;
@@ -76,6 +148,12 @@ struct xbee {
 	struct ll_head pluginList;
 	
 	struct xbee_netInfo *net;
+	struct xbee_reactorInst *reactor; /* the instance's I/O is done by the reactor, see reactor.c */
+	
+	/* connections that have ended, but are waiting for their callback thread to finish - xbee_shutdown() waits for them */
+	int conEnding;
+	
+	struct xbee_statsInfo stats;
 };
 
 /* ######################################################################### */
@@ -89,6 +167,9 @@ struct xbee_fmap {
 
 	int  (*postInit)(struct xbee *xbe);
 	void (*shutdown)(struct xbee *xbee); /* user-facing / diversion */
+	int  (*baudrateSet)(struct xbee *xbee, int baudrate); /* user-facing / diversion */
+	int  (*lowLatencySet)(struct xbee *xbee, int enable); /* user-facing / diversion */
+	int  (*apiModeSet)(struct xbee *xbee, int apiMode); /* user-facing / diversion */
 
 	int  (*conValidate)(struct xbee *xbee, struct xbee_con *con, struct xbee_conType **conType); /* extension */
 	int  (*conNew)(struct xbee *xbee, struct xbee_con **retCon, unsigned char id, struct xbee_conAddress *address, void *userData); /* extension */
@@ -103,6 +184,7 @@ struct xbee_fmap {
 	int  (*pluginUnload)(char *filename, struct xbee *xbee); /* user-facing / diversion */
 
 	int  (*netStart)(struct xbee *xbee, int port); /* user-facing / diversion */
+	int  (*netStartUnix)(struct xbee *xbee, char *path, int type); /* user-facing / diversion */
 	int  (*netStop)(struct xbee *xbee); /* user-facing / diversion */
 };
 
@@ -118,10 +200,13 @@ struct xbee_con {
 	void(*callback)(struct xbee *xbee, struct xbee_con *con, struct xbee_pkt **pkt, void **userData);
 	xsys_thread callbackThread;
 	xsys_sem callbackSem;
+	xsys_mutex callbackMutex; /* held while the callback thread is started or stops, and while xbee_conEnd() looks at it */
 	
-	char callbackStarted : 1;
-	char callbackRunning : 1;
-	char destroySelf     : 1;
+	/* these are shared with the callback thread, so they can't share a byte with each other */
+	volatile char callbackStarted;
+	volatile char callbackRunning;
+	volatile char destroySelf;
+	volatile char ended; /* xbee_conEnd() left the connection for the callback thread to free, counted in xbee->conEnding */
 	char sleeping        : 1;
 	char wakeOnRx        : 1;
 	
@@ -138,8 +223,9 @@ struct xbee_con {
 	struct ll_head rxList; /* data is struct xbee_pkt */
 };
 
-#define XBEE_MAX_PACKETLEN 128
 struct bufData {
+	struct timespec deadline; /* only used on the txList, see xbee_txSetDeadline() */
+	unsigned char frameID; /* the FrameID that the sender is waiting on an ACK for, or 0 */
 	int len;
 	unsigned char buf[1];
 };
@@ -167,9 +253,9 @@ typedef int(*xbee_pktHandlerFunc)(struct xbee *xbee,
                                   struct xbee_pkt **pkt);
 
 struct rxData {
-	unsigned char threadStarted;
-	unsigned char threadRunning;
-	unsigned char threadShutdown;
+	volatile unsigned char threadStarted;
+	volatile unsigned char threadRunning;
+	volatile unsigned char threadShutdown;
 	struct xbee *xbee;
 	xsys_sem sem;
 	struct ll_head list; /* data is struct bufData */
@@ -218,6 +304,9 @@ struct xbee_conType {
 	struct xbee_pktHandler *rxHandler;
 	struct xbee_pktHandler *txHandler;
 	struct ll_head conList; /* data is struct xbee_con */
+	/* held by the rx handler from finding a connection until the packet has been delivered, and by xbee_conEnd() while
+	   it removes one - so a connection can't be free'd under a packet that is on its way to it */
+	xsys_mutex conMutex;
 };
 
 struct xbee_mode {
@@ -231,5 +320,6 @@ struct xbee_mode {
 
 /* xbee.c */
 int _xbee_validate(struct xbee *xbee, int acceptShutdown);
+int _xbee_setup(const struct xbee_fmap *f, char *path, int baudrate, void *fmapData, struct xbee **retXbee);
 
 #endif /* __XBEE_INTERNAL_H */
@@ -22,22 +22,26 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
 
 #include "internal.h"
 #include "log.h"
 #include "io.h"
+#include "replay.h"
+#include "stats.h"
+#include "uring.h"
+#include "escape.h"
 
 /* setup the XBee I/O device */
 int xbee_io_open(struct xbee *xbee) {
 	int ret;
 	int fd;
-	FILE *f;
 	xbee->device.ready = 0;
 	ret = XBEE_ENONE;
 	
-	/* open the device */
-	if ((fd = xsys_open(xbee->device.path, O_RDWR | O_NOCTTY)) == -1) {
+	/* open the device, nothing ever blocks on it - reads wait in xsys_poll(), and writes wait there until their deadline */
+	if ((fd = xsys_open(xbee->device.path, O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) {
 		xbee_perror(1,"xsys_open()");
 		ret = XBEE_EOPENFAILED;
 		goto die1;
@@ -50,23 +54,12 @@ int xbee_io_open(struct xbee *xbee) {
 		goto die2;
 	}
 	
-	/* open the device as a buffered FILE */
-	if ((f = xsys_fdopen(fd, "r+")) == NULL) {
-		xsys_close(fd);
-		xbee_perror(1,"xsys_fdopen()");
-		ret = XBEE_EOPENFAILED;
-		goto die2;
-	}
-	
-	/* flush the serial port */
-	xsys_fflush(f);
-	
-	/* disable buffering */
-	xsys_disableBuffer(f);
-	
-	/* keep the values */
+	/* keep the values, anything left over from before a reopen is gone */
 	xbee->device.fd = fd;
-	xbee->device.f = f;
+	xbee->device.rxChunkLen = 0;
+	xbee->device.rxChunkPos = 0;
+	xbee->device.rxRescanLen = 0;
+	xbee->device.rxRescanPos = 0;
 
 	/* setup serial port (baud, control lines etc...) */
 	if ((ret = xsys_setupSerial(xbee)) != 0) {
@@ -77,16 +70,18 @@ int xbee_io_open(struct xbee *xbee) {
 		} else {
 			xbee_log(0,"xsys_setupSerial() failed");
 		}
-		goto die3;
+		goto die2;
 	}
 	
+	/* re-apply low latency mode after a reopen, it isn't fatal if the driver doesn't have it */
+	if (xbee->device.lowLatency) xsys_setupLowLatency(xbee, 1);
+	
 	/* mark it as ready! */
 	xbee->device.ready = 1;
 	
 	goto done;
-die3:
-	xsys_fclose(f);
 die2:
+	xbee->device.fd = -1;
 	xsys_close(fd);
 die1:
 done:
@@ -96,17 +91,16 @@ done:
 /* close up the XBee I/O device */
 void xbee_io_close(struct xbee *xbee) {
 	int fd;
-	FILE *f;
 	xbee->device.ready = 0;
 	
+	/* put the driver back how we found it */
+	if (xbee->device.lowLatency) xsys_setupLowLatency(xbee, 0);
+	
 	/* keep the values, but remove them from the xbee instance */
 	fd = xbee->device.fd;
 	xbee->device.fd = -1;
-	f = xbee->device.f;
-	xbee->device.f = NULL;
 	
-	/* close the handles */
-	xsys_fclose(f);
+	/* close the handle */
 	xsys_close(fd);
 }
 
@@ -122,22 +116,325 @@ int xbee_io_reopen(struct xbee *xbee) {
 	return xbee->f->io_open(xbee);
 }
 
+/* the device has gone (e.g. a USB adapter was unplugged), wait for it to come back and open it again
+   this is called by the rx thread, and only returns early if the instance is shutting down. the tx thread keeps the
+   txList until the device is ready again, so only frames that have missed their deadline (see xbee_txSetDeadline()) are lost */
+int xbee_io_reconnect(struct xbee *xbee) {
+	struct timespec start;
+	int delay;
+	int ret;
+	int fd;
+	
+	if (!xbee->f->io_open) return XBEE_ENOTIMPLEMENTED;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	xbee_log(1,"Lost the device '%s', waiting for it to come back...", xbee->device.path);
+	if (xbee->f->io_close) xbee->f->io_close(xbee);
+	
+	/* watch before the first attempt, so that the device can't appear unnoticed in between
+	   the rx thread may be cancelled in here by xbee_shutdown(), which closes whatever watchFd holds */
+	xbee->device.watchFd = xsys_watchOpen(xbee->device.path);
+	
+	delay = XBEE_IO_RECONNECT_MIN;
+	ret = XBEE_EOPENFAILED;
+	while (xbee->running) {
+		if ((ret = xbee->f->io_open(xbee)) == XBEE_ENONE) break;
+		
+		/* try again when something changes - the delay is for when it can't be watched, or opening still fails */
+		if (xbee->device.watchFd == -1) {
+			usleep(delay * 1000);
+		} else if (xsys_watchWait(xbee->device.watchFd, xbee->device.path, delay) == 1) {
+			continue;
+		}
+		delay *= 2;
+		if (delay > XBEE_IO_RECONNECT_MAX) delay = XBEE_IO_RECONNECT_MAX;
+	}
+	
+	if (ret == XBEE_ENONE) {
+		xbee_statsReconnect(xbee, &start);
+		xbee_log(1,"The device '%s' is back", xbee->device.path);
+		/* let the tx thread know */
+		xsys_sem_post(&xbee->txSem);
+	}
+	
+	/* closing the watch can take a few ms, the tx thread is already on its way */
+	if ((fd = xbee->device.watchFd) != -1) {
+		xbee->device.watchFd = -1;
+		xsys_close(fd);
+	}
+	
+	return ret;
+}
+
+/* ######################################################################### */
+
+/* the rates that the module's BD command takes an index for, anything else is given as the rate itself */
+static const int xbee_io_bdRates[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+
+/* get the Local AT connection (there can only be one) with waitForAck enabled, to configure the module
+   xbee_io_atPut() puts it back the way it was */
+static int xbee_io_atGet(struct xbee *xbee, struct xbee_con **con, int *conCreated, struct xbee_conOptions *oldOptions) {
+	struct xbee_conAddress address;
+	struct xbee_conOptions options;
+	unsigned char conTypeId;
+	int ret;
+	
+	if ((ret = xbee_conTypeIdFromName(xbee, "Local AT", &conTypeId)) != 0) return ret;
+	memset(&address, 0, sizeof(address));
+	*conCreated = 0;
+	if ((ret = xbee_conNew(xbee, con, conTypeId, &address, NULL)) == XBEE_ENONE) {
+		*conCreated = 1;
+	} else if (ret != XBEE_EEXISTS) {
+		return ret;
+	}
+	
+	/* we need to know that each command was accepted */
+	if ((ret = xbee_conOptions(xbee, *con, oldOptions, NULL)) != 0) goto die1;
+	memcpy(&options, oldOptions, sizeof(options));
+	options.waitForAck = 1;
+	if ((ret = xbee_conOptions(xbee, *con, NULL, &options)) != 0) goto die1;
+	
+	return XBEE_ENONE;
+die1:
+	if (*conCreated) xbee_conEnd(xbee, *con, NULL);
+	return ret;
+}
+
+static void xbee_io_atPut(struct xbee *xbee, struct xbee_con *con, int conCreated, struct xbee_conOptions *oldOptions) {
+	xbee_conOptions(xbee, con, NULL, oldOptions);
+	if (conCreated) xbee_conEnd(xbee, con, NULL);
+}
+
+/* change the baud rate of the module and then the serial port, without restarting the instance
+   the module applies the new BD when it gets AC, after it has responded at the old rate */
+EXPORT int xbee_baudrateSet(struct xbee *xbee, int baudrate) {
+	int ret;
+	int i;
+	int oldBaudrate;
+	int conCreated;
+	unsigned char cmd[6];
+	int cmdLen;
+	struct xbee_con *con;
+	struct xbee_conOptions oldOptions;
+	
+	/* check parameters */
+  if (!xbee) {
+    if (!xbee_default) return XBEE_ENOXBEE;
+    xbee = xbee_default;
+  }
+  if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
+	
+	/* user-facing functions need this form of protection...
+	   this means that for the default behavior, the fmap must point at this function! */
+	if (!xbee->f->baudrateSet) return XBEE_ENOTIMPLEMENTED;
+	if (xbee->f->baudrateSet != xbee_baudrateSet) {
+		return xbee->f->baudrateSet(xbee, baudrate);
+	}
+	
+	if (!xbee->mode) return XBEE_ENOMODE;
+	if (xsys_checkBaudrate(baudrate)) return XBEE_EINVALBAUDRATE;
+	if (baudrate == xbee->device.baudrate) return XBEE_ENONE;
+	
+	/* build the BD command */
+	cmd[0] = 'B';
+	cmd[1] = 'D';
+	for (i = 0; i < sizeof(xbee_io_bdRates) / sizeof(*xbee_io_bdRates); i++) {
+		if (xbee_io_bdRates[i] == baudrate) break;
+	}
+	if (i < sizeof(xbee_io_bdRates) / sizeof(*xbee_io_bdRates)) {
+		cmd[2] = i;
+		cmdLen = 3;
+	} else {
+		cmd[2] = (baudrate >> 24) & 0xFF;
+		cmd[3] = (baudrate >> 16) & 0xFF;
+		cmd[4] = (baudrate >> 8) & 0xFF;
+		cmd[5] = baudrate & 0xFF;
+		cmdLen = 6;
+	}
+	
+	if ((ret = xbee_io_atGet(xbee, &con, &conCreated, &oldOptions)) != 0) return ret;
+	
+	/* a positive return is the module's status - 3 is 'invalid parameter' */
+	if ((ret = xbee_connTx(xbee, con, (char *)cmd, cmdLen)) != 0) {
+		xbee_log(1,"the module refused BD for %d baud (%d)", baudrate, ret);
+		ret = (ret == 3) ? XBEE_EINVALBAUDRATE : (ret > 0) ? XBEE_EFAILED : ret;
+		goto die1;
+	}
+	if ((ret = xbee_connTx(xbee, con, "AC", 2)) != 0) {
+		xbee_log(1,"the module refused AC (%d)", ret);
+		if (ret > 0) ret = XBEE_EFAILED;
+		goto die1;
+	}
+	
+	/* follow the module */
+	oldBaudrate = xbee->device.baudrate;
+	xbee->device.baudrate = baudrate;
+	if ((ret = xsys_setupSerial(xbee)) != 0) {
+		xbee_log(1,"xsys_setupSerial() failed for %d baud, the module has already changed!", baudrate);
+		xbee->device.baudrate = oldBaudrate;
+		xsys_setupSerial(xbee);
+		goto die1;
+	}
+	
+	/* check that we can still hear each other */
+	for (i = 0; i < 3; i++) {
+		if ((ret = xbee_connTx(xbee, con, "BD", 2)) == 0) break;
+	}
+	if (ret != 0) {
+		xbee_log(1,"no response from the module at %d baud, going back to %d baud", baudrate, oldBaudrate);
+		xbee->device.baudrate = oldBaudrate;
+		xsys_setupSerial(xbee);
+		ret = XBEE_EIO;
+		goto die1;
+	}
+	
+	xbee_log(2,"Now running at %d baud", baudrate);
+	
+die1:
+	xbee_io_atPut(xbee, con, conCreated, &oldOptions);
+	return ret;
+}
+
+/* switch low latency mode on or off, see xsys_setupLowLatency() */
+EXPORT int xbee_lowLatencySet(struct xbee *xbee, int enable) {
+	/* check parameters */
+  if (!xbee) {
+    if (!xbee_default) return XBEE_ENOXBEE;
+    xbee = xbee_default;
+  }
+  if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
+	
+	/* user-facing functions need this form of protection...
+	   this means that for the default behavior, the fmap must point at this function! */
+	if (!xbee->f->lowLatencySet) return XBEE_ENOTIMPLEMENTED;
+	if (xbee->f->lowLatencySet != xbee_lowLatencySet) {
+		return xbee->f->lowLatencySet(xbee, enable);
+	}
+	
+	enable = !!enable;
+	if (enable == xbee->device.lowLatency) return XBEE_ENONE;
+	
+	/* it is all in the driver, the rx thread polls the device either way */
+	xbee->device.lowLatency = enable;
+	if (xsys_setupLowLatency(xbee, enable)) {
+		xbee_log(2,"The driver for '%s' has no low latency settings", xbee->device.path);
+	}
+	
+	xbee_log(2,"Low latency mode %s", enable ? "enabled" : "disabled");
+	
+	return XBEE_ENONE;
+}
+
+/* switch between API mode 1 (unescaped) and API mode 2 (escaped) framing
+   once the mode has been set the module is told (AP, applied with AC) and checked afterwards, as xbee_baudrateSet() does
+   before then only libxbee's framing changes, to match a module that already has that AP */
+EXPORT int xbee_apiModeSet(struct xbee *xbee, int apiMode) {
+	int ret;
+	int i;
+	int oldApiMode;
+	int conCreated;
+	unsigned char cmd[3];
+	struct xbee_con *con;
+	struct xbee_conOptions oldOptions;
+	
+	/* check parameters */
+  if (!xbee) {
+    if (!xbee_default) return XBEE_ENOXBEE;
+    xbee = xbee_default;
+  }
+  if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
+	
+	/* user-facing functions need this form of protection...
+	   this means that for the default behavior, the fmap must point at this function! */
+	if (!xbee->f->apiModeSet) return XBEE_ENOTIMPLEMENTED;
+	if (xbee->f->apiModeSet != xbee_apiModeSet) {
+		return xbee->f->apiModeSet(xbee, apiMode);
+	}
+	
+	if (apiMode != 1 && apiMode != 2) return XBEE_EINVAL;
+	if (apiMode == xbee->device.apiMode) return XBEE_ENONE;
+	
+	if (!xbee->mode) {
+		xbee->device.apiMode = apiMode;
+		xbee_log(2,"Now using API mode %d framing", apiMode);
+		return XBEE_ENONE;
+	}
+	
+	cmd[0] = 'A';
+	cmd[1] = 'P';
+	cmd[2] = apiMode;
+	
+	if ((ret = xbee_io_atGet(xbee, &con, &conCreated, &oldOptions)) != 0) return ret;
+	
+	if ((ret = xbee_connTx(xbee, con, (char *)cmd, 3)) != 0) {
+		xbee_log(1,"the module refused AP=%d (%d)", apiMode, ret);
+		if (ret > 0) ret = XBEE_EFAILED;
+		goto die1;
+	}
+	if ((ret = xbee_connTx(xbee, con, "AC", 2)) != 0) {
+		xbee_log(1,"the module refused AC (%d)", ret);
+		if (ret > 0) ret = XBEE_EFAILED;
+		goto die1;
+	}
+	
+	/* follow the module - the responses so far rarely have anything to escape, so are framed the same either way */
+	oldApiMode = xbee->device.apiMode;
+	xbee->device.apiMode = apiMode;
+	
+	/* check that we can still understand each other */
+	for (i = 0; i < 3; i++) {
+		if ((ret = xbee_connTx(xbee, con, "AP", 2)) == 0) break;
+	}
+	if (ret != 0) {
+		xbee_log(1,"no response from the module with AP=%d, going back to AP=%d", apiMode, oldApiMode);
+		xbee->device.apiMode = oldApiMode;
+		ret = XBEE_EIO;
+		goto die1;
+	}
+	
+	xbee_log(2,"Now using API mode %d framing", apiMode);
+	
+die1:
+	xbee_io_atPut(xbee, con, conCreated, &oldOptions);
+	return ret;
+}
+
 /* ######################################################################### */
 
-/* get a raw byte from the device */
+/* get a raw byte from the device
+   the device is read in chunks (whatever is waiting, up to XBEE_IO_CHUNKLEN), and the bytes are handed out from there */
 int xbee_io_getRawByte(struct xbee *xbee, unsigned char *cOut) {
 	unsigned char c;
 	int ret = XBEE_EUNKNOWN;
 	int retries = XBEE_IO_RETRIES;
+	int sawEof;
+	int hangup;
+	xsys_ssize_t len;
 	*cOut = 0;
 
 	/* if the device isn't ready, then don't try */
 	if (!xbee->device.ready) return XBEE_ENOTREADY;
 	
+	/* bytes of a bad frame that are being parsed again, see xbee_rxRescan() */
+	if (xbee->device.rxRescanPos < xbee->device.rxRescanLen) {
+		*cOut = xbee->device.rxRescan[xbee->device.rxRescanPos++];
+		return XBEE_ENONE;
+	}
+	
+	/* there is still some of the last chunk left */
+	if (xbee->device.rxChunkPos < xbee->device.rxChunkLen) goto got;
+	
+	/* the io_uring function map waits, and reads, in its own way */
+	if (xbee->device.uring) {
+		if ((ret = xbee_uringRead(xbee)) != 0) goto done;
+		goto got;
+	}
+	
+	sawEof = 0;
 	do {
 		/* wait paitently for a byte to read */
-		if ((ret = xsys_select(xbee->device.f, NULL)) == -1) {
-			xbee_perror(1,"xbee_select()");
+		if ((ret = xsys_poll(xbee->device.fd, XSYS_POLLIN, -1)) == -1) {
+			xbee_perror(1,"xsys_poll()");
 			if (errno == EINTR) {
 				ret = XBEE_ESELECTINTERRUPTED;
 			} else {
@@ -145,14 +442,22 @@ int xbee_io_getRawByte(struct xbee *xbee, unsigned char *cOut) {
 			}
 			goto done;
 		}
+		hangup = ret & XSYS_POLLHUP;
 	
-		/* read it */
-		if (xsys_fread(&c, 1, 1, xbee->device.f) == 0) {
+		/* read everything that is waiting */
+		if ((len = xsys_read(xbee->device.fd, xbee->device.rxChunk, sizeof(xbee->device.rxChunk))) <= 0) {
 			/* for some reason nothing was read... */
-			if (xsys_ferror(xbee->device.f)) {
+			if (len == 0) sawEof = 1;
+			/* the device has gone (e.g. a USB adapter was unplugged) - don't spend the retries finding that out */
+			if ((len == 0 && hangup) || (len == -1 && (errno == EIO || errno == ENXIO || errno == ENODEV))) {
+				xbee_logstderr(1,"EOF detected...");
+				ret = XBEE_EEOF;
+				goto done;
+			}
+			if (len == -1 && errno != EAGAIN) {
 				char *s;
 				/* this shouldn't ever happen, but has been seen on USB devices on disconnect */
-				if (xsys_feof(xbee->device.f)) {
+				if (sawEof) {
 					xbee_logstderr(1,"EOF detected...");
 					ret = XBEE_EEOF;
 					goto done;
@@ -172,6 +477,9 @@ int xbee_io_getRawByte(struct xbee *xbee, unsigned char *cOut) {
 				usleep(100);
 			}
 		} else {
+			xbee->device.rxChunkLen = len;
+			xbee->device.rxChunkPos = 0;
+			xbee_statsRxRead(xbee, len);
 			break;
 		}
 	} while (--retries);
@@ -185,9 +493,13 @@ int xbee_io_getRawByte(struct xbee *xbee, unsigned char *cOut) {
 	if (!retries) {
 		ret = XBEE_EIORETRIES;
 	} else {
+got:
 		/* otherwise return the read byte */
+		c = xbee->device.rxChunk[xbee->device.rxChunkPos++];
 		*cOut = c;
 		xbee_log(20,"READ: 0x%02X [%c]", c, ((c >= 32 && c <= 126)?c:' '));
+		/* if a capture is in progress, then record the byte */
+		if (xbee->device.record) xbee_recordByte(xbee, c);
 		ret = XBEE_ENONE;
 	}
 	
@@ -221,77 +533,173 @@ int xbee_io_getEscapedByte(struct xbee *xbee, unsigned char *cOut) {
 	return ret;
 }
 
+/* get up to 'max' bytes of a frame, at least one, and then as many as are left in the current chunk - for API mode 1 */
+int xbee_io_getRawBlock(struct xbee *xbee, unsigned char *out, int max, int *got) {
+	unsigned char *in;
+	int used;
+	int ret;
+	int i;
+	
+	*got = 0;
+	
+	/* bytes that are being parsed again come first, and on their own */
+	if (xbee->device.rxRescanPos < xbee->device.rxRescanLen) {
+		used = xbee->device.rxRescanLen - xbee->device.rxRescanPos;
+		if (used > max) used = max;
+		memcpy(out, &xbee->device.rxRescan[xbee->device.rxRescanPos], used);
+		xbee->device.rxRescanPos += used;
+		*got = used;
+		return XBEE_ENONE;
+	}
+	
+	if ((ret = xbee_io_getRawByte(xbee, out)) != 0) return ret;
+	*got = 1;
+	
+	in = &xbee->device.rxChunk[xbee->device.rxChunkPos];
+	used = xbee->device.rxChunkLen - xbee->device.rxChunkPos;
+	if (used > max - 1) used = max - 1;
+	if (used <= 0) return XBEE_ENONE;
+	memcpy(&out[1], in, used);
+	*got += used;
+	xbee->device.rxChunkPos += used;
+	
+	if (xbee_shouldLog(20) || xbee->device.record) {
+		for (i = 0; i < used; i++) {
+			xbee_log(20,"READ: 0x%02X [%c]", in[i], ((in[i] >= 32 && in[i] <= 126)?in[i]:' '));
+			if (xbee->device.record) xbee_recordByte(xbee, in[i]);
+		}
+	}
+	
+	return XBEE_ENONE;
+}
+
+/* get up to 'max' unescaped bytes of a frame, at least one, and then as many as are left in the current chunk
+   this stops before an unescaped 0x7E, which the next call will return as XBEE_EUNESCAPED_START */
+int xbee_io_getEscapedBlock(struct xbee *xbee, unsigned char *out, int max, int *got) {
+	unsigned char *in;
+	char escaped;
+	int used;
+	int ret;
+	int i;
+	
+	*got = 0;
+	
+	/* the first byte may have to wait for the device */
+	if ((ret = xbee_io_getEscapedByte(xbee, out)) != 0) return ret;
+	*got = 1;
+	if (max <= 1 || xbee->device.rxChunkPos >= xbee->device.rxChunkLen) return XBEE_ENONE;
+	/* (only left over from API mode 1) */
+	if (xbee->device.rxRescanPos < xbee->device.rxRescanLen) return XBEE_ENONE;
+	
+	/* then take the rest of the chunk in one go, leaving a trailing escape character for xbee_io_getEscapedByte() */
+	in = &xbee->device.rxChunk[xbee->device.rxChunkPos];
+	escaped = 0;
+	used = xbee_escapeDecode(&out[1], max - 1, in, xbee->device.rxChunkLen - xbee->device.rxChunkPos, &i, &escaped);
+	if (escaped) used--;
+	*got += i;
+	xbee->device.rxChunkPos += used;
+	
+	if (xbee_shouldLog(20) || xbee->device.record) {
+		for (i = 0; i < used; i++) {
+			xbee_log(20,"READ: 0x%02X [%c]", in[i], ((in[i] >= 32 && in[i] <= 126)?in[i]:' '));
+			if (xbee->device.record) xbee_recordByte(xbee, in[i]);
+		}
+	}
+	
+	return XBEE_ENONE;
+}
+
 /* ######################################################################### */
 
-int xbee_io_writeRawByte(struct xbee *xbee, unsigned char c) {
+/* write a block (normally a whole frame) to the device, waiting for room until the 'deadline' (CLOCK_MONOTONIC) passes
+   if the deadline is NULL then it will wait for as long as it takes. the time spent waiting is kept in the stats, so that
+   flow control shows up as backpressure, rather than a stuck thread
+   the deadline only applies until the first byte has gone - after that the rest of the block is always written, because
+   half a frame on the wire would take the next one with it (in API mode 1 the module would read it as payload)
+   so if XBEE_ETIMEOUT is returned, none of the block was written */
+int xbee_io_write(struct xbee *xbee, unsigned char *data, int len, struct timespec *deadline) {
+	struct timespec start;
+	xsys_ssize_t n;
+	long long timeout;
 	int ret = XBEE_EUNKNOWN;
 	int retries = XBEE_IO_RETRIES;
-
+	int off;
+	
 	/* if the device isn't ready, then don't try */
 	if (!xbee->device.ready) return XBEE_ENOTREADY;
 	
 	/* log some info */
-	xbee_log(20,"WRITE: 0x%02X [%c]", c, ((c >= 32 && c <= 126)?c:' '));
-	do {
-		/* write the byte */
-		if (xsys_fwrite(&c, 1, 1, xbee->device.f)) break;
-		
-		/* for some reason nothing was written... (if 1 byte was written, fwrite() should return 1, and therefore break) */
-		if (xsys_feof(xbee->device.f)) {
-			/* may be seen when USB devices are unplugged */
+	xbee_log(20,"WRITE: %d bytes", len);
+	
+	for (off = 0; off < len;) {
+		/* write as much as it will take */
+		if ((n = xsys_write(xbee->device.fd, &data[off], len - off)) > 0) {
+			off += n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1 && (errno == EIO || errno == ENXIO || errno == ENODEV || errno == EBADF)) {
+			/* the device has gone (or the rx thread has just closed it, to wait for it to come back) */
 			xbee_logstderr(1,"EOF detected...");
 			ret = XBEE_EEOF;
 			goto done;
-		} else if (xsys_ferror(xbee->device.f)) {
-			/* some other error? */
-			char *s;
-			if (retries <= XBEE_IO_RETRIES_WARN) {
-				if (!(s = strerror(errno))) {
-					xbee_logstderr(1,"Unknown error detected (%d)",errno);
-				} else {
-					xbee_logstderr(1,"Error detected (%s)",s);
+		}
+		
+		if (n == 0 || errno == EAGAIN) {
+			/* the device is full, most likely we are being held off by CTS - wait for room */
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			timeout = -1;
+			if (deadline && off == 0) {
+				timeout = (deadline->tv_sec - start.tv_sec) * 1000LL + (deadline->tv_nsec - start.tv_nsec) / 1000000;
+				if (timeout <= 0) {
+					ret = XBEE_ETIMEOUT;
+					goto done;
 				}
 			}
-				/* and give a little pause */
-			usleep(1000);
-		} else {
-			/* no error? weird... try again */
-			usleep(100);
+			ret = xsys_poll(xbee->device.fd, XSYS_POLLOUT, timeout);
+			xbee_statsTxStall(xbee, &start);
+			if (ret == -1) {
+				if (errno == EINTR) continue;
+				xbee_perror(1,"xsys_poll()");
+				ret = XBEE_ESELECT;
+				goto done;
+			}
+			if (ret == 0) {
+				ret = XBEE_ETIMEOUT;
+				goto done;
+			}
+			if (!(ret & XSYS_POLLOUT)) {
+				/* may be seen when USB devices are unplugged */
+				xbee_logstderr(1,"EOF detected...");
+				ret = XBEE_EEOF;
+				goto done;
+			}
+			continue;
 		}
-	} while (--retries);
+		
+		/* some other error? */
+		if (!--retries) {
+			ret = XBEE_EIORETRIES;
+			goto done;
+		}
+		if (retries <= XBEE_IO_RETRIES_WARN) {
+			char *s;
+			if (!(s = strerror(errno))) {
+				xbee_logstderr(1,"Unknown error detected (%d)",errno);
+			} else {
+				xbee_logstderr(1,"Error detected (%s)",s);
+			}
+		}
+		/* and give a little pause */
+		usleep(1000);
+	}
 	
 	/* if we used any retries, then log how many */
 	if (retries != XBEE_IO_RETRIES) {
 		xbee_log(2,"Used up %d retries...", XBEE_IO_RETRIES - retries);
 	}
 	
-	/* if there are NO retries left, then return an error */
-	if (!retries) {
-		ret = XBEE_EIORETRIES;
-	} else {
-		/* otherwise success! */
-		ret = XBEE_ENONE;
-	}
-	
+	ret = XBEE_ENONE;
 done:
 	return ret;
 }
-
-/* write an escaped byte (escapes 'start of packet', 'escape', 'XON' and 'XOFF') */
-int xbee_io_writeEscapedByte(struct xbee *xbee, unsigned char c) {
-	/* if the device isn't ready, then don't try */
-	if (!xbee->device.ready) return XBEE_ENOTREADY;
-
-	/* if it is a byte that needs escaping... */
-	if (c == 0x7E ||
-			c == 0x7D ||
-			c == 0x11 ||
-			c == 0x13) {
-		/* prepend an 0x7D */
-		if (xbee_io_writeRawByte(xbee, 0x7D)) return XBEE_EIO;
-		/* and munge it */
-		c ^= 0x20;
-	}
-	if (xbee_io_writeRawByte(xbee, c)) return XBEE_EIO;
-	return 0;
-}
@@ -21,18 +21,33 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <time.h>
+
 #define XBEE_IO_RETRIES 10
 #define XBEE_IO_RETRIES_WARN 6
+/* while the device has gone, it is opened again as soon as it appears - or failing that, after a delay (ms) that starts at
+   RECONNECT_MIN and doubles up to RECONNECT_MAX */
+#define XBEE_IO_RECONNECT_MIN 10
+#define XBEE_IO_RECONNECT_MAX 1000
+/* a device that stays for this long (ms) after coming back has just been unplugged again, only one that goes sooner than
+   that (i.e. fails as soon as it is opened) counts toward XBEE_IO_RETRIES */
+#define XBEE_IO_RECONNECT_STABLE 100
 
 int xbee_io_open(struct xbee *xbee);
 void xbee_io_close(struct xbee *xbee);
 int xbee_io_reopen(struct xbee *xbee);
+int xbee_io_reconnect(struct xbee *xbee);
+
+int xbee_baudrateSet(struct xbee *xbee, int baudrate);
+int xbee_lowLatencySet(struct xbee *xbee, int enable);
+int xbee_apiModeSet(struct xbee *xbee, int apiMode);
 
 int xbee_io_getRawByte(struct xbee *xbee, unsigned char *cOut);
 int xbee_io_getEscapedByte(struct xbee *xbee, unsigned char *cOut);
+int xbee_io_getRawBlock(struct xbee *xbee, unsigned char *out, int max, int *got);
+int xbee_io_getEscapedBlock(struct xbee *xbee, unsigned char *out, int max, int *got);
 
-int xbee_io_writeRawByte(struct xbee *xbee, unsigned char c);
-int xbee_io_writeEscapedByte(struct xbee *xbee, unsigned char c);
+int xbee_io_write(struct xbee *xbee, unsigned char *data, int len, struct timespec *deadline);
 
 #endif /* __XBEE_IO_H */
 
@@ -302,10 +302,21 @@ out:
 }
 
 void *ll_get_index(void *list, int index) {
+	struct ll_head *h;
+	struct ll_info *i, *p;
 	void *ret;
-	
-	for (ret = NULL; (ret = ll_get_next(list, ret)) != NULL && index; index--);
-	
+	ret = NULL;
+	if (!list) return NULL;
+	i = list;
+	h = i->head;
+	if (!h) goto out;
+	if (!(h->is_head && h->self == h)) goto out;
+	/* walk the nodes, not the items - items may repeat (e.g. samples stored as values) */
+	xsys_mutex_lock(&h->mutex);
+	for (p = h->head; p && index > 0; p = p->next, index--);
+	if (p && index == 0) ret = p->item;
+	xsys_mutex_unlock(&h->mutex);
+out:
 	return ret;
 }
 
@@ -433,3 +444,26 @@ int ll_count_items(void *list) {
 out:
 	return ret;
 }
+
+int ll_for_each(void *list, void (*callback)(void *item, void *arg), void *arg) {
+	struct ll_head *h;
+	struct ll_info *i, *p;
+	int ret;
+	ret = -1;
+	if (!list) return XBEE_EINVAL;
+	if (!callback) return XBEE_EMISSINGPARAM;
+	i = list;
+	h = i->head;
+	if (!h) goto out;
+	if (!(h->is_head && h->self == h)) goto out;
+	xsys_mutex_lock(&h->mutex);
+	/* walk the nodes, not the items - items may repeat (e.g. samples stored as values) */
+	ret = 0;
+	for (p = h->head; p; p = p->next) {
+		callback(p->item, arg);
+		ret++;
+	}
+	xsys_mutex_unlock(&h->mutex);
+out:
+	return ret;
+}
@@ -66,5 +66,7 @@ void *ll_ext_tail(void *list);
 int ll_ext_item(void *list, void *item);
 
 int ll_count_items(void *list);
+/* calls 'callback' for each item in order, under one lock (so it mustn't touch the list) - returns the number of items */
+int ll_for_each(void *list, void (*callback)(void *item, void *arg), void *arg);
 
 #endif /* __XBEE_LL_H */
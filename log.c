@@ -99,8 +99,11 @@ EXPORT void xbee_logSetLevel(int level) {
 	xbee_logLevel = level;
 }
 
-/* test if this message should be logged */
-#define xbee_shouldLog(minLevel) (!(xbee_logLevel < minLevel))
+/* test if this message should be logged, so that expensive messages can be skipped entirely */
+int xbee_shouldLog(int minLevel) {
+	if (!xbee_logReady) if (xbee_logPrepare()) return 0;
+	return !(xbee_logLevel < minLevel);
+}
 
 /* the magical write */
 void _xbee_logWrite(FILE *stream, const char *file, int line, const char *function, struct xbee *xbee, int minLevel) {
@@ -39,6 +39,7 @@ void _xbee_logstderr(const char *file, int line, const char *function, struct xb
 
 #else /* XBEE_DISABLE_LOGGING */
 
+#define xbee_shouldLog(minLevel) 0
 #define xbee_log(...)
 #define xbee_perror(...)
 #define xbee_logstderr(...)
@@ -58,33 +58,6 @@ void xbee_cleanupMode(struct xbee *xbee) {
 	
 	/* the xbee_log() calls can suffice for comments here... */
 	
-	xbee_log(5,"- Cleaning up connections...");
-	for (i = 0; mode->conTypes[i].name; i++) {
-		if (!mode->conTypes[i].initialized) continue;
-		conType = &(mode->conTypes[i]);
-		xbee_log(5,"-- Cleaning up connection type '%s'...", conType->name);
-		
-		while ((con = ll_ext_head(&conType->conList)) != NULL) {
-			xbee_log(5,"--- Cleaning up connection @ %p", con);
-			
-			if (con->callbackRunning) {
-				xbee_log(5,"---- Terminating callback thread...");
-				con->destroySelf = 1;
-				xsys_sem_post(&con->callbackSem);
-				while (con->callbackRunning);
-				xsys_thread_cancel(con->callbackThread);
-			}
-			
-			/* we don't use ll_destroy() here, because we want to get some stats (number of packets discarded) */
-			for (o = 0; (pkt = ll_ext_head(&con->rxList)) != NULL; o++) {
-				xbee_pktFree(pkt);
-			}
-			if (o) xbee_log(5,"---- Free'd %d packets", o);
-			
-			xbee_conFree(xbee, con);
-		}
-	}
-
 	xbee_log(5,"- Cleaning up packet handlers...");
 	for (i = 0; mode->pktHandlers[i].handler; i++) {
 		if (!mode->pktHandlers[i].initialized) continue;
@@ -98,8 +71,8 @@ void xbee_cleanupMode(struct xbee *xbee) {
 				xbee_log(5,"---- Terminating handler thread");
 				pktHandler->rxData->threadShutdown = 1;
 				xsys_sem_post(&pktHandler->rxData->sem);
+				/* the thread is detached, and will return as soon as it is marked as not-running */
 				while (pktHandler->rxData->threadRunning);
-				xsys_thread_cancel(pktHandler->rxData->thread);
 			}
 			
 			/* we don't use ll_destroy() here, because we want to get some stats (number of packets discarded) */
@@ -115,6 +88,38 @@ void xbee_cleanupMode(struct xbee *xbee) {
 		}
 	}
 	
+	/* the handler threads deliver packets to connections, so they must be stopped first */
+	xbee_log(5,"- Cleaning up connections...");
+	for (i = 0; mode->conTypes[i].name; i++) {
+		if (!mode->conTypes[i].initialized) continue;
+		conType = &(mode->conTypes[i]);
+		xbee_log(5,"-- Cleaning up connection type '%s'...", conType->name);
+		
+		while ((con = ll_ext_head(&conType->conList)) != NULL) {
+			xbee_log(5,"--- Cleaning up connection @ %p", con);
+			
+			if (con->callbackRunning) {
+				xbee_log(5,"---- Terminating callback thread...");
+				con->destroySelf = 1;
+				xsys_sem_post(&con->callbackSem);
+				/* the thread is detached, and will return as soon as it is marked as not-running */
+				while (con->callbackRunning);
+				/* ... but wait for it to let go of the lock */
+				xsys_mutex_lock(&con->callbackMutex);
+				xsys_mutex_unlock(&con->callbackMutex);
+			}
+			
+			/* we don't use ll_destroy() here, because we want to get some stats (number of packets discarded) */
+			for (o = 0; (pkt = ll_ext_head(&con->rxList)) != NULL; o++) {
+				xbee_pktFree(pkt);
+			}
+			if (o) xbee_log(5,"---- Free'd %d packets", o);
+			
+			xbee_conFree(xbee, con);
+		}
+		xsys_mutex_destroy(&conType->conMutex);
+	}
+	
 	/* finish tidying up the mode */
 	free(mode->pktHandlers);
 	free(mode->conTypes);
@@ -296,6 +301,7 @@ EXPORT int xbee_modeSet(struct xbee *xbee, char *name) {
 			/* mark the conType as (at least) partially initialized - not all conTypes have both Tx and Rx */
 			conType->initialized = 1;
 			ll_init(&conType->conList);
+			xsys_mutex_init(&conType->conMutex);
 		}
 		
 		/* match up the pktHandler and conType */
@@ -20,161 +20,861 @@
 
 #ifndef XBEE_NO_NET_SERVER
 
+/* for struct ucred */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 
 #include "internal.h"
 #include "net.h"
 #include "net_handlers.h"
+#include "net_shm.h"
 #include "log.h"
 #include "thread.h"
 
-/* super simple - it transmits the buffer */
-int xbee_netSend(int fd, unsigned char *buf, int len, int flags) {
-	int ret;
-	int i, j;
+static void xbee_netClientFree(struct xbee *xbee, struct xbee_netInfo *net, struct xbee_netClient *client);
 
-	ret = 0;
+/* put a socket into non-blocking mode, the event loop must never block on a client */
+static int xbee_netNonBlock(int fd) {
+	int flags;
+	if ((flags = fcntl(fd, F_GETFL)) == -1) return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-	for (i = 0; i < len; i += j) {
-		if ((j = send(fd, &buf[i], len, flags)) == -1) {
-			ret = -1;
-			goto done;
-		}
+/* tell the event loop what to watch for on a client's socket
+   reading stops while the client has too many requests waiting, and writability is only interesting while there is
+   something in the txBuf. the caller must hold fdTxMutex */
+static int _xbee_netClientWatch(struct xbee *xbee, struct xbee_netClient *client) {
+	struct epoll_event ev;
+	int events;
+
+	events = (client->rxPaused ? 0 : EPOLLIN) | (client->txLen ? EPOLLOUT : 0);
+	if (events == client->events) return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = client;
+	if (epoll_ctl(client->epfd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
+		xbee_perror(1, "epoll_ctl()");
+		return XBEE_EIO;
 	}
+	client->events = events;
+
+	return 0;
+}
+
+/* fill in the cmsg for any file descriptors that are waiting to go to the client
+   the caller must hold fdTxMutex */
+static void _xbee_netClientFdMsg(struct xbee_netClient *client, struct msghdr *msg, union xbee_netFdCmsg *cbuf) {
+	struct cmsghdr *cmsg;
+
+	if (!client->txFdCount) return;
+
+	memset(cbuf, 0, sizeof(*cbuf));
+	msg->msg_control = cbuf->buf;
+	msg->msg_controllen = CMSG_SPACE(sizeof(int) * client->txFdCount);
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * client->txFdCount);
+	memcpy(CMSG_DATA(cmsg), client->txFd, sizeof(int) * client->txFdCount);
+}
+
+/* sendmsg() wrapper, that carries any waiting file descriptors with the first byte that goes
+   the caller must hold fdTxMutex */
+static ssize_t _xbee_netClientSendmsg(struct xbee_netClient *client, struct msghdr *msg) {
+	union xbee_netFdCmsg cbuf;
+	ssize_t ret;
+
+	_xbee_netClientFdMsg(client, msg, &cbuf);
+	while ((ret = sendmsg(client->fd, msg, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 && errno == EINTR);
+	if (ret > 0) client->txFdCount = 0;
+	msg->msg_control = NULL;
+	msg->msg_controllen = 0;
 
-	ret = len;
-done:
 	return ret;
 }
 
-/* super simple - it fills the given buffer */
-int xbee_netRecv(int fd, unsigned char *buf, int len, int flags) {
-	int ret;
-	int i, j;
+/* ... for a single buffer */
+static ssize_t _xbee_netClientSend(struct xbee_netClient *client, void *buf, int len) {
+	struct iovec iov;
+	struct msghdr msg;
 
-	ret = 0;
+	if (!client->txFdCount) return send(client->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	return _xbee_netClientSendmsg(client, &msg);
+}
 
-	for (i = 0; i < len; i += j) {
-		if ((j = recv(fd, &buf[i], len, flags)) == -1) {
-			if (errno == EBADF) {
-				ret = -2;
-			} else {
-				ret = -1;
+/* send as much of the client's txBuf as the socket will take without blocking
+   the caller must hold fdTxMutex */
+static int _xbee_netClientFlush(struct xbee *xbee, struct xbee_netClient *client) {
+	int ret;
+	int pos;
+	int len;
+
+	for (pos = 0; pos < client->txLen; pos += ret) {
+		len = client->txLen - pos;
+		/* SOCK_SEQPACKET clients get one message per record - only whole messages are ever queued for them */
+		if (client->seqpacket) {
+			unsigned char *p = &client->txBuf[pos];
+			len = ((p[4] & 0x80) ? 7 : 6) + (((p[1] << 8) & 0xFF00) | (p[2] & 0xFF)) + 1;
+		}
+		if ((ret = _xbee_netClientSend(client, &client->txBuf[pos], len)) == -1) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
 			}
-			goto done;
-		} else if (j == 0) {
-			ret = -2;
-			goto done;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return XBEE_EIO;
 		}
 	}
 
-	ret = len;
-done:
-	return ret;
+	/* keep whatever didn't make it at the front of the buffer */
+	if (pos > 0) {
+		client->txLen -= pos;
+		if (client->txLen) memmove(client->txBuf, &client->txBuf[pos], client->txLen);
+	}
+
+	return _xbee_netClientWatch(xbee, client);
 }
 
-/* ######################################################################### */
+/* add the unsent part of a message to the client's txBuf
+   the caller must hold fdTxMutex */
+static int _xbee_netClientQueue(struct xbee *xbee, struct xbee_netClient *client, struct iovec *iov, int iovcnt, int skip) {
+	unsigned char *p;
+	int size;
+	int len;
+	int i;
 
-/* transmit a message, with correct encapsulation */
-int xbee_netClientTx(struct xbee *xbee, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct bufData *buf) {
-	int ret;
-	int txLen;
-	unsigned char ibuf[8];
+	for (len = -skip, i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
 
-	ret = 0;
+	/* make room */
+	if (client->txLen + len > client->txSize) {
+		if (client->txLen + len > XBEE_NET_TXQUEUE_MAX) {
+			xbee_log(1, "client %s:%hu isn't keeping up, dropping a %d byte message", client->addr, client->port, len);
+			return XBEE_EIO;
+		}
+		for (size = (client->txSize ? client->txSize : XBEE_NET_RXBUFLEN); size < client->txLen + len; size *= 2);
+		if ((p = realloc(client->txBuf, size)) == NULL) return XBEE_ENOMEM;
+		client->txBuf = p;
+		client->txSize = size;
+	}
 
+	/* copy in everything after the first 'skip' bytes */
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		memcpy(&client->txBuf[client->txLen], (unsigned char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+		client->txLen += iov[i].iov_len - skip;
+		skip = 0;
+	}
+
+	return 0;
+}
+
+/* ######################################################################### */
+
+/* build a message's header - returns its length, 6 for a request or 7 for a response (with the returnValue) */
+int xbee_netMsgHeader(unsigned char *buf, int dataLen, unsigned char id, unsigned char reqID, unsigned char returnValue) {
 	/* starting byte */
-	ibuf[0] = '{';
-	
+	buf[0] = '{';
+
 	/* data length */
-	if (!buf || buf->len == 0) {
-		ibuf[1] = 0;
-		ibuf[2] = 0;
-	  xbee_log(20,"Tx message: (0 bytes)");
-	} else {
-		int i;
-		ibuf[1] = (buf->len >> 8) & 0xFF;
-		ibuf[2] = (buf->len) & 0xFF;
-	  xbee_log(20,"Tx message: (%d bytes)", buf->len);
-	  for (i = 0; i < buf->len; i++) {
-    	xbee_log(20,"  %2d: 0x%02X '%c'", i, buf->buf[i], ((buf->buf[i] >= ' ' && buf->buf[i] <= '~')?buf->buf[i]:'.'));
-  	}
-	}
-	
+	buf[1] = (dataLen >> 8) & 0xFF;
+	buf[2] = (dataLen) & 0xFF;
+
 	/* header seperator */
-	ibuf[3] = '|';
-	
+	buf[3] = '|';
+
 	/* identification bytes */
-	ibuf[4] = id;
-	ibuf[5] = reqID;
-	
+	buf[4] = id;
+	buf[5] = reqID;
+
 	/* return value, if necessary */
 	if (id & 0x80) {
-		ibuf[6] = returnValue;
-		txLen = 7;
+		buf[6] = returnValue;
+		return 7;
+	}
+	return 6;
+}
+
+/* pass file descriptors to a local (AF_UNIX) client, they go with the next bytes that are sent - so they arrive
+   no later than the next message. the descriptors are duplicated by the kernel, the caller keeps its own copies
+   but must keep them open until they have gone */
+int xbee_netClientTxFds(struct xbee *xbee, struct xbee_netClient *client, int *fds, int fdCount) {
+	int ret;
+
+	if (fdCount < 1 || fdCount > XBEE_NET_TXFDS_MAX) return XBEE_ERANGE;
+	if (!client->local) return XBEE_EINVAL;
+
+	ret = 0;
+	xsys_mutex_lock(&client->fdTxMutex);
+	if (client->txFdCount) {
+		/* the last lot haven't gone yet */
+		ret = XBEE_EBUSY;
 	} else {
-		txLen = 6;
+		memcpy(client->txFd, fds, sizeof(int) * fdCount);
+		client->txFdCount = fdCount;
 	}
-	
+	xsys_mutex_unlock(&client->fdTxMutex);
+
+	return ret;
+}
+
+/* transmit a message, with correct encapsulation
+   the data is given as a list of pieces, that are sent in order without being gathered into one buffer first
+   if nothing is waiting to go to the client, the message is sent straight from the caller's memory in a single sendmsg(),
+   otherwise it is appended to the client's txBuf and goes out with everything else that is queued. either way, the caller
+   may free or reuse the data as soon as this returns */
+int xbee_netClientTxv(struct xbee *xbee, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct iovec *data, int dataCnt) {
+	int ret;
+	int txLen;
+	int dataLen;
+	int i;
+	unsigned char ibuf[8];
+	struct iovec iov[XBEE_NET_TXV_MAX + 2];
+	struct msghdr msg;
+	ssize_t sent;
+
+	if (dataCnt < 0 || dataCnt > XBEE_NET_TXV_MAX) return XBEE_ERANGE;
+
+	ret = 0;
+	for (dataLen = 0, i = 0; i < dataCnt; i++) {
+		dataLen += data[i].iov_len;
+	}
+	if (dataLen > 0xFFFF) return XBEE_ERANGE;
+
+	if (xbee_shouldLog(20)) {
+		int j, k;
+		/* no local pointer to each piece here, with XBEE_DISABLE_LOGGING it would be set but never used */
+#define XBEE_NET_TXV_BYTE(i, j) (((unsigned char *)data[(i)].iov_base)[(j)])
+	  xbee_log(20,"Tx message: (%d bytes)", dataLen);
+	  for (k = 0, i = 0; i < dataCnt; i++) {
+	  	for (j = 0; j < data[i].iov_len; j++, k++) {
+    		xbee_log(20,"  %2d: 0x%02X '%c'", k, XBEE_NET_TXV_BYTE(i, j),
+    		         ((XBEE_NET_TXV_BYTE(i, j) >= ' ' && XBEE_NET_TXV_BYTE(i, j) <= '~')?XBEE_NET_TXV_BYTE(i, j):'.'));
+    	}
+  	}
+#undef XBEE_NET_TXV_BYTE
+	}
+
+	txLen = xbee_netMsgHeader(ibuf, dataLen, id, reqID, returnValue);
+
 	/* ending byte */
 	ibuf[7] = '}';
 
-	/* lock the file, transmit, and unlock */
+	/* header, data and terminator */
+	iov[0].iov_base = ibuf;
+	iov[0].iov_len = txLen;
+	for (i = 0; i < dataCnt; i++) {
+		iov[i + 1] = data[i];
+	}
+	iov[dataCnt + 1].iov_base = &ibuf[7];
+	iov[dataCnt + 1].iov_len = 1;
+
 	xsys_mutex_lock(&client->fdTxMutex);
-	         if (xbee_netSend(client->fd, ibuf, txLen, MSG_WAITALL) != txLen)            { ret = XBEE_EIO; goto die1; }
-	if (buf) if (xbee_netSend(client->fd, buf->buf, buf->len, MSG_WAITALL) != buf->len)  { ret = XBEE_EIO; goto die1; }
-	         if (xbee_netSend(client->fd, &ibuf[7], 1, MSG_WAITALL) != 1)                { ret = XBEE_EIO; goto die1; }
+
+	/* if there is already something waiting, or we are holding messages back, then join the queue */
+	if (client->txLen || client->txCork) {
+		if ((ret = _xbee_netClientQueue(xbee, client, iov, dataCnt + 2, 0)) != 0) goto die1;
+		if (!client->txCork) ret = _xbee_netClientFlush(xbee, client);
+		goto die1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = dataCnt + 2;
+	if ((sent = _xbee_netClientSendmsg(client, &msg)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			ret = XBEE_EIO;
+			goto die1;
+		}
+		sent = 0;
+	}
+
+	/* if the socket didn't take it all, then queue the rest for the event loop */
+	if (sent < txLen + dataLen + 1) {
+		if ((ret = _xbee_netClientQueue(xbee, client, iov, dataCnt + 2, sent)) != 0) goto die1;
+		ret = _xbee_netClientFlush(xbee, client);
+	}
+
 die1:
 	xsys_mutex_unlock(&client->fdTxMutex);
 
 	return ret;
 }
 
+/* transmit a message held in a single buffer */
+int xbee_netClientTx(struct xbee *xbee, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct bufData *buf) {
+	struct iovec iov;
+
+	if (!buf || !buf->len) {
+		return xbee_netClientTxv(xbee, client, id, reqID, returnValue, NULL, 0);
+	}
+	iov.iov_base = buf->buf;
+	iov.iov_len = buf->len;
+	return xbee_netClientTxv(xbee, client, id, reqID, returnValue, &iov, 1);
+}
+
+/* hold back messages for a client, so that the responses to a batch of requests can be sent together */
+static void xbee_netClientCork(struct xbee *xbee, struct xbee_netClient *client) {
+	xsys_mutex_lock(&client->fdTxMutex);
+	client->txCork = 1;
+	xsys_mutex_unlock(&client->fdTxMutex);
+}
+
+/* ... and send them */
+static int xbee_netClientUncork(struct xbee *xbee, struct xbee_netClient *client) {
+	int ret;
+	xsys_mutex_lock(&client->fdTxMutex);
+	client->txCork = 0;
+	ret = _xbee_netClientFlush(xbee, client);
+	xsys_mutex_unlock(&client->fdTxMutex);
+	return ret;
+}
+
 /* ######################################################################### */
 
-/* get a connection based on the network 'key' rather than its address */
-int xbee_netGetCon(struct xbee *xbee, struct xbee_netClient *client, unsigned short key, struct xbee_con **rCon) {
+/* protects the feeds' refs and the userData of their connections, and finding a feed by its connection
+   a single lock is shared by every feed, because the callback only has the connection's userData to go on */
+static xsys_mutex xbee_netFeedMutex = XSYS_MUTEX_INITIALIZER;
+
+/* drop a reference to a feed, the caller must hold xbee_netFeedMutex
+   the connection is ended with the lock held, so that nobody can find it by its address and pick up the feed */
+static void _xbee_netFeedPut(struct xbee *xbee, struct xbee_netFeed *feed) {
+	int ret;
+
+	if (--feed->refs > 0) return;
+
+	/* the callback thread may be about to run, it will find that the feed has gone
+	   this isn't done with xbee_conSetData(), which refuses once xbee_shutdown() has begun (it stops the server first) */
+	feed->con->userData = NULL;
+	/* XBEE_ECALLBACK means that the callback thread will finish it off */
+	if ((ret = xbee_conEnd(xbee, feed->con, NULL)) != 0 && ret != XBEE_ECALLBACK) {
+		xbee_log(1, "failed to end shared connection @ %p (%d)", feed->con, ret);
+	}
+
+	xsys_mutex_destroy(&feed->subMutex);
+	free(feed->subs);
+	free(feed);
+}
+
+/* find one of the client's subscriptions, the caller must hold xbee_netFeedMutex */
+static struct xbee_netConData *_xbee_netConFind(struct xbee_netClient *client, unsigned short key) {
+	struct xbee_netConData *sub;
+
+	for (sub = NULL; (sub = ll_get_next(&client->conList, sub)) != NULL;) {
+		if (sub->key == key) break;
+	}
+
+	return sub;
+}
+
+/* subscribe a client to the connection with the given type and address - it is created if no other client has it */
+int xbee_netConSubscribe(struct xbee *xbee, struct xbee_netClient *client, unsigned char conTypeId, struct xbee_conAddress *address, struct xbee_netConData **rSub) {
+	int ret;
 	struct xbee_con *con;
+	struct xbee_netFeed *feed;
+	struct xbee_netConData *sub;
+	struct xbee_netConData **subs;
+	void *callback;
+
+	if ((sub = calloc(1, sizeof(*sub))) == NULL) return XBEE_ENOMEM;
+	sub->client = client;
+
+	/* requests run concurrently, so the key must be allocated under the client's lock */
+	xsys_mutex_lock(&client->conMutex);
+	sub->key = client->conKeyCount++;
+	if (client->conKeyCount < sub->key) {
+		/* we wrapped! too many connections... very unlikely... */
+		client->conKeyCount--;
+		xsys_mutex_unlock(&client->conMutex);
+		ret = XBEE_ENOMEM;
+		goto die1;
+	}
+	xsys_mutex_unlock(&client->conMutex);
+
+	xsys_mutex_lock(&xbee_netFeedMutex);
+
+	con = NULL;
+	if ((ret = xbee_conNew(xbee, &con, conTypeId, address, NULL)) == XBEE_EEXISTS) {
+		/* join in if another client has it, but a connection that the application opened isn't ours to share */
+		if (xbee_conGetCallback(xbee, con, &callback) != 0 || callback != (void *)xbee_netCallback || !con->userData) {
+			ret = XBEE_EINUSE;
+			goto die2;
+		}
+		feed = con->userData;
+	} else if (ret != XBEE_ENONE) {
+		goto die2;
+	} else {
+		if ((feed = calloc(1, sizeof(*feed))) == NULL) {
+			xbee_conEnd(xbee, con, NULL);
+			ret = XBEE_ENOMEM;
+			goto die2;
+		}
+		if (xsys_mutex_init(&feed->subMutex)) {
+			free(feed);
+			xbee_conEnd(xbee, con, NULL);
+			ret = XBEE_EMUTEX;
+			goto die2;
+		}
+		feed->con = con;
+		xbee_conSetData(xbee, con, feed);
+		xbee_conAttachCallback(xbee, con, xbee_netCallback, NULL);
+	}
+	ret = XBEE_ENONE;
+
+	/* from here on, a failure must give the reference back (which ends a new connection) */
+	feed->refs++;
+
+	xsys_mutex_lock(&feed->subMutex);
+	if (feed->subCount >= feed->subSize) {
+		int size = (feed->subSize ? feed->subSize * 2 : 4);
+		if ((subs = realloc(feed->subs, sizeof(*subs) * size)) == NULL) {
+			xsys_mutex_unlock(&feed->subMutex);
+			_xbee_netFeedPut(xbee, feed);
+			ret = XBEE_ENOMEM;
+			goto die2;
+		}
+		feed->subs = subs;
+		feed->subSize = size;
+	}
+	sub->feed = feed;
+	feed->subs[feed->subCount++] = sub;
+	xsys_mutex_unlock(&feed->subMutex);
+
+	ll_add_tail(&client->conList, sub);
+
+	if (feed->refs > 1) xbee_log(4, "client %s:%hu shares con @ %p (%d references)", client->addr, client->port, feed->con, feed->refs);
+
+	xsys_mutex_unlock(&xbee_netFeedMutex);
+
+	*rSub = sub;
+	return XBEE_ENONE;
+
+die2:
+	xsys_mutex_unlock(&xbee_netFeedMutex);
+die1:
+	free(sub);
+	return ret;
+}
+
+/* end a client's subscription, the connection is ended once nothing else is using it */
+int xbee_netConUnsubscribe(struct xbee *xbee, struct xbee_netClient *client, unsigned short key) {
+	struct xbee_netConData *sub;
+	struct xbee_netFeed *feed;
+	int i;
+
+	xsys_mutex_lock(&xbee_netFeedMutex);
+	if ((sub = _xbee_netConFind(client, key)) == NULL) {
+		xsys_mutex_unlock(&xbee_netFeedMutex);
+		return XBEE_EFAILED;
+	}
+	ll_ext_item(&client->conList, sub);
+	feed = sub->feed;
+
+	/* once it is out of the list, the callback can't deliver to it */
+	xsys_mutex_lock(&feed->subMutex);
+	for (i = 0; i < feed->subCount; i++) {
+		if (feed->subs[i] != sub) continue;
+		feed->subs[i] = feed->subs[--feed->subCount];
+		break;
+	}
+	xsys_mutex_unlock(&feed->subMutex);
+
+	_xbee_netFeedPut(xbee, feed);
+	xsys_mutex_unlock(&xbee_netFeedMutex);
+
+	free(sub);
+
+	return XBEE_ENONE;
+}
+
+/* put a client's subscription to sleep, or wake it up
+   the connection is shared, so it stays awake - the subscription just doesn't get the packets */
+int xbee_netConSleep(struct xbee *xbee, struct xbee_netClient *client, unsigned short key, int sleeping, int wakeOnRx) {
+	struct xbee_netConData *sub;
+
+	xsys_mutex_lock(&xbee_netFeedMutex);
+	if ((sub = _xbee_netConFind(client, key)) == NULL) {
+		xsys_mutex_unlock(&xbee_netFeedMutex);
+		return XBEE_EFAILED;
+	}
+	xsys_mutex_lock(&sub->feed->subMutex);
+	sub->sleeping = !!sleeping;
+	sub->wakeOnRx = !!wakeOnRx;
+	xsys_mutex_unlock(&sub->feed->subMutex);
+	xsys_mutex_unlock(&xbee_netFeedMutex);
+
+	return XBEE_ENONE;
+}
+
+/* get a connection based on the network 'key' rather than its address
+   if rFeed is given, a reference is taken that must be given back with xbee_netPutCon() */
+int xbee_netGetCon(struct xbee *xbee, struct xbee_netClient *client, unsigned short key, struct xbee_netFeed **rFeed) {
+	struct xbee_netConData *sub;
 
 	/* check parameters */
 	if (!xbee || !client) return XBEE_EMISSINGPARAM;
 	if (!xbee->net) return XBEE_EINVAL;
 
 	/* find the connection */
-	for (con = NULL; (con = ll_get_next(&client->conList, con)) != NULL;) {
-		if (((struct xbee_netConData *)con->userData)->key == key) break;
+	xsys_mutex_lock(&xbee_netFeedMutex);
+	if ((sub = _xbee_netConFind(client, key)) == NULL) {
+		xsys_mutex_unlock(&xbee_netFeedMutex);
+		return XBEE_EFAILED;
+	}
+
+	/* if successful, return it */
+	if (rFeed) {
+		sub->feed->refs++;
+		*rFeed = sub->feed;
+	}
+	xsys_mutex_unlock(&xbee_netFeedMutex);
+
+	return 0;
+}
+
+void xbee_netPutCon(struct xbee *xbee, struct xbee_netFeed *feed) {
+	xsys_mutex_lock(&xbee_netFeedMutex);
+	_xbee_netFeedPut(xbee, feed);
+	xsys_mutex_unlock(&xbee_netFeedMutex);
+}
+
+/* take a reference to the feed that a connection's callback was given, NULL if it has ended */
+struct xbee_netFeed *xbee_netFeedHold(void **userData) {
+	struct xbee_netFeed *feed;
+
+	xsys_mutex_lock(&xbee_netFeedMutex);
+	if ((feed = *userData) != NULL) feed->refs++;
+	xsys_mutex_unlock(&xbee_netFeedMutex);
+
+	return feed;
+}
+
+/* convert 2 bytes into a 'key', for use with the network interface */
+unsigned short xbee_netKeyFromBytes(unsigned char *bytes) {
+	unsigned short key;
+
+	key  = (bytes[0] << 8) & 0xFF00;
+	key |= (bytes[1]     ) & 0x00FF;
+
+	return key;
+}
+/* convert a 'key' into 2 bytes, for use with the network interface */
+void xbee_netBytesFromKey(unsigned char *bytes, unsigned short key) {
+	bytes[0] = ((key >> 8) & 0xFF);
+	bytes[1] = ((key     ) & 0xFF);
+}
+
+/* ######################################################################### */
+
+/* run a handler, and respond if the message was a request */
+static void xbee_netClientRun(struct xbee *xbee, struct xbee_netClient *client, int pos, unsigned char id, unsigned char reqID, unsigned char returnValue, struct bufData *buf) {
+	int iret;
+	struct bufData *rBuf;
+
+	rBuf = NULL;
+	/* a request handler should not expect anything from the returnValue */
+	if ((iret = netHandlers[pos].handler(xbee, client, id, returnValue, buf, &rBuf)) != 0) {
+		xbee_log(2, "netHandler '%s' returned %d for client %s:%hu", netHandlers[pos].handlerName, iret, client->addr, client->port);
+	}
+	/* if this was a request, then send a response (unless the client has already gone) */
+	if (!(id & 0x80) && !client->dead) {
+		if ((iret = xbee_netClientTx(xbee, client, id | 0x80, reqID, iret, rBuf)) != 0) {
+			xbee_log(1, "WARNING! response failed (%d)", iret);
+		}
+	}
+
+	/* free the stuff */
+	if (rBuf && rBuf != buf) free(rBuf);
+}
+
+/* can one of the client's requests start now? net->jobMutex must be held
+   a request for a connection waits while another one for it is running, so that they reach the connection in order */
+static int xbee_netJobReady(struct xbee_netClient *client, struct xbee_netJob *job) {
+	int i;
+
+	if (client->jobActive >= XBEE_NET_CLIENT_REQUESTS) return 0;
+	if (job->key == -1) return 1;
+	for (i = 0; i < XBEE_NET_CLIENT_REQUESTS; i++) {
+		if (client->jobKeys[i] == job->key) return 0;
+	}
+	return 1;
+}
+
+/* give one of the client's requests to the workers, net->jobMutex must be held */
+static void xbee_netJobStart(struct xbee_netInfo *net, struct xbee_netClient *client, struct xbee_netJob *job) {
+	int i;
+
+	client->jobActive++;
+	if (job->key != -1) {
+		/* there is always room, there are at most XBEE_NET_CLIENT_REQUESTS active */
+		for (i = 0; client->jobKeys[i] != -1; i++);
+		client->jobKeys[i] = job->key;
+	}
+	ll_add_tail(&net->jobList, job);
+	xsys_sem_post(&net->jobSem);
+}
+
+/* start whichever of the client's waiting requests can go now, net->jobMutex must be held
+   the list is turned over once, so that the requests that are left keep their order */
+static void xbee_netJobStartWaiting(struct xbee_netInfo *net, struct xbee_netClient *client) {
+	struct xbee_netJob *job;
+	int n;
+
+	if (client->jobActive >= XBEE_NET_CLIENT_REQUESTS) return;
+	for (n = ll_count_items(&client->jobList); n > 0; n--) {
+		if ((job = ll_ext_head(&client->jobList)) == NULL) break;
+		if (xbee_netJobReady(client, job)) {
+			xbee_netJobStart(net, client, job);
+		} else {
+			ll_add_tail(&client->jobList, job);
+		}
+	}
+}
+
+/* a job has finished (or been abandoned), start the client's next requests, and free the client if it has gone
+   returns the client if the caller should free it */
+static struct xbee_netClient *xbee_netJobDone(struct xbee *xbee, struct xbee_netInfo *net, struct xbee_netJob *job) {
+	struct xbee_netClient *client;
+	int resume;
+	int key;
+	int i;
+
+	client = job->client;
+	key = job->key;
+	free(job->buf);
+	free(job);
+
+	xsys_mutex_lock(&net->jobMutex);
+	client->jobActive--;
+	client->jobCount--;
+	if (key != -1) {
+		for (i = 0; i < XBEE_NET_CLIENT_REQUESTS; i++) {
+			if (client->jobKeys[i] != key) continue;
+			client->jobKeys[i] = -1;
+			break;
+		}
+	}
+	/* requests for different connections may finish in any order, those for the same connection are started in the order
+	   they arrived, once the one before has finished */
+	if (!client->dead) xbee_netJobStartWaiting(net, client);
+	/* start reading again once the backlog has cleared */
+	resume = (!client->dead && client->rxPaused && client->jobCount < XBEE_NET_CLIENT_BACKLOG / 2);
+	if (resume) {
+		xsys_mutex_lock(&client->fdTxMutex);
+		client->rxPaused = 0;
+		_xbee_netClientWatch(xbee, client);
+		xsys_mutex_unlock(&client->fdTxMutex);
+	}
+	if (!client->dead || client->jobActive) client = NULL;
+	xsys_mutex_unlock(&net->jobMutex);
+
+	return client;
+}
+
+/* the worker threads - these run the handlers for requests, so that a slow request (e.g. a connTx() waiting for an ACK)
+   doesn't hold up the event loop, or the client's other requests */
+void xbee_netWorkerThread(struct xbee_netInfo *net) {
+	struct xbee *xbee;
+	struct xbee_netJob *job;
+	struct xbee_netClient *client;
+
+	xbee = net->xbee;
+
+	for (;;) {
+		if (xsys_sem_wait(&net->jobSem)) {
+			if (errno == EINTR) continue;
+			xbee_perror(1, "xsys_sem_wait()");
+			break;
+		}
+		if (net->workersStop) break;
+		if ((job = ll_ext_head(&net->jobList)) == NULL) continue;
+
+		xbee_netClientRun(xbee, job->client, job->handler, job->id, job->reqID, job->returnValue, job->buf);
+
+		if ((client = xbee_netJobDone(xbee, net, job)) != NULL) {
+			xbee_log(2, "connection from %s:%hu ended", client->addr, client->port);
+			xbee_netClientFree(xbee, net, client);
+		}
+	}
+}
+
+/* start the worker pool */
+static int xbee_netWorkersStart(struct xbee *xbee, struct xbee_netInfo *net) {
+	int ret;
+
+	ret = XBEE_ENONE;
+
+	if (xsys_mutex_init(&net->jobMutex)) {
+		ret = XBEE_EMUTEX;
+		goto die1;
+	}
+	if (xsys_sem_init(&net->jobSem)) {
+		ret = XBEE_ESEMAPHORE;
+		goto die2;
+	}
+	if (ll_init(&net->jobList)) {
+		ret = XBEE_ELINKEDLIST;
+		goto die3;
+	}
+	if ((net->workers = calloc(XBEE_NET_WORKERS, sizeof(*net->workers))) == NULL) {
+		ret = XBEE_ENOMEM;
+		goto die4;
+	}
+	for (net->workerCount = 0; net->workerCount < XBEE_NET_WORKERS; net->workerCount++) {
+		if (xsys_thread_create(&net->workers[net->workerCount], (void*(*)(void*))xbee_netWorkerThread, (void*)net)) break;
+	}
+	if (!net->workerCount) {
+		xbee_log(1, "xsys_thread_create(): failed to start any workers...");
+		ret = XBEE_ETHREAD;
+		goto die5;
+	}
+	if (net->workerCount < XBEE_NET_WORKERS) {
+		xbee_log(1, "only started %d of %d workers", net->workerCount, XBEE_NET_WORKERS);
+	}
+
+	goto done;
+die5:
+	free(net->workers);
+die4:
+	ll_destroy(&net->jobList, NULL);
+die3:
+	xsys_sem_destroy(&net->jobSem);
+die2:
+	xsys_mutex_destroy(&net->jobMutex);
+die1:
+done:
+	return ret;
+}
+
+/* stop the worker pool, each worker finishes the request it is running first */
+static void xbee_netWorkersStop(struct xbee *xbee, struct xbee_netInfo *net) {
+	struct xbee_netJob *job;
+	struct xbee_netClient *client;
+	int i;
+
+	net->workersStop = 1;
+	for (i = 0; i < net->workerCount; i++) {
+		xsys_sem_post(&net->jobSem);
+	}
+	for (i = 0; i < net->workerCount; i++) {
+		xsys_thread_join(net->workers[i], NULL);
+	}
+	free(net->workers);
+
+	/* abandon the requests that didn't get started */
+	while ((job = ll_ext_head(&net->jobList)) != NULL) {
+		if ((client = xbee_netJobDone(xbee, net, job)) != NULL) {
+			xbee_netClientFree(xbee, net, client);
+		}
+	}
+
+	ll_destroy(&net->jobList, NULL);
+	xsys_sem_destroy(&net->jobSem);
+	xsys_mutex_destroy(&net->jobMutex);
+}
+
+/* find a handler for a complete message, and either run it now, or give it to the workers
+   messages that affect how the rest are handled (the version check, and anything before it) and responses from the client are
+   handled on the event loop, in order. requests are handed to the worker pool, at most XBEE_NET_CLIENT_REQUESTS at a time per client,
+   and one at a time for each connection (key) - so e.g. a client's connTx()s reach the device in the order they were sent
+   the buffer is free'd once it has been handled */
+static void xbee_netClientHandle(struct xbee *xbee, struct xbee_netInfo *net, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct bufData *buf) {
+	int pos;
+	int i;
+	int iret;
+	struct xbee_netJob *job;
+
+#ifndef XBEE_NO_NET_STRICT_VERSIONS
+	/* if enabled, nothing can be done until the versions have been compared, and match */
+	if (!client->versionsMatched) {
+		if (id != 0x7F) {
+			xbee_log(5, "client must confirm commit ID before communication can begin");
+			if ((iret = xbee_netClientTx(xbee, client, 0x7F | 0x80, reqID, XBEE_EINVAL, NULL)) != 0) {
+				xbee_log(1, "WARNING! response failed (%d)", iret);
+			}
+			goto done;
+		}
+	}
+#endif /* XBEE_NO_NET_STRICT_VERSIONS */
+
+	/* find a net handler that is registered for this messageID */
+	for (pos = 0; netHandlers[pos].handler; pos++ ) {
+		if (netHandlers[pos].id == id) break;
+	}
+	if (!netHandlers[pos].handler) {
+		xbee_log(1, "Unknown message received / no packet handler (0x%02X)", id);
+		goto done;
 	}
-	if (!con) return XBEE_EFAILED;
+	xbee_log(2, "Received %d byte message (0x%02X - '%s') @ %p", buf->len, id, netHandlers[pos].handlerName, buf);
 
-	/* if successful, return it */
-	if (rCon) *rCon = con;
+	/* print the message! */
+	if (xbee_shouldLog(20)) {
+	  xbee_log(20,"Rx message: (%d bytes)", buf->len);
+	  for (i = 0; i < buf->len; i++) {
+	   	xbee_log(20,"  %2d: 0x%02X '%c'", i, buf->buf[i], ((buf->buf[i] >= ' ' && buf->buf[i] <= '~')?buf->buf[i]:'.'));
+	 	}
+	}
 
-	return 0;
-}
+	if ((id & 0x80) || id == 0x7F || (job = malloc(sizeof(*job))) == NULL) {
+		xbee_netClientRun(xbee, client, pos, id, reqID, returnValue, buf);
+		goto done;
+	}
+	job->client = client;
+	job->handler = pos;
+	job->id = id;
+	job->reqID = reqID;
+	job->returnValue = returnValue;
+	job->buf = buf;
+	job->key = (netHandlers[pos].keyed && buf->len >= 2) ? xbee_netKeyFromBytes(buf->buf) : -1;
+
+	xsys_mutex_lock(&net->jobMutex);
+	client->jobCount++;
+	/* while there is room, anything that is waiting is held up by its key - so this can't overtake a request for the same one */
+	if (xbee_netJobReady(client, job)) {
+		xbee_netJobStart(net, client, job);
+	} else {
+		ll_add_tail(&client->jobList, job);
+	}
+	/* if the client is getting too far ahead, then stop reading from it for a while */
+	if (client->jobCount >= XBEE_NET_CLIENT_BACKLOG && !client->rxPaused) {
+		xsys_mutex_lock(&client->fdTxMutex);
+		client->rxPaused = 1;
+		_xbee_netClientWatch(xbee, client);
+		xsys_mutex_unlock(&client->fdTxMutex);
+	}
+	xsys_mutex_unlock(&net->jobMutex);
+	return;
 
-/* convert 2 bytes into a 'key', for use with the network interface */
-unsigned short xbee_netKeyFromBytes(unsigned char *bytes) {
-	unsigned short key;
-	
-	key  = (bytes[0] << 8) & 0xFF00;
-	key |= (bytes[1]     ) & 0x00FF;
-	
-	return key;
-}
-/* convert a 'key' into 2 bytes, for use with the network interface */
-void xbee_netBytesFromKey(unsigned char *bytes, unsigned short key) {
-	bytes[0] = ((key >> 8) & 0xFF);
-	bytes[1] = ((key     ) & 0xFF);
+done:
+	free(buf);
 }
 
-/* ######################################################################### */
-
 /* protocol is as follows:
 
 		{<size>|<id><reqID>[returnValue]<data...>}
@@ -189,297 +889,441 @@ void xbee_netBytesFromKey(unsigned char *bytes, unsigned short key) {
 
 	e.g: request with id of 'x', request id of 'y' and 6 bytes of data (pass the following through `echo`)
 		{\0000\0006|xy123456}
-		
+
 	e.g: the response for the above example could be as follows (a 0 return value indicates NO ERROR):
 		{\0000\0002|\0370y\0000Hi}
 
 			it is permitted for a response to be sent with no request, for example within an XBee connection's callback function - see xbee_netCallback()
-*/
-int xbee_netClientRx(struct xbee *xbee, struct xbee_netClient *client) {
+
+	the socket is non-blocking, data is read in large chunks into client->rxBuf, and every complete message in there is
+	handled before reading again. a partial message is kept at the front of the buffer until the rest arrives
+	returns 0 once the socket has been drained, or -1 if the client has gone away */
+int xbee_netClientRx(struct xbee *xbee, struct xbee_netInfo *net, struct xbee_netClient *client) {
 	int ret;
-	int iret;
+	int space;
 	int pos;
-	int i;
-	unsigned char c;
-	unsigned char ibuf[5];
-	unsigned char id;
-	unsigned char reqID;
-	unsigned char returnValue;
+	int hdrLen;
+	int msgLen;
+	unsigned char *p;
 	unsigned short len;
-	struct bufData *buf, *rBuf;
-
-	ret = 0;
+	struct bufData *buf;
 
 	for (;;) {
-		/* read the start byte '{' */
-		if ((iret = xbee_netRecv(client->fd, &c, 1, MSG_WAITALL)) == -1) {
-			xbee_perror(1, "xbee_netRecv()");
-			goto retry;
-		} else if (iret == -2) {
-			break;
+		/* make sure there is room to read into */
+		if (client->rxLen == client->rxSize) {
+			if ((p = realloc(client->rxBuf, client->rxSize * 2)) == NULL) {
+				xbee_log(1, "ENOMEM - data lost");
+				return -1;
+			}
+			client->rxBuf = p;
+			client->rxSize *= 2;
 		}
 
-		/* try again if that wasn't a '{' */
-		if (c != '{') continue;
-
-		/* read the length, seperator, messageID and reqID bytes */
-		if ((iret = xbee_netRecv(client->fd, ibuf, 5, MSG_WAITALL)) == -1) {
-			xbee_perror(1, "xbee_netRecv()");
-			goto retry;
-		} else if (iret == -2) {
-			break;
+		/* a SOCK_SEQPACKET record is cut short if it doesn't fit, so always offer room for the largest message */
+		if (client->seqpacket && client->rxSize - client->rxLen < XBEE_NET_MSGMAX) {
+			for (space = client->rxSize; space - client->rxLen < XBEE_NET_MSGMAX; space *= 2);
+			if ((p = realloc(client->rxBuf, space)) == NULL) {
+				xbee_log(1, "ENOMEM - data lost");
+				return -1;
+			}
+			client->rxBuf = p;
+			client->rxSize = space;
 		}
 
-		/* try again if the seperator wasn't where it should have been */
-		if (ibuf[2] != '|') {
-			xbee_log(1, "invalid data recieved...");
-			goto next;
+		space = client->rxSize - client->rxLen;
+		/* for SOCK_SEQPACKET, MSG_TRUNC returns the record's full length (on TCP it would throw the data away!) */
+		if ((ret = recv(client->fd, &client->rxBuf[client->rxLen], space, MSG_DONTWAIT | (client->seqpacket ? MSG_TRUNC : 0))) == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			xbee_perror(1, "recv()");
+			return -1;
+		} else if (ret == 0) {
+			/* the client hung up */
+			return -1;
+		} else if (ret > space) {
+			xbee_log(1, "client %s:%hu sent a %d byte record, that is larger than any message", client->addr, client->port, ret);
+			return -1;
 		}
-		
-		/* retrieve the data length, messageID and requestID */
-		len = ((ibuf[0] << 8) & 0xFF00) | (ibuf[1] & 0xFF);
-		id = ibuf[3];
-		reqID = ibuf[4];
-		
-		/* if bit 7 is set, then this is a response */
-		if (id & 0x80) {
-			/* then this is a response... so suck in the returnValue */
-			if ((iret = xbee_netRecv(client->fd, &returnValue, 1, MSG_WAITALL)) == -1) {
-				xbee_perror(1, "xbee_netRecv()");
-				goto retry;
-			} else if (iret == -2) {
-				break;
+		client->rxLen += ret;
+
+		/* handle every complete message in the buffer, the responses are held back and sent together afterwards */
+		xbee_netClientCork(xbee, client);
+		for (pos = 0; pos < client->rxLen; pos += msgLen) {
+			p = &client->rxBuf[pos];
+
+			/* skip anything that isn't the start of a message '{' */
+			if (p[0] != '{') {
+				msgLen = 1;
+				continue;
 			}
-		} else {
-			returnValue = 0;
-		}
 
-#ifndef XBEE_NO_NET_STRICT_VERSIONS
-		/* if enabled, nothing can be done until the versions have been compared, and match */
-		if (!client->versionsMatched) {
-			if (id != 0x7F) {
-				xbee_log(5, "client must confirm commit ID before communication can begin");
-				if ((iret = xbee_netClientTx(xbee, client, 0x7F | 0x80, reqID, XBEE_EINVAL, NULL)) != 0) {
-					xbee_log(1, "WARNING! response failed (%d)", iret);
-				}
-				goto retry;
+			/* we need the length, seperator, messageID and reqID bytes */
+			if (client->rxLen - pos < 6) break;
+
+			/* try again if the seperator wasn't where it should have been */
+			if (p[3] != '|') {
+				xbee_log(1, "invalid data recieved...");
+				msgLen = 1;
+				continue;
 			}
-		}
-#endif /* XBEE_NO_NET_STRICT_VERSIONS */
-		
-		/* get some storage */
-		if ((buf = calloc(1, sizeof(*buf) + len)) == NULL) {
-			xbee_log(1, "ENOMEM - data lost");
-			goto next;
-		}
-		buf->len = len;
 
-		len += 1; /* +1 so that we read the closing '}'
-		             this will later be checked and then overwritten with a '\0', and is included in the sizeof(struct bufData) */
+			/* if bit 7 is set, then this is a response, and the returnValue follows */
+			hdrLen = ((p[4] & 0x80) ? 7 : 6);
+			len = ((p[1] << 8) & 0xFF00) | (p[2] & 0xFF);
+			msgLen = hdrLen + len + 1;
 
-		/* suck in the data */
-		if ((iret = xbee_netRecv(client->fd, buf->buf, len, MSG_WAITALL)) == -1) {
-			xbee_perror(1, "xbee_netRecv()");
-			goto retry;
-		} else if (iret == -2) {
-			break;
-		}
+			/* wait for the rest to arrive */
+			if (client->rxLen - pos < msgLen) break;
 
-		/* check we have the terminator ('}') and replace it with a nul ('\0') */
-		if (buf->buf[buf->len] != '}') {
-			xbee_log(1, "invalid data recieved...");
-			goto next;
-		}
-		buf->buf[buf->len] = '\0';
+			/* check we have the terminator ('}') */
+			if (p[msgLen - 1] != '}') {
+				xbee_log(1, "invalid data recieved...");
+				msgLen = 1;
+				continue;
+			}
 
-		/* find a net handler that is registered for this messageID */
-		for (pos = 0; netHandlers[pos].handler; pos++ ) {
-			if (netHandlers[pos].id == id) break;
-		}
-		if (!netHandlers[pos].handler) {
-			xbee_log(1, "Unknown message received / no packet handler (0x%02X)", id);
-			goto next;
+			/* the handlers expect their own buffer, with the data followed by a nul ('\0')
+			   there is room for the nul, because 1 byte is included in the sizeof(struct bufData) */
+			if ((buf = malloc(sizeof(*buf) + len)) == NULL) {
+				xbee_log(1, "ENOMEM - data lost");
+				continue;
+			}
+			buf->len = len;
+			memcpy(buf->buf, &p[hdrLen], len);
+			buf->buf[len] = '\0';
+
+			xbee_netClientHandle(xbee, net, client, p[4], p[5], ((hdrLen == 7) ? p[6] : 0), buf);
 		}
-		xbee_log(2, "Received %d byte message (0x%02X - '%s') @ %p", buf->len, id, netHandlers[pos].handlerName, buf);
 
-		/* print the message! */
-	  xbee_log(20,"Rx message: (%d bytes)", buf->len);
-	  for (i = 0; i < buf->len; i++) {
-    	xbee_log(20,"  %2d: 0x%02X '%c'", i, buf->buf[i], ((buf->buf[i] >= ' ' && buf->buf[i] <= '~')?buf->buf[i]:'.'));
-  	}
+		if (xbee_netClientUncork(xbee, client) != 0) return -1;
 
-		rBuf = NULL;
-#warning TODO - need to make this threadded...
-		/* a request handler should not expect anything from the returnValue */
-		if ((iret = netHandlers[pos].handler(xbee, client, id, returnValue, buf, &rBuf)) != 0) {
-			xbee_log(2, "netHandler '%s' returned %d for client %s:%hu", netHandlers[pos].handlerName, iret, client->addr, client->port);
-		}
-		/* if this was a request, then send a response */
-		if (!(id & 0x80)) {
-			if ((iret = xbee_netClientTx(xbee, client, id | 0x80, reqID, iret, rBuf)) != 0) {
-				xbee_log(1, "WARNING! response failed (%d)", iret);
-			}
+		/* keep hold of any partial message, at the front of the buffer */
+		if (pos > 0) {
+			client->rxLen -= pos;
+			if (client->rxLen) memmove(client->rxBuf, &client->rxBuf[pos], client->rxLen);
 		}
 
-		/* free the stuff */
-		if (rBuf && rBuf != buf) free(rBuf);
-next:
-		free(buf);
-		continue;
-retry:
-    sleep(1);
+		/* if the client has too many requests waiting, then leave the rest in the socket for now */
+		if (client->rxPaused) break;
+
+		/* if the read didn't fill the space we offered, then the socket is empty
+		   there is no need to go round again just to get EAGAIN - the loop will tell us when there is more
+		   (this doesn't hold for SOCK_SEQPACKET, where each read returns a single record) */
+		if (ret < space && !client->seqpacket) break;
 	}
 
-	return ret;
+	return 0;
 }
 
-/* the receiving thread */
-void xbee_netClientRxThread(struct xbee_netClientThreadInfo *info) {
-	struct xbee *xbee;
-	struct xbee_con *con;
-	struct xbee_netClient *client;
-	int ret;
-
-	xsys_thread_detach_self();
-
-	xbee = NULL;
+/* ######################################################################### */
 
-	/* check parameters */
-	if (!info) goto die1;
+/* currently just returns 'OK!' */
+int xbee_netAuthorizeAddress(struct xbee *xbee, char *addr) {
+	/* checks IP address, returns 0 to allow, else deny. not yet implemented */
+	return 0;
+}
 
-	if (!info->client) goto die2;
-	client = info->client;
+/* local (AF_UNIX) clients are authorized by who they are, rather than where they are
+   root, our own user and members of our group are allowed (the group is the easy way to give others access)
+   returns 0 to allow, else deny */
+int xbee_netAuthorizeCred(struct xbee *xbee, struct ucred *cred) {
+	if (cred->uid == 0) return 0;
+	if (cred->uid == geteuid()) return 0;
+	if (cred->gid == getegid()) return 0;
+	return 1;
+}
 
-	if (!info->xbee) goto die3;
-	xbee = info->xbee;
-	if (!xbee_validate(xbee)) goto die4;
-	if (!xbee->net) goto die4;
+/* remove a client from the event loop, and tidy up everything it had open */
+static void xbee_netClientFree(struct xbee *xbee, struct xbee_netInfo *net, struct xbee_netClient *client) {
+	struct xbee_netConData *sub;
 
-	free(info); info = NULL;
+	epoll_ctl(net->epfd, EPOLL_CTL_DEL, client->fd, NULL);
 
-	/* execute the Rx function */
-	if ((ret = xbee_netClientRx(xbee, client)) != 0) {
-		xbee_log(5, "xbee_netClientRx() returned %d", ret);
+	/* end all the subscriptions, connections that other clients share are left open
+	   until this is done callback threads may still be sending to the client, so the fd must stay open */
+	while ((sub = ll_get_head(&client->conList)) != NULL) {
+		xbee_netConUnsubscribe(xbee, client, sub->key);
 	}
+	ll_destroy(&client->conList, NULL);
+	ll_destroy(&client->jobList, NULL);
+	/* the subscriptions have gone, so nothing is writing to the ring any more */
+	xbee_netShmFree(client->shm);
 
-die4:
-	/* if we get here, then the client probrably disconnected, so close up */
-	if (ll_ext_item(&xbee->net->clientList, client)) {
-		xbee_log(1, "tried to remove missing client... %p", client);
-		goto die2;
-	}
-die3:
+	/* now nothing else can use it, shutdown the communications link */
 	shutdown(client->fd, SHUT_RDWR);
 	close(client->fd);
-
-	xbee_log(2, "connection from %s:%hu ended", client->addr, client->port);
-
-	/* remove all xbee connections that the network client had active */
-	while ((con = ll_ext_head(&client->conList)) != NULL) {
-		void *p;
-		xbee_conEnd(xbee, con, &p);
-		/* we know what the userData was, so it's okay to free() it */
-		if (p) free(p);
-	}
-	ll_destroy(&client->conList, NULL);
+	free(client->txBuf);
+	free(client->rxBuf);
+	xsys_mutex_destroy(&client->shmMutex);
+	xsys_mutex_destroy(&client->conMutex);
+	xsys_mutex_destroy(&client->fdTxMutex);
 	free(client);
-die2:
-	if (info) free(info);
-die1:;
 }
 
-/* ######################################################################### */
+/* mark a client as gone, and forget any requests that haven't started yet
+   returns non-zero if workers are still running requests for it - the last of them will free the client */
+static int xbee_netClientDrop(struct xbee *xbee, struct xbee_netInfo *net, struct xbee_netClient *client) {
+	struct xbee_netJob *job;
+	int ret;
 
-/* currently just returns 'OK!' */
-int xbee_netAuthorizeAddress(struct xbee *xbee, char *addr) {
-	/* checks IP address, returns 0 to allow, else deny. not yet implemented */
-	return 0;
+	/* stop listening to it, but keep the fd open until nothing can use it */
+	epoll_ctl(net->epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	shutdown(client->fd, SHUT_RDWR);
+
+	xsys_mutex_lock(&net->jobMutex);
+	client->dead = 1;
+	while ((job = ll_ext_head(&client->jobList)) != NULL) {
+		client->jobCount--;
+		free(job->buf);
+		free(job);
+	}
+	ret = client->jobActive;
+	xsys_mutex_unlock(&net->jobMutex);
+
+	return ret;
 }
 
-/* the listen thread - accepts incoming connections */
-void xbee_netListenThread(struct xbee *xbee) {
+/* accept all pending connections, and add them to the event loop */
+static void xbee_netAccept(struct xbee *xbee, struct xbee_netInfo *net) {
 	struct sockaddr_in addrinfo;
 	socklen_t addrlen;
 	char addr[INET_ADDRSTRLEN];
 	unsigned short port;
-
-	struct xbee_netClientThreadInfo *tinfo;
-
+	struct ucred cred;
+	struct epoll_event ev;
+	struct xbee_netClient *client;
 	int confd;
-	int run;
-
-	run = 1;
+	int i;
 
-	while (xbee->net && run) {
-		/* accept the next connection */
+	for (;;) {
+		/* accept the next connection, the address is only interesting for AF_INET */
 		addrlen = sizeof(addrinfo);
-		if ((confd = accept(xbee->net->fd, (struct sockaddr *)&addrinfo, &addrlen)) < 0) {
-			xbee_perror(1, "accept()");
-			usleep(750000);
-			goto die1;
+		if ((confd = accept(net->fd, (net->family == AF_INET ? (struct sockaddr *)&addrinfo : NULL), (net->family == AF_INET ? &addrlen : NULL))) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				xbee_perror(1, "accept()");
+				usleep(250000);
+			}
+			return;
 		}
-		
-		if (!xbee->net) break;
-		
-		/* get the network address info */
+
 		memset(addr, 0, sizeof(addr));
-		if (inet_ntop(AF_INET, (const void *)&addrinfo.sin_addr, addr, sizeof(addr)) == NULL) {
-			xbee_perror(1, "inet_ntop()");
-			goto die2;
-		}
-		port = ntohs(addrinfo.sin_port);
+		if (net->family == AF_UNIX) {
+			/* local clients are identified by their credentials, the 'port' is the low bits of the pid, for the logs */
+			addrlen = sizeof(cred);
+			if (getsockopt(confd, SOL_SOCKET, SO_PEERCRED, &cred, &addrlen) == -1) {
+				xbee_perror(1, "getsockopt()");
+				goto die1;
+			}
+			snprintf(addr, sizeof(addr), "local");
+			port = cred.pid;
 
-		/* try to authorize the host */
-		if (xbee_netAuthorizeAddress(xbee, addr)) {
-			xbee_log(0, "*** connection from %s:%hu was blocked ***", addr, port);
-			goto die2;
+			if (xbee_netAuthorizeCred(xbee, &cred)) {
+				xbee_log(0, "*** local connection from pid %d (uid %d, gid %d) was blocked ***", cred.pid, cred.uid, cred.gid);
+				goto die1;
+			}
+			xbee_log(3, "local connection from pid %d (uid %d, gid %d)", cred.pid, cred.uid, cred.gid);
+		} else {
+			/* get the network address info */
+			if (inet_ntop(AF_INET, (const void *)&addrinfo.sin_addr, addr, sizeof(addr)) == NULL) {
+				xbee_perror(1, "inet_ntop()");
+				goto die1;
+			}
+			port = ntohs(addrinfo.sin_port);
+
+			/* try to authorize the host */
+			if (xbee_netAuthorizeAddress(xbee, addr)) {
+				xbee_log(0, "*** connection from %s:%hu was blocked ***", addr, port);
+				goto die1;
+			}
 		}
 
-		xbee_log(2, "accepted connection from %s:%hu", addr, port);
+		if (xbee_netNonBlock(confd) == -1) {
+			xbee_perror(1, "fcntl()");
+			goto die1;
+		}
 
-		/* build up some info */
-		if ((tinfo = calloc(1, sizeof(*tinfo))) == NULL) {
+		/* build up the client */
+		if ((client = calloc(1, sizeof(*client))) == NULL) {
 			xbee_log(1, "calloc(): no memory");
-			run = 0;
-			goto die2;
+			goto die1;
 		}
-		tinfo->xbee = xbee;
-		if ((tinfo->client = calloc(1, sizeof(*tinfo->client))) == NULL) {
-			xbee_log(1, "calloc(): no memory");
-			run = 0;
+		client->fd = confd;
+		client->epfd = net->epfd;
+		if (xsys_mutex_init(&client->fdTxMutex)) goto die2;
+		if (xsys_mutex_init(&client->conMutex)) goto die2_5;
+		if (xsys_mutex_init(&client->shmMutex)) goto die2_75;
+		memcpy(client->addr, addr, sizeof(addr));
+		client->port = port;
+		client->local = (net->family == AF_UNIX);
+		client->seqpacket = (net->sockType == SOCK_SEQPACKET);
+		ll_init(&client->conList);
+		ll_init(&client->jobList);
+		for (i = 0; i < XBEE_NET_CLIENT_REQUESTS; i++) client->jobKeys[i] = -1;
+		client->rxSize = XBEE_NET_RXBUFLEN;
+		if ((client->rxBuf = malloc(client->rxSize)) == NULL) {
+			xbee_log(1, "malloc(): no memory");
 			goto die3;
 		}
 
-		tinfo->client->fd = confd;
-		if (xsys_mutex_init(&tinfo->client->fdTxMutex)) goto die4;
-		memcpy(tinfo->client->addr, addr, sizeof(addr));
-		tinfo->client->port = port;
-		ll_init(&tinfo->client->conList);
-
-		/* start the thread */
-		if (xsys_thread_create(&tinfo->client->rxThread, (void*(*)(void*))xbee_netClientRxThread, (void*)tinfo)) {
-			xbee_log(1, "xsys_thread_create(): failed to start client thread...");
-			goto die5;
+		/* hand it to the event loop */
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		client->events = ev.events;
+		if (epoll_ctl(net->epfd, EPOLL_CTL_ADD, confd, &ev) == -1) {
+			xbee_perror(1, "epoll_ctl()");
+			goto die4;
 		}
 
 		/* add the client to the list */
-		ll_add_tail(&xbee->net->clientList, tinfo->client);
+		ll_add_tail(&net->clientList, client);
+
+		xbee_log(2, "accepted connection from %s:%hu", addr, port);
 
 		continue;
-die5:
-		xsys_mutex_destroy(&tinfo->client->fdTxMutex);
 die4:
-		free(tinfo->client);
+		free(client->rxBuf);
 die3:
-		free(tinfo);
+		ll_destroy(&client->jobList, NULL);
+		ll_destroy(&client->conList, NULL);
+		xsys_mutex_destroy(&client->shmMutex);
+die2_75:
+		xsys_mutex_destroy(&client->conMutex);
+die2_5:
+		xsys_mutex_destroy(&client->fdTxMutex);
 die2:
+		free(client);
+die1:
 		shutdown(confd, SHUT_RDWR);
 		close(confd);
-die1:
-		usleep(250000);
 	}
 }
 
+/* the event loop - a single thread accepts incoming connections, and services every client */
+void xbee_netLoopThread(struct xbee *xbee) {
+	struct xbee_netInfo *net;
+	struct xbee_netClient *client;
+	struct epoll_event events[XBEE_NET_MAXEVENTS];
+	uint64_t v;
+	int ret;
+	int n, i;
+
+	/* this isn't cancelled (it takes each client's fdTxMutex), xbee_netStop() clears xbee->net and then wakes it up */
+	while ((net = xbee->net) != NULL) {
+		if ((n = epoll_wait(net->epfd, events, XBEE_NET_MAXEVENTS, -1)) == -1) {
+			if (errno == EINTR) continue;
+			xbee_perror(1, "epoll_wait()");
+			usleep(250000);
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			/* the listening socket is registered with a NULL pointer, and the wakeFd with the net */
+			if ((client = events[i].data.ptr) == NULL) {
+				xbee_netAccept(xbee, net);
+				continue;
+			}
+			if ((void *)client == (void *)net) {
+				if (read(net->wakeFd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+					xbee_perror(1, "read(eventfd)");
+				}
+				continue;
+			}
+
+			ret = 0;
+			if (events[i].events & EPOLLOUT) {
+				xsys_mutex_lock(&client->fdTxMutex);
+				ret = _xbee_netClientFlush(xbee, client);
+				xsys_mutex_unlock(&client->fdTxMutex);
+			}
+			if (!ret && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				ret = xbee_netClientRx(xbee, net, client);
+			}
+			if (!ret) continue;
+
+			/* the client disconnected, so close up */
+			if (ll_ext_item(&net->clientList, client)) {
+				xbee_log(1, "tried to remove missing client... %p", client);
+				continue;
+			}
+			if (xbee_netClientDrop(xbee, net, client)) continue;
+			xbee_log(2, "connection from %s:%hu ended", client->addr, client->port);
+			xbee_netClientFree(xbee, net, client);
+		}
+	}
+}
+
+/* run the server on a socket that is already listening (net->fd), net is owned by xbee->net if this succeeds */
+static int xbee_netRun(struct xbee *xbee, struct xbee_netInfo *net) {
+	int ret;
+	struct epoll_event ev;
+
+	ret = XBEE_ENONE;
+
+	/* the event loop accepts connections as they arrive, so it mustn't block in accept() */
+	if (xbee_netNonBlock(net->fd) == -1) {
+		xbee_perror(1, "fcntl()");
+		ret = XBEE_ESOCKET;
+		goto die1;
+	}
+
+	/* build the event loop, starting with the listening socket */
+	if ((net->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		xbee_perror(1, "epoll_create1()");
+		ret = XBEE_ESOCKET;
+		goto die1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(net->epfd, EPOLL_CTL_ADD, net->fd, &ev) == -1) {
+		xbee_perror(1, "epoll_ctl()");
+		ret = XBEE_ESOCKET;
+		goto die2;
+	}
+	if ((net->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		xbee_perror(1, "eventfd()");
+		ret = XBEE_ESOCKET;
+		goto die2;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = net;
+	if (epoll_ctl(net->epfd, EPOLL_CTL_ADD, net->wakeFd, &ev) == -1) {
+		xbee_perror(1, "epoll_ctl()");
+		ret = XBEE_ESOCKET;
+		goto die2_5;
+	}
+
+	/* start the workers that will run the requests */
+	if ((ret = xbee_netWorkersStart(xbee, net)) != XBEE_ENONE) goto die2_5;
+
+	/* the loop runs for as long as xbee->net is set */
+	xbee->net = net;
+
+	/* start the event loop thread */
+	if (xbee_threadStartMonitored(xbee, &net->loopThread, xbee_netLoopThread, xbee)) {
+		xbee_log(1, "xbee_threadStartMonitored(): failed...");
+		ret = XBEE_ETHREAD;
+		goto die3;
+	}
+
+	goto done;
+
+die3:
+	xbee->net = NULL;
+	xbee_threadStopMonitored(xbee, &net->loopThread, NULL, NULL);
+	xbee_netWorkersStop(xbee, net);
+die2_5:
+	close(net->wakeFd);
+die2:
+	close(net->epfd);
+die1:
+done:
+	return ret;
+}
+
 /* start listening for connections on the given port */
 EXPORT int xbee_netStart(struct xbee *xbee, int port) {
 	int ret;
@@ -493,14 +1337,14 @@ EXPORT int xbee_netStart(struct xbee *xbee, int port) {
     xbee = xbee_default;
   }
   if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
-	
+
 	/* user-facing functions need this form of protection...
 	   this means that for the default behavior, the fmap must point at this function! */
 	if (!xbee->f->netStart) return XBEE_ENOTIMPLEMENTED;
 	if (xbee->f->netStart != xbee_netStart) {
 		return xbee->f->netStart(xbee, port);
 	}
-	
+
 	/* sanity check */
 	if (port <= 0 || port >= 65535) return XBEE_ERANGE;
 
@@ -516,6 +1360,9 @@ EXPORT int xbee_netStart(struct xbee *xbee, int port) {
 		goto die1;
 	}
 	net->listenPort = port;
+	net->family = AF_INET;
+	net->sockType = SOCK_STREAM;
+	net->xbee = xbee;
 	ll_init(&net->clientList);
 
 	/* build a socket */
@@ -548,18 +1395,10 @@ EXPORT int xbee_netStart(struct xbee *xbee, int port) {
     goto die3;
   }
 
-	/* start the listen/accept thread */
-	if (xbee_threadStartMonitored(xbee, &net->listenThread, xbee_netListenThread, xbee)) {
-		xbee_log(1, "xbee_threadStartMonitored(): failed...");
-		ret = XBEE_ETHREAD;
-		goto die4;
-	}
+	if ((ret = xbee_netRun(xbee, net)) != XBEE_ENONE) goto die3;
 
-	xbee->net = net;
 	goto done;
 
-die4:
-	xbee_threadStopMonitored(xbee, &net->listenThread, NULL, NULL);
 die3:
 	close(net->fd);
 die2:
@@ -569,42 +1408,115 @@ done:
 	return ret;
 }
 
-/* kill off the given network client */
-int xbee_netClientKill(struct xbee *xbee, struct xbee_netClient *client) {
-	struct xbee_con *con;
+/* start listening for local connections on a Unix domain socket
+   a 'path' that starts with '@' is in the abstract namespace (no file is created, and it goes away with the server) */
+EXPORT int xbee_netStartUnix(struct xbee *xbee, char *path, int type) {
+	int ret;
+	int len;
+	struct xbee_netInfo *net;
+	struct sockaddr_un addrinfo;
+	struct stat st;
+	socklen_t addrlen;
+
+	/* check parameters */
+	if (!xbee) {
+		if (!xbee_default) return XBEE_ENOXBEE;
+		xbee = xbee_default;
+	}
+	if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
 
-	/* remove it from the list */
-	if (ll_ext_item(&xbee->net->clientList, client)) {
-		xbee_log(1, "tried to remove missing client... %p", client);
-		return XBEE_EINVAL;
+	/* user-facing functions need this form of protection...
+	   this means that for the default behavior, the fmap must point at this function! */
+	if (!xbee->f->netStartUnix) return XBEE_ENOTIMPLEMENTED;
+	if (xbee->f->netStartUnix != xbee_netStartUnix) {
+		return xbee->f->netStartUnix(xbee, path, type);
 	}
 
-	/* cancel its rx thread */
-	xsys_thread_cancel(client->rxThread);
+	/* sanity check */
+	if (!path) return XBEE_EMISSINGPARAM;
+	if (type == 0) type = SOCK_STREAM;
+	if (type != SOCK_STREAM && type != SOCK_SEQPACKET) return XBEE_EINVAL;
+	len = strlen(path);
+	if (len < 1 || len >= sizeof(addrinfo.sun_path)) return XBEE_ERANGE;
 
-	/* shutdown the communications link */
-	shutdown(client->fd, SHUT_RDWR);
-	close(client->fd);
+	ret = XBEE_ENONE;
 
-	xbee_log(2, "connection from %s:%hu killed", client->addr, client->port);
+	if (xbee->net != NULL) {
+		ret = XBEE_EBUSY;
+		goto die1;
+	}
 
-	/* destroy all the connections */
-	while ((con = ll_ext_head(&client->conList)) != NULL) {
-		void *p;
-		xbee_conEnd(xbee, con, &p);
-		if (p) free(p);
+	if ((net = calloc(1, sizeof(struct xbee_netInfo))) == NULL) {
+		ret = XBEE_ENOMEM;
+		goto die1;
 	}
-	ll_destroy(&client->conList, NULL);
-	xsys_mutex_destroy(&client->fdTxMutex);
-	free(client);
+	net->family = AF_UNIX;
+	net->sockType = type;
+	net->xbee = xbee;
+	ll_init(&net->clientList);
 
-	return 0;
+	memset(&addrinfo, 0, sizeof(addrinfo));
+	addrinfo.sun_family = AF_UNIX;
+	memcpy(addrinfo.sun_path, path, len);
+	if (path[0] == '@') {
+		/* abstract names start with a nul, and aren't nul terminated */
+		addrinfo.sun_path[0] = '\0';
+		addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+	} else {
+		addrlen = sizeof(addrinfo);
+		/* remember the path, so that it can be removed when we stop */
+		if ((net->unixPath = strdup(path)) == NULL) {
+			ret = XBEE_ENOMEM;
+			goto die2;
+		}
+		/* a socket left behind by a previous run would stop us from binding, but don't remove anything else! */
+		if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			unlink(path);
+		}
+	}
+
+	/* build a socket */
+	if ((net->fd = socket(AF_UNIX, type, 0)) == -1) {
+		xbee_perror(1, "socket()");
+		ret = XBEE_EOPENFAILED;
+		goto die3;
+	}
+
+	if (bind(net->fd, (const struct sockaddr*)&addrinfo, addrlen) == -1) {
+		xbee_perror(1, "bind()");
+		ret = XBEE_ESOCKET;
+		goto die4;
+	}
+
+	/* and listen! */
+	if (listen(net->fd, 512) == -1) {
+		xbee_perror(1, "listen()");
+		ret = XBEE_ESOCKET;
+		goto die5;
+	}
+
+	if ((ret = xbee_netRun(xbee, net)) != XBEE_ENONE) goto die5;
+
+	goto done;
+
+die5:
+	if (net->unixPath) unlink(net->unixPath);
+die4:
+	close(net->fd);
+die3:
+	free(net->unixPath);
+die2:
+	free(net);
+die1:
+done:
+	return ret;
 }
 
 /* stop listening for network connections, and kill all active clients */
 EXPORT int xbee_netStop(struct xbee *xbee) {
 	struct xbee_netInfo *net;
 	struct xbee_netClient *client;
+	uint64_t v = 1;
 
 	/* check parameters */
   if (!xbee) {
@@ -612,7 +1524,7 @@ EXPORT int xbee_netStop(struct xbee *xbee) {
     xbee = xbee_default;
   }
   if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
-	
+
 	/* user-facing functions need this form of protection...
 	   this means that for the default behavior, the fmap must point at this function! */
 	if (!xbee->f->netStop) return XBEE_ENOTIMPLEMENTED;
@@ -624,19 +1536,33 @@ EXPORT int xbee_netStop(struct xbee *xbee) {
 	net = xbee->net;
 	xbee->net = NULL;
 
-	/* shutdown the listen/accept thread */
-	xbee_threadStopMonitored(xbee, &net->listenThread, NULL, NULL);
+	/* shutdown the event loop - it isn't cancelled, it sees that xbee->net has gone when it wakes, and returns */
+	if (write(net->wakeFd, &v, sizeof(v)) == -1) {
+		xbee_perror(1, "write(eventfd)");
+	}
+	xbee_threadJoinMonitored(xbee, &net->loopThread, NULL, NULL);
+
+	/* let the workers finish what they are doing */
+	xbee_netWorkersStop(xbee, net);
 
 	/* shutdown the listening socket */
 	shutdown(net->fd, SHUT_RDWR);
 	close(net->fd);
+	if (net->unixPath) {
+		unlink(net->unixPath);
+		free(net->unixPath);
+	}
 
 	/* kill off all the active clients */
 	while ((client = ll_ext_head(&net->clientList)) != NULL) {
-		xbee_netClientKill(xbee, client);
+		xbee_log(2, "connection from %s:%hu killed", client->addr, client->port);
+		xbee_netClientDrop(xbee, net, client);
+		xbee_netClientFree(xbee, net, client);
 	}
 	ll_destroy(&net->clientList, NULL);
 
+	close(net->wakeFd);
+	close(net->epfd);
 	free(net);
 
 	return XBEE_EUNKNOWN;
@@ -23,42 +23,159 @@
 
 #ifndef XBEE_NO_NET_SERVER
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #ifndef INET_ADDRSTRLEN
 #define INET_ADDRSTRLEN 16
 #endif
 
-struct xbee_netClientThreadInfo {
-	struct xbee *xbee;
+/* the initial size of each client's receive buffer */
+#define XBEE_NET_RXBUFLEN    4096
+/* the number of threads that run requests from network clients */
+#ifndef XBEE_NET_WORKERS
+#define XBEE_NET_WORKERS          4
+#endif
+/* the most requests from a single client that may run at the same time, the rest wait their turn
+   responses are matched to requests by the reqID, so they may arrive out of order - but requests for the same connection
+   (key) are run one after another, in the order they arrived */
+#ifndef XBEE_NET_CLIENT_REQUESTS
+#define XBEE_NET_CLIENT_REQUESTS  4
+#endif
+/* stop reading from a client that has this many requests waiting */
+#define XBEE_NET_CLIENT_BACKLOG   256
+
+/* the most pieces of data that can be given to xbee_netClientTxv() */
+#define XBEE_NET_TXV_MAX          8
+/* the most file descriptors that can be passed to a local client at once */
+#define XBEE_NET_TXFDS_MAX        2
+
+/* room for an SCM_RIGHTS cmsg, aligned as a struct cmsghdr */
+union xbee_netFdCmsg {
+	char buf[CMSG_SPACE(sizeof(int) * XBEE_NET_TXFDS_MAX)];
+	struct cmsghdr align;
+};
+
+/* the largest message - header, 0xFFFF bytes of data and the terminator */
+#define XBEE_NET_MSGMAX      (7 + 0xFFFF + 1)
+
+/* the most events handled per epoll_wait() */
+#define XBEE_NET_MAXEVENTS   64
+/* if a client isn't reading, stop queueing messages for it beyond this many bytes */
+#define XBEE_NET_TXQUEUE_MAX (1024 * 1024)
+
+struct xbee_netJob {
 	struct xbee_netClient *client;
+	int handler; /* index into netHandlers[] */
+	unsigned char id;
+	unsigned char reqID;
+	unsigned char returnValue;
+	struct bufData *buf;
+	int key; /* the connection that the request is about, or -1 (see ADD_NET_KEY_HANDLER()) */
 };
 
 struct xbee_netClient {
 	int fd;
+	int epfd;
 	xsys_mutex fdTxMutex;
 
-	char addr[INET_ADDRSTRLEN];
-	unsigned short port;
+	char addr[INET_ADDRSTRLEN]; /* "local" for AF_UNIX clients */
+	unsigned short port;        /* ... and this is their pid */
+	char local;                 /* the socket is AF_UNIX, so file descriptors can be passed */
+	char seqpacket;             /* the socket is SOCK_SEQPACKET, each record holds exactly one message */
 
 	struct ll_head conList;
-	xsys_thread rxThread;
 	
 	char versionsMatched;
+	/* how packets are forwarded to this client (XBEE_NET_PKT_*), chosen during the version check */
+	unsigned char pktEncoding;
 
+	xsys_mutex conMutex; /* protects conKeyCount */
 	unsigned short conKeyCount;
+
+	/* data read from the socket, that hasn't yet been handled - rxLen of rxSize bytes are in use
+	   rxBuf grows if a message won't fit */
+	unsigned char *rxBuf;
+	int rxLen;
+	int rxSize;
+
+	/* data that hasn't been sent yet - txLen of txSize bytes are in use, protected by fdTxMutex
+	   messages collect here while the socket is full, or while the client is corked (handling a batch of requests) */
+	unsigned char *txBuf;
+	int txLen;
+	int txSize;
+	char txCork;
+	/* file descriptors to pass with the next bytes that are sent, see xbee_netClientTxFds() */
+	int txFd[XBEE_NET_TXFDS_MAX];
+	int txFdCount;
+
+	/* if not NULL, packets for this client's connections go into a shared memory ring instead of the socket (see net_shm.c)
+	   shmMutex protects the pointer, and makes the callbacks take turns as the ring's single producer */
+	xsys_mutex shmMutex;
+	struct xbee_netShm *shm;
+
+	/* the events that the loop is watching for, protected by fdTxMutex */
+	int events;
+	char rxPaused;
+
+	/* requests waiting for their turn (struct xbee_netJob), protected by net->jobMutex
+	   jobCount includes the jobActive requests that are running, or queued for a worker
+	   jobKeys holds the keys of the active requests that have one (-1 for an unused entry), a request for one of those waits */
+	struct ll_head jobList;
+	int jobCount;
+	int jobActive;
+	int jobKeys[XBEE_NET_CLIENT_REQUESTS];
+	/* the client has disconnected, it is free'd when the last of its requests has finished */
+	char dead;
 };
 
+/* a client's subscription to a connection, it is what the client's key refers to */
 struct xbee_netConData {
 	unsigned short key;
 	struct xbee_netClient *client;
+	struct xbee_netFeed *feed;
+	/* the client has put its subscription to sleep - the connection stays awake for the others, protected by feed->subMutex */
+	char sleeping;
+	char wakeOnRx;
 };
 
-int xbee_netClientTx(struct xbee *xbee, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct bufData *buf);
+/* clients that ask for the same connection (type and address) share a single xbee_con, which is the feed's
+   each packet is encoded once, and the same bytes are sent to every subscriber
+
+   a reference is held by each subscriber, and by anything that is using the feed's connection (a request, or the
+   callback while it is delivering a packet). the connection is ended when the last reference is dropped */
+struct xbee_netFeed {
+	struct xbee_con *con;
+	int refs; /* protected by a lock that is shared by every feed, see xbee_netFeedHold() */
 
-int xbee_netGetCon(struct xbee *xbee, struct xbee_netClient *client, unsigned short key, struct xbee_con **rCon);
+	/* the subscribers, held while a packet is delivered, so none of them can go away under the callback */
+	xsys_mutex subMutex;
+	struct xbee_netConData **subs;
+	int subCount;
+	int subSize;
+};
+
+int xbee_netMsgHeader(unsigned char *buf, int dataLen, unsigned char id, unsigned char reqID, unsigned char returnValue);
+int xbee_netClientTxFds(struct xbee *xbee, struct xbee_netClient *client, int *fds, int fdCount);
+int xbee_netClientTx(struct xbee *xbee, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct bufData *buf);
+int xbee_netClientTxv(struct xbee *xbee, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct iovec *data, int dataCnt);
+
+struct ucred; /* <sys/socket.h> only has it with _GNU_SOURCE */
+int xbee_netAuthorizeAddress(struct xbee *xbee, char *addr);
+int xbee_netAuthorizeCred(struct xbee *xbee, struct ucred *cred);
+
+int xbee_netConSubscribe(struct xbee *xbee, struct xbee_netClient *client, unsigned char conTypeId, struct xbee_conAddress *address, struct xbee_netConData **rSub);
+int xbee_netConUnsubscribe(struct xbee *xbee, struct xbee_netClient *client, unsigned short key);
+int xbee_netConSleep(struct xbee *xbee, struct xbee_netClient *client, unsigned short key, int sleeping, int wakeOnRx);
+int xbee_netGetCon(struct xbee *xbee, struct xbee_netClient *client, unsigned short key, struct xbee_netFeed **rFeed);
+void xbee_netPutCon(struct xbee *xbee, struct xbee_netFeed *feed);
+struct xbee_netFeed *xbee_netFeedHold(void **userData);
 unsigned short xbee_netKeyFromBytes(unsigned char *bytes);
 void xbee_netBytesFromKey(unsigned char *bytes, unsigned short key);
 
-void xbee_netClientRxThread(struct xbee_netClientThreadInfo *info);
+int xbee_netClientRx(struct xbee *xbee, struct xbee_netInfo *net, struct xbee_netClient *client);
+void xbee_netLoopThread(struct xbee *xbee);
+void xbee_netWorkerThread(struct xbee_netInfo *net);
 
 #else /* XBEE_NO_NET_SERVER */
 
@@ -22,49 +22,104 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "internal.h"
 #include "conn.h"
 #include "net.h"
 #include "net_handlers.h"
+#include "net_pkt.h"
+#include "net_shm.h"
 #include "log.h"
 
-void xbee_netCallback(struct xbee *xbee, struct xbee_con *con, struct xbee_pkt **pkt, void **userData) {
-	struct xbee_netClient *client;
-	struct bufData *buf;
-	void *p;
-	unsigned int dataLen;
+/* forward a packet to the client, through its shared memory ring if it has one */
+static void xbee_netCallbackTxv(struct xbee *xbee, struct xbee_netClient *client, struct iovec *iov, int iovcnt) {
+	int ret;
 
-	if (!userData) {
-		xbee_log(1, "missing userData... for con @ %p", con);
-		xbee_conAttachCallback(xbee, con, NULL, NULL);
-		return;
+	if (client->shm) {
+		if ((ret = xbee_netShmTxv(xbee, client, 0x02 | 0x80, 0, 0, iov, iovcnt)) != XBEE_ENOTREADY) {
+			if (ret == XBEE_EBUSY) xbee_log(5, "client %s:%hu's ring is full, packet dropped", client->addr, client->port);
+			return;
+		}
 	}
-	client = *userData;
 
-	dataLen = sizeof(struct xbee_pkt) + (*pkt)->datalen;
+	xbee_netClientTxv(xbee, client, 0x02 | 0x80, 0, 0, iov, iovcnt);
+}
 
-	if (dataLen & ~0xFFFF) {
-		xbee_log(0, "data too long... (%u bytes) for con @ %p", dataLen, con);
-		return;
-	}
+/* deliver a packet to every client that has subscribed to the connection */
+void xbee_netCallback(struct xbee *xbee, struct xbee_con *con, struct xbee_pkt **pkt, void **userData) {
+	/* stands in for the packet's dataItems pointer on the wire */
+	static const void *noDataItems = NULL;
+	struct xbee_netFeed *feed;
+	struct xbee_netConData *sub;
+	struct xbee_netPktEnc enc;
+	struct iovec raw[3];
+	struct iovec iov[4];
+	unsigned char key[2];
+	unsigned int dataLen;
+	int encTried;
+	int encCnt;
+	int i;
 
-	if ((buf = calloc(1, dataLen)) == NULL) {
-		xbee_log(0, "calloc() failed...");
-		return;
-	}
-	buf->len = dataLen;
+	/* the feed has gone if the connection has ended, this packet was on its way out anyway */
+	if ((feed = xbee_netFeedHold(userData)) == NULL) return;
 
-	/* we don't want to pass the dataItems through, it SHOULD be possible to determine these from the buffer */
-	p = (*pkt)->dataItems;
-	(*pkt)->dataItems = NULL;
-	memcpy(buf->buf, *pkt, dataLen);
-	(*pkt)->dataItems = p;
+	/* send the packet straight from its own memory, it is only copied if a client can't take it all right now.
+	   we don't want to pass the dataItems through, it SHOULD be possible to determine these from the buffer */
+	dataLen = sizeof(struct xbee_pkt) + (*pkt)->datalen;
+	raw[0].iov_base = *pkt;
+	raw[0].iov_len = offsetof(struct xbee_pkt, dataItems);
+	raw[1].iov_base = (void *)&noDataItems;
+	raw[1].iov_len = sizeof(noDataItems);
+	raw[2].iov_base = &((char *)*pkt)[raw[0].iov_len + raw[1].iov_len];
+	raw[2].iov_len = dataLen - (raw[0].iov_len + raw[1].iov_len);
+
+	/* the compact encoding is done once, when the first subscriber that wants it is found
+	   iov[0] is left free for the key */
+	encTried = 0;
+	encCnt = -1;
+
+	xsys_mutex_lock(&feed->subMutex);
+	for (i = 0; i < feed->subCount; i++) {
+		sub = feed->subs[i];
+
+		if (sub->sleeping) {
+			if (!sub->wakeOnRx) continue;
+			sub->sleeping = 0;
+		}
+
+		if (sub->client->pktEncoding < XBEE_NET_PKT_COMPACT) {
+			if (dataLen & ~0xFFFF) {
+				xbee_log(0, "data too long... (%u bytes) for con @ %p", dataLen, con);
+				continue;
+			}
+			xbee_netCallbackTxv(xbee, sub->client, raw, 3);
+			continue;
+		}
+
+		if (!encTried) {
+			encTried = 1;
+			if ((encCnt = xbee_netPktEncode(xbee, *pkt, &enc, &iov[1])) < 0) {
+				xbee_log(0, "failed to encode packet (%d) for con @ %p", encCnt, con);
+			}
+		}
+		if (encCnt < 0) continue;
+
+		if (sub->client->pktEncoding == XBEE_NET_PKT_KEYED) {
+			xbee_netBytesFromKey(key, sub->key);
+			iov[0].iov_base = key;
+			iov[0].iov_len = 2;
+			xbee_netCallbackTxv(xbee, sub->client, iov, 1 + encCnt);
+		} else {
+			xbee_netCallbackTxv(xbee, sub->client, &iov[1], encCnt);
+		}
+	}
+	xsys_mutex_unlock(&feed->subMutex);
 
-	xbee_netClientTx(xbee, ((struct xbee_netConData*)(*userData))->client, 0x02 | 0x80, 0, 0, buf);
+	if (encCnt >= 0) xbee_netPktEncodeDone(&enc);
 
-	free(buf);
+	xbee_netPutCon(xbee, feed);
 }
 
 /* ######################################################################### */
@@ -72,15 +127,19 @@ void xbee_netCallback(struct xbee *xbee, struct xbee_con *con, struct xbee_pkt *
 int xbee_netH_connTx(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
 	unsigned short key;
 	int ret;
-	struct xbee_con *con;
+	struct xbee_netFeed *feed;
 	
 	if (buf->len < 2) return XBEE_EINVAL;
 	
 	key = xbee_netKeyFromBytes(&buf->buf[0]);
 	
-	if ((ret = xbee_netGetCon(xbee, client, key, &con)) != 0) return ret;
+	if ((ret = xbee_netGetCon(xbee, client, key, &feed)) != 0) return ret;
+	
+	ret = xbee_connTx(xbee, feed->con, (char*)&buf->buf[2], buf->len - 2);
 	
-	return xbee_conTx(xbee, con, (char*)&buf->buf[2], buf->len - 4);
+	xbee_netPutCon(xbee, feed);
+	
+	return ret;
 }
 
 int xbee_netH_conRx(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
@@ -90,8 +149,7 @@ int xbee_netH_conRx(struct xbee *xbee, struct xbee_netClient *client, unsigned i
 int xbee_netH_conNew(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
 	unsigned char conTypeId;
 	struct xbee_conAddress *address;
-	struct xbee_con *con;
-	struct xbee_netConData *userData;
+	struct xbee_netConData *sub;
 	struct bufData *ibuf;
 	int ret;
 	
@@ -101,75 +159,41 @@ int xbee_netH_conNew(struct xbee *xbee, struct xbee_netClient *client, unsigned
 	conTypeId = buf->buf[0];
 	address = (struct xbee_conAddress *)&(buf->buf[1]);
 	
-	if ((ret = xbee_conNew(xbee, &con, conTypeId, address, NULL)) != 0 && ret != XBEE_EEXISTS) return ret;
-	
-	if (!con) return XBEE_EUNKNOWN;
-	
-	if ((userData = calloc(1, sizeof(*userData))) == NULL) {
-		ret = XBEE_ENOMEM;
-		goto die1;
-	}
-	
 	/* 3 because one is included in sizeof(*buf) */
-	if ((ibuf = calloc(1, sizeof(*buf) + 3)) == NULL) {
-		ret = XBEE_ENOMEM;
-		goto die2;
-	}
+	if ((ibuf = calloc(1, sizeof(*buf) + 3)) == NULL) return XBEE_ENOMEM;
 	
-	userData->key = client->conKeyCount++;
-	if (client->conKeyCount < userData->key) {
-		/* we wrapped! too many connections... very unlikely... */
-		client->conKeyCount--;
-		ret = XBEE_ENOMEM;
-		goto die2;
+	/* if another client already has this connection, then we share it */
+	if ((ret = xbee_netConSubscribe(xbee, client, conTypeId, address, &sub)) != 0) {
+		free(ibuf);
+		return ret;
 	}
-	userData->client = client;
-	
-	xbee_conSetData(xbee, con, userData);
-	xbee_conAttachCallback(xbee, con, xbee_netCallback, NULL);
-	
-	ll_add_tail(&client->conList, con);
 	
 	ibuf->len = 4;
-	ibuf->buf[0] = (userData->key >> 24) & 0xFF;
-	ibuf->buf[1] = (userData->key >> 16) & 0xFF;
-	ibuf->buf[2] = (userData->key >> 8 ) & 0xFF;
-	ibuf->buf[3] = (userData->key      ) & 0xFF;
+	ibuf->buf[0] = (sub->key >> 24) & 0xFF;
+	ibuf->buf[1] = (sub->key >> 16) & 0xFF;
+	ibuf->buf[2] = (sub->key >> 8 ) & 0xFF;
+	ibuf->buf[3] = (sub->key      ) & 0xFF;
 	
 	*rBuf = ibuf;
 	
-	goto done;
-die2:
-	free(userData);
-die1:
-done:
-	return ret;
+	return 0;
 }
 
 int xbee_netH_conEnd(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
 	unsigned short key;
-	int ret;
-	struct xbee_con *con;
-	struct xbee_netConData *userData;
 	
 	if (buf->len != 2) return XBEE_EINVAL;
 	
 	key = xbee_netKeyFromBytes(&buf->buf[0]);
 	
-	if ((ret = xbee_netGetCon(xbee, client, key, &con)) != 0) return ret;
-	
-	if ((ret = xbee_conEnd(xbee, con, (void**)&userData)) != 0) return ret;
-	
-	ll_ext_item(&client->conList, con);
-	free(userData);
-	
-	return 0;
+	/* the connection itself is only ended when nobody else is using it */
+	return xbee_netConUnsubscribe(xbee, client, key);
 }
 
 int xbee_netH_conOptions(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
 	unsigned short key;
 	int ret;
-	struct xbee_con *con;
+	struct xbee_netFeed *feed;
 	struct xbee_conOptions getOptions;
 	struct xbee_conOptions *setOptions;
 	struct bufData *ibuf;
@@ -178,8 +202,6 @@ int xbee_netH_conOptions(struct xbee *xbee, struct xbee_netClient *client, unsig
 	
 	key = xbee_netKeyFromBytes(&buf->buf[0]);
 	
-	if ((ret = xbee_netGetCon(xbee, client, key, &con)) != 0) return ret;
-	
 	if (buf->len == 2) {
 		setOptions = NULL;
 	} else {
@@ -189,7 +211,17 @@ int xbee_netH_conOptions(struct xbee *xbee, struct xbee_netClient *client, unsig
 	/* -1 because 1 is included in the struct bufData */
 	if ((ibuf = malloc(sizeof(*ibuf) + sizeof(struct xbee_conOptions) - 1)) == NULL) return XBEE_ENOMEM;
 	
-	if ((ret = xbee_conOptions(xbee, con, &getOptions, setOptions)) != 0) return ret;
+	/* the options belong to the connection, so they are shared by all of its subscribers */
+	if ((ret = xbee_netGetCon(xbee, client, key, &feed)) != 0) {
+		free(ibuf);
+		return ret;
+	}
+	ret = xbee_conOptions(xbee, feed->con, &getOptions, setOptions);
+	xbee_netPutCon(xbee, feed);
+	if (ret != 0) {
+		free(ibuf);
+		return ret;
+	}
 	
 	ibuf->len = sizeof(struct xbee_conOptions);
 	memcpy(ibuf->buf, &getOptions, ibuf->len);
@@ -201,30 +233,23 @@ int xbee_netH_conOptions(struct xbee *xbee, struct xbee_netClient *client, unsig
 
 int xbee_netH_conSleep(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
 	unsigned short key;
-	int ret;
-	struct xbee_con *con;
 	
 	if (buf->len != 3) return XBEE_EINVAL;
 	
 	key = xbee_netKeyFromBytes(&buf->buf[0]);
 	
-	if ((ret = xbee_netGetCon(xbee, client, key, &con)) != 0) return ret;
-	
-	return xbee_conSleep(xbee, con, buf->buf[2]);
+	/* only this client's subscription sleeps, the others still get their packets */
+	return xbee_netConSleep(xbee, client, key, 1, buf->buf[2]);
 }
 
 int xbee_netH_conWake(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
 	unsigned short key;
-	int ret;
-	struct xbee_con *con;
 	
 	if (buf->len != 2) return XBEE_EINVAL;
 	
 	key = xbee_netKeyFromBytes(&buf->buf[0]);
 	
-	if ((ret = xbee_netGetCon(xbee, client, key, &con)) != 0) return ret;
-	
-	return xbee_conWake(xbee, con);
+	return xbee_netConSleep(xbee, client, key, 0, 0);
 }
 
 int xbee_netH_conValidate(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
@@ -306,11 +331,83 @@ int xbee_netH_modeGet(struct xbee *xbee, struct xbee_netClient *client, unsigned
 	return 0;
 }
 
+int xbee_netH_shmAttach(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
+	struct xbee_netShm *shm;
+	struct bufData *ibuf;
+	unsigned int size;
+	int fds[2];
+	int ret;
+
+	/* the ring is handed over as a file descriptor, so the client must be on this machine */
+	if (!client->local) return XBEE_EINVAL;
+
+	size = 0;
+	if (buf->len == 4) {
+		size = (buf->buf[0] << 24) | (buf->buf[1] << 16) | (buf->buf[2] << 8) | buf->buf[3];
+	} else if (buf->len != 0) {
+		return XBEE_EINVAL;
+	}
+
+	xsys_mutex_lock(&client->shmMutex);
+	if (client->shm) {
+		ret = XBEE_EEXISTS;
+		goto die1;
+	}
+
+	if ((ibuf = calloc(1, sizeof(*ibuf) + 3)) == NULL) {
+		ret = XBEE_ENOMEM;
+		goto die1;
+	}
+
+	if ((ret = xbee_netShmNew(xbee, size, &shm)) != 0) goto die2;
+
+	/* the descriptors go no later than the response */
+	fds[0] = shm->memfd;
+	fds[1] = shm->eventfd;
+	if ((ret = xbee_netClientTxFds(xbee, client, fds, 2)) != 0) goto die3;
+
+	client->shm = shm;
+	xsys_mutex_unlock(&client->shmMutex);
+
+	ibuf->len = 4;
+	ibuf->buf[0] = (shm->size >> 24) & 0xFF;
+	ibuf->buf[1] = (shm->size >> 16) & 0xFF;
+	ibuf->buf[2] = (shm->size >> 8 ) & 0xFF;
+	ibuf->buf[3] = (shm->size      ) & 0xFF;
+	*rBuf = ibuf;
+
+	xbee_log(2, "client %s:%hu now has a %u byte shared memory ring", client->addr, client->port, shm->size);
+
+	return 0;
+die3:
+	xbee_netShmFree(shm);
+die2:
+	free(ibuf);
+die1:
+	xsys_mutex_unlock(&client->shmMutex);
+	return ret;
+}
+
 int xbee_netH_versionCheck(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf) {
-	if (buf->len != strlen(libxbee_commit) + 1) return XBEE_EINVAL;
-	if (strncasecmp((char *)buf->buf, libxbee_commit, buf->len)) return XBEE_EINVAL;
+	int len;
+	struct bufData *ibuf;
+
+	len = strlen(libxbee_commit) + 1;
+	/* the commit may be followed by the newest packet encoding that the client understands */
+	if (buf->len != len && buf->len != len + 1) return XBEE_EINVAL;
+	if (strncasecmp((char *)buf->buf, libxbee_commit, len)) return XBEE_EINVAL;
+
+	if (buf->len > len) {
+		if ((ibuf = calloc(1, sizeof(*ibuf))) == NULL) return XBEE_ENOMEM;
+		client->pktEncoding = buf->buf[len];
+		if (client->pktEncoding > XBEE_NET_PKT_ENCODING) client->pktEncoding = XBEE_NET_PKT_ENCODING;
+		ibuf->len = 1;
+		ibuf->buf[0] = client->pktEncoding;
+		*rBuf = ibuf;
+	}
+
 	client->versionsMatched = 1;
-	xbee_log(2,"Client has matched commit versions!");
+	xbee_log(2,"Client has matched commit versions! (packet encoding %d)", client->pktEncoding);
 	return 0;
 }
 
@@ -331,21 +428,22 @@ int xbee_netH_echo(struct xbee *xbee, struct xbee_netClient *client, unsigned in
 
 struct xbee_netHandler netHandlers[] = {
 	/* frequently used functions at the front */
-	ADD_NET_REQ_HANDLER(0x01, xbee_netH_connTx),            /* xbee_connTx() */
+	ADD_NET_KEY_HANDLER(0x01, xbee_netH_connTx),            /* xbee_connTx() */
 	ADD_NET_RSP_HANDLER(0x02, xbee_netH_conRx),             /* xbee_conRx() */
 	ADD_NET_REQ_HANDLER(0x03, xbee_netH_conNew),            /* xbee_conNew() */
-	ADD_NET_REQ_HANDLER(0x04, xbee_netH_conEnd),            /* xbee_conEnd() */
+	ADD_NET_KEY_HANDLER(0x04, xbee_netH_conEnd),            /* xbee_conEnd() */
 	
-	ADD_NET_REQ_HANDLER(0x05, xbee_netH_conOptions),        /* xbee_conOptions */
-	ADD_NET_REQ_HANDLER(0x06, xbee_netH_conSleep),          /* xbee_conSleep() */
-	ADD_NET_REQ_HANDLER(0x07, xbee_netH_conWake),           /* xbee_conWake() */
+	ADD_NET_KEY_HANDLER(0x05, xbee_netH_conOptions),        /* xbee_conOptions */
+	ADD_NET_KEY_HANDLER(0x06, xbee_netH_conSleep),          /* xbee_conSleep() */
+	ADD_NET_KEY_HANDLER(0x07, xbee_netH_conWake),           /* xbee_conWake() */
 	
-	ADD_NET_REQ_HANDLER(0x08, xbee_netH_conValidate),       /* xbee_conValidate() */
+	ADD_NET_KEY_HANDLER(0x08, xbee_netH_conValidate),       /* xbee_conValidate() */
 	ADD_NET_REQ_HANDLER(0x09, xbee_netH_conGetTypeList),    /* xbee_conGetTypeList() */
 	ADD_NET_REQ_HANDLER(0x0A, xbee_netH_conTypeIdFromName), /* xbee_conTypeIdFromName() */
 	
 	/* other non-connection related functions */
 	ADD_NET_REQ_HANDLER(0x0B, xbee_netH_modeGet),           /* xbee_modeGet() */
+	ADD_NET_REQ_HANDLER(0x0C, xbee_netH_shmAttach),         /* deliver packets through shared memory (local clients) */
 	ADD_NET_REQ_HANDLER(0x7F, xbee_netH_versionCheck),
 	ADD_NET_REQ_HANDLER(0x00, xbee_netH_echo),              /* echo traffic */
 	
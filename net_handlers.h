@@ -23,21 +23,27 @@
 
 #ifndef XBEE_NO_NET_SERVER
 
-/* ADD_NET_HANDLER(id, functionName) */
+/* ADD_NET_HANDLER(id, functionName)
+   a KEY handler's request starts with a connection's key, a client's requests for the same key are run in the order they arrived */
 #define ADD_NET_REQ_HANDLER(a, b) \
-  { ((a)&0x7F), (#b), (b) }
+  { ((a)&0x7F), (#b), (b), 0 }
+#define ADD_NET_KEY_HANDLER(a, b) \
+  { ((a)&0x7F), (#b), (b), 1 }
 #define ADD_NET_RSP_HANDLER(a, b) \
-  { ((a)|0x80), (#b), (b) }
+  { ((a)|0x80), (#b), (b), 0 }
 #define ADD_NET_HANDLER_TERMINATOR() \
-  { 0, NULL, NULL  }
+  { 0, NULL, NULL, 0 }
 struct xbee_netHandler {
 	unsigned char id;
 	char *handlerName;
 	int (*handler)(struct xbee *xbee, struct xbee_netClient *client, unsigned int id, unsigned int returnValue, struct bufData *buf, struct bufData **rBuf);
+	char keyed;
 };
 
 extern struct xbee_netHandler netHandlers[];
 
+void xbee_netCallback(struct xbee *xbee, struct xbee_con *con, struct xbee_pkt **pkt, void **userData);
+
 #endif /* XBEE_NO_NET_SERVER */
 
 #endif /* __XBEE_NET_HANDLERS_H */
@@ -0,0 +1,252 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "net_pkt.h"
+#include "pkt.h"
+#include "ll.h"
+
+/* a varint never needs more than this for 32 bits */
+#define VARINT_MAX 5
+
+static int varintPut(unsigned char *buf, unsigned int val) {
+	int i;
+	for (i = 0; val > 0x7F; i++) {
+		buf[i] = (val & 0x7F) | 0x80;
+		val >>= 7;
+	}
+	buf[i++] = val;
+	return i;
+}
+
+/* returns the number of bytes used, or -1 if the varint runs off the end of the buffer */
+static int varintGet(unsigned char *buf, int len, unsigned int *val) {
+	int i;
+	*val = 0;
+	for (i = 0; i < len && i < VARINT_MAX; i++) {
+		*val |= (buf[i] & 0x7F) << (7 * i);
+		if (!(buf[i] & 0x80)) return i + 1;
+	}
+	return -1;
+}
+
+/* returns the sample type of a packet's key, or -1 if it isn't a sample */
+static int sampleType(struct pkt_infoKey *key) {
+	if (!strncasecmp(key->name, "analog", PKT_INFOKEY_MAXLEN)) return XBEE_NET_PKT_ANALOG;
+	if (!strncasecmp(key->name, "digital", PKT_INFOKEY_MAXLEN)) return XBEE_NET_PKT_DIGITAL;
+	return -1;
+}
+
+/* ######################################################################### */
+
+/* the samples of one block, written by ll_for_each() in a single walk of the items */
+struct sampleWalk {
+	unsigned char *buf;
+	int o;
+	int n;
+	int count; /* the number that there is space for */
+};
+
+static void sampleAnalog(void *item, struct sampleWalk *w) {
+	if (w->n++ >= w->count) return;
+	/* the value is stored as the item's pointer */
+	w->o += varintPut(&w->buf[w->o], (unsigned int)(long)item);
+}
+
+static void sampleDigital(void *item, struct sampleWalk *w) {
+	if (w->n >= w->count) return;
+	if (item) w->buf[w->o + w->n / 8] |= 1 << (w->n % 8);
+	w->n++;
+}
+
+/* fill in iov[] with the compact encoding of 'pkt', and return how many iovecs were used (up to 3)
+   the data is sent from the packet itself, so it must outlive the iovecs. call xbee_netPktEncodeDone() after */
+int xbee_netPktEncode(struct xbee *xbee, struct xbee_pkt *pkt, struct xbee_netPktEnc *enc, struct iovec *iov) {
+	struct pkt_infoKey *key;
+	struct sampleWalk w;
+	int blocks, size;
+	int count;
+	int type;
+	int o;
+
+	if (!pkt || !enc || !iov) return XBEE_EMISSINGPARAM;
+	enc->samples = NULL;
+
+	/* work out how much space the samples could need */
+	blocks = 0;
+	size = VARINT_MAX;
+	if (pkt->dataItems) {
+		for (key = NULL; (key = ll_get_next(pkt->dataItems, key)) != NULL;) {
+			if ((type = sampleType(key)) == -1) continue;
+			if ((count = ll_count_items(&key->items)) <= 0) continue;
+			blocks++;
+			size += 1 + VARINT_MAX + VARINT_MAX;
+			size += (type == XBEE_NET_PKT_ANALOG) ? count * VARINT_MAX : (count + 7) / 8;
+		}
+	}
+
+	o = 0;
+	enc->head[o++] = pkt->status;
+	enc->head[o++] = pkt->options;
+	enc->head[o++] = pkt->rssi;
+	enc->head[o] = 0;
+	if (pkt->data_valid) enc->head[o] |= 0x01;
+	if (pkt->atCommand[0] || pkt->atCommand[1]) enc->head[o] |= 0x02;
+	if (blocks) enc->head[o] |= 0x04;
+	if (enc->head[o++] & 0x02) {
+		enc->head[o++] = pkt->atCommand[0];
+		enc->head[o++] = pkt->atCommand[1];
+	}
+	o += varintPut(&enc->head[o], pkt->datalen);
+
+	iov[0].iov_base = enc->head;
+	iov[0].iov_len = o;
+	iov[1].iov_base = pkt->data;
+	iov[1].iov_len = pkt->datalen;
+
+	if (!blocks) return 2;
+
+	if (size <= sizeof(enc->sampleBuf)) {
+		enc->samples = enc->sampleBuf;
+	} else if ((enc->samples = malloc(size)) == NULL) {
+		return XBEE_ENOMEM;
+	}
+
+	o = varintPut(enc->samples, blocks);
+	for (key = NULL; (key = ll_get_next(pkt->dataItems, key)) != NULL;) {
+		if ((type = sampleType(key)) == -1) continue;
+		if ((count = ll_count_items(&key->items)) <= 0) continue;
+		enc->samples[o++] = type;
+		o += varintPut(&enc->samples[o], key->id);
+		o += varintPut(&enc->samples[o], count);
+		w.buf = enc->samples;
+		w.o = o;
+		w.n = 0;
+		w.count = count;
+		if (type == XBEE_NET_PKT_ANALOG) {
+			ll_for_each(&key->items, (void (*)(void *, void *))sampleAnalog, &w);
+			/* keep the block the length that was promised, even if items went meanwhile */
+			for (; w.n < count; w.n++) w.o += varintPut(&w.buf[w.o], 0);
+			o = w.o;
+		} else {
+			memset(&enc->samples[o], 0, (count + 7) / 8);
+			ll_for_each(&key->items, (void (*)(void *, void *))sampleDigital, &w);
+			o += (count + 7) / 8;
+		}
+	}
+
+	iov[2].iov_base = enc->samples;
+	iov[2].iov_len = o;
+
+	return 3;
+}
+
+void xbee_netPktEncodeDone(struct xbee_netPktEnc *enc) {
+	if (enc->samples && enc->samples != enc->sampleBuf) free(enc->samples);
+	enc->samples = NULL;
+}
+
+/* ######################################################################### */
+
+/* build a packet from its compact encoding, the packet should be free'd with xbee_pktFree() */
+int xbee_netPktDecode(struct xbee *xbee, unsigned char *buf, int len, struct xbee_pkt **retPkt) {
+	struct xbee_pkt *pkt;
+	unsigned int datalen;
+	unsigned int blocks, channel, count, val;
+	unsigned char flags;
+	void *p;
+	int ret;
+	int i, n, o;
+
+	if (!buf || !retPkt) return XBEE_EMISSINGPARAM;
+	*retPkt = NULL;
+
+	if (len < 5) return XBEE_ELENGTH;
+	flags = buf[3];
+	o = 4;
+	if (flags & 0x02) {
+		if (len < o + 2) return XBEE_ELENGTH;
+		o += 2;
+	}
+	if ((i = varintGet(&buf[o], len - o, &datalen)) < 0) return XBEE_ELENGTH;
+	o += i;
+	if (datalen > len - o) return XBEE_ELENGTH;
+
+	if ((pkt = xbee_pktAlloc()) == NULL) return XBEE_ENOMEM;
+	if ((p = realloc(pkt, sizeof(*pkt) + datalen)) == NULL) {
+		ret = XBEE_ENOMEM;
+		goto die1;
+	}
+	pkt = p;
+
+	pkt->status = buf[0];
+	pkt->options = buf[1];
+	pkt->rssi = buf[2];
+	pkt->data_valid = !!(flags & 0x01);
+	if (flags & 0x02) {
+		pkt->atCommand[0] = buf[4];
+		pkt->atCommand[1] = buf[5];
+	}
+	pkt->datalen = datalen;
+	memcpy(pkt->data, &buf[o], datalen);
+	pkt->data[datalen] = '\0';
+	o += datalen;
+
+	if (flags & 0x04) {
+		if ((i = varintGet(&buf[o], len - o, &blocks)) < 0) goto die2;
+		for (o += i; blocks > 0; blocks--) {
+			unsigned char type;
+
+			if (o >= len) goto die2;
+			type = buf[o++];
+			if ((i = varintGet(&buf[o], len - o, &channel)) < 0) goto die2;
+			o += i;
+			if ((i = varintGet(&buf[o], len - o, &count)) < 0) goto die2;
+			o += i;
+
+			for (n = 0; n < count; n++) {
+				if (type == XBEE_NET_PKT_ANALOG) {
+					if ((i = varintGet(&buf[o], len - o, &val)) < 0) goto die2;
+					o += i;
+					ret = xbee_pktAddAnalog(xbee, pkt, channel, val);
+				} else if (type == XBEE_NET_PKT_DIGITAL) {
+					if (o + n / 8 >= len) goto die2;
+					ret = xbee_pktAddDigital(xbee, pkt, channel, (buf[o + n / 8] >> (n % 8)) & 0x01);
+				} else {
+					goto die2;
+				}
+				if (ret) goto die1;
+			}
+			if (type == XBEE_NET_PKT_DIGITAL) o += (count + 7) / 8;
+		}
+	}
+
+	*retPkt = pkt;
+	return 0;
+die2:
+	ret = XBEE_ELENGTH;
+die1:
+	xbee_pktFree(pkt);
+	return ret;
+}
@@ -0,0 +1,71 @@
+#ifndef __XBEE_NET_PKT_H
+#define __XBEE_NET_PKT_H
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/uio.h>
+
+/* how packets are encoded when they are forwarded to a network client (message 0x82)
+   a client asks for an encoding by adding a byte to the version check (message 0x7F), after the commit's '\0'
+   the server replies with the encoding that it will use - clients that don't ask are sent XBEE_NET_PKT_RAW */
+
+/* the in-memory struct xbee_pkt, followed by the data (dataItems is sent as NULL, samples are lost) */
+#define XBEE_NET_PKT_RAW      0
+/* compact and portable, varints are 7 bits per byte, least significant first, 0x80 set on all but the last byte:
+     1 byte  - status
+     1 byte  - options
+     1 byte  - rssi
+     1 byte  - flags: 0x01 data_valid, 0x02 atCommand follows, 0x04 samples follow
+     2 bytes - atCommand (if flagged)
+     varint  - datalen
+     n bytes - data (without the '\0' terminator)
+     varint  - number of sample blocks (if flagged), followed by the blocks:
+       1 byte  - type: XBEE_NET_PKT_ANALOG or XBEE_NET_PKT_DIGITAL
+       varint  - channel
+       varint  - number of samples
+       analog:  a varint per sample
+       digital: a bit per sample, least significant first, padded to a whole byte */
+#define XBEE_NET_PKT_COMPACT  1
+/* as XBEE_NET_PKT_COMPACT, but preceded by the key of the connection that the packet is for (2 bytes, big endian, as
+   returned by conNew) - so a client with many connections can tell them apart */
+#define XBEE_NET_PKT_KEYED    2
+/* the newest encoding that we understand */
+#define XBEE_NET_PKT_ENCODING XBEE_NET_PKT_KEYED
+
+#define XBEE_NET_PKT_ANALOG   0
+#define XBEE_NET_PKT_DIGITAL  1
+
+/* the most bytes that the compact encoding needs before the data */
+#define XBEE_NET_PKT_HEADMAX  (6 + 5)
+/* samples are encoded here if they fit, otherwise a buffer is allocated */
+#define XBEE_NET_PKT_SAMPLEBUF 256
+
+struct xbee_netPktEnc {
+	unsigned char head[XBEE_NET_PKT_HEADMAX];
+	unsigned char *samples;
+	unsigned char sampleBuf[XBEE_NET_PKT_SAMPLEBUF];
+};
+
+int xbee_netPktEncode(struct xbee *xbee, struct xbee_pkt *pkt, struct xbee_netPktEnc *enc, struct iovec *iov);
+void xbee_netPktEncodeDone(struct xbee_netPktEnc *enc);
+int xbee_netPktDecode(struct xbee *xbee, unsigned char *buf, int len, struct xbee_pkt **retPkt);
+
+#endif /* __XBEE_NET_PKT_H */
@@ -0,0 +1,202 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef XBEE_NO_NET_SERVER
+
+/* for memfd_create() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "internal.h"
+#include "net.h"
+#include "net_shm.h"
+#include "log.h"
+
+#define SHM_ALIGN(x) (((x) + 7) & ~7)
+
+/* build a ring of (at least) 'size' bytes, in a sealed memfd */
+int xbee_netShmNew(struct xbee *xbee, unsigned int size, struct xbee_netShm **retShm) {
+	struct xbee_netShm *shm;
+	unsigned int ringSize;
+	int ret;
+
+	if (!retShm) return XBEE_EMISSINGPARAM;
+
+	if (size == 0) size = XBEE_NET_SHM_DEFAULT;
+	if (size > XBEE_NET_SHM_MAX) return XBEE_ERANGE;
+	for (ringSize = XBEE_NET_SHM_MIN; ringSize < size; ringSize *= 2);
+
+	if ((shm = calloc(1, sizeof(*shm))) == NULL) return XBEE_ENOMEM;
+	shm->mapLen = sizeof(struct xbee_netShmHeader) + ringSize;
+
+	if ((shm->memfd = memfd_create("libxbee-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+		xbee_perror(1, "memfd_create()");
+		ret = XBEE_EOPENFAILED;
+		goto die1;
+	}
+	if (ftruncate(shm->memfd, shm->mapLen) == -1) {
+		xbee_perror(1, "ftruncate()");
+		ret = XBEE_ENOMEM;
+		goto die2;
+	}
+	/* the client mustn't be able to shrink the segment out from under us (that would be a SIGBUS) */
+	if (fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+		xbee_perror(1, "fcntl(F_ADD_SEALS)");
+		ret = XBEE_EIO;
+		goto die2;
+	}
+	if ((shm->hdr = mmap(NULL, shm->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0)) == MAP_FAILED) {
+		xbee_perror(1, "mmap()");
+		ret = XBEE_ENOMEM;
+		goto die2;
+	}
+	/* the client blocks in read(), so this mustn't be O_NONBLOCK (the flag would be shared with it) */
+	if ((shm->eventfd = eventfd(0, EFD_CLOEXEC)) == -1) {
+		xbee_perror(1, "eventfd()");
+		ret = XBEE_EIO;
+		goto die3;
+	}
+
+	shm->ring = (unsigned char *)shm->hdr + sizeof(struct xbee_netShmHeader);
+	shm->size = ringSize;
+	shm->mask = ringSize - 1;
+	shm->hdr->magic = XBEE_NET_SHM_MAGIC;
+	shm->hdr->version = XBEE_NET_SHM_VERSION;
+	shm->hdr->size = ringSize;
+	shm->hdr->dataOffset = sizeof(struct xbee_netShmHeader);
+
+	*retShm = shm;
+	return 0;
+
+die3:
+	munmap(shm->hdr, shm->mapLen);
+die2:
+	close(shm->memfd);
+die1:
+	free(shm);
+	return ret;
+}
+
+void xbee_netShmFree(struct xbee_netShm *shm) {
+	if (!shm) return;
+	close(shm->eventfd);
+	munmap(shm->hdr, shm->mapLen);
+	close(shm->memfd);
+	free(shm);
+}
+
+/* put a message into the client's ring, instead of sending it on the socket
+   returns XBEE_ENOTREADY if the client doesn't have a ring, or XBEE_EBUSY if it was full (the message is dropped)
+   only 'tail' is read from the segment, and if it is impossible the client is disconnected and XBEE_EINVAL is returned */
+int xbee_netShmTxv(struct xbee *xbee, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct iovec *data, int dataCnt) {
+	struct xbee_netShm *shm;
+	struct xbee_netShmHeader *hdr;
+	unsigned char ibuf[8];
+	unsigned char *p;
+	uint64_t head, tail;
+	uint32_t pos, len, need, wrap;
+	int hdrLen, dataLen;
+	int ret;
+	int i;
+
+	for (dataLen = 0, i = 0; i < dataCnt; i++) {
+		dataLen += data[i].iov_len;
+	}
+	if (dataLen > 0xFFFF) return XBEE_ERANGE;
+	hdrLen = xbee_netMsgHeader(ibuf, dataLen, id, reqID, returnValue);
+	len = hdrLen + dataLen + 1;
+	need = SHM_ALIGN(sizeof(uint32_t) + len);
+
+	ret = 0;
+	xsys_mutex_lock(&client->shmMutex);
+	if ((shm = client->shm) == NULL) {
+		ret = XBEE_ENOTREADY;
+		goto die1;
+	}
+	if (shm->broken) {
+		ret = XBEE_EINVAL;
+		goto die1;
+	}
+	hdr = shm->hdr;
+
+	/* only we write the head, the client writes the tail - which must be somewhere in the last 'size' bytes */
+	head = shm->head;
+	tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	if (head - tail > shm->size) {
+		xbee_log(1, "client %s:%hu moved its ring's tail out of range, disconnecting it", client->addr, client->port);
+		/* the event loop sees the hangup, and drops the client */
+		shutdown(client->fd, SHUT_RDWR);
+		shm->broken = 1;
+		ret = XBEE_EINVAL;
+		goto die1;
+	}
+
+	/* records don't wrap around the end of the ring, so skip to the start if it won't fit */
+	pos = head & shm->mask;
+	wrap = (shm->size - pos < need) ? shm->size - pos : 0;
+	if (head + wrap + need - tail > shm->size) {
+		__atomic_store_n(&hdr->dropped, ++shm->dropped, __ATOMIC_RELAXED);
+		ret = XBEE_EBUSY;
+		goto die1;
+	}
+	if (wrap) {
+		*(uint32_t *)&shm->ring[pos] = XBEE_NET_SHM_WRAP;
+		head += wrap;
+		pos = 0;
+	}
+
+	/* the record - the length, then the message as it would be on the socket */
+	p = &shm->ring[pos];
+	*(uint32_t *)p = len;
+	p += sizeof(uint32_t);
+	memcpy(p, ibuf, hdrLen);
+	p += hdrLen;
+	for (i = 0; i < dataCnt; i++) {
+		memcpy(p, data[i].iov_base, data[i].iov_len);
+		p += data[i].iov_len;
+	}
+	*p = '}';
+
+	/* publish it, then wake the client if it is (about to be) asleep
+	   the full barrier pairs with the client's, between setting 'waiting' and checking the head */
+	shm->head = head + need;
+	__atomic_store_n(&hdr->head, shm->head, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->waiting, __ATOMIC_RELAXED)) {
+		uint64_t one = 1;
+		if (write(shm->eventfd, &one, sizeof(one)) == -1) {
+			xbee_perror(1, "write(eventfd)");
+		}
+	}
+
+die1:
+	xsys_mutex_unlock(&client->shmMutex);
+	return ret;
+}
+
+#endif /* XBEE_NO_NET_SERVER */
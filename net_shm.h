@@ -0,0 +1,92 @@
+#ifndef __XBEE_NET_SHM_H
+#define __XBEE_NET_SHM_H
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+/* a local client can ask for packets to be delivered through shared memory (message 0x0C), rather than the socket
+   the request carries the ring's size (4 bytes, big endian, 0 for the default), and the response carries the size that
+   was used. a memfd holding the segment, and an eventfd, are passed with SCM_RIGHTS (in that order), arriving no later
+   than the response. connTx, conNew etc. carry on over the socket as before.
+
+   the segment is a struct xbee_netShmHeader, followed by the ring at 'dataOffset'. each record in the ring is a uint32_t
+   length, followed by a message exactly as it would have been sent on the socket ('{' ... '}'), padded to 8 bytes.
+   a length of XBEE_NET_SHM_WRAP means that the rest of the ring is unused, and the next record is at the start.
+
+   the server only moves 'head', and the client only moves 'tail' - both count bytes since the ring was created, so the
+   position in the ring is (head & (size - 1)). to wait for more, the client should:
+     set 'waiting', then check head != tail again (with a full barrier between), and if there is still nothing then
+     read() the eventfd. clear 'waiting' once woken
+   the server only writes to the eventfd while 'waiting' is set, so a busy client never costs a syscall.
+   if the ring is full, the message is dropped and 'dropped' is incremented. a client that moves 'tail' past 'head', or
+   more than 'size' behind it, is disconnected */
+
+#define XBEE_NET_SHM_MAGIC    0x58424545 /* 'XBEE' */
+#define XBEE_NET_SHM_VERSION  1
+#define XBEE_NET_SHM_WRAP     0xFFFFFFFF
+
+/* ring sizes are rounded up to a power of 2, within these limits */
+#define XBEE_NET_SHM_DEFAULT  (1024 * 1024)
+#define XBEE_NET_SHM_MIN      (128 * 1024)
+#define XBEE_NET_SHM_MAX      (64 * 1024 * 1024)
+
+/* the producer's and consumer's fields are on their own cache lines */
+struct xbee_netShmHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;       /* bytes in the ring, a power of 2 */
+	uint32_t dataOffset; /* where the ring starts, from the start of the segment */
+	uint64_t dropped;
+	uint8_t _pad0[40];
+
+	/* written by the server */
+	uint64_t head;
+	uint8_t _pad1[56];
+
+	/* written by the client */
+	uint64_t tail;
+	uint32_t waiting;
+	uint8_t _pad2[52];
+};
+
+/* the client can write to all of the segment, so everything that we rely on is kept here, and only copied out to it */
+struct xbee_netShm {
+	int memfd;
+	int eventfd;
+	size_t mapLen;
+	struct xbee_netShmHeader *hdr;
+	unsigned char *ring;
+	uint32_t size;
+	uint32_t mask;
+	uint64_t head;
+	uint64_t dropped;
+	int broken; /* the client moved 'tail' somewhere impossible, and is being dropped */
+};
+
+struct xbee_netClient;
+struct iovec;
+
+int xbee_netShmNew(struct xbee *xbee, unsigned int size, struct xbee_netShm **retShm);
+void xbee_netShmFree(struct xbee_netShm *shm);
+int xbee_netShmTxv(struct xbee *xbee, struct xbee_netClient *client, unsigned char id, unsigned char reqID, unsigned char returnValue, struct iovec *data, int dataCnt);
+
+#endif /* __XBEE_NET_SHM_H */
@@ -0,0 +1,731 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "internal.h"
+#include "reactor.h"
+#include "fmaps.h"
+#include "rx.h"
+#include "tx.h"
+#include "ll.h"
+#include "log.h"
+#include "replay.h"
+#include "stats.h"
+#include "trace.h"
+#include "escape.h"
+#include "io.h"
+
+/* the loops, and how many instances are using them - protected by xbee_reactorMutex */
+static xsys_mutex xbee_reactorMutex = XSYS_MUTEX_INITIALIZER;
+static struct xbee_reactorLoop *xbee_reactorLoops = NULL;
+static int xbee_reactorLoopCount = 0;
+static int xbee_reactorInstCount = 0;
+
+/* ######################################################################### */
+
+/* change the events that the loop waits for on an instance's fd */
+static void xbee_reactorPollOut(struct xbee_reactorInst *inst, int enable) {
+	struct xbee *xbee = inst->xbee;
+	struct epoll_event ev;
+
+	if (inst->pollOut == enable) return;
+	
+	/* waiting for EPOLLOUT is a stall, the same as in xbee_io_write() */
+	if (enable) {
+		clock_gettime(CLOCK_MONOTONIC, &inst->stallStart);
+	} else {
+		xbee_statsTxStall(xbee, &inst->stallStart);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+	ev.data.ptr = inst;
+	if (epoll_ctl(inst->loop->epfd, EPOLL_CTL_MOD, inst->fd, &ev)) {
+		xbee_perror(1,"epoll_ctl(EPOLL_CTL_MOD)");
+		return;
+	}
+	inst->pollOut = enable;
+}
+
+/* the device has gone, stop polling it - the loop opens it again when it comes back, see xbee_reactorRetry() */
+static void xbee_reactorFail(struct xbee_reactorInst *inst) {
+	struct xbee *xbee = inst->xbee;
+
+	if (inst->failed) return;
+	inst->failed = 1;
+	inst->loop->failedCount++;
+
+	xbee_log(1,"Lost the device '%s', waiting for it to come back...", xbee->device.path);
+	epoll_ctl(inst->loop->epfd, EPOLL_CTL_DEL, inst->fd, NULL);
+	if (xbee->f->io_close) xbee->f->io_close(xbee);
+	inst->fd = -1;
+
+	/* the frame that was being read has gone with it */
+	free(inst->rxBuf);
+	inst->rxBuf = NULL;
+	inst->rxPos = -3;
+	inst->rxEscaped = 0;
+
+	/* so has anything that was already encoded, but the txList is kept until the device is back */
+	inst->txLen = 0;
+	inst->txOff = 0;
+	if (inst->pollOut) {
+		xbee_statsTxStall(xbee, &inst->stallStart);
+		inst->pollOut = 0;
+	}
+
+	/* try again straight away */
+	clock_gettime(CLOCK_MONOTONIC, &inst->lostAt);
+	inst->retryAt = inst->lostAt;
+	inst->retryDelay = XBEE_IO_RECONNECT_MIN;
+}
+
+/* ######################################################################### */
+
+/* write as much as possible, topping the buffer up from the txList as it goes */
+static void xbee_reactorTxFlush(struct xbee_reactorInst *inst) {
+	struct xbee *xbee = inst->xbee;
+	struct bufData *buf;
+	struct timespec now;
+	unsigned char *p;
+	ssize_t ret;
+	int need;
+	int len;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (;;) {
+		if (inst->txOff == inst->txLen) {
+			inst->txOff = 0;
+			inst->txLen = 0;
+		}
+
+		/* encode as many queued frames as will fit */
+		while ((buf = ll_ext_head(&xbee->txList)) != NULL) {
+			/* frames that waited too long behind a stall are dropped, once one is in txBuf it will be sent */
+			if (xbee_txExpired(buf, &now)) {
+				xbee_log(1,"A frame spent more than %dms in the txList, it was dropped", XBEE_TX_DEADLINE);
+				xbee_txDropped(xbee, buf);
+				free(buf);
+				continue;
+			}
+			/* the rest wait for the device to come back */
+			if (inst->failed) {
+				ll_add_head(&xbee->txList, buf);
+				return;
+			}
+			need = XBEE_TX_ENCODEDLEN(buf->len);
+			if (inst->txLen + need > inst->txSize && inst->txOff) {
+				memmove(inst->txBuf, &inst->txBuf[inst->txOff], inst->txLen - inst->txOff);
+				inst->txLen -= inst->txOff;
+				inst->txOff = 0;
+			}
+			if (inst->txLen + need > inst->txSize) {
+				/* send what we have first */
+				if (inst->txLen) {
+					ll_add_head(&xbee->txList, buf);
+					break;
+				}
+				if ((p = realloc(inst->txBuf, need)) == NULL) {
+					xbee_log(1,"Unable to grow the tx buffer to %d bytes, a frame was dropped", need);
+					free(buf);
+					continue;
+				}
+				inst->txBuf = p;
+				inst->txSize = need;
+			}
+			xbee_trace3(tx_dequeue, xbee, buf, buf->len);
+			len = xbee_txEncode(xbee, buf, &inst->txBuf[inst->txLen]);
+			inst->txLen += len;
+			xbee_statsTx(xbee, 1, len);
+			xbee_trace3(tx_written, xbee, buf, 0);
+			free(buf);
+		}
+
+		if (inst->txOff == inst->txLen) break;
+
+		if ((ret = write(inst->fd, &inst->txBuf[inst->txOff], inst->txLen - inst->txOff)) > 0) {
+			inst->txOff += ret;
+			continue;
+		}
+		if (ret == -1 && errno == EINTR) continue;
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* flow control, or a full driver buffer - carry on when there is room */
+			xbee_reactorPollOut(inst, 1);
+			return;
+		}
+		xbee_perror(1,"write()");
+		xbee_reactorFail(inst);
+		return;
+	}
+
+	xbee_reactorPollOut(inst, 0);
+}
+
+/* ######################################################################### */
+
+/* the same as xbee_rxSerialXBee(), a byte at a time */
+static void xbee_reactorRxByte(struct xbee_reactorInst *inst, unsigned char c) {
+	struct xbee *xbee = inst->xbee;
+	struct bufData *buf;
+	int unescaped = (xbee->device.apiMode == 1);
+
+	/* an unescaped start delimiter always starts a new frame - with API mode 1 it can only be looked for between frames */
+	if (c == 0x7E && (!unescaped || inst->rxPos == -3)) {
+		if (inst->rxPos > -2) xbee_log(3,"Unexpected start byte... restarting packet capture");
+		free(inst->rxBuf);
+		inst->rxBuf = NULL;
+		inst->rxPos = -2;
+		inst->rxEscaped = 0;
+		return;
+	}
+	if (inst->rxPos == -3) return;
+
+	/* un-mangle escaped bytes */
+	if (!unescaped && c == 0x7D) {
+		inst->rxEscaped = 1;
+		return;
+	}
+	if (inst->rxEscaped) {
+		c ^= 0x20;
+		inst->rxEscaped = 0;
+	}
+
+	switch (inst->rxPos) {
+		case -2:
+			inst->rxLen = c << 8;
+			inst->rxPos++;
+			return;
+		case -1:
+			inst->rxLen |= c;
+			if (inst->rxLen == 0 || inst->rxLen + 1 > XBEE_MAX_PACKETLEN) {
+				xbee_log(1,"Invalid length (%d bytes)... discarding the frame", inst->rxLen);
+				xbee_statsRxCorrupt(xbee);
+				inst->rxPos = -3;
+				if (unescaped) xbee_rxRescan(xbee, inst->rxLen, NULL, 0);
+				return;
+			}
+			/* with room for the checksum too, in case the frame has to be parsed again */
+			if ((inst->rxBuf = malloc(sizeof(struct bufData) + (sizeof(unsigned char) * inst->rxLen))) == NULL) {
+				xbee_log(1,"Out of memory... discarding the frame");
+				inst->rxPos = -3;
+				return;
+			}
+			inst->rxBuf->len = inst->rxLen;
+			inst->rxChksum = 0;
+			inst->rxPos++;
+			return;
+	}
+
+	inst->rxChksum += c;
+	if (inst->rxPos < inst->rxLen) {
+		inst->rxBuf->buf[inst->rxPos++] = c;
+		return;
+	}
+
+	/* that was the checksum */
+	buf = inst->rxBuf;
+	inst->rxBuf = NULL;
+	inst->rxPos = -3;
+	if (inst->rxChksum != 0xFF) {
+		xbee_log(1,"Invalid checksum detected... %d byte packet discarded", buf->len);
+		xbee_statsRxCorrupt(xbee);
+		if (unescaped) {
+			buf->buf[buf->len] = c;
+			xbee_rxRescan(xbee, buf->len, buf->buf, buf->len + 1);
+		}
+		free(buf);
+		return;
+	}
+	if (!xbee->mode) {
+		xbee_log(1,"libxbee's mode has not been set, please use xbee_setMode()... %d byte packet discarded", buf->len);
+		free(buf);
+		return;
+	}
+
+	xbee_rxDispatch(xbee, buf, 1);
+}
+
+/* read whatever is waiting, and parse it */
+static void xbee_reactorRx(struct xbee_reactorInst *inst) {
+	struct xbee *xbee = inst->xbee;
+	ssize_t len;
+	int used;
+	int got;
+	int i;
+
+	if ((len = read(inst->fd, xbee->device.rxChunk, sizeof(xbee->device.rxChunk))) <= 0) {
+		if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+		if (len == -1) xbee_perror(1,"read()");
+		xbee_reactorFail(inst);
+		return;
+	}
+	xbee_statsRxRead(xbee, len);
+
+	if (xbee_shouldLog(20) || xbee->device.record) {
+		for (i = 0; i < len; i++) {
+			xbee_log(20,"READ: 0x%02X [%c]", xbee->device.rxChunk[i], ((xbee->device.rxChunk[i] >= 32 && xbee->device.rxChunk[i] <= 126)?xbee->device.rxChunk[i]:' '));
+			if (xbee->device.record) xbee_recordByte(xbee, xbee->device.rxChunk[i]);
+		}
+	}
+
+	for (i = 0; ; ) {
+		/* the bytes of a bad frame that are being parsed again come first (see xbee_rxRescan()) */
+		if (xbee->device.rxRescanPos < xbee->device.rxRescanLen) {
+			xbee_reactorRxByte(inst, xbee->device.rxRescan[xbee->device.rxRescanPos++]);
+			continue;
+		}
+		if (i >= len) break;
+		
+		/* a frame's data is unescaped (or with API mode 1, copied) straight into its buffer, a run at a time */
+		if (inst->rxPos >= 0 && inst->rxPos < inst->rxLen) {
+			if (xbee->device.apiMode == 1) {
+				used = got = (inst->rxLen - inst->rxPos < len - i) ? inst->rxLen - inst->rxPos : len - i;
+				memcpy(&inst->rxBuf->buf[inst->rxPos], &xbee->device.rxChunk[i], got);
+			} else {
+				used = xbee_escapeDecode(&inst->rxBuf->buf[inst->rxPos], inst->rxLen - inst->rxPos,
+				                         &xbee->device.rxChunk[i], len - i, &got, &inst->rxEscaped);
+			}
+			if (used) {
+				inst->rxChksum += xbee_escapeSum(&inst->rxBuf->buf[inst->rxPos], got);
+				inst->rxPos += got;
+				i += used;
+				continue;
+			}
+		}
+		/* and everything else (the header, checksum and delimiters) a byte at a time */
+		xbee_reactorRxByte(inst, xbee->device.rxChunk[i++]);
+	}
+}
+
+/* ######################################################################### */
+
+/* stop watching for an instance's device */
+static void xbee_reactorUnwatch(struct xbee_reactorInst *inst) {
+	if (inst->watchFd == -1) return;
+	epoll_ctl(inst->loop->epfd, EPOLL_CTL_DEL, inst->watchFd, NULL);
+	xsys_close(inst->watchFd);
+	inst->watchFd = -1;
+}
+
+/* try to open an instance's device again - where it lives is watched from the first try, so that it can't appear unnoticed
+   in between. if it still isn't there, the next try is after retryDelay, or as soon as the watch sees a change */
+static void xbee_reactorReconnect(struct xbee_reactorInst *inst) {
+	struct xbee *xbee = inst->xbee;
+	struct epoll_event ev;
+	long long ns;
+
+	if (inst->watchFd == -1 && (inst->watchFd = xsys_watchOpen(xbee->device.path)) != -1) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = inst;
+		if (epoll_ctl(inst->loop->epfd, EPOLL_CTL_ADD, inst->watchFd, &ev)) {
+			xsys_close(inst->watchFd);
+			inst->watchFd = -1;
+		}
+	}
+
+	if (xbee->f->io_open(xbee) == XBEE_ENONE) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = inst;
+		if (epoll_ctl(inst->loop->epfd, EPOLL_CTL_ADD, xbee->device.fd, &ev) == 0) {
+			inst->fd = xbee->device.fd;
+			inst->failed = 0;
+			inst->loop->failedCount--;
+			xbee_statsReconnect(xbee, &inst->lostAt);
+			xbee_log(1,"The device '%s' is back", xbee->device.path);
+			/* send what was queued meanwhile, closing the watch can take a few ms */
+			xbee_reactorTxFlush(inst);
+			xbee_reactorUnwatch(inst);
+			return;
+		}
+		xbee_perror(1,"epoll_ctl(EPOLL_CTL_ADD)");
+		if (xbee->f->io_close) xbee->f->io_close(xbee);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &inst->retryAt);
+	ns = inst->retryAt.tv_nsec + inst->retryDelay * 1000000LL;
+	inst->retryAt.tv_sec += ns / 1000000000;
+	inst->retryAt.tv_nsec = ns % 1000000000;
+}
+
+/* the instances whose device has gone - try the ones that are due, drop the frames that have missed their deadline
+   while waiting, and return how long (ms) epoll_wait() may sleep before the next try */
+static int xbee_reactorRetry(struct xbee_reactorLoop *loop) {
+	struct xbee_reactorInst *inst;
+	struct timespec now;
+	long long ms;
+	int timeout;
+	int i;
+
+	timeout = -1;
+	xsys_mutex_lock(&loop->mutex);
+	for (i = 0; i < loop->instCount; i++) {
+		inst = loop->insts[i];
+		if (!inst->failed || inst->detach) continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (inst->retryAt.tv_sec - now.tv_sec) * 1000LL + (inst->retryAt.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms <= 0) {
+			xbee_reactorReconnect(inst);
+			if (!inst->failed) continue;
+			ms = inst->retryDelay;
+			inst->retryDelay *= 2;
+			if (inst->retryDelay > XBEE_IO_RECONNECT_MAX) inst->retryDelay = XBEE_IO_RECONNECT_MAX;
+		}
+		xbee_reactorTxFlush(inst);
+
+		if (timeout == -1 || ms < timeout) timeout = ms;
+	}
+	xsys_mutex_unlock(&loop->mutex);
+
+	return timeout;
+}
+
+/* send anything new, and let go of instances that are leaving */
+static void xbee_reactorService(struct xbee_reactorLoop *loop) {
+	struct xbee_reactorInst *inst;
+	int i;
+
+	xsys_mutex_lock(&loop->mutex);
+	for (i = 0; i < loop->instCount; i++) {
+		inst = loop->insts[i];
+
+		if (inst->detach) {
+			if (!inst->failed) {
+				epoll_ctl(loop->epfd, EPOLL_CTL_DEL, inst->fd, NULL);
+			} else {
+				xbee_reactorUnwatch(inst);
+				loop->failedCount--;
+			}
+			loop->insts[i] = loop->insts[--loop->instCount];
+			i--;
+			/* the instance is free'd by xbee_reactorDetach(), this loop must not touch it again */
+			xsys_sem_post(&inst->detachedSem);
+			continue;
+		}
+
+		if (__atomic_exchange_n(&inst->txPending, 0, __ATOMIC_ACQ_REL)) xbee_reactorTxFlush(inst);
+	}
+	xsys_mutex_unlock(&loop->mutex);
+}
+
+/* a loop thread */
+static void *xbee_reactorLoopThread(struct xbee_reactorLoop *loop) {
+	struct xbee *xbee __attribute__((unused)) = NULL; /* not about one instance, this is only for the log macros */
+	struct epoll_event events[XBEE_REACTOR_MAXEVENTS];
+	struct xbee_reactorInst *inst;
+	uint64_t v;
+	int timeout;
+	int woken;
+	int count;
+	int i;
+
+	while (!loop->stop) {
+		/* instances that are waiting for their device are tried again on a timer, as well as when it appears */
+		timeout = loop->failedCount ? xbee_reactorRetry(loop) : -1;
+		
+		if ((count = epoll_wait(loop->epfd, events, XBEE_REACTOR_MAXEVENTS, timeout)) == -1) {
+			if (errno == EINTR) continue;
+			xbee_perror(1,"epoll_wait()");
+			usleep(100000);
+			continue;
+		}
+
+		woken = 0;
+		for (i = 0; i < count; i++) {
+			if ((inst = events[i].data.ptr) == NULL) {
+				if (read(loop->wakeFd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+					xbee_perror(1,"read(eventfd)");
+				}
+				woken = 1;
+				continue;
+			}
+
+			/* instances are only let go of by xbee_reactorService(), after the whole batch has been handled */
+			if (inst->detach) continue;
+			if (inst->failed) {
+				/* something changed where the device lives */
+				if (inst->watchFd != -1) xsys_watchWait(inst->watchFd, inst->xbee->device.path, 0);
+				xbee_reactorReconnect(inst);
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) xbee_reactorRx(inst);
+			if (inst->failed) continue;
+			if (events[i].events & EPOLLOUT) xbee_reactorTxFlush(inst);
+		}
+
+		if (woken) xbee_reactorService(loop);
+	}
+
+	return NULL;
+}
+
+static void xbee_reactorLoopWake(struct xbee_reactorLoop *loop) {
+	struct xbee *xbee __attribute__((unused)) = NULL; /* not about one instance, this is only for the log macros */
+	uint64_t v = 1;
+	if (write(loop->wakeFd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+		xbee_perror(1,"write(eventfd)");
+	}
+}
+
+/* ######################################################################### */
+
+static void xbee_reactorLoopFree(struct xbee_reactorLoop *loop) {
+	if (loop->wakeFd != -1) xsys_close(loop->wakeFd);
+	if (loop->epfd != -1) xsys_close(loop->epfd);
+	xsys_mutex_destroy(&loop->mutex);
+	free(loop->insts);
+}
+
+/* start the loops, xbee_reactorMutex must be held */
+static int _xbee_reactorStart(int threads) {
+	struct xbee *xbee __attribute__((unused)) = NULL; /* not about one instance, this is only for the log macros */
+	struct xbee_reactorLoop *loops;
+	struct xbee_reactorLoop *loop;
+	struct epoll_event ev;
+	int ret;
+	int i;
+
+	if (xbee_reactorLoops) return XBEE_EEXISTS;
+	if (threads <= 0) threads = XBEE_REACTOR_THREADS;
+	if (threads > XBEE_REACTOR_MAXTHREADS) return XBEE_ERANGE;
+
+	if ((loops = calloc(threads, sizeof(struct xbee_reactorLoop))) == NULL) return XBEE_ENOMEM;
+
+	ret = XBEE_ENONE;
+	for (i = 0; i < threads; i++) {
+		loop = &loops[i];
+		loop->epfd = -1;
+		loop->wakeFd = -1;
+		xsys_mutex_init(&loop->mutex);
+
+		if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			xbee_perror(1,"epoll_create1()");
+			ret = XBEE_EOPENFAILED;
+			goto die1;
+		}
+		if ((loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			xbee_perror(1,"eventfd()");
+			ret = XBEE_EOPENFAILED;
+			goto die1;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakeFd, &ev)) {
+			xbee_perror(1,"epoll_ctl(EPOLL_CTL_ADD)");
+			ret = XBEE_EOPENFAILED;
+			goto die1;
+		}
+		if (xsys_thread_create(&loop->thread, (void *(*)(void *))xbee_reactorLoopThread, loop)) {
+			xbee_perror(1,"xsys_thread_create()");
+			ret = XBEE_ETHREAD;
+			goto die1;
+		}
+	}
+
+	xbee_reactorLoops = loops;
+	xbee_reactorLoopCount = threads;
+	xbee_log(2,"Started the reactor with %d thread%s", threads, (threads == 1) ? "" : "s");
+
+	return XBEE_ENONE;
+die1:
+	/* 'i' is the loop that failed, it has no thread */
+	xbee_reactorLoopFree(&loops[i]);
+	while (i-- > 0) {
+		loops[i].stop = 1;
+		xbee_reactorLoopWake(&loops[i]);
+		xsys_thread_join(loops[i].thread, NULL);
+		xbee_reactorLoopFree(&loops[i]);
+	}
+	free(loops);
+	return ret;
+}
+
+/* start the reactor's loop threads, before any instances are set up with xbee_setupReactor() */
+EXPORT int xbee_reactorStart(int threads) {
+	int ret;
+
+	xsys_mutex_lock(&xbee_reactorMutex);
+	ret = _xbee_reactorStart(threads);
+	xsys_mutex_unlock(&xbee_reactorMutex);
+
+	return ret;
+}
+
+/* stop the reactor's loop threads, once every instance that used them has been shutdown */
+EXPORT int xbee_reactorStop(void) {
+	struct xbee_reactorLoop *loops;
+	int count;
+	int i;
+
+	xsys_mutex_lock(&xbee_reactorMutex);
+	if (!xbee_reactorLoops) {
+		xsys_mutex_unlock(&xbee_reactorMutex);
+		return XBEE_EINVAL;
+	}
+	if (xbee_reactorInstCount) {
+		xsys_mutex_unlock(&xbee_reactorMutex);
+		return XBEE_EINUSE;
+	}
+	loops = xbee_reactorLoops;
+	count = xbee_reactorLoopCount;
+	xbee_reactorLoops = NULL;
+	xbee_reactorLoopCount = 0;
+	xsys_mutex_unlock(&xbee_reactorMutex);
+
+	for (i = 0; i < count; i++) {
+		loops[i].stop = 1;
+		xbee_reactorLoopWake(&loops[i]);
+		xsys_thread_join(loops[i].thread, NULL);
+		xbee_reactorLoopFree(&loops[i]);
+	}
+	free(loops);
+
+	return XBEE_ENONE;
+}
+
+/* ######################################################################### */
+
+/* give a new instance to the least busy loop - this is the postInit() for xbee_fmap_reactor */
+int xbee_reactorPostInit(struct xbee *xbee) {
+	struct xbee_reactorInst *inst;
+	struct xbee_reactorLoop *loop;
+	struct epoll_event ev;
+	void *p;
+	int ret;
+	int i;
+
+	if ((inst = calloc(1, sizeof(struct xbee_reactorInst))) == NULL) return XBEE_ENOMEM;
+	inst->xbee = xbee;
+	inst->fd = xbee->device.fd;
+	inst->rxPos = -3;
+	inst->watchFd = -1;
+	if (xsys_sem_init(&inst->detachedSem)) {
+		ret = XBEE_ESEMAPHORE;
+		goto die1;
+	}
+	if ((inst->txBuf = malloc(XBEE_REACTOR_TXBUFLEN)) == NULL) {
+		ret = XBEE_ENOMEM;
+		goto die2;
+	}
+	inst->txSize = XBEE_REACTOR_TXBUFLEN;
+
+	/* xbee_io_open() has made the device non-blocking, so the loop never blocks on it */
+
+	xsys_mutex_lock(&xbee_reactorMutex);
+
+	/* start the reactor with the default number of threads, if nobody has yet */
+	if (!xbee_reactorLoops && (ret = _xbee_reactorStart(0)) != 0) goto die3;
+
+	loop = &xbee_reactorLoops[0];
+	for (i = 1; i < xbee_reactorLoopCount; i++) {
+		if (xbee_reactorLoops[i].instCount < loop->instCount) loop = &xbee_reactorLoops[i];
+	}
+	inst->loop = loop;
+
+	xsys_mutex_lock(&loop->mutex);
+	if (loop->instCount == loop->instSize) {
+		if ((p = realloc(loop->insts, sizeof(*loop->insts) * (loop->instSize + 8))) == NULL) {
+			xsys_mutex_unlock(&loop->mutex);
+			ret = XBEE_ENOMEM;
+			goto die3;
+		}
+		loop->insts = p;
+		loop->instSize += 8;
+	}
+	xbee->reactor = inst;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = inst;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, inst->fd, &ev)) {
+		xsys_mutex_unlock(&loop->mutex);
+		xbee_perror(1,"epoll_ctl(EPOLL_CTL_ADD)");
+		xbee->reactor = NULL;
+		ret = XBEE_ESETUP;
+		goto die3;
+	}
+	loop->insts[loop->instCount++] = inst;
+	xsys_mutex_unlock(&loop->mutex);
+
+	xbee_reactorInstCount++;
+	xsys_mutex_unlock(&xbee_reactorMutex);
+
+	return XBEE_ENONE;
+die3:
+	xsys_mutex_unlock(&xbee_reactorMutex);
+	free(inst->txBuf);
+die2:
+	xsys_sem_destroy(&inst->detachedSem);
+die1:
+	free(inst);
+	return ret;
+}
+
+/* take an instance off the reactor, nothing more will be read or written - called by xbee_shutdown() */
+void xbee_reactorDetach(struct xbee *xbee) {
+	struct xbee_reactorInst *inst;
+
+	if ((inst = xbee->reactor) == NULL) return;
+
+	/* the loop lets go of it between batches of events, so that none of them are left pointing at it */
+	inst->detach = 1;
+	xbee_reactorLoopWake(inst->loop);
+	while (xsys_sem_wait(&inst->detachedSem) && errno == EINTR);
+
+	xbee->reactor = NULL;
+	xsys_mutex_lock(&xbee_reactorMutex);
+	xbee_reactorInstCount--;
+	xsys_mutex_unlock(&xbee_reactorMutex);
+
+	xsys_sem_destroy(&inst->detachedSem);
+	free(inst->rxBuf);
+	free(inst->txBuf);
+	free(inst);
+}
+
+/* buffers have been added to the txList */
+void xbee_reactorTxWake(struct xbee *xbee) {
+	struct xbee_reactorInst *inst;
+
+	if ((inst = xbee->reactor) == NULL) return;
+
+	/* one wakeup covers everything queued until the loop gets to it */
+	if (__atomic_exchange_n(&inst->txPending, 1, __ATOMIC_ACQ_REL)) return;
+	xbee_reactorLoopWake(inst->loop);
+}
+
+/* ######################################################################### */
+
+/* this is the same as xbee_setup(), but the instance's I/O is done by the reactor's threads */
+EXPORT int xbee_setupReactor(char *path, int baudrate, struct xbee **retXbee) {
+	return _xbee_setup(&xbee_fmap_reactor, path, baudrate, NULL, retXbee);
+}
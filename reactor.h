@@ -0,0 +1,93 @@
+#ifndef __XBEE_REACTOR_H
+#define __XBEE_REACTOR_H
+
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* the reactor lets many instances share a small, fixed number of I/O threads, instead of each instance having its own
+   rx thread, tx thread and a thread for each pktHandler. each loop thread has an epoll set, and every instance is given
+   to the loop with the fewest instances when it is set up, and stays there - so an instance's frames are always parsed,
+   handled and written by the same thread, one at a time. callbacks still run on their own threads, because they may
+   block (e.g. in xbee_connTx() with waitForAck, which needs the loop to read the ACK) */
+
+/* the number of loop threads, if xbee_reactorStart() isn't given one */
+#ifndef XBEE_REACTOR_THREADS
+#define XBEE_REACTOR_THREADS   1
+#endif
+#define XBEE_REACTOR_MAXTHREADS 64
+#define XBEE_REACTOR_MAXEVENTS  32
+/* the initial size of each instance's tx buffer, it grows if a single frame won't fit */
+#define XBEE_REACTOR_TXBUFLEN   1024
+
+struct xbee_reactorInst;
+
+struct xbee_reactorLoop {
+	int epfd;
+	int wakeFd; /* eventfd, written when an instance has something to send, or wants to leave */
+	xsys_thread thread;
+	volatile char stop;
+	
+	xsys_mutex mutex; /* protects insts[] */
+	struct xbee_reactorInst **insts;
+	int instCount;
+	int instSize;
+	
+	int failedCount; /* instances that are waiting for their device to come back, only touched by the loop */
+};
+
+/* an instance's state on the reactor, held by xbee->reactor */
+struct xbee_reactorInst {
+	struct xbee *xbee;
+	struct xbee_reactorLoop *loop;
+	int fd;
+	
+	char txPending; /* the txList has new buffers, and the loop has been woken */
+	char detach;    /* xbee_reactorDetach() is waiting, the loop drops the instance */
+	char failed;    /* the device has gone, the fd is no longer polled - watchFd is, until it comes back */
+	char pollOut;   /* a write would have blocked, EPOLLOUT is enabled */
+	xsys_sem detachedSem;
+	
+	/* the frame being received, only touched by the loop - rxPos is -3 while hunting for a start delimiter */
+	struct bufData *rxBuf;
+	int rxPos;
+	int rxLen;
+	unsigned char rxChksum;
+	char rxEscaped;
+	
+	/* encoded frames that haven't been written yet, only touched by the loop */
+	unsigned char *txBuf;
+	int txSize;
+	int txLen;
+	int txOff;
+	struct timespec stallStart; /* when pollOut was enabled */
+	
+	/* while the device has gone, only touched by the loop (see xbee_reactorRetry()) */
+	int watchFd;             /* -1 if the device's directory can't be watched, the delay alone is used */
+	int retryDelay;          /* ms, doubles up to XBEE_IO_RECONNECT_MAX */
+	struct timespec retryAt; /* when to try opening it again, if nothing has changed before then */
+	struct timespec lostAt;
+};
+
+int xbee_reactorPostInit(struct xbee *xbee);
+void xbee_reactorDetach(struct xbee *xbee);
+void xbee_reactorTxWake(struct xbee *xbee);
+
+#endif /* __XBEE_REACTOR_H */
@@ -0,0 +1,874 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "internal.h"
+#include "remote.h"
+#include "fmaps.h"
+#include "conn.h"
+#include "frame.h"
+#include "net_pkt.h"
+#include "pkt.h"
+#include "rx.h"
+#include "log.h"
+#include "ll.h"
+
+/* the most pieces of data in a request (the header and terminator are added to these) */
+#define XBEE_REMOTE_TXV_MAX 4
+
+/* ######################################################################### */
+
+/* send a request to the server, as a single message */
+static int xbee_remoteSend(struct xbee_remoteLink *link, unsigned char id, unsigned char reqID, struct iovec *data, int dataCnt) {
+	struct iovec iov[XBEE_REMOTE_TXV_MAX + 2];
+	struct msghdr msg;
+	unsigned char hdr[6];
+	unsigned char term = '}';
+	int dataLen;
+	int ret;
+	int i;
+
+	if (dataCnt > XBEE_REMOTE_TXV_MAX) return XBEE_EINVAL;
+	for (dataLen = 0, i = 0; i < dataCnt; i++) {
+		dataLen += data[i].iov_len;
+		iov[i + 1] = data[i];
+	}
+	if (dataLen > 0xFFFF) return XBEE_ERANGE;
+
+	hdr[0] = '{';
+	hdr[1] = (dataLen >> 8) & 0xFF;
+	hdr[2] = (dataLen     ) & 0xFF;
+	hdr[3] = '|';
+	hdr[4] = id;
+	hdr[5] = reqID;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[dataCnt + 1].iov_base = &term;
+	iov[dataCnt + 1].iov_len = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = dataCnt + 2;
+
+	ret = XBEE_ENONE;
+	xsys_mutex_lock(&link->txMutex);
+	while (msg.msg_iovlen > 0) {
+		ssize_t sent;
+		if ((sent = sendmsg(link->fd, &msg, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) continue;
+			ret = XBEE_EIO;
+			break;
+		}
+		/* a stream socket may only take part of it, so skip over what has gone and go round again */
+		while (msg.msg_iovlen > 0 && sent >= msg.msg_iov[0].iov_len) {
+			sent -= msg.msg_iov[0].iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + sent;
+			msg.msg_iov[0].iov_len -= sent;
+		}
+	}
+	xsys_mutex_unlock(&link->txMutex);
+
+	return ret;
+}
+
+/* the server has gone, fail everything that is waiting on this link */
+static void xbee_remoteLinkDead(struct xbee *xbee, struct xbee_remoteLink *link) {
+	struct xbee_remoteReq *req;
+	int i;
+
+	xsys_mutex_lock(&link->reqMutex);
+	if (!link->dead) xbee_log(1, "lost the link to the server (fd %d)", link->fd);
+	link->dead = 1;
+	for (i = 0; i <= 0xFF; i++) {
+		req = &link->reqs[i];
+		if (!req->busy || req->done) continue;
+		if (req->abandoned) {
+			req->abandoned = 0;
+			req->busy = 0;
+			continue;
+		}
+		req->lost = 1;
+		req->done = 1;
+		xsys_sem_post(&req->sem);
+	}
+	xsys_mutex_unlock(&link->reqMutex);
+}
+
+/* ######################################################################### */
+
+/* a packet has arrived, give it to the connection that the key belongs to */
+static void xbee_remotePkt(struct xbee *xbee, struct xbee_remoteInfo *info, struct xbee_remoteLink *link, unsigned char *data, int len) {
+	struct xbee_remoteCon *rcon;
+	struct xbee_pkt *pkt;
+	unsigned short key;
+	int ret;
+
+	if (len < 2) {
+		xbee_log(1, "packet without a connection key (%d bytes)", len);
+		return;
+	}
+	key = (data[0] << 8) | data[1];
+
+	if ((ret = xbee_netPktDecode(xbee, &data[2], len - 2, &pkt)) != 0) {
+		xbee_log(1, "failed to decode packet for key 0x%04X (%d)", key, ret);
+		return;
+	}
+
+	xsys_mutex_lock(&info->conMutex);
+	for (rcon = NULL; (rcon = ll_get_next(&info->conList, rcon)) != NULL;) {
+		if (rcon->link == link && rcon->key == key) break;
+	}
+	/* the connection may be on its way out (or the mode may have changed under it) */
+	if (!rcon || _xbee_conValidate(xbee, rcon->con, NULL) != 0) {
+		xbee_log(3, "no connection for packet (key 0x%04X)...", key);
+	} else if (xbee_rxDeliver(xbee, rcon->con, pkt) == 0) {
+		pkt = NULL;
+	}
+	xsys_mutex_unlock(&info->conMutex);
+
+	if (pkt) xbee_pktFree(pkt);
+}
+
+/* a response has arrived, wake up the request that it belongs to */
+static void xbee_remoteRsp(struct xbee *xbee, struct xbee_remoteLink *link, unsigned char id, unsigned char reqID, unsigned char returnValue, unsigned char *data, int len) {
+	struct xbee_remoteReq *req;
+	struct bufData *buf;
+
+	/* the handlers expect their own buffer, with the data followed by a nul ('\0')
+	   there is room for the nul, because 1 byte is included in the sizeof(struct bufData) */
+	if ((buf = malloc(sizeof(*buf) + len)) == NULL) {
+		xbee_log(1, "ENOMEM - response lost");
+		return;
+	}
+	buf->len = len;
+	memcpy(buf->buf, data, len);
+	buf->buf[len] = '\0';
+
+	xsys_mutex_lock(&link->reqMutex);
+	req = &link->reqs[reqID];
+	if (!req->busy || req->done) {
+		xbee_log(1, "unexpected response (0x%02X) for reqID %d", id, reqID);
+		free(buf);
+	} else if (req->abandoned) {
+		/* nobody is waiting any more */
+		free(buf);
+		req->abandoned = 0;
+		req->busy = 0;
+	} else {
+		/* the return value is sent as a single byte, so the errors are negative */
+		req->returnValue = (signed char)returnValue;
+		req->rBuf = buf;
+		req->done = 1;
+		xsys_sem_post(&req->sem);
+	}
+	xsys_mutex_unlock(&link->reqMutex);
+}
+
+/* read whatever the link has for us, and handle every complete message
+   returns non-zero if the link has failed */
+static int xbee_remoteLinkRx(struct xbee *xbee, struct xbee_remoteInfo *info, struct xbee_remoteLink *link) {
+	unsigned char *p;
+	int hdrLen;
+	int msgLen;
+	int len;
+	int pos;
+	int ret;
+
+	if (link->rxLen == link->rxSize) {
+		if ((p = realloc(link->rxBuf, link->rxSize * 2)) == NULL) {
+			xbee_log(1, "ENOMEM - data lost");
+			return -1;
+		}
+		link->rxBuf = p;
+		link->rxSize *= 2;
+	}
+
+	if ((ret = recv(link->fd, &link->rxBuf[link->rxLen], link->rxSize - link->rxLen, MSG_DONTWAIT)) == -1) {
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		xbee_perror(1, "recv()");
+		return -1;
+	} else if (ret == 0) {
+		/* the server hung up */
+		return -1;
+	}
+	link->rxLen += ret;
+
+	for (pos = 0; pos < link->rxLen; pos += msgLen) {
+		p = &link->rxBuf[pos];
+
+		/* skip anything that isn't the start of a message '{' */
+		if (p[0] != '{') {
+			msgLen = 1;
+			continue;
+		}
+		/* we need the length, seperator, messageID and reqID bytes */
+		if (link->rxLen - pos < 6) break;
+		if (p[3] != '|') {
+			xbee_log(1, "invalid data recieved...");
+			msgLen = 1;
+			continue;
+		}
+
+		/* if bit 7 is set, then this is a response, and the returnValue follows */
+		hdrLen = ((p[4] & 0x80) ? 7 : 6);
+		len = ((p[1] << 8) & 0xFF00) | (p[2] & 0xFF);
+		msgLen = hdrLen + len + 1;
+
+		/* wait for the rest to arrive */
+		if (link->rxLen - pos < msgLen) break;
+
+		if (p[msgLen - 1] != '}') {
+			xbee_log(1, "invalid data recieved...");
+			msgLen = 1;
+			continue;
+		}
+
+		/* the server doesn't make requests of us */
+		if (hdrLen != 7) {
+			xbee_log(1, "unexpected request from the server (0x%02X)", p[4]);
+			continue;
+		}
+
+		if (p[4] == (0x02 | 0x80)) {
+			xbee_remotePkt(xbee, info, link, &p[hdrLen], len);
+		} else {
+			xbee_remoteRsp(xbee, link, p[4], p[5], p[6], &p[hdrLen], len);
+		}
+	}
+
+	/* each SOCK_SEQPACKET record holds whole messages, so anything left over is garbage */
+	if (link->seqpacket) pos = link->rxLen;
+
+	/* keep hold of any partial message, at the front of the buffer */
+	if (pos > 0) {
+		link->rxLen -= pos;
+		if (link->rxLen) memmove(link->rxBuf, &link->rxBuf[pos], link->rxLen);
+	}
+
+	return 0;
+}
+
+/* ######################################################################### */
+
+/* make a request, and wait for the response
+   the response's data is returned in *rBuf (if there was any), and must be free'd by the caller
+   if 'pump' is set, the link is read from here - this is used before the rx thread is running */
+static int _xbee_remoteRequest(struct xbee *xbee, struct xbee_remoteLink *link, unsigned char id, struct iovec *data, int dataCnt, int *returnValue, struct bufData **rBuf, int pump) {
+	struct xbee_remoteReq *req;
+	unsigned char reqID;
+	int waited;
+	int ret;
+	int i;
+
+	if (rBuf) *rBuf = NULL;
+
+	/* find a free reqID, 0 is left for the packets that the server sends */
+	xsys_mutex_lock(&link->reqMutex);
+	if (link->dead) {
+		xsys_mutex_unlock(&link->reqMutex);
+		return XBEE_EIO;
+	}
+	reqID = link->reqLast;
+	for (i = 0; i <= 0xFF; i++) {
+		if (++reqID == 0) continue;
+		if (!link->reqs[reqID].busy) break;
+	}
+	if (i > 0xFF) {
+		xsys_mutex_unlock(&link->reqMutex);
+		return XBEE_EBUSY;
+	}
+	link->reqLast = reqID;
+	req = &link->reqs[reqID];
+	req->busy = 1;
+	req->done = 0;
+	req->abandoned = 0;
+	req->lost = 0;
+	req->rBuf = NULL;
+	xsys_mutex_unlock(&link->reqMutex);
+
+	waited = 0;
+	if ((ret = xbee_remoteSend(link, id, reqID, data, dataCnt)) != 0) {
+		xbee_log(1, "failed to send request 0x%02X to the server (%d)", id, ret);
+		goto release;
+	}
+
+	if (pump) {
+		struct xbee_remoteInfo *info = xbee->fmapData;
+		struct pollfd pfd;
+		int t;
+
+		pfd.fd = link->fd;
+		pfd.events = POLLIN;
+		for (t = XBEE_REMOTE_TIMEOUT * 10; t > 0 && !req->done; t--) {
+			if ((ret = poll(&pfd, 1, 100)) == -1 && errno != EINTR) break;
+			if (ret <= 0) continue;
+			if (xbee_remoteLinkRx(xbee, info, link) != 0) {
+				xbee_remoteLinkDead(xbee, link);
+				break;
+			}
+		}
+	} else {
+		while ((ret = xsys_sem_timedwait(&req->sem, XBEE_REMOTE_TIMEOUT, 0)) != 0 && errno == EINTR);
+		waited = (ret == 0);
+	}
+
+	xsys_mutex_lock(&link->reqMutex);
+	if (!req->done) {
+		/* leave the reqID with the rx thread, it will be free'd if the response ever turns up */
+		req->abandoned = 1;
+		xsys_mutex_unlock(&link->reqMutex);
+		xbee_log(1, "request 0x%02X to the server timed out", id);
+		return XBEE_ETIMEOUT;
+	}
+	/* the response was posted, but we didn't take it */
+	if (!waited) xsys_sem_wait(&req->sem);
+	if (req->lost) {
+		ret = XBEE_EIO;
+	} else {
+		ret = XBEE_ENONE;
+		if (returnValue) *returnValue = req->returnValue;
+		if (rBuf) {
+			*rBuf = req->rBuf;
+			req->rBuf = NULL;
+		}
+	}
+	if (req->rBuf) free(req->rBuf);
+	req->rBuf = NULL;
+	req->busy = 0;
+	xsys_mutex_unlock(&link->reqMutex);
+	return ret;
+
+release:
+	xsys_mutex_lock(&link->reqMutex);
+	if (req->done) {
+		xsys_sem_wait(&req->sem);
+		if (req->rBuf) free(req->rBuf);
+		req->rBuf = NULL;
+	}
+	req->busy = 0;
+	xsys_mutex_unlock(&link->reqMutex);
+	return ret;
+}
+
+static int xbee_remoteRequest(struct xbee *xbee, struct xbee_remoteLink *link, unsigned char id, struct iovec *data, int dataCnt, int *returnValue, struct bufData **rBuf) {
+	return _xbee_remoteRequest(xbee, link, id, data, dataCnt, returnValue, rBuf, 0);
+}
+
+/* make a request about a connection - the key goes in front of the data, and the server's return value is returned */
+static int xbee_remoteConRequest(struct xbee *xbee, struct xbee_con *con, unsigned char id, void *data, int len) {
+	struct xbee_remoteInfo *info;
+	struct xbee_remoteCon *rcon;
+	struct xbee_remoteLink *link;
+	struct iovec iov[2];
+	unsigned char key[2];
+	int returnValue;
+	int ret;
+
+	info = xbee->fmapData;
+	link = NULL;
+
+	xsys_mutex_lock(&info->conMutex);
+	for (rcon = NULL; (rcon = ll_get_next(&info->conList, rcon)) != NULL;) {
+		if (rcon->con == con) break;
+	}
+	if (rcon) {
+		link = rcon->link;
+		key[0] = (rcon->key >> 8) & 0xFF;
+		key[1] = (rcon->key     ) & 0xFF;
+	}
+	xsys_mutex_unlock(&info->conMutex);
+	if (!rcon) return XBEE_EINVAL;
+
+	iov[0].iov_base = key;
+	iov[0].iov_len = 2;
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+
+	if ((ret = xbee_remoteRequest(xbee, link, id, iov, (len ? 2 : 1), &returnValue, NULL)) != 0) return ret;
+	return returnValue;
+}
+
+/* ######################################################################### */
+
+/* connect one link to the server - 'path' is a host name, or a Unix domain socket if it starts with '/' or '@' */
+static int xbee_remoteConnect(struct xbee *xbee, struct xbee_remoteLink *link) {
+	char *path;
+	int ret;
+
+	path = xbee->device.path;
+
+	if (path[0] == '/' || path[0] == '@') {
+		struct sockaddr_un addrinfo;
+		socklen_t addrlen;
+		int len;
+
+		len = strlen(path);
+		if (len >= sizeof(addrinfo.sun_path)) return XBEE_ERANGE;
+		memset(&addrinfo, 0, sizeof(addrinfo));
+		addrinfo.sun_family = AF_UNIX;
+		memcpy(addrinfo.sun_path, path, len);
+		addrlen = sizeof(addrinfo);
+		if (path[0] == '@') {
+			/* an abstract name, the '@' stands for a nul */
+			addrinfo.sun_path[0] = '\0';
+			addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+		}
+
+		/* we don't know which type the server is listening with, a stream socket won't connect to a seqpacket socket */
+		if ((link->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+			xbee_perror(1, "socket()");
+			return XBEE_EOPENFAILED;
+		}
+		if (connect(link->fd, (struct sockaddr *)&addrinfo, addrlen) == 0) return XBEE_ENONE;
+		if (errno == EPROTOTYPE) {
+			close(link->fd);
+			if ((link->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+				xbee_perror(1, "socket()");
+				return XBEE_EOPENFAILED;
+			}
+			link->seqpacket = 1;
+			if (connect(link->fd, (struct sockaddr *)&addrinfo, addrlen) == 0) return XBEE_ENONE;
+		}
+		xbee_perror(1, "connect()");
+		close(link->fd);
+		link->fd = -1;
+		return XBEE_EOPENFAILED;
+
+	} else {
+		struct addrinfo hints;
+		struct addrinfo *res, *ai;
+		char port[8];
+		int one = 1;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		snprintf(port, sizeof(port), "%d", xbee->device.baudrate);
+		if ((ret = getaddrinfo(path, port, &hints, &res)) != 0) {
+			xbee_log(1, "getaddrinfo(%s): %s", path, gai_strerror(ret));
+			return XBEE_EOPENFAILED;
+		}
+		link->fd = -1;
+		for (ai = res; ai; ai = ai->ai_next) {
+			if ((link->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1) continue;
+			if (connect(link->fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+			close(link->fd);
+			link->fd = -1;
+		}
+		freeaddrinfo(res);
+		if (link->fd == -1) {
+			xbee_perror(1, "connect()");
+			return XBEE_EOPENFAILED;
+		}
+		/* requests are small, and something is usually waiting for them */
+		setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	return XBEE_ENONE;
+}
+
+/* tidy up a link, the rx thread must have finished with it */
+static void xbee_remoteLinkFree(struct xbee_remoteLink *link) {
+	int i;
+
+	if (link->fd != -1) close(link->fd);
+	link->fd = -1;
+	for (i = 0; i <= 0xFF; i++) {
+		if (link->reqs[i].rBuf) free(link->reqs[i].rBuf);
+		xsys_sem_destroy(&link->reqs[i].sem);
+	}
+	xsys_mutex_destroy(&link->reqMutex);
+	xsys_mutex_destroy(&link->txMutex);
+	free(link->rxBuf);
+}
+
+/* connect a link, and agree on the version and packet encoding with the server */
+static int xbee_remoteLinkOpen(struct xbee *xbee, struct xbee_remoteLink *link) {
+	struct bufData *rBuf;
+	struct iovec iov[2];
+	unsigned char encoding;
+	int returnValue;
+	int ret;
+	int i;
+
+	memset(link, 0, sizeof(*link));
+	link->fd = -1;
+
+	/* a SOCK_SEQPACKET record is cut short if it doesn't fit, so always offer room for the largest message */
+	link->rxSize = XBEE_REMOTE_RXBUFLEN;
+	if ((link->rxBuf = malloc(link->rxSize)) == NULL) return XBEE_ENOMEM;
+	if (xsys_mutex_init(&link->txMutex)) {
+		ret = XBEE_EMUTEX;
+		goto die1;
+	}
+	if (xsys_mutex_init(&link->reqMutex)) {
+		ret = XBEE_EMUTEX;
+		goto die2;
+	}
+	for (i = 0; i <= 0xFF; i++) {
+		if (xsys_sem_init(&link->reqs[i].sem)) {
+			ret = XBEE_ESEMAPHORE;
+			goto die3;
+		}
+	}
+
+	if ((ret = xbee_remoteConnect(xbee, link)) != 0) goto die3;
+	if (link->seqpacket) {
+		void *p;
+		if ((p = realloc(link->rxBuf, XBEE_REMOTE_MSGMAX)) == NULL) {
+			ret = XBEE_ENOMEM;
+			goto die4;
+		}
+		link->rxBuf = p;
+		link->rxSize = XBEE_REMOTE_MSGMAX;
+	}
+
+	/* our commit (with its nul), followed by the packet encoding that we want */
+	encoding = XBEE_NET_PKT_KEYED;
+	iov[0].iov_base = (void *)libxbee_commit;
+	iov[0].iov_len = strlen(libxbee_commit) + 1;
+	iov[1].iov_base = &encoding;
+	iov[1].iov_len = 1;
+	if ((ret = _xbee_remoteRequest(xbee, link, 0x7F, iov, 2, &returnValue, &rBuf, 1)) != 0) goto die4;
+	if (returnValue != 0) {
+		xbee_log(1, "the server rejected our version (%d), it must be running libxbee %s", returnValue, libxbee_commit);
+		ret = XBEE_EINVAL;
+		goto die5;
+	}
+	if (!rBuf || rBuf->len != 1 || rBuf->buf[0] != XBEE_NET_PKT_KEYED) {
+		xbee_log(1, "the server can't send packets with their connection's key");
+		ret = XBEE_EINVAL;
+		goto die5;
+	}
+	free(rBuf);
+
+	return XBEE_ENONE;
+die5:
+	if (rBuf) free(rBuf);
+die4:
+	close(link->fd);
+	link->fd = -1;
+die3:
+	for (; i > 0; i--) {
+		xsys_sem_destroy(&link->reqs[i - 1].sem);
+	}
+	xsys_mutex_destroy(&link->reqMutex);
+die2:
+	xsys_mutex_destroy(&link->txMutex);
+die1:
+	free(link->rxBuf);
+	return ret;
+}
+
+/* ######################################################################### */
+
+int xbee_remoteIoOpen(struct xbee *xbee) {
+	struct xbee_remoteInfo *info;
+	struct bufData *rBuf;
+	int returnValue;
+	int ret;
+	int i;
+
+	xbee->device.ready = 0;
+	if ((info = xbee->fmapData) == NULL) return XBEE_EMISSINGPARAM;
+
+	if (xsys_mutex_init(&info->conMutex)) return XBEE_EMUTEX;
+	if (ll_init(&info->conList)) {
+		ret = XBEE_ELINKEDLIST;
+		goto die1;
+	}
+
+	for (i = 0; i < XBEE_REMOTE_LINKS; i++) {
+		if ((ret = xbee_remoteLinkOpen(xbee, &info->links[i])) != 0) goto die3;
+	}
+	xbee_log(2, "Connected to %s:%d with %d links", xbee->device.path, xbee->device.baudrate, XBEE_REMOTE_LINKS);
+
+	/* the rx thread won't start until a mode is set, so find out what the server is using now - postInit() sets it */
+	if ((ret = _xbee_remoteRequest(xbee, &info->links[0], 0x0B, NULL, 0, &returnValue, &rBuf, 1)) != 0) goto die3;
+	if (returnValue != 0 || !rBuf || rBuf->len < 2) {
+		xbee_log(1, "the server doesn't have a mode set");
+		if (rBuf) free(rBuf);
+		ret = XBEE_ENOMODE;
+		goto die3;
+	}
+	info->mode = strdup((char *)rBuf->buf);
+	free(rBuf);
+	if (!info->mode) {
+		ret = XBEE_ENOMEM;
+		goto die3;
+	}
+
+	xbee->device.ready = 1;
+	return XBEE_ENONE;
+die3:
+	for (; i > 0; i--) {
+		xbee_remoteLinkFree(&info->links[i - 1]);
+	}
+	ll_destroy(&info->conList, free);
+die1:
+	xsys_mutex_destroy(&info->conMutex);
+	return ret;
+}
+
+void xbee_remoteIoClose(struct xbee *xbee) {
+	struct xbee_remoteInfo *info;
+	int i;
+
+	xbee->device.ready = 0;
+	if ((info = xbee->fmapData) == NULL) return;
+
+	/* the server ends our connections when the links go */
+	for (i = 0; i < XBEE_REMOTE_LINKS; i++) {
+		xbee_remoteLinkFree(&info->links[i]);
+	}
+	ll_destroy(&info->conList, free);
+	xsys_mutex_destroy(&info->conMutex);
+	free(info->mode);
+}
+
+int xbee_remotePostInit(struct xbee *xbee) {
+	struct xbee_remoteInfo *info;
+	int ret;
+
+	info = xbee->fmapData;
+	if ((ret = xbee_modeSet(xbee, info->mode)) != 0) {
+		xbee_log(1, "the server's mode ('%s') isn't available here (%d)", info->mode, ret);
+	}
+	return ret;
+}
+
+/* the rx function never returns a buffer, the responses and packets are all dealt with here
+   it only returns when every link has failed */
+int xbee_remoteRx(struct xbee *xbee, struct bufData **buf, int retries) {
+	struct xbee_remoteInfo *info;
+	struct xbee_remoteLink *links[XBEE_REMOTE_LINKS];
+	struct pollfd fds[XBEE_REMOTE_LINKS];
+	int cancelState;
+	int count;
+	int i;
+
+	info = xbee->fmapData;
+
+	while (xbee->running) {
+		for (count = 0, i = 0; i < XBEE_REMOTE_LINKS; i++) {
+			if (info->links[i].dead) continue;
+			links[count] = &info->links[i];
+			fds[count].fd = info->links[i].fd;
+			fds[count].events = POLLIN;
+			fds[count].revents = 0;
+			count++;
+		}
+		if (!count) {
+			xbee_log(1, "every link to the server has gone");
+			return XBEE_EIO;
+		}
+
+		/* the thread is cancelled at xbee_shutdown(), that must only happen while we are waiting here */
+		if (poll(fds, count, -1) == -1) {
+			if (errno == EINTR) continue;
+			xbee_perror(1, "poll()");
+			return XBEE_EIO;
+		}
+
+		xsys_thread_cancelDisable(&cancelState);
+		for (i = 0; i < count; i++) {
+			if (!fds[i].revents) continue;
+			if (xbee_remoteLinkRx(xbee, info, links[i]) != 0) xbee_remoteLinkDead(xbee, links[i]);
+		}
+		xsys_thread_cancelRestore(cancelState);
+	}
+
+	return XBEE_ENOTREADY;
+}
+
+/* ######################################################################### */
+
+/* the server is told about the connection first, and it is given to the link that has the fewest */
+int xbee_remoteConNew(struct xbee *xbee, struct xbee_con **retCon, unsigned char id, struct xbee_conAddress *address, void *userData) {
+	struct xbee_remoteInfo *info;
+	struct xbee_remoteCon *rcon;
+	struct xbee_remoteLink *link;
+	struct bufData *rBuf;
+	struct iovec iov[2];
+	int returnValue;
+	int ret;
+	int i;
+
+	info = xbee->fmapData;
+
+	if ((rcon = calloc(1, sizeof(*rcon))) == NULL) return XBEE_ENOMEM;
+
+	xsys_mutex_lock(&info->conMutex);
+	for (link = NULL, i = 0; i < XBEE_REMOTE_LINKS; i++) {
+		if (info->links[i].dead) continue;
+		if (!link || info->links[i].conCount < link->conCount) link = &info->links[i];
+	}
+	if (link) link->conCount++;
+	xsys_mutex_unlock(&info->conMutex);
+	if (!link) {
+		ret = XBEE_EIO;
+		goto die1;
+	}
+
+	/* the conType's index, followed by the address */
+	iov[0].iov_base = &id;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = address;
+	iov[1].iov_len = sizeof(*address);
+	if ((ret = xbee_remoteRequest(xbee, link, 0x03, iov, 2, &returnValue, &rBuf)) != 0) goto die2;
+
+	/* the server may already have a connection to this address, we can share it */
+	if (returnValue != 0 && returnValue != XBEE_EEXISTS) {
+		ret = returnValue;
+		goto die3;
+	}
+	if (!rBuf || rBuf->len != 4) {
+		ret = XBEE_EUNKNOWN;
+		goto die3;
+	}
+
+	rcon->con = *retCon;
+	rcon->link = link;
+	rcon->key = (rBuf->buf[2] << 8) | rBuf->buf[3];
+	free(rBuf);
+
+	xsys_mutex_lock(&info->conMutex);
+	ll_add_tail(&info->conList, rcon);
+	xsys_mutex_unlock(&info->conMutex);
+
+	xbee_log(2, "Connection @ %p has key 0x%04X on link %d", rcon->con, rcon->key, (int)(link - info->links));
+
+	return XBEE_ENONE;
+die3:
+	if (rBuf) free(rBuf);
+die2:
+	xsys_mutex_lock(&info->conMutex);
+	link->conCount--;
+	xsys_mutex_unlock(&info->conMutex);
+die1:
+	free(rcon);
+	return ret;
+}
+
+/* the data is sent as it was given (the server runs the conType's handler), and the server's ACK is passed on */
+int xbee_remoteConnTx(struct xbee *xbee, struct xbee_con *con, struct bufData *buf) {
+	int ret;
+
+	if ((ret = xbee_remoteConRequest(xbee, con, 0x01, buf->buf, buf->len)) < 0) return ret;
+
+	/* if xbee_connTx() is waiting for an ACK, then it gets the server's */
+	if (con->frameID_enabled) {
+		xbee_frameIdGiveACK(xbee, con->frameID, ret);
+	} else if (ret != 0) {
+		return ret;
+	}
+
+	/* the buffer is ours once we have succeeded */
+	free(buf);
+	return XBEE_ENONE;
+}
+
+/* the connection is going whatever the server says, so this always succeeds */
+int xbee_remoteConEnd(struct xbee *xbee, struct xbee_con *con) {
+	struct xbee_remoteInfo *info;
+	struct xbee_remoteCon *rcon;
+	struct iovec iov;
+	unsigned char key[2];
+	int returnValue;
+	int ret;
+
+	info = xbee->fmapData;
+
+	/* once it is out of the list, no more packets will be delivered to it */
+	xsys_mutex_lock(&info->conMutex);
+	for (rcon = NULL; (rcon = ll_get_next(&info->conList, rcon)) != NULL;) {
+		if (rcon->con == con) break;
+	}
+	if (rcon) {
+		ll_ext_item(&info->conList, rcon);
+		rcon->link->conCount--;
+	}
+	xsys_mutex_unlock(&info->conMutex);
+	if (!rcon) return XBEE_ENONE;
+
+	key[0] = (rcon->key >> 8) & 0xFF;
+	key[1] = (rcon->key     ) & 0xFF;
+	iov.iov_base = key;
+	iov.iov_len = 2;
+	if ((ret = xbee_remoteRequest(xbee, rcon->link, 0x04, &iov, 1, &returnValue, NULL)) != 0) {
+		xbee_log(1, "failed to end connection @ %p (key 0x%04X) on the server (%d)", con, rcon->key, ret);
+	} else if (returnValue != 0 && returnValue != XBEE_ECALLBACK) {
+		/* XBEE_ECALLBACK means that the server will finish it off once its callback has returned */
+		xbee_log(1, "the server failed to end connection @ %p (key 0x%04X) (%d)", con, rcon->key, returnValue);
+	}
+
+	free(rcon);
+	return XBEE_ENONE;
+}
+
+/* only a change needs to go to the server, our copy of the options is kept by xbee_conOptions() */
+int xbee_remoteConOptions(struct xbee *xbee, struct xbee_con *con, struct xbee_conOptions *getOptions, struct xbee_conOptions *setOptions) {
+	if (!setOptions) return XBEE_ENONE;
+	return xbee_remoteConRequest(xbee, con, 0x05, setOptions, sizeof(*setOptions));
+}
+
+int xbee_remoteConSleep(struct xbee *xbee, struct xbee_con *con, int wakeOnRx) {
+	unsigned char data;
+	data = !!wakeOnRx;
+	return xbee_remoteConRequest(xbee, con, 0x06, &data, 1);
+}
+
+int xbee_remoteConWake(struct xbee *xbee, struct xbee_con *con) {
+	return xbee_remoteConRequest(xbee, con, 0x07, NULL, 0);
+}
+
+/* ######################################################################### */
+
+/* setup a libxbee instance that uses the radio of a libxbee network server */
+EXPORT int xbee_setupRemote(char *host, int port, struct xbee **retXbee) {
+	struct xbee_remoteInfo *info;
+
+	/* check parameters */
+	if (!host) return XBEE_EMISSINGPARAM;
+	if (host[0] != '/' && host[0] != '@' && (port <= 0 || port > 0xFFFF)) return XBEE_ERANGE;
+
+	if ((info = calloc(1, sizeof(struct xbee_remoteInfo))) == NULL) return XBEE_ENOMEM;
+
+	/* the instance now owns 'info', and will free it - the host and port are kept as the device's path and baudrate */
+	return _xbee_setup(&xbee_fmap_remote, host, port, info, retXbee);
+}
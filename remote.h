@@ -0,0 +1,99 @@
+#ifndef __XBEE_REMOTE_H
+#define __XBEE_REMOTE_H
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* the remote function map talks to a libxbee network server (xbee_netStart() / xbee_netStartUnix()) instead of a device
+   each instance keeps a small pool of links (sockets) to the server, and each connection is given to the least busy link
+   when it is created - the server only knows a connection's key on the link that created it. requests are pipelined,
+   many threads may be waiting on one link at a time, and the responses are matched up by the reqID */
+
+/* the number of links to the server that each instance keeps */
+#ifndef XBEE_REMOTE_LINKS
+#define XBEE_REMOTE_LINKS    2
+#endif
+/* how long to wait for the server to respond to a request (seconds) */
+#define XBEE_REMOTE_TIMEOUT  5
+/* the initial size of each link's receive buffer */
+#define XBEE_REMOTE_RXBUFLEN 4096
+/* the largest message - header, 0xFFFF bytes of data and the terminator */
+#define XBEE_REMOTE_MSGMAX   (7 + 0xFFFF + 1)
+
+/* a request that is waiting for its response, indexed by reqID - reqID 0 is used by the server for packets */
+struct xbee_remoteReq {
+	char busy;      /* the reqID is in use */
+	char done;      /* the response has arrived, and sem has been posted */
+	char abandoned; /* the requester stopped waiting, the response should be thrown away */
+	char lost;      /* the link failed before the response arrived */
+	int returnValue;
+	struct bufData *rBuf;
+	xsys_sem sem;
+};
+
+struct xbee_remoteLink {
+	int fd;
+	char seqpacket; /* SOCK_SEQPACKET, each record holds exactly one message */
+	char dead;      /* the server has gone, requests fail straight away */
+
+	xsys_mutex txMutex; /* one message at a time on the socket */
+
+	xsys_mutex reqMutex; /* protects reqs[] and reqLast */
+	struct xbee_remoteReq reqs[0x100];
+	unsigned char reqLast;
+
+	int conCount; /* connections using this link, protected by the info's conMutex */
+
+	/* data read from the socket that hasn't been handled yet, only touched by the rx thread (or io_open()) */
+	unsigned char *rxBuf;
+	int rxLen;
+	int rxSize;
+};
+
+/* a local connection, and the key that the server knows it by */
+struct xbee_remoteCon {
+	struct xbee_con *con;
+	struct xbee_remoteLink *link;
+	unsigned short key;
+};
+
+struct xbee_remoteInfo {
+	char *mode; /* the server's mode, set locally by postInit() */
+
+	struct xbee_remoteLink links[XBEE_REMOTE_LINKS];
+
+	/* struct xbee_remoteCon, the mutex is held while a packet is delivered, so the connection can't be ended under it */
+	xsys_mutex conMutex;
+	struct ll_head conList;
+};
+
+int xbee_remoteIoOpen(struct xbee *xbee);
+void xbee_remoteIoClose(struct xbee *xbee);
+int xbee_remoteRx(struct xbee *xbee, struct bufData **buf, int retries);
+int xbee_remotePostInit(struct xbee *xbee);
+
+int xbee_remoteConNew(struct xbee *xbee, struct xbee_con **retCon, unsigned char id, struct xbee_conAddress *address, void *userData);
+int xbee_remoteConnTx(struct xbee *xbee, struct xbee_con *con, struct bufData *buf);
+int xbee_remoteConEnd(struct xbee *xbee, struct xbee_con *con);
+int xbee_remoteConOptions(struct xbee *xbee, struct xbee_con *con, struct xbee_conOptions *getOptions, struct xbee_conOptions *setOptions);
+int xbee_remoteConSleep(struct xbee *xbee, struct xbee_con *con, int wakeOnRx);
+int xbee_remoteConWake(struct xbee *xbee, struct xbee_con *con);
+
+#endif /* __XBEE_REMOTE_H */
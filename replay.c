@@ -0,0 +1,398 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+
+#include "internal.h"
+#include "replay.h"
+#include "fmaps.h"
+#include "log.h"
+
+/* the replay function map reads a capture file (see replay.h) from a feeder thread, and writes it into one end of a
+   socketpair. the other end is used as the device, so that the full rx path (xbee_rxSerialXBee() onwards) is exercised */
+struct xbee_replayInfo {
+	int realtime; /* 0 = as fast as possible, otherwise keep the original timing */
+	int raw;      /* the capture file has no header or timing information */
+
+	FILE *capture;
+	int fds[2];   /* [0] is read by libxbee, [1] is written to by the feeder */
+
+	xsys_thread feeder;
+	volatile int stop;
+	xsys_sem stopSem;
+	xsys_sem doneSem;
+};
+
+static long long xbee_replayNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
+
+/* ######################################################################### */
+
+/* write the whole buffer to the device */
+static int xbee_replaySend(struct xbee_replayInfo *info, unsigned char *buf, int len) {
+	int ret;
+	int pos;
+	for (pos = 0; pos < len; pos += ret) {
+		if ((ret = send(info->fds[1], &buf[pos], len - pos, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* this thread feeds the capture file into the device */
+static void *xbee_replayFeeder(struct xbee *xbee) {
+	struct xbee_replayInfo *info;
+	unsigned char hdr[10];
+	unsigned char buf[XBEE_RECORD_BUFLEN];
+	long long start, due, now;
+	int count;
+	int len;
+	int i;
+
+	info = xbee->fmapData;
+	start = xbee_replayNow();
+	count = 0;
+
+	while (!info->stop) {
+		if (info->raw) {
+			/* raw captures have no timing information */
+			if ((len = fread(buf, 1, sizeof(buf), info->capture)) <= 0) break;
+		} else {
+			/* read the record's header */
+			if (fread(hdr, 1, sizeof(hdr), info->capture) != sizeof(hdr)) break;
+			for (due = 0, i = 0; i < 8; i++) {
+				due = (due << 8) | hdr[i];
+			}
+			len = (hdr[8] << 8) | hdr[9];
+			if (len > sizeof(buf)) {
+				xbee_log(1,"Corrupt capture file, record %d is %d bytes long", count, len);
+				break;
+			}
+			if (fread(buf, 1, len, info->capture) != len) {
+				xbee_log(1,"Capture file is truncated (record %d)", count);
+				break;
+			}
+
+			/* wait until the record is due, unless we are asked to stop */
+			if (info->realtime) {
+				due += start;
+				if ((now = xbee_replayNow()) < due) {
+					due -= now;
+					if (xsys_sem_timedwait(&info->stopSem, due / 1000000, (due % 1000000) * 1000) == 0) break;
+				}
+			}
+		}
+
+		if (xbee_replaySend(info, buf, len)) {
+			if (!info->stop) xbee_perror(1,"send()");
+			break;
+		}
+		count++;
+	}
+
+	/* wait for libxbee to read everything... */
+	while (!info->stop) {
+		if (ioctl(info->fds[0], FIONREAD, &len) || len == 0) break;
+		usleep(1000);
+	}
+	xbee_log(2,"Replay complete (%d records)", count);
+
+	/* ... and let anyone waiting know about it, the connection is left open so that the rx thread simply waits */
+	xsys_sem_post(&info->doneSem);
+
+	return NULL;
+}
+
+/* ######################################################################### */
+
+int xbee_replayIoOpen(struct xbee *xbee) {
+	struct xbee_replayInfo *info;
+	char magic[XBEE_RECORD_MAGIC_LEN];
+	int ret;
+
+	xbee->device.ready = 0;
+	ret = XBEE_ENONE;
+
+	if ((info = xbee->fmapData) == NULL) return XBEE_EINVAL;
+	info->stop = 0;
+
+	/* open the capture, and check if it is a raw byte stream */
+	if ((info->capture = xsys_fopen(xbee->device.path, "rb")) == NULL) {
+		xbee_perror(1,"xsys_fopen()");
+		ret = XBEE_EOPENFAILED;
+		goto die1;
+	}
+	if (fread(magic, 1, XBEE_RECORD_MAGIC_LEN, info->capture) != XBEE_RECORD_MAGIC_LEN ||
+	    memcmp(magic, XBEE_RECORD_MAGIC, XBEE_RECORD_MAGIC_LEN)) {
+		info->raw = 1;
+		rewind(info->capture);
+		xbee_log(2,"'%s' has no capture header, replaying it as a raw byte stream", xbee->device.path);
+	}
+
+	/* build the device */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, info->fds)) {
+		xbee_perror(1,"socketpair()");
+		ret = XBEE_EOPENFAILED;
+		goto die2;
+	}
+	if (xsys_sem_init(&info->stopSem)) {
+		ret = XBEE_ESEMAPHORE;
+		goto die3;
+	}
+	if (xsys_sem_init(&info->doneSem)) {
+		ret = XBEE_ESEMAPHORE;
+		goto die4;
+	}
+
+	xbee->device.fd = info->fds[0];
+	xbee->device.rxChunkLen = 0;
+	xbee->device.rxChunkPos = 0;
+	xbee->device.rxRescanLen = 0;
+	xbee->device.rxRescanPos = 0;
+
+	/* start feeding the capture into the device */
+	if (xsys_thread_create(&info->feeder, (void *(*)(void *))xbee_replayFeeder, xbee)) {
+		xbee_perror(1,"xsys_thread_create()");
+		ret = XBEE_ETHREAD;
+		goto die5;
+	}
+
+	/* mark it as ready! */
+	xbee->device.ready = 1;
+
+	goto done;
+die5:
+	xbee->device.fd = -1;
+	xsys_sem_destroy(&info->doneSem);
+die4:
+	xsys_sem_destroy(&info->stopSem);
+die3:
+	xsys_close(info->fds[0]);
+	xsys_close(info->fds[1]);
+die2:
+	xsys_fclose(info->capture);
+die1:
+done:
+	return ret;
+}
+
+void xbee_replayIoClose(struct xbee *xbee) {
+	struct xbee_replayInfo *info;
+
+	xbee->device.ready = 0;
+	if ((info = xbee->fmapData) == NULL) return;
+
+	/* stop the feeder, it may be sleeping or blocked in send() */
+	info->stop = 1;
+	xsys_sem_post(&info->stopSem);
+	shutdown(info->fds[1], SHUT_RDWR);
+	xsys_thread_join(info->feeder, NULL);
+
+	xsys_close(xbee->device.fd);
+	xbee->device.fd = -1;
+	xsys_close(info->fds[1]);
+	xsys_fclose(info->capture);
+
+	xsys_sem_destroy(&info->stopSem);
+	xsys_sem_destroy(&info->doneSem);
+}
+
+/* there is nothing to transmit to, so everything is discarded */
+int xbee_replayTx(struct xbee *xbee, struct bufData *buf) {
+	return XBEE_ENONE;
+}
+
+/* there is no module to tell, the capture is just parsed with the given framing */
+int xbee_replayApiModeSet(struct xbee *xbee, int apiMode) {
+	if (apiMode != 1 && apiMode != 2) return XBEE_EINVAL;
+	xbee->device.apiMode = apiMode;
+	return XBEE_ENONE;
+}
+
+/* ######################################################################### */
+
+/* setup a libxbee instance that reads from a capture file */
+EXPORT int xbee_setupReplay(char *path, int realtime, struct xbee **retXbee) {
+	struct xbee_replayInfo *info;
+
+	/* check parameters */
+	if (!path) return XBEE_EMISSINGPARAM;
+
+	if ((info = calloc(1, sizeof(struct xbee_replayInfo))) == NULL) return XBEE_ENOMEM;
+	info->realtime = realtime;
+
+	/* the instance now owns 'info', and will free it */
+	return _xbee_setup(&xbee_fmap_replay, path, 0, info, retXbee);
+}
+
+/* wait for the capture to be completely read by libxbee */
+EXPORT int xbee_replayWait(struct xbee *xbee) {
+	struct xbee_replayInfo *info;
+
+	/* check parameters */
+	if (!xbee) {
+		if (!xbee_default) return XBEE_ENOXBEE;
+		xbee = xbee_default;
+	}
+	if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
+	if (xbee->f != &xbee_fmap_replay) return XBEE_EINVAL;
+	info = xbee->fmapData;
+
+	/* pass the news on to anyone else that is waiting */
+	if (xsys_sem_wait(&info->doneSem)) return XBEE_ESEMAPHORE;
+	xsys_sem_post(&info->doneSem);
+
+	return XBEE_ENONE;
+}
+
+/* ######################################################################### */
+
+/* write out the current record */
+static int xbee_recordFlush(struct xbee_recordInfo *rec) {
+	unsigned char hdr[10];
+	int i;
+	if (!rec->len) return 0;
+	for (i = 0; i < 8; i++) {
+		hdr[i] = (rec->chunkTime >> (8 * (7 - i))) & 0xFF;
+	}
+	hdr[8] = (rec->len >> 8) & 0xFF;
+	hdr[9] = (rec->len     ) & 0xFF;
+	i = 0;
+	if (xsys_fwrite(hdr, 1, sizeof(hdr), rec->f) != sizeof(hdr)) i = -1;
+	if (xsys_fwrite(rec->buf, 1, rec->len, rec->f) != rec->len) i = -1;
+	rec->len = 0;
+	return i;
+}
+
+/* this is called by xbee_io_getRawByte() for every byte read, while a capture is in progress */
+void xbee_recordByte(struct xbee *xbee, unsigned char c) {
+	struct xbee_recordInfo *rec;
+	struct timespec ts;
+	long long now;
+
+	xsys_mutex_lock(&xbee->device.recordMutex);
+	if ((rec = xbee->device.record) == NULL) goto done;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ((long long)(ts.tv_sec - rec->start.tv_sec) * 1000000LL) + ((ts.tv_nsec - rec->start.tv_nsec) / 1000);
+
+	/* bytes that arrive close together share a record */
+	if (rec->len && (rec->len >= XBEE_RECORD_BUFLEN || now - rec->chunkTime >= XBEE_RECORD_RESOLUTION)) {
+		if (xbee_recordFlush(rec)) xbee_log(1,"Failed to write to capture file...");
+	}
+	if (!rec->len) rec->chunkTime = now;
+	rec->buf[rec->len++] = c;
+
+done:
+	xsys_mutex_unlock(&xbee->device.recordMutex);
+}
+
+/* start capturing everything that is read from the device */
+EXPORT int xbee_recordStart(struct xbee *xbee, char *path) {
+	struct xbee_recordInfo *rec;
+	int ret;
+
+	/* check parameters */
+	if (!xbee) {
+		if (!xbee_default) return XBEE_ENOXBEE;
+		xbee = xbee_default;
+	}
+	if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
+	if (!path) return XBEE_EMISSINGPARAM;
+
+	ret = XBEE_ENONE;
+
+	if ((rec = calloc(1, sizeof(struct xbee_recordInfo))) == NULL) {
+		ret = XBEE_ENOMEM;
+		goto die1;
+	}
+	if ((rec->f = xsys_fopen(path, "wb")) == NULL) {
+		xbee_perror(1,"xsys_fopen()");
+		ret = XBEE_EOPENFAILED;
+		goto die2;
+	}
+	if (xsys_fwrite(XBEE_RECORD_MAGIC, 1, XBEE_RECORD_MAGIC_LEN, rec->f) != XBEE_RECORD_MAGIC_LEN) {
+		ret = XBEE_EIO;
+		goto die3;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &rec->start);
+
+	/* only one capture at a time */
+	xsys_mutex_lock(&xbee->device.recordMutex);
+	if (xbee->device.record) {
+		ret = XBEE_EINUSE;
+	} else {
+		xbee->device.record = rec;
+	}
+	xsys_mutex_unlock(&xbee->device.recordMutex);
+	if (ret) goto die3;
+
+	goto done;
+die3:
+	xsys_fclose(rec->f);
+	unlink(path);
+die2:
+	free(rec);
+die1:
+done:
+	return ret;
+}
+
+/* stop capturing, and close the capture file */
+EXPORT int xbee_recordStop(struct xbee *xbee) {
+	struct xbee_recordInfo *rec;
+	int ret;
+
+	/* check parameters */
+	if (!xbee) {
+		if (!xbee_default) return XBEE_ENOXBEE;
+		xbee = xbee_default;
+	}
+	if (!_xbee_validate(xbee, 1)) return XBEE_ENOXBEE;
+
+	xsys_mutex_lock(&xbee->device.recordMutex);
+	rec = xbee->device.record;
+	xbee->device.record = NULL;
+	xsys_mutex_unlock(&xbee->device.recordMutex);
+
+	if (!rec) return XBEE_EINVAL;
+
+	ret = XBEE_ENONE;
+	if (xbee_recordFlush(rec)) ret = XBEE_EIO;
+	if (xsys_fclose(rec->f)) ret = XBEE_EIO;
+	free(rec);
+
+	return ret;
+}
@@ -0,0 +1,50 @@
+#ifndef __XBEE_REPLAY_H
+#define __XBEE_REPLAY_H
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* capture files start with this, followed by records of:
+     8 bytes - microseconds since the capture started (big endian)
+     2 bytes - length of the data (big endian)
+     n bytes - data, exactly as it was read from the device
+   files without this header are replayed as a raw byte stream */
+#define XBEE_RECORD_MAGIC     "libxbee-capture-1\n"
+#define XBEE_RECORD_MAGIC_LEN 18
+/* bytes read within this many microseconds of each other share a record */
+#define XBEE_RECORD_RESOLUTION 1000
+#define XBEE_RECORD_BUFLEN     4096
+
+struct xbee_recordInfo {
+	FILE *f;
+	struct timespec start;
+	long long chunkTime;
+	int len;
+	unsigned char buf[XBEE_RECORD_BUFLEN];
+};
+
+int xbee_replayIoOpen(struct xbee *xbee);
+void xbee_replayIoClose(struct xbee *xbee);
+int xbee_replayTx(struct xbee *xbee, struct bufData *buf);
+int xbee_replayApiModeSet(struct xbee *xbee, int apiMode);
+
+void xbee_recordByte(struct xbee *xbee, unsigned char c);
+
+#endif /* __XBEE_REPLAY_H */
@@ -30,7 +30,10 @@
 #include "frame.h"
 #include "log.h"
 #include "io.h"
+#include "escape.h"
+#include "stats.h"
 #include "ll.h"
+#include "trace.h"
 
 struct xbee_callbackInfo {
 	struct xbee *xbee;
@@ -46,6 +49,8 @@ int _xbee_rxCallbackThread(struct xbee_callbackInfo *info) {
 	struct xbee *xbee;
 	struct xbee_con *con;
 	void(*callback)(struct xbee *xbee, struct xbee_con *con, struct xbee_pkt **pkt, void **userData);
+	int destroySelf;
+	int ended;
 	
 	/* prevent having to xsys_thread_join() */
 	xsys_thread_detach_self();
@@ -56,9 +61,6 @@ int _xbee_rxCallbackThread(struct xbee_callbackInfo *info) {
 	/* and mark it as used - the data is stored in a local variable in xbee_triggerCallback() */
 	info->taken = 1;
 	
-	/* mark us as running */
-	con->callbackRunning = 1;
-	
 	while (!con->destroySelf) {
 		/* get the next packet */
 		pkt = ll_ext_head(&(con->rxList));
@@ -107,7 +109,9 @@ int _xbee_rxCallbackThread(struct xbee_callbackInfo *info) {
 		/* keep hold of the packet's original address - opkt */
 		opkt = pkt;
 		/* run the callback */
+		xbee_trace3(callback_begin, xbee, con, opkt);
 		callback(xbee, con, &pkt, &con->userData);
+		xbee_trace3(callback_end, xbee, con, opkt);
 		if (pkt) {
 			/* if the developer wants to hold onto the packet themselves, then they should set pkt to NULL, otherwise this will happen */
 			if (pkt != opkt) {
@@ -125,19 +129,34 @@ int _xbee_rxCallbackThread(struct xbee_callbackInfo *info) {
 	/* when we die, log the fact */
 	xbee_log(2,"Callback thread terminating (con: %p)", con);
 	
+	/* if the connection has been marked to 'destroySelf' by xbee_conEnd(), then we need to finish tidying up the connection
+	   during shutdown xbee_cleanupMode() will do this for us (it has already removed the mode), and may free the connection
+	   as soon as we are marked as not-running, so this must be decided first */
+	xsys_mutex_lock(&con->callbackMutex);
+	destroySelf = (con->destroySelf && xbee->mode);
+	ended = con->ended;
+	
 	/* mark us as not-running */
 	con->callbackRunning = 0;
+	xsys_mutex_unlock(&con->callbackMutex);
 
-	/* if the connection has been marked to 'destroySelf', then we need to finish tidying up the connection */
-	if (con->destroySelf) {
+	if (destroySelf) {
 		_xbee_conEnd2(xbee, con);
 	}
+	/* xbee_shutdown() may free the instance as soon as this reaches zero */
+	if (ended) __atomic_sub_fetch(&xbee->conEnding, 1, __ATOMIC_ACQ_REL);
 
 	return 0;
 }
 
 /* this is a magical function that starts the callback thread for a connection */
 void xbee_triggerCallback(struct xbee *xbee, struct xbee_con *con) {
+	xsys_mutex_lock(&con->callbackMutex);
+	/* an ended connection doesn't get a new thread, the old one (if any) is tidying it up */
+	if (con->destroySelf) {
+		xsys_mutex_unlock(&con->callbackMutex);
+		return;
+	}
 	/* if the thread isn't marked as running, or even started then start it */
 	if ((!con->callbackStarted || !con->callbackRunning)) {
 		struct xbee_callbackInfo info;  	                                           /* vv */
@@ -145,7 +164,8 @@ void xbee_triggerCallback(struct xbee *xbee, struct xbee_con *con) {
 		info.con = con;
 		info.taken = 0;
 		
-		con->callbackRunning = 0;
+		/* mark it as running before it starts, otherwise we could start a second thread before the first has got going */
+		con->callbackRunning = 1;
 		if (!xsys_thread_create(&con->callbackThread, (void*(*)(void*))_xbee_rxCallbackThread, (void*)&info)) {
 			con->callbackStarted = 1;
 			/* wait for the info to be taken - its that local variable up there remember  ^^ */
@@ -153,22 +173,109 @@ void xbee_triggerCallback(struct xbee *xbee, struct xbee_con *con) {
 				usleep(100);
 			}
 		} else {
+			con->callbackRunning = 0;
 			xbee_log(-99,"Failed to start callback for connection @ %p... xsys_thread_create() returned error", con);
 		}
 	}
 	/* prod it just incase */
 	xsys_sem_post(&con->callbackSem);
+	xsys_mutex_unlock(&con->callbackMutex);
+}
+
+/* give a packet to a connection, waking it if it is allowed, and trigger the callback
+   returns non-zero if the connection wouldn't take the packet, which then still belongs to the caller */
+int xbee_rxDeliver(struct xbee *xbee, struct xbee_con *rxCon, struct xbee_pkt *pkt) {
+	/* if it is sleeping, then wake it up */
+	if (rxCon->sleeping) {
+		if (!rxCon->wakeOnRx) {
+			/* unless it is sleeping 'deeply' */
+			xbee_log(3,"Found a connection @ %p, but it's in a 'deep sleep'...", rxCon);
+			return XBEE_EINVAL;
+		}
+		xbee_log(2,"Woke up connection @ %p", rxCon);
+		rxCon->sleeping = 0;
+	}
+	
+	/* add the packet to the connections rxList */
+	ll_add_tail(&rxCon->rxList, pkt);
+	xbee_trace3(rx_dispatch, xbee, rxCon, pkt);
+	
+	if (rxCon->callback) {
+		/* trigger a callback if appropriate */
+		xbee_triggerCallback(xbee, rxCon);
+	}
+	
+	xbee_log(3,"%d packets in queue for connection @ %p", ll_count_items(&rxCon->rxList), rxCon);
+	
+	return XBEE_ENONE;
+}
+
+/* run a pktHandler on a received frame, and deliver the packet that it makes - 'buf' is always consumed
+   frames for the same pktHandler must not be handled concurrently */
+void xbee_rxHandle(struct xbee *xbee, struct xbee_pktHandler *pktHandler, struct bufData *buf) {
+	int ret;
+	struct xbee_pkt *pkt;
+	struct xbee_con con;
+	struct xbee_con *rxCon;
+	
+	/* make space for a new packet */
+	if ((pkt = xbee_pktAlloc()) == NULL) {
+		xbee_perror(1,"xbee_pktAlloc()");
+		goto skip;
+	}
+	
+	xbee_log(2,"Processing packet @ %p", buf);
+	
+	/* clear out the connection and packet structs - the handler should fill them in */
+	xbee_pktClean(pkt);
+	memset(&con, 0, sizeof(struct xbee_con));
+	/* call the handler, it should fill in con and pkt */
+	if ((ret = pktHandler->handler(xbee, pktHandler, 1, &buf, &con, &pkt)) != 0) {
+		xbee_log(1,"Failed to handle packet... pktHandler->handler() returned %d", ret);
+		goto skip;
+	}
+	if (!pkt) {
+		xbee_log(1,"pktHandler->handler() failed to return a packet! This has quite possibly caused a memory leak...");
+		goto skip;
+	}
+	
+	/* if a frameID was provided, then poke the waiting thread */
+	if (con.frameID_enabled) {
+		xbee_frameIdGiveACK(xbee, con.frameID, pkt->status);
+	}
+	
+	/* if the conType demands an address, but we haven't got one, then skip the rest */
+	if (pktHandler->conType->needsAddress &&
+	    !con.address.addr16_enabled &&
+	    !con.address.addr64_enabled) goto skip;
+
+	/* log the address we recieved the packet for */
+	xbee_conLogAddress(xbee, &con.address);
+	
+	/* get a connection, and hold on to it until the packet has been delivered */
+	xsys_mutex_lock(&pktHandler->conType->conMutex);
+	if ((rxCon = xbee_conFromAddress(xbee, pktHandler->conType, &con.address)) == NULL) {
+		xsys_mutex_unlock(&pktHandler->conType->conMutex);
+		xbee_log(3,"No connection for packet...");
+		goto skip;
+	}
+	ret = xbee_rxDeliver(xbee, rxCon, pkt);
+	xsys_mutex_unlock(&pktHandler->conType->conMutex);
+	if (ret != 0) goto skip;
+	
+	/* the packet belongs to the connection now */
+	pkt = NULL;
+skip:
+	/* free up any storage */
+	if (pkt) xbee_pktFree(pkt);
+	if (buf) free(buf);
 }
 
 /* this thread is thread is activated for each pktHandler that recieves data */
 int _xbee_rxHandlerThread(struct xbee_pktHandler *pktHandler) {
-	int ret;
 	struct rxData *data;
 	struct bufData *buf;
 	struct xbee *xbee;
-	struct xbee_pkt *pkt;
-	struct xbee_con con;
-	struct xbee_con *rxCon;
 	
 	/* prevent having to xsys_thread_join() */
 	xsys_thread_detach_self();
@@ -180,10 +287,6 @@ int _xbee_rxHandlerThread(struct xbee_pktHandler *pktHandler) {
 	xbee = data->xbee;
 	if (!xbee) return XBEE_ENOXBEE;
 	
-	/* mark ourselves as running */
-	data->threadRunning = 1;
-	
-	pkt = NULL;
 	for (;!data->threadShutdown;) {
 		/* wait for a packet */
 		if (xsys_sem_wait(&data->sem)) {
@@ -199,79 +302,10 @@ int _xbee_rxHandlerThread(struct xbee_pktHandler *pktHandler) {
 			xbee_log(1,"No buffer!");
 			continue;
 		}
-
-		/* make space for a new packet */
-		if ((pkt = xbee_pktAlloc()) == NULL) {
-			xbee_perror(1,"xbee_pktAlloc()");
-			usleep(100000);
-			continue;
-		}
-		
-		xbee_log(2,"Processing packet @ %p", buf);
-		
-		/* clear out the connection and packet structs - the handler should fill them in */
-		xbee_pktClean(pkt);
-		memset(&con, 0, sizeof(struct xbee_con));
-		/* call the handler, it should fill in con and pkt */
-		if ((ret = pktHandler->handler(data->xbee, pktHandler, 1, &buf, &con, &pkt)) != 0) {
-			xbee_log(1,"Failed to handle packet... pktHandler->handler() returned %d", ret);
-			goto skip;
-		}
-		if (!pkt) {
-			xbee_log(1,"pktHandler->handler() failed to return a packet! This has quite possibly caused a memory leak...");
-			goto skip;
-		}
-		
-		/* if a frameID was provided, then poke the waiting thread */
-		if (con.frameID_enabled) {
-			xbee_frameIdGiveACK(xbee, con.frameID, pkt->status);
-		}
-		
-		/* if the conType demands an address, but we haven't got one, then skip the rest */
-		if (pktHandler->conType->needsAddress &&
-		    !con.address.addr16_enabled &&
-		    !con.address.addr64_enabled) goto skip;
-
-		/* log the address we recieved the packet for */
-		xbee_conLogAddress(xbee, &con.address);
-		
-		/* get a connection */
-		if ((rxCon = xbee_conFromAddress(xbee, pktHandler->conType, &con.address)) == NULL) {
-			xbee_log(3,"No connection for packet...");
-			goto skip;
-		}
-		/* if it is sleeping, then wake it up */
-		if (rxCon->sleeping) {
-			if (!rxCon->wakeOnRx) {
-				/* unless it is sleeping 'deeply' */
-				xbee_log(3,"Found a connection @ %p, but it's in a 'deep sleep'...", rxCon);
-				goto skip;
-			}
-			xbee_log(2,"Woke up connection @ %p", rxCon);
-			rxCon->sleeping = 0;
-		}
-		
-		/* add the packet to the connections rxList */
-		ll_add_tail(&rxCon->rxList, pkt);
-		
-		if (rxCon->callback) {
-			/* trigger a callback if appropriate */
-			xbee_triggerCallback(data->xbee, rxCon);
-		}
 		
-		xbee_log(3,"%d packets in queue for connection @ %p", ll_count_items(&rxCon->rxList), rxCon);
-		
-		/* flag pkt for a new allocation */
-		pkt = NULL;
-skip:
-		/* free up any storage */
-		if (pkt) xbee_pktFree(pkt);
-		pkt = NULL;
-		if (buf) free(buf);
+		xbee_rxHandle(xbee, pktHandler, buf);
 	}
 	
-	if (pkt) xbee_pktFree(pkt);
-
 	/* mark us as not running */
 	data->threadRunning = 0;
 	return 0;
@@ -310,8 +344,10 @@ int _xbee_rxHandler(struct xbee *xbee, struct xbee_pktHandler *pktHandler, struc
 	
 	/* start a handler thread if necessary */
 	if (!data->threadStarted || !data->threadRunning) {
-		data->threadRunning = 0;
+		/* mark the thread as running before it starts, so a shutdown can't miss it */
+		data->threadRunning = 1;
 		if (xsys_thread_create(&data->thread, (void*(*)(void*))_xbee_rxHandlerThread, (void*)pktHandler)) {
+			data->threadRunning = 0;
 			xbee_perror(1,"xsys_thread_create()");
 			ret = XBEE_ETHREAD;
 			goto die4;
@@ -336,16 +372,103 @@ done:
 	return ret;
 }
 
-/* the XBee serial Rx function */
+/* find the conType that handles a received frame, and give it the frame - 'buf' is always consumed
+   if 'direct' is set, then the pktHandler is run by the caller instead of the pktHandler's own thread */
+int xbee_rxDispatch(struct xbee *xbee, struct bufData *buf, int direct) {
+	int ret;
+	int pos;
+	struct xbee_conType *conTypes;
+	
+	conTypes = xbee->mode->conTypes;
+	xbee_trace4(rx_frame, xbee, buf, buf->buf[0], buf->len);
+
+	/* find an initialized conType that can handle this message */
+	for (pos = 0; conTypes[pos].name; pos++) {
+		if (!conTypes[pos].initialized) continue;
+		if (!conTypes[pos].rxEnabled) continue;
+		if (conTypes[pos].rxID != buf->buf[0]) continue;
+		break;
+	}
+	if (!conTypes[pos].name) {
+		xbee_log(1,"Unknown packet received / no packet handler (0x%02X)", buf->buf[0]);
+		ret = XBEE_EINVAL;
+		goto die1;
+	}
+	if (!conTypes[pos].rxHandler) {
+		xbee_log(1,"Packet recieved, but not handler is registered (0x%02X)", buf->buf[0]);
+		ret = XBEE_EINVAL;
+		goto die1;
+	}
+	xbee_log(2,"Received %d byte packet (0x%02X - '%s') @ %p", buf->len, buf->buf[0], conTypes[pos].name, buf);
+	
+	if (direct) {
+		xbee_rxHandle(xbee, conTypes[pos].rxHandler, buf);
+		return XBEE_ENONE;
+	}
+	
+	if ((ret = _xbee_rxHandler(xbee, conTypes[pos].rxHandler, buf)) != 0) {
+		xbee_log(1,"Failed to handle packet... _xbee_rxHandler() returned %d", ret);
+		goto die1;
+	}
+	
+	return XBEE_ENONE;
+die1:
+	free(buf);
+	return ret;
+}
+
+/* a frame was bad - with API mode 1 nothing stops a 0x7E turning up inside a frame, so the next frame may already have
+   started in the bytes that were taken for this one. everything from the first 0x7E after the start delimiter (in the
+   length, data or checksum) is put back, to be parsed again before anything else is read
+   'len' is the frame's length field, and 'data' the 'dataLen' bytes that followed it */
+void xbee_rxRescan(struct xbee *xbee, int len, unsigned char *data, int dataLen) {
+	struct xbee_device *device = &xbee->device;
+	unsigned char frame[XBEE_MAX_PACKETLEN + 2];
+	unsigned char *p;
+	int remaining;
+	int n;
+	
+	if (dataLen > XBEE_MAX_PACKETLEN) dataLen = XBEE_MAX_PACKETLEN;
+	frame[0] = (len >> 8) & 0xFF;
+	frame[1] = len & 0xFF;
+	if (dataLen > 0) memcpy(&frame[2], data, dataLen);
+	n = dataLen + 2;
+	if ((p = memchr(frame, 0x7E, n)) == NULL) return;
+	n -= p - frame;
+	
+	/* these bytes go in front of any that are still waiting - if there are any, the whole frame came from them, so it fits */
+	remaining = device->rxRescanLen - device->rxRescanPos;
+	if (n + remaining > sizeof(device->rxRescan)) {
+		xbee_log(1,"Unable to parse %d bytes again, they have been discarded", n);
+		return;
+	}
+	memmove(&device->rxRescan[n], &device->rxRescan[device->rxRescanPos], remaining);
+	memcpy(device->rxRescan, p, n);
+	device->rxRescanLen = n + remaining;
+	device->rxRescanPos = 0;
+	xbee_log(3,"Parsing %d bytes of the bad frame again", n);
+}
+
+/* the XBee serial Rx function
+   bad frames (an impossible length, or a bad checksum) are counted, and the search for the next frame carries on */
 int xbee_rxSerialXBee(struct xbee *xbee, struct bufData **buf, int retries) {
 	struct bufData *ibuf;
+	struct timespec back;
+	struct timespec now;
+	int maxRetries;
 	int pos;
 	int len;
+	int got;
 	int ret;
+	int unescaped;
 	unsigned char c;
 	unsigned char chksum;
 
 	ret = XBEE_ENONE;
+	maxRetries = retries;
+	back.tv_sec = 0;
+	/* with API mode 1 nothing is escaped, so a 0x7E inside a frame is just data - only the checksum shows a bad frame */
+	unescaped = (xbee->device.apiMode == 1);
 
 	/* make space to recieve the packet */
 	if ((ibuf = calloc(1, sizeof(struct bufData) + (sizeof(unsigned char) * (XBEE_MAX_PACKETLEN - 1)))) == NULL) {
@@ -364,31 +487,44 @@ int xbee_rxSerialXBee(struct xbee *xbee, struct bufData **buf, int retries) {
 	      n = checksum */
 	for (pos = -3; pos < 0 || (pos < len && pos < XBEE_MAX_PACKETLEN); pos++) {
 	
-		/* get the data, byte by byte */
-		if ((ret = xbee_io_getEscapedByte(xbee, &c)) != 0) {
+		/* get the header byte by byte, and then the data (and checksum) in blocks */
+		if (pos < 0) {
+			ret = unescaped ? xbee_io_getRawByte(xbee, &c) : xbee_io_getEscapedByte(xbee, &c);
+		} else if (unescaped) {
+			ret = xbee_io_getRawBlock(xbee, &ibuf->buf[pos], len - pos, &got);
+		} else {
+			ret = xbee_io_getEscapedBlock(xbee, &ibuf->buf[pos], len - pos, &got);
+		}
+		if (ret != 0) {
 			
 			if (ret == XBEE_EUNESCAPED_START) {
 				if (pos > -3) xbee_log(3,"Unexpected start byte... restarting packet capture");
 				pos = -3; /* reset to the begining */
 				continue;
 			} else if (ret == XBEE_EEOF) {
-				/* EOF seems to occur when USB devices are unplugged */
+				/* EOF seems to occur when USB devices are unplugged - a device that keeps going as soon as it is opened
+				   is given a rest by xbee_rx(), but one that was back for a while starts with a clean slate */
+				if (back.tv_sec) {
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					if ((now.tv_sec - back.tv_sec) * 1000LL + (now.tv_nsec - back.tv_nsec) / 1000000 >= XBEE_IO_RECONNECT_STABLE) {
+						retries = maxRetries;
+					}
+				}
 				if (--retries == 0) {
 					xbee_log(1,"Too many device failures (EOF)");
 					goto die2;
 				}
-				/* try closing and re-opening the device */
-				usleep(100000);
-				/* this will most likely fail (because the device has been removed) */
-				if ((ret = xbee_io_reopen(xbee)) != 0) {
+				/* wait for it to come back, the frame that was being read has gone with it */
+				if ((ret = xbee_io_reconnect(xbee)) != 0) {
 					ret = XBEE_EOPENFAILED;
 					goto die2;
 				}
-				usleep(10000);
+				clock_gettime(CLOCK_MONOTONIC, &back);
+				pos = -4;
 				continue;
 			}
 			/* otherwise there was an unknown error */
-			xbee_perror(1,"xbee_io_getEscapedByte()");
+			xbee_perror(1,"xbee_io_get%s%s()", unescaped ? "Raw" : "Escaped", (pos < 0) ? "Byte" : "Block");
 			ret = XBEE_EIO;
 			goto die2;
 		}
@@ -403,32 +539,42 @@ int xbee_rxSerialXBee(struct xbee *xbee, struct bufData **buf, int retries) {
 				break;
 			case -1:
 				len |= c;                /* length low byte */
+				if (len == 0 || len + 1 > XBEE_MAX_PACKETLEN) {
+					/* that wasn't a start delimiter, look for the next one */
+					xbee_log(1,"Invalid length (%d bytes)... restarting packet capture", len);
+					xbee_statsRxCorrupt(xbee);
+					if (unescaped) xbee_rxRescan(xbee, len, NULL, 0);
+					pos = -4;
+					continue;
+				}
 				ibuf->len = len;
 				len++;
 				chksum = 0;              /* wipe the checksum */
 				break;
 			default:
-				chksum += c;             /* keep track of the checksum */
-				ibuf->buf[pos] = c;      /* pull in the data */
+				chksum += xbee_escapeSum(&ibuf->buf[pos], got); /* keep track of the checksum */
+				pos += got - 1;          /* the data was pulled in by the block read */
+				
+				/* check the checksum (should = 0xFF) */
+				if (pos == len - 1 && chksum != 0xFF) {
+					int i;
+					xbee_log(1,"Invalid checksum detected... %d byte packet discarded", ibuf->len);
+					for (i = 0; i < len; i++) {
+						xbee_log(3,"%3d: 0x%02X",i, ibuf->buf[i]);
+					}
+					xbee_statsRxCorrupt(xbee);
+					if (unescaped) xbee_rxRescan(xbee, ibuf->len, ibuf->buf, len);
+					pos = -4;                /* and look for the next one */
+				}
 		}
 	}
-	
-  /* check the checksum (should = 0xFF) */
-  if ((chksum & 0xFF) != 0xFF) {
-		int i;
-   	xbee_log(1,"Invalid checksum detected... %d byte packet discarded", ibuf->len);
-		for (i = 0; i < len; i++) {
-			xbee_log(1,"%3d: 0x%02X",i, ibuf->buf[i]);
-		}
-		ret = XBEE_EINVAL;
-		goto die2;
-  }
 
 	/* return the buffer */
 	*buf = ibuf;
 	xbee->rxBuf = NULL;
 	goto done;
 die2:
+	xbee->rxBuf = NULL;
 	free(ibuf);
 die1:
 done:
@@ -439,10 +585,8 @@ done:
 int _xbee_rx(struct xbee *xbee) {
 	struct bufData *buf;
 	void *p;
-	int pos;
 	int retries = XBEE_IO_RETRIES;
 	int ret;
-	struct xbee_conType *conTypes;
 	
 	/* check parameters */
 	if (!xbee) return XBEE_ENOXBEE;
@@ -476,32 +620,11 @@ int _xbee_rx(struct xbee *xbee) {
 			ret = XBEE_ENOMODE;
 			goto die2;
 		}
-		conTypes = xbee->mode->conTypes;
-
-		/* find an initialized conType that can handle this message */
-		for (pos = 0; conTypes[pos].name; pos++) {
-			if (!conTypes[pos].initialized) continue;
-			if (!conTypes[pos].rxEnabled) continue;
-			if (conTypes[pos].rxID != buf->buf[0]) continue;
-			break;
-		}
-		if (!conTypes[pos].name) {
-			xbee_log(1,"Unknown packet received / no packet handler (0x%02X)", buf->buf[0]);
-			continue;
-		}
-		if (!conTypes[pos].rxHandler) {
-			xbee_log(1,"Packet recieved, but not handler is registered (0x%02X)", buf->buf[0]);
-			continue;
-		}
-		xbee_log(2,"Received %d byte packet (0x%02X - '%s') @ %p", buf->len, buf->buf[0], conTypes[pos].name, buf);
 		
 		/* try (and ignore failure) to realloc buf to the correct length */
 		if ((p = realloc(buf, sizeof(struct bufData) + (sizeof(unsigned char) * (buf->len - 1)))) != NULL) buf = p;
-
-		if ((ret = _xbee_rxHandler(xbee, conTypes[pos].rxHandler, buf)) != 0) {
-			xbee_log(1,"Failed to handle packet... _xbee_rxHandler() returned %d", ret);
-			free(buf);
-		}
+		
+		xbee_rxDispatch(xbee, buf, 0);
 		
 		/* trigger a new calloc() */
 		buf = NULL;
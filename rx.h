@@ -24,7 +24,11 @@
 #define XBEE_RX_RESTART_DELAY 25
 
 void xbee_triggerCallback(struct xbee *xbee, struct xbee_con *con);
+int xbee_rxDeliver(struct xbee *xbee, struct xbee_con *rxCon, struct xbee_pkt *pkt);
+void xbee_rxHandle(struct xbee *xbee, struct xbee_pktHandler *pktHandler, struct bufData *buf);
+int xbee_rxDispatch(struct xbee *xbee, struct bufData *buf, int direct);
 int xbee_rx(struct xbee *xbee);
 int xbee_rxSerialXBee(struct xbee *xbee, struct bufData **buf, int retries);
+void xbee_rxRescan(struct xbee *xbee, int len, unsigned char *data, int dataLen);
 
 #endif /* __XBEE_RX_H */
@@ -0,0 +1,201 @@
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+#include "stats.h"
+
+/* the counters are updated with atomics, by whichever thread sees the event, and are never locked
+   a snapshot may be taken halfway through an update, but each field is always whole */
+
+/* count a successful read() from the device */
+void xbee_statsRxRead(struct xbee *xbee, int bytes) {
+	__atomic_fetch_add(&xbee->stats.rxReads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&xbee->stats.rxBytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* record a round trip, 'start' is when the FrameID was given out */
+void xbee_statsRtt(struct xbee *xbee, struct timespec *start) {
+	struct timespec now;
+	long long us;
+	unsigned int rtt;
+	unsigned int old;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+	if (us < 0) us = 0;
+	rtt = (us > 0xFFFFFFFF) ? 0xFFFFFFFF : us;
+	
+	__atomic_store_n(&xbee->stats.rttLast, rtt, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&xbee->stats.rttTotal, rtt, __ATOMIC_RELAXED);
+	
+	/* rttMin is 0 until the first round trip */
+	old = __atomic_load_n(&xbee->stats.rttMin, __ATOMIC_RELAXED);
+	while ((old == 0 || rtt < old) &&
+	       !__atomic_compare_exchange_n(&xbee->stats.rttMin, &old, rtt ? rtt : 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	old = __atomic_load_n(&xbee->stats.rttMax, __ATOMIC_RELAXED);
+	while (rtt > old &&
+	       !__atomic_compare_exchange_n(&xbee->stats.rttMax, &old, rtt, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	
+	/* count it last, so that a snapshot never has a count without the times */
+	__atomic_fetch_add(&xbee->stats.rttCount, 1, __ATOMIC_RELEASE);
+}
+
+/* count frames that have been written to the device */
+void xbee_statsTx(struct xbee *xbee, int frames, int bytes) {
+	__atomic_fetch_add(&xbee->stats.txFrames, frames, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&xbee->stats.txBytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* record a wait for the device to accept more data, 'start' is when the write() said it was full */
+void xbee_statsTxStall(struct xbee *xbee, struct timespec *start) {
+	struct timespec now;
+	long long us;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+	if (us < 0) us = 0;
+	
+	__atomic_fetch_add(&xbee->stats.txStalls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&xbee->stats.txStallTime, us, __ATOMIC_RELAXED);
+}
+
+/* count a frame that was dropped because it missed its deadline */
+void xbee_statsTxExpired(struct xbee *xbee) {
+	__atomic_fetch_add(&xbee->stats.txExpired, 1, __ATOMIC_RELAXED);
+}
+
+/* count a frame from the device that was discarded */
+void xbee_statsRxCorrupt(struct xbee *xbee) {
+	__atomic_fetch_add(&xbee->stats.rxCorrupt, 1, __ATOMIC_RELAXED);
+}
+
+/* record the device being opened again, 'start' is when it went */
+void xbee_statsReconnect(struct xbee *xbee, struct timespec *start) {
+	struct timespec now;
+	long long ms;
+	unsigned int gap;
+	unsigned int old;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - start->tv_sec) * 1000LL + (now.tv_nsec - start->tv_nsec) / 1000000;
+	if (ms < 0) ms = 0;
+	gap = (ms > 0xFFFFFFFF) ? 0xFFFFFFFF : ms;
+	
+	__atomic_store_n(&xbee->stats.reconnectLast, gap, __ATOMIC_RELAXED);
+	old = __atomic_load_n(&xbee->stats.reconnectMax, __ATOMIC_RELAXED);
+	while (gap > old &&
+	       !__atomic_compare_exchange_n(&xbee->stats.reconnectMax, &old, gap, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&xbee->stats.reconnects, 1, __ATOMIC_RELAXED);
+}
+
+/* record a monitored thread being restarted, 'exited' is when it went */
+void xbee_statsThreadRestart(struct xbee *xbee, struct timespec *exited) {
+	struct timespec now;
+	long long us;
+	unsigned int gap;
+	unsigned int old;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - exited->tv_sec) * 1000000LL + (now.tv_nsec - exited->tv_nsec) / 1000;
+	if (us < 0) us = 0;
+	gap = (us > 0xFFFFFFFF) ? 0xFFFFFFFF : us;
+	
+	__atomic_store_n(&xbee->stats.threadRestartLast, gap, __ATOMIC_RELAXED);
+	old = __atomic_load_n(&xbee->stats.threadRestartMax, __ATOMIC_RELAXED);
+	while (gap > old &&
+	       !__atomic_compare_exchange_n(&xbee->stats.threadRestartMax, &old, gap, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&xbee->stats.threadRestarts, 1, __ATOMIC_RELAXED);
+}
+
+/* ######################################################################### */
+
+EXPORT int xbee_statsGet(struct xbee *xbee, struct xbee_stats *stats) {
+	/* check parameters */
+  if (!xbee) {
+    if (!xbee_default) return XBEE_ENOXBEE;
+    xbee = xbee_default;
+  }
+  if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
+	if (!stats) return XBEE_EMISSINGPARAM;
+	
+	memset(stats, 0, sizeof(*stats));
+	
+	stats->rttCount = __atomic_load_n(&xbee->stats.rttCount, __ATOMIC_ACQUIRE);
+	stats->rttLast = __atomic_load_n(&xbee->stats.rttLast, __ATOMIC_RELAXED);
+	stats->rttMin = __atomic_load_n(&xbee->stats.rttMin, __ATOMIC_RELAXED);
+	stats->rttMax = __atomic_load_n(&xbee->stats.rttMax, __ATOMIC_RELAXED);
+	if (stats->rttCount) stats->rttAvg = __atomic_load_n(&xbee->stats.rttTotal, __ATOMIC_RELAXED) / stats->rttCount;
+	
+	stats->rxReads = __atomic_load_n(&xbee->stats.rxReads, __ATOMIC_RELAXED);
+	stats->rxBytes = __atomic_load_n(&xbee->stats.rxBytes, __ATOMIC_RELAXED);
+	
+	stats->txFrames = __atomic_load_n(&xbee->stats.txFrames, __ATOMIC_RELAXED);
+	stats->txBytes = __atomic_load_n(&xbee->stats.txBytes, __ATOMIC_RELAXED);
+	stats->txStalls = __atomic_load_n(&xbee->stats.txStalls, __ATOMIC_RELAXED);
+	stats->txStallTime = __atomic_load_n(&xbee->stats.txStallTime, __ATOMIC_RELAXED);
+	stats->txExpired = __atomic_load_n(&xbee->stats.txExpired, __ATOMIC_RELAXED);
+	
+	stats->rxCorrupt = __atomic_load_n(&xbee->stats.rxCorrupt, __ATOMIC_RELAXED);
+	
+	stats->reconnects = __atomic_load_n(&xbee->stats.reconnects, __ATOMIC_RELAXED);
+	stats->reconnectLast = __atomic_load_n(&xbee->stats.reconnectLast, __ATOMIC_RELAXED);
+	stats->reconnectMax = __atomic_load_n(&xbee->stats.reconnectMax, __ATOMIC_RELAXED);
+	stats->threadRestarts = __atomic_load_n(&xbee->stats.threadRestarts, __ATOMIC_RELAXED);
+	stats->threadRestartLast = __atomic_load_n(&xbee->stats.threadRestartLast, __ATOMIC_RELAXED);
+	stats->threadRestartMax = __atomic_load_n(&xbee->stats.threadRestartMax, __ATOMIC_RELAXED);
+	
+	return XBEE_ENONE;
+}
+
+EXPORT int xbee_statsReset(struct xbee *xbee) {
+	/* check parameters */
+  if (!xbee) {
+    if (!xbee_default) return XBEE_ENOXBEE;
+    xbee = xbee_default;
+  }
+  if (!xbee_validate(xbee)) return XBEE_ENOXBEE;
+	
+	__atomic_store_n(&xbee->stats.rttCount, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&xbee->stats.rttTotal, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.rttLast, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.rttMin, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.rttMax, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.rxReads, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.rxBytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.txFrames, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.txBytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.txStalls, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.txStallTime, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.txExpired, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.rxCorrupt, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.reconnects, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.reconnectLast, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.reconnectMax, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.threadRestarts, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.threadRestartLast, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&xbee->stats.threadRestartMax, 0, __ATOMIC_RELAXED);
+	
+	return XBEE_ENONE;
+}
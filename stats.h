@@ -0,0 +1,36 @@
+#ifndef __XBEE_STATS_H
+#define __XBEE_STATS_H
+
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <time.h>
+
+void xbee_statsRxRead(struct xbee *xbee, int bytes);
+void xbee_statsRtt(struct xbee *xbee, struct timespec *start);
+void xbee_statsTx(struct xbee *xbee, int frames, int bytes);
+void xbee_statsTxStall(struct xbee *xbee, struct timespec *start);
+void xbee_statsTxExpired(struct xbee *xbee);
+void xbee_statsRxCorrupt(struct xbee *xbee);
+void xbee_statsReconnect(struct xbee *xbee, struct timespec *start);
+void xbee_statsThreadRestart(struct xbee *xbee, struct timespec *exited);
+
+#endif /* __XBEE_STATS_H */
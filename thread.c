@@ -21,35 +21,75 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "internal.h"
 #include "thread.h"
 #include "log.h"
 #include "ll.h"
-#include "errno.h"
+#include "stats.h"
 
 struct threadInfo {
+	struct xbee *xbee;
 	char *funcName;
 	void *(*start_routine)(void *);
 	void *arg;
 	xsys_thread *thread; /* this points to the original xsys_thread */
 	unsigned int restartCount;
-	int running;
+	int running; /* the thread has been started, and hasn't been joined yet - protected by threadMutex */
+	int exited;  /* the thread has gone, set by the thread itself (see xbee_threadExited()) */
+	struct timespec startTime;
+	struct timespec exitTime;
 };
 
-/* the thread monitoring thread... hmm */
+/* a monitored thread is going, however that happens (returning, or being cancelled) - let the monitor know straight away */
+static void xbee_threadExited(struct threadInfo *info) {
+	clock_gettime(CLOCK_MONOTONIC, &info->exitTime);
+	__atomic_store_n(&info->exited, 1, __ATOMIC_RELEASE);
+	xsys_sem_post(&info->xbee->semMonitor);
+}
+
+/* every monitored thread runs in here */
+static void *xbee_threadWrapper(struct threadInfo *info) {
+	void *ret;
+	
+	xsys_thread_cleanupPush((void (*)(void *))xbee_threadExited, info);
+	ret = info->start_routine(info->arg);
+	xsys_thread_cleanupPop(1);
+	
+	return ret;
+}
+
+/* start (or restart) a monitored thread, threadMutex must be held */
+static int xbee_threadStart(struct threadInfo *info) {
+	clock_gettime(CLOCK_MONOTONIC, &info->startTime);
+	info->exited = 0;
+	if (xsys_thread_create(info->thread, (void *(*)(void *))xbee_threadWrapper, info)) return XBEE_ETHREAD;
+	info->running = 1;
+	return XBEE_ENONE;
+}
+
+/* the thread monitoring thread... hmm
+   it sleeps until a monitored thread goes, and then restarts it - a thread that didn't last XBEE_THREAD_HOLDOFF is
+   restarted once that long has passed since it was started, so that one that dies straight away doesn't spin */
 void xbee_threadMonitor(struct xbee *xbee) {
 	struct threadInfo *info;
+	struct timespec now;
+	long long wait;
+	long long left;
 	void *tRet;
-	int ret;
+	int oldState;
 	int count, joined, restarted;
 	
-	/* detach self, so that resources are free'd as soon as we return */
-	xsys_thread_detach_self();
-	
-	while (xbee->running) {
-		/* wait for 10 seconds, unless prodded */
-		xsys_sem_timedwait(&xbee->semMonitor, 10, 0);
+	wait = -1;
+	for (;;) {
+		/* wait to be prodded by a thread going (or xbee_shutdown()), or for a restart that was held off */
+		if (wait == -1) {
+			xsys_sem_wait(&xbee->semMonitor);
+		} else {
+			xsys_sem_timedwait(&xbee->semMonitor, wait / 1000000000, wait % 1000000000);
+		}
+		if (!xbee->running) break;
 		
 		xbee_log(15,"Scanning for dead threads...");
 		
@@ -57,57 +97,69 @@ void xbee_threadMonitor(struct xbee *xbee) {
 		count = 0;
 		joined = 0;
 		restarted = 0;
+		wait = -1;
+		
+		/* xbee_threadStopMonitored() waits for the threadMutex, so this mustn't be cancelled while holding it */
+		xsys_thread_cancelDisable(&oldState);
+		xsys_mutex_lock(&xbee->threadMutex);
 		
 		/* iterate through each monitored thread */
 		for (info = NULL; (info = ll_get_next(&xbee->threadList, info)) != NULL;) {
-			/* if thread is supposed to be running */
+			/* if the thread has gone, join with it */
+			if (info->running && __atomic_load_n(&info->exited, __ATOMIC_ACQUIRE)) {
+				xsys_thread_join(*info->thread, &tRet);
+				info->running = 0;
+				xbee_log(15,"Thread 0x%X died (%s), it returned %p", info->thread, info->funcName, tRet);
+				joined++;
+			}
 			if (info->running) {
-#warning TODO - find an alternative to pthread_tryjoin_np()
-				/* try to join with the thread */
-				if ((ret = xsys_thread_tryjoin(*info->thread, &tRet)) == 0) {
-					/* apparently it died! mark it dead, and report it */
-					info->running = 0;
-					xbee_log(15,"Thread 0x%X died (%s), it returned 0x%X", info->thread, info->funcName, ret);
-					joined++;
-				} else {
-					/* if the join failed, then find out why (to the best of our ability) and log the details */
-					if (ret == EBUSY) {
-						xbee_log(10,"xsys_thread_tryjoin(): 0x%X (%s) EBUSY", info->thread, info->funcName);
-					} else if (ret == ETIMEDOUT) {
-						xbee_log(10,"xsys_thread_tryjoin(): 0x%X (%s) ETIMEDOUT", info->thread, info->funcName);
-					} else if (ret == EINVAL) {
-						xbee_log(10,"xsys_thread_tryjoin(): 0x%X (%s) EINVAL", info->thread, info->funcName);
-					} else {
-						xbee_log(10,"xsys_thread_tryjoin(): 0x%X (%s) unknown (%d)", info->thread, info->funcName, ret);
-					}
-					count++;
-				}
+				count++;
+				continue;
 			}
 			
-			/* we need to re-test info->running, because it may have just been marked dead */
-			if (!info->running) {
-				/* try to restart the thread */
-				if (xsys_thread_create(info->thread, info->start_routine, info->arg) == 0) {
-					/* success! keep the stats */
-					restarted++;
-					info->restartCount++;
-					info->running = 1;
-				} else {
-					/* otherwise log the info */
-					xbee_log(10,"Failed to restart thread (%s)...\n", info->funcName);
-				}
+			/* don't restart a thread that has only just started */
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left = (info->startTime.tv_sec - now.tv_sec) * 1000000000LL + (info->startTime.tv_nsec - now.tv_nsec) +
+			       XBEE_THREAD_HOLDOFF * 1000000LL;
+			if (left > 0) {
+				if (wait == -1 || left < wait) wait = left;
+				continue;
+			}
+			
+			/* try to restart the thread */
+			if (xbee_threadStart(info) == 0) {
+				/* success! keep the stats */
+				restarted++;
+				info->restartCount++;
+				xbee_statsThreadRestart(xbee, &info->exitTime);
+			} else {
+				/* otherwise log the info, and try again later */
+				xbee_log(10,"Failed to restart thread (%s)...\n", info->funcName);
+				if (wait == -1 || XBEE_THREAD_HOLDOFF * 1000000LL < wait) wait = XBEE_THREAD_HOLDOFF * 1000000LL;
 			}
 		}
 		
+		xsys_mutex_unlock(&xbee->threadMutex);
+		xsys_thread_cancelRestore(oldState);
+		
 		/* log the stats */
 		xbee_log(15,"Scan complete! joined/restarted/remain %d/%d/%d threads", joined, restarted, count);
 	}
 }
 
+/* stop the thread monitor - xbee->running must already be 0, the monitored threads are left alone */
+void xbee_threadMonitorStop(struct xbee *xbee) {
+	if (!xbee->threadMonitorStarted) return;
+	xsys_sem_post(&xbee->semMonitor);
+	xsys_thread_join(xbee->threadMonitor, NULL);
+	xbee->threadMonitorStarted = 0;
+}
+
 /* start a monitored thread. If it dies, it will be restarted
    the thread identification information will be stored in the thread parameter */
 int _xbee_threadStartMonitored(struct xbee *xbee, xsys_thread *thread, void*(*start_routine)(void*), void *arg, char *funcName) {
 	struct threadInfo *tinfo;
+	int ret;
 	
 	/* check parameters */
 	if (!xbee) {
@@ -139,29 +191,51 @@ int _xbee_threadStartMonitored(struct xbee *xbee, xsys_thread *thread, void*(*st
 	}
 	
 	/* setup all the details */
+	tinfo->xbee = xbee;
 	tinfo->funcName = funcName;
 	tinfo->start_routine = start_routine;
 	tinfo->arg = arg;
 	tinfo->thread = thread;
 	
-	/* add it to the threadList */
-	if (ll_add_tail(&xbee->threadList, tinfo)) {
-		return XBEE_ELINKEDLIST;
+	/* start the monitor if this is the first thread - an instance on the reactor may never need it */
+	if (!__atomic_exchange_n(&xbee->threadMonitorStarted, 1, __ATOMIC_ACQ_REL)) {
+		if (xsys_thread_create(&xbee->threadMonitor, (void *(*)(void *))xbee_threadMonitor, xbee)) {
+			xbee_perror(1,"xsys_thread_create(threadMonitor)");
+			xbee->threadMonitorStarted = 0;
+			free(tinfo);
+			return XBEE_ETHREAD;
+		}
 	}
 	
-	/* and prod the monitor thread (who will start the thread for us! */
-	xsys_sem_post(&xbee->semMonitor);
+	/* start the thread here, so that it exists as soon as we return (the monitor only restarts it) */
+	xsys_mutex_lock(&xbee->threadMutex);
+	if (ll_add_tail(&xbee->threadList, tinfo)) {
+		ret = XBEE_ELINKEDLIST;
+		goto die1;
+	}
+	if ((ret = xbee_threadStart(tinfo)) != 0) {
+		ll_ext_item(&xbee->threadList, tinfo);
+		goto die1;
+	}
+	xsys_mutex_unlock(&xbee->threadMutex);
 	
 	return XBEE_ENONE;
+die1:
+	xsys_mutex_unlock(&xbee->threadMutex);
+	free(tinfo);
+	return ret;
 }
 
-/* kill a thread that is being monitored */
-static int _xbee_threadKillMonitored(struct threadInfo *info, int *restartCount, void **retval) {
+/* kill a thread that is being monitored - or if 'cancel' is clear, wait for it to return by itself */
+static int _xbee_threadKillMonitored(struct threadInfo *info, int *restartCount, void **retval, int cancel) {
 	if (info == NULL) return XBEE_EINVAL;
 	
-	/* cancel the thread, and join with it */
-	xsys_thread_cancel(*(info->thread));
-	xsys_thread_join(*(info->thread), retval);
+	/* cancel the thread, and join with it - unless it went, and couldn't be restarted */
+	if (info->running) {
+		if (cancel) xsys_thread_cancel(*(info->thread));
+		xsys_thread_join(*(info->thread), retval);
+		info->running = 0;
+	}
 	
 	/* if the restart count was requested, then give it */
 	if (restartCount) *restartCount = info->restartCount;
@@ -173,12 +247,12 @@ static int _xbee_threadKillMonitored(struct threadInfo *info, int *restartCount,
 }
 /* kill a thread (for use with ll_destroy() */
 void xbee_threadKillMonitored(void *info) {
-	_xbee_threadKillMonitored(info, NULL, NULL);
+	_xbee_threadKillMonitored(info, NULL, NULL, 1);
 }
 
-/* cleanly stop a monitored thread */
-int xbee_threadStopMonitored(struct xbee *xbee, xsys_thread *thread, int *restartCount, void **retval) {
+static int _xbee_threadStopMonitored(struct xbee *xbee, xsys_thread *thread, int *restartCount, void **retval, int cancel) {
 	struct threadInfo *tinfo;
+	int ret;
 	
 	/* check parameters */
 	if (!xbee) {
@@ -198,9 +272,23 @@ int xbee_threadStopMonitored(struct xbee *xbee, xsys_thread *thread, int *restar
 	/* if it wasn't found, then return an error */
 	if (tinfo == NULL) return XBEE_EINVAL;
 	
-	/* extract the thread block */
-	if (ll_ext_item(&xbee->threadList, tinfo)) return XBEE_ELINKEDLIST;
+	/* extract the thread block, once the monitor has let go of it */
+	xsys_mutex_lock(&xbee->threadMutex);
+	ret = ll_ext_item(&xbee->threadList, tinfo);
+	xsys_mutex_unlock(&xbee->threadMutex);
+	if (ret) return XBEE_ELINKEDLIST;
 	
 	/* and kill it */
-	return _xbee_threadKillMonitored(tinfo, restartCount, retval);
+	return _xbee_threadKillMonitored(tinfo, restartCount, retval, cancel);
+}
+
+/* cleanly stop a monitored thread */
+int xbee_threadStopMonitored(struct xbee *xbee, xsys_thread *thread, int *restartCount, void **retval) {
+	return _xbee_threadStopMonitored(xbee, thread, restartCount, retval, 1);
+}
+
+/* stop monitoring a thread that has been told to return, and join with it - for a thread that mustn't be cancelled
+   (e.g. it holds locks that others need). if it goes before the monitor lets go, it is restarted, and must return again */
+int xbee_threadJoinMonitored(struct xbee *xbee, xsys_thread *thread, int *restartCount, void **retval) {
+	return _xbee_threadStopMonitored(xbee, thread, restartCount, retval, 0);
 }
@@ -21,7 +21,11 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* a thread that dies is restarted once it has been running for this long (ms) */
+#define XBEE_THREAD_HOLDOFF 100
+
 void xbee_threadMonitor(struct xbee *xbee);
+void xbee_threadMonitorStop(struct xbee *xbee);
 
 #define xbee_threadStartMonitored(a,b,c,d) \
 	_xbee_threadStartMonitored((a),(b),(void*(*)(void*))(c),(void*)(d),(#c))
@@ -29,6 +33,7 @@ int _xbee_threadStartMonitored(struct xbee *xbee, xsys_thread *thread, void*(*st
 
 void xbee_threadKillMonitored(void *info);
 int xbee_threadStopMonitored(struct xbee *xbee, xsys_thread *thread, int *restartCount, void **retval);
+int xbee_threadJoinMonitored(struct xbee *xbee, xsys_thread *thread, int *restartCount, void **retval);
 
 #endif /* __XBEE_JOIN_H */
 
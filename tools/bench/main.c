@@ -0,0 +1,509 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* xbee_bench - end-to-end throughput and latency benchmark
+
+   this drives a libxbee instance against the pty simulator in tools/sim, once
+   for each mode (series1 & series2), and reports the following as CSV on
+   stdout - one 'mode,metric,value,unit' record per line:
+
+     rx_fps              frames/s delivered to a callback, simulator flooding
+     tx_fps              frames/s written by xbee_conTx() without waiting for ACKs
+     ack_rtt             ACKed transmissions per second (waitForAck = 1, one at a time)
+     cb_latency_p50/p90/p99/max
+                         time from the simulator writing a frame, to the callback
+                         running, at a fixed rate that the host can keep up with
+     cpu_per_rx_frame    user + system CPU time per received frame
+     cpu_per_tx_frame    user + system CPU time per transmitted frame
+     allocs_per_rx_frame malloc() / calloc() / realloc() calls per received frame
+     allocs_per_tx_frame malloc() / calloc() / realloc() calls per transmitted frame
+
+   allocations are counted by linking with -Wl,--wrap=malloc,calloc,realloc
+   (see the makefile), so only allocations made by libxbee and this program are
+   counted, not those made inside libc itself */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "xbee.h"
+
+#define BENCH_LATENCY_RATE "2000"
+
+struct bench_mode {
+	char *name;     /* libxbee mode name */
+	char *simMode;  /* xbee_sim -m argument */
+	char *inject;   /* xbee_sim -i argument, without the rate */
+	char *dataType; /* connection type that receives the injected data */
+};
+
+static struct bench_mode modes[] = {
+	{ "series1", "1", "0x80", "64-bit Data" },
+	{ "series2", "2", "0x90", "Data" },
+	{ NULL, NULL, NULL, NULL },
+};
+
+static char *simPath = "../sim/xbee_sim";
+static int frameCount = 20000;
+static int verbose = 0;
+
+/* ######################################################################### */
+/* allocation counting */
+
+static volatile unsigned long allocCount = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	__sync_fetch_and_add(&allocCount, 1);
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	__sync_fetch_and_add(&allocCount, 1);
+	return __real_calloc(nmemb, size);
+}
+void *__wrap_realloc(void *ptr, size_t size) {
+	__sync_fetch_and_add(&allocCount, 1);
+	return __real_realloc(ptr, size);
+}
+
+/* ######################################################################### */
+
+static long long bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+static long long bench_cpu(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ((long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL) + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void bench_report(struct bench_mode *mode, char *metric, double value, char *unit) {
+	printf("%s,%s,%.3f,%s\n", mode->name, metric, value, unit);
+	fflush(stdout);
+}
+
+/* ######################################################################### */
+/* simulator control */
+
+struct bench_sim {
+	pid_t pid;
+	char pty[256];
+};
+
+/* start the simulator, the extra arguments are NULL terminated */
+static int bench_simStart(struct bench_sim *sim, struct bench_mode *mode, ...) {
+	char *argv[32];
+	int pfd[2];
+	int argc;
+	va_list ap;
+	FILE *f;
+	int l;
+
+	argc = 0;
+	argv[argc++] = simPath;
+	argv[argc++] = "-m";
+	argv[argc++] = mode->simMode;
+	va_start(ap, mode);
+	while (argc < 31 && (argv[argc] = va_arg(ap, char *)) != NULL) argc++;
+	va_end(ap);
+	argv[argc] = NULL;
+
+	if (pipe(pfd)) {
+		perror("pipe()");
+		return -1;
+	}
+	if ((sim->pid = fork()) == -1) {
+		perror("fork()");
+		return -1;
+	}
+	if (sim->pid == 0) {
+		dup2(pfd[1], 1);
+		close(pfd[0]);
+		close(pfd[1]);
+		if (!verbose) freopen("/dev/null", "w", stderr);
+		execv(simPath, argv);
+		perror("execv()");
+		_exit(1);
+	}
+	close(pfd[1]);
+
+	/* the simulator prints the path of the pty once it is ready */
+	f = fdopen(pfd[0], "r");
+	if (!fgets(sim->pty, sizeof(sim->pty), f)) {
+		fprintf(stderr, "xbee_bench: failed to start '%s'\n", simPath);
+		fclose(f);
+		waitpid(sim->pid, NULL, 0);
+		return -1;
+	}
+	fclose(f);
+	if ((l = strlen(sim->pty)) > 0 && sim->pty[l - 1] == '\n') sim->pty[l - 1] = '\0';
+
+	return 0;
+}
+
+static void bench_simStop(struct bench_sim *sim) {
+	kill(sim->pid, SIGTERM);
+	waitpid(sim->pid, NULL, 0);
+}
+
+/* ######################################################################### */
+/* libxbee setup */
+
+struct bench_rx {
+	sem_t done;
+	int expected;
+	volatile int count;
+	long long lastRx;
+	long long *latency; /* nanoseconds */
+};
+
+static void bench_rxCallback(struct xbee *xbee, struct xbee_con *con, struct xbee_pkt **pkt, void **userData) {
+	struct bench_rx *rx = *userData;
+	long long now, ts;
+	int i;
+
+	now = bench_now();
+
+	if (rx->latency && (*pkt)->datalen >= 12 && rx->count < rx->expected) {
+		for (ts = 0, i = 4; i < 12; i++) {
+			ts = (ts << 8) | (*pkt)->data[i];
+		}
+		rx->latency[rx->count] = now - ts;
+	}
+
+	rx->lastRx = now;
+	if (++rx->count == rx->expected) sem_post(&rx->done);
+}
+
+static int bench_setup(struct bench_sim *sim, struct bench_mode *mode, struct xbee **retXbee, struct xbee_con **atCon, struct xbee_con **dataCon, void *userData) {
+	struct xbee *xbee;
+	struct xbee_conAddress addr;
+	struct xbee_conOptions opts;
+	unsigned char conType;
+	int ret;
+
+	if ((ret = xbee_setup(sim->pty, 115200, &xbee)) != 0) {
+		fprintf(stderr, "xbee_bench: xbee_setup() failed (%d)\n", ret);
+		return -1;
+	}
+	if ((ret = xbee_modeSet(xbee, mode->name)) != 0) {
+		fprintf(stderr, "xbee_bench: xbee_modeSet() failed (%d)\n", ret);
+		goto die;
+	}
+
+	/* a local AT connection that waits for its response, used for synchronization */
+	memset(&addr, 0, sizeof(addr));
+	if ((ret = xbee_conTypeIdFromName(xbee, "Local AT", &conType)) != 0) goto die;
+	if ((ret = xbee_conNew(xbee, atCon, conType, &addr, NULL)) != 0) goto die;
+	xbee_conOptions(xbee, *atCon, &opts, NULL);
+	opts.waitForAck = 1;
+	xbee_conOptions(xbee, *atCon, NULL, &opts);
+
+	/* the data connection, addressed to the simulator's remote node */
+	addr.addr64_enabled = 1;
+	memcpy(addr.addr64, "\x00\x13\xA2\x00\x40\x00\x00\x01", 8);
+	if (!strcmp(mode->name, "series2")) {
+		addr.addr16_enabled = 1;
+		addr.addr16[0] = 0xFF;
+		addr.addr16[1] = 0xFE;
+	}
+	if ((ret = xbee_conTypeIdFromName(xbee, mode->dataType, &conType)) != 0) goto die;
+	if ((ret = xbee_conNew(xbee, dataCon, conType, &addr, userData)) != 0) goto die;
+
+	*retXbee = xbee;
+	return 0;
+die:
+	fprintf(stderr, "xbee_bench: setup failed (%d)\n", ret);
+	xbee_shutdown(xbee);
+	return -1;
+}
+
+/* send a local AT command and wait for its response
+   the simulator processes frames in order, so this completes once every prior frame has been handled */
+static int bench_sync(struct xbee *xbee, struct xbee_con *atCon) {
+	struct xbee_pkt *pkt;
+	long long deadline;
+	int ret;
+
+	/* if there is a lot queued, then waiting for the ACK may time out - the response will still arrive */
+	if ((ret = xbee_conTx(xbee, atCon, "NI")) != 0 && ret != XBEE_ETIMEOUT) return ret;
+	deadline = bench_now() + (60 * 1000000000LL);
+	while (bench_now() < deadline) {
+		if ((pkt = xbee_conRx(xbee, atCon)) != NULL) {
+			xbee_pktFree(pkt);
+			return 0;
+		}
+		usleep(100);
+	}
+	return -1;
+}
+
+static int bench_wait(struct bench_rx *rx, int seconds) {
+	struct timespec to;
+	clock_gettime(CLOCK_REALTIME, &to);
+	to.tv_sec += seconds;
+	while (sem_timedwait(&rx->done, &to) != 0) {
+		if (errno != EINTR) return -1;
+	}
+	return 0;
+}
+
+/* ######################################################################### */
+/* the benchmarks */
+
+static int bench_rxThroughput(struct bench_mode *mode) {
+	struct bench_sim sim;
+	struct bench_rx rx;
+	struct xbee *xbee;
+	struct xbee_con *atCon, *dataCon;
+	long long t0, c0;
+	unsigned long a0;
+	char count[16];
+	char inject[32];
+	int ret = -1;
+
+	snprintf(count, sizeof(count), "%d", frameCount);
+	snprintf(inject, sizeof(inject), "%s:0", mode->inject);
+	if (bench_simStart(&sim, mode, "-W", "-n", count, "-i", inject, NULL)) return -1;
+
+	memset(&rx, 0, sizeof(rx));
+	sem_init(&rx.done, 0, 0);
+	rx.expected = frameCount;
+
+	if (bench_setup(&sim, mode, &xbee, &atCon, &dataCon, &rx)) goto die1;
+	xbee_conAttachCallback(xbee, dataCon, bench_rxCallback, NULL);
+
+	/* the first frame from the host starts the flood */
+	c0 = bench_cpu();
+	a0 = allocCount;
+	t0 = bench_now();
+	bench_sync(xbee, atCon);
+
+	if (bench_wait(&rx, 60)) {
+		fprintf(stderr, "xbee_bench: %s: only received %d of %d frames\n", mode->name, rx.count, rx.expected);
+	}
+	if (rx.count > 0) {
+		bench_report(mode, "rx_fps", rx.count / ((rx.lastRx - t0) / 1e9), "frames/s");
+		bench_report(mode, "cpu_per_rx_frame", (double)(bench_cpu() - c0) / rx.count, "us");
+		bench_report(mode, "allocs_per_rx_frame", (double)(allocCount - a0) / rx.count, "allocs");
+		ret = 0;
+	}
+
+	xbee_shutdown(xbee);
+die1:
+	bench_simStop(&sim);
+	sem_destroy(&rx.done);
+	return ret;
+}
+
+static int bench_cmpLatency(const void *a, const void *b) {
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static int bench_rxLatency(struct bench_mode *mode) {
+	struct bench_sim sim;
+	struct bench_rx rx;
+	struct xbee *xbee;
+	struct xbee_con *atCon, *dataCon;
+	char count[16];
+	char inject[32];
+	int ret = -1;
+	int n;
+
+	n = frameCount / 5;
+	if (n < 100) n = 100;
+
+	snprintf(count, sizeof(count), "%d", n);
+	snprintf(inject, sizeof(inject), "%s:%s", mode->inject, BENCH_LATENCY_RATE);
+	if (bench_simStart(&sim, mode, "-W", "-n", count, "-i", inject, NULL)) return -1;
+
+	memset(&rx, 0, sizeof(rx));
+	sem_init(&rx.done, 0, 0);
+	rx.expected = n;
+	if ((rx.latency = calloc(n, sizeof(*rx.latency))) == NULL) goto die1;
+
+	if (bench_setup(&sim, mode, &xbee, &atCon, &dataCon, &rx)) goto die2;
+	xbee_conAttachCallback(xbee, dataCon, bench_rxCallback, NULL);
+
+	bench_sync(xbee, atCon);
+	if (bench_wait(&rx, 60)) {
+		fprintf(stderr, "xbee_bench: %s: only received %d of %d frames\n", mode->name, rx.count, rx.expected);
+	}
+	if (rx.count > 0) {
+		n = rx.count;
+		qsort(rx.latency, n, sizeof(*rx.latency), bench_cmpLatency);
+		bench_report(mode, "cb_latency_p50", rx.latency[(n * 50) / 100] / 1e3, "us");
+		bench_report(mode, "cb_latency_p90", rx.latency[(n * 90) / 100] / 1e3, "us");
+		bench_report(mode, "cb_latency_p99", rx.latency[(n * 99) / 100] / 1e3, "us");
+		bench_report(mode, "cb_latency_max", rx.latency[n - 1] / 1e3, "us");
+		ret = 0;
+	}
+
+	xbee_shutdown(xbee);
+die2:
+	free(rx.latency);
+die1:
+	bench_simStop(&sim);
+	sem_destroy(&rx.done);
+	return ret;
+}
+
+static int bench_txThroughput(struct bench_mode *mode) {
+	struct bench_sim sim;
+	struct xbee *xbee;
+	struct xbee_con *atCon, *dataCon;
+	long long t0, t1, c0;
+	unsigned long a0;
+	char payload[17];
+	int ret = -1;
+	int i;
+
+	if (bench_simStart(&sim, mode, NULL)) return -1;
+	if (bench_setup(&sim, mode, &xbee, &atCon, &dataCon, NULL)) goto die1;
+
+	memset(payload, 'x', sizeof(payload) - 1);
+	payload[sizeof(payload) - 1] = '\0';
+
+	c0 = bench_cpu();
+	a0 = allocCount;
+	t0 = bench_now();
+	for (i = 0; i < frameCount; i++) {
+		if (xbee_conTx(xbee, dataCon, "%s", payload) != 0) break;
+	}
+	if (bench_sync(xbee, atCon) == 0 && i > 0) {
+		t1 = bench_now();
+		bench_report(mode, "tx_fps", i / ((t1 - t0) / 1e9), "frames/s");
+		bench_report(mode, "cpu_per_tx_frame", (double)(bench_cpu() - c0) / i, "us");
+		bench_report(mode, "allocs_per_tx_frame", (double)(allocCount - a0) / i, "allocs");
+		ret = 0;
+	} else {
+		fprintf(stderr, "xbee_bench: %s: tx failed after %d frames\n", mode->name, i);
+	}
+
+	xbee_shutdown(xbee);
+die1:
+	bench_simStop(&sim);
+	return ret;
+}
+
+static int bench_ackRoundTrip(struct bench_mode *mode) {
+	struct bench_sim sim;
+	struct xbee *xbee;
+	struct xbee_con *atCon, *dataCon;
+	struct xbee_conOptions opts;
+	long long t0, t1;
+	int ret = -1;
+	int n;
+	int i;
+
+	n = frameCount / 10;
+	if (n < 100) n = 100;
+
+	if (bench_simStart(&sim, mode, NULL)) return -1;
+	if (bench_setup(&sim, mode, &xbee, &atCon, &dataCon, NULL)) goto die1;
+
+	xbee_conOptions(xbee, dataCon, &opts, NULL);
+	opts.waitForAck = 1;
+	xbee_conOptions(xbee, dataCon, NULL, &opts);
+
+	t0 = bench_now();
+	for (i = 0; i < n; i++) {
+		if (xbee_conTx(xbee, dataCon, "ping") != 0) break;
+	}
+	t1 = bench_now();
+	if (i == n) {
+		bench_report(mode, "ack_rtt", n / ((t1 - t0) / 1e9), "roundtrips/s");
+		ret = 0;
+	} else {
+		fprintf(stderr, "xbee_bench: %s: ACKed tx failed after %d frames\n", mode->name, i);
+	}
+
+	xbee_shutdown(xbee);
+die1:
+	bench_simStop(&sim);
+	return ret;
+}
+
+/* ######################################################################### */
+
+static void usage(char *argv0) {
+	fprintf(stderr, "usage: %s [options]\n", argv0);
+	fprintf(stderr, "  -S <path>   path to the xbee_sim binary (default: %s)\n", simPath);
+	fprintf(stderr, "  -n <count>  number of frames for the throughput tests (default: %d)\n", frameCount);
+	fprintf(stderr, "  -m <mode>   only run the given mode (series1 / series2)\n");
+	fprintf(stderr, "  -v          show the simulator's output\n");
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_mode *mode;
+	char *only = NULL;
+	int ret = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "S:n:m:vh")) != -1) {
+		switch (c) {
+			case 'S': simPath = optarg;             break;
+			case 'n': frameCount = atoi(optarg);    break;
+			case 'm': only = optarg;                break;
+			case 'v': verbose++;                    break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (frameCount <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("# libxbee %s (%s), %d frames\n", libxbee_revision, libxbee_commit, frameCount);
+	printf("mode,metric,value,unit\n");
+
+	for (mode = modes; mode->name; mode++) {
+		if (only && strcmp(only, mode->name)) continue;
+		if (bench_rxThroughput(mode)) ret = 1;
+		if (bench_rxLatency(mode))    ret = 1;
+		if (bench_txThroughput(mode)) ret = 1;
+		if (bench_ackRoundTrip(mode)) ret = 1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,482 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* xbee_microbench - microbenchmarks of libxbee's internal building blocks
+
+   this links against the static library and uses the internal headers, so
+   that the following can be timed in isolation:
+
+     ll_add_ext          ll_add_tail() + ll_ext_head() pairs, shared list, 1-16 threads
+     ll_get_next         iterating a list of N items with ll_get_next()
+     pkt_add_analog      xbee_pktAddAnalog(), N samples on each of 6 channels
+     pkt_get_analog      xbee_pktGetAnalog(), reading back every sample
+     frameid             xbee_frameIdGet() + GiveACK() + GetACK(), 1-16 threads
+     con_from_address    xbee_conFromAddress() with 10k connections
+     escape              xbee_txSerialXBee() of 100 byte frames
+     unescape            xbee_rxSerialXBee() of 100 byte frames
+     kernel_encode       xbee_escapeEncode() + xbee_escapeSum() of N bytes, and the byte at a time loop that it replaced
+     kernel_decode       xbee_escapeDecode() + xbee_escapeSum() of N escaped bytes, and the byte at a time loop
+     kernel_sum          xbee_escapeSum() of N bytes
+
+   all iteration counts are fixed, so runs can be compared with each other
+   the library is normally built without optimisation (DEBUG:=-g), while this is built with -O2 - for the kernel_*
+   comparisons to mean anything, build the library with 'make DEBUG="-g -O2"' first
+   results are written as CSV on stdout: 'bench,param,iterations,ns_per_op' */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "ll.h"
+#include "pkt.h"
+#include "frame.h"
+#include "conn.h"
+#include "rx.h"
+#include "tx.h"
+#include "escape.h"
+
+#define MB_LL_OPS          1000000
+#define MB_FRAMEID_OPS     200000
+#define MB_CON_COUNT       10000
+#define MB_CON_LOOKUPS     16
+#define MB_FRAME_COUNT     20000
+#define MB_FRAME_LEN       100
+#define MB_KERNEL_BYTES    (16 * 1024 * 1024)
+
+static int threadCounts[] = { 1, 2, 4, 8, 16, 0 };
+
+/* ######################################################################### */
+
+static long long mb_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+static void mb_report(char *bench, char *param, long iterations, long long ns) {
+	printf("%s,%s,%ld,%.1f\n", bench, param, iterations, (double)ns / iterations);
+	fflush(stdout);
+}
+
+/* run 'func' on 'count' threads at once, and return the wall time in nanoseconds */
+static long long mb_threads(int count, void *(*func)(void *), void *arg) {
+	pthread_t threads[16];
+	long long t0;
+	int i;
+
+	t0 = mb_now();
+	for (i = 0; i < count; i++) {
+		pthread_create(&threads[i], NULL, func, arg);
+	}
+	for (i = 0; i < count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	return mb_now() - t0;
+}
+
+/* ######################################################################### */
+/* ll.c */
+
+struct mb_llArg {
+	struct ll_head list;
+	long ops;
+};
+
+static void *mb_llAddExtThread(void *arg) {
+	struct mb_llArg *a = arg;
+	long i;
+	for (i = 0; i < a->ops; i++) {
+		ll_add_tail(&a->list, (void *)(i + 1));
+		ll_ext_head(&a->list);
+	}
+	return NULL;
+}
+
+static void mb_llAddExt(void) {
+	struct mb_llArg a;
+	char param[16];
+	int i;
+
+	for (i = 0; threadCounts[i]; i++) {
+		ll_init(&a.list);
+		a.ops = MB_LL_OPS / threadCounts[i];
+		snprintf(param, sizeof(param), "threads=%d", threadCounts[i]);
+		mb_report("ll_add_ext", param, a.ops * threadCounts[i], mb_threads(threadCounts[i], mb_llAddExtThread, &a));
+		ll_destroy(&a.list, NULL);
+	}
+}
+
+static void mb_llGetNext(void) {
+	static int sizes[] = { 100, 1000, 10000, 0 };
+	struct ll_head list;
+	char param[16];
+	long long t0;
+	void *p;
+	int i, o;
+
+	for (i = 0; sizes[i]; i++) {
+		ll_init(&list);
+		for (o = 0; o < sizes[i]; o++) {
+			ll_add_tail(&list, (void *)(long)(o + 1));
+		}
+		snprintf(param, sizeof(param), "items=%d", sizes[i]);
+		t0 = mb_now();
+		for (p = NULL; (p = ll_get_next(&list, p)) != NULL;);
+		mb_report("ll_get_next", param, sizes[i], mb_now() - t0);
+		ll_destroy(&list, NULL);
+	}
+}
+
+/* ######################################################################### */
+/* pkt.c */
+
+static void mb_pktAnalog(struct xbee *xbee) {
+	static int samples[] = { 1, 16, 64, 256, 0 };
+	struct xbee_pkt *pkt;
+	long long tAdd, tGet, t0;
+	char param[16];
+	int packets;
+	int i, o, c, v;
+
+	for (i = 0; samples[i]; i++) {
+		/* keep the work per configuration roughly constant */
+		packets = 64000 / (samples[i] * samples[i]);
+		if (packets < 4) packets = 4;
+		if (packets > 4000) packets = 4000;
+
+		tAdd = tGet = 0;
+		for (o = 0; o < packets; o++) {
+			pkt = xbee_pktAlloc();
+			t0 = mb_now();
+			for (v = 0; v < samples[i]; v++) {
+				for (c = 0; c < 6; c++) {
+					xbee_pktAddAnalog(xbee, pkt, c, v);
+				}
+			}
+			tAdd += mb_now() - t0;
+			t0 = mb_now();
+			for (v = 0; v < samples[i]; v++) {
+				for (c = 0; c < 6; c++) {
+					int val;
+					xbee_pktGetAnalog(xbee, pkt, c, v, &val);
+				}
+			}
+			tGet += mb_now() - t0;
+			xbee_pktFree(pkt);
+		}
+		snprintf(param, sizeof(param), "samples=%d", samples[i]);
+		mb_report("pkt_add_analog", param, (long)packets * samples[i] * 6, tAdd);
+		mb_report("pkt_get_analog", param, (long)packets * samples[i] * 6, tGet);
+	}
+}
+
+/* ######################################################################### */
+/* frame.c */
+
+struct mb_frameIdArg {
+	struct xbee *xbee;
+	long ops;
+	long failed;
+};
+
+static void *mb_frameIdThread(void *arg) {
+	struct mb_frameIdArg *a = arg;
+	struct xbee_con con; /* only used as a token */
+	unsigned char frameID;
+	long i;
+	for (i = 0; i < a->ops; i++) {
+		if ((frameID = xbee_frameIdGet(a->xbee, &con)) == 0) {
+			__sync_fetch_and_add(&a->failed, 1);
+			continue;
+		}
+		xbee_frameIdGiveACK(a->xbee, frameID, 0);
+		xbee_frameIdGetACK(a->xbee, &con, frameID);
+	}
+	return NULL;
+}
+
+static void mb_frameId(struct xbee *xbee) {
+	struct mb_frameIdArg a;
+	char param[16];
+	int i;
+
+	for (i = 0; threadCounts[i]; i++) {
+		a.xbee = xbee;
+		a.ops = MB_FRAMEID_OPS / threadCounts[i];
+		a.failed = 0;
+		snprintf(param, sizeof(param), "threads=%d", threadCounts[i]);
+		mb_report("frameid", param, a.ops * threadCounts[i], mb_threads(threadCounts[i], mb_frameIdThread, &a));
+		if (a.failed) fprintf(stderr, "xbee_microbench: frameid: %ld allocations failed\n", a.failed);
+	}
+}
+
+/* ######################################################################### */
+/* conn.c */
+
+static void mb_conFromAddress(struct xbee *xbee) {
+	struct xbee_conType *conType;
+	struct xbee_conAddress addr;
+	struct xbee_con **cons;
+	struct xbee_con *con;
+	long long t0;
+	int i;
+
+	if (xbee_modeSet(xbee, "series1")) {
+		fprintf(stderr, "xbee_microbench: xbee_modeSet() failed\n");
+		return;
+	}
+	for (i = 0; xbee->mode->conTypes[i].name; i++) {
+		if (!strcmp(xbee->mode->conTypes[i].name, "64-bit Data")) break;
+	}
+	conType = &xbee->mode->conTypes[i];
+	if (!conType->name) return;
+
+	/* connections are added directly, xbee_conNew() would perform a lookup for each of them */
+	if ((cons = calloc(MB_CON_COUNT, sizeof(*cons))) == NULL) return;
+	memset(&addr, 0, sizeof(addr));
+	addr.addr64_enabled = 1;
+	for (i = 0; i < MB_CON_COUNT; i++) {
+		if ((cons[i] = calloc(1, sizeof(struct xbee_con))) == NULL) goto done;
+		cons[i]->conType = conType;
+		cons[i]->address = addr;
+		cons[i]->address.addr64[4] = (i >> 24) & 0xFF;
+		cons[i]->address.addr64[5] = (i >> 16) & 0xFF;
+		cons[i]->address.addr64[6] = (i >>  8) & 0xFF;
+		cons[i]->address.addr64[7] = (i      ) & 0xFF;
+		ll_add_tail(&conType->conList, cons[i]);
+	}
+
+	/* look up the connections at the end of the list (the worst case) */
+	t0 = mb_now();
+	for (i = 0; i < MB_CON_LOOKUPS; i++) {
+		addr = cons[MB_CON_COUNT - 1 - i]->address;
+		if ((con = xbee_conFromAddress(xbee, conType, &addr)) != cons[MB_CON_COUNT - 1 - i]) {
+			fprintf(stderr, "xbee_microbench: con_from_address: lookup %d failed\n", i);
+		}
+	}
+	mb_report("con_from_address", "cons=10000", MB_CON_LOOKUPS, mb_now() - t0);
+
+done:
+	for (i = 0; i < MB_CON_COUNT && cons[i]; i++) {
+		ll_ext_item(&conType->conList, cons[i]);
+		free(cons[i]);
+	}
+	free(cons);
+}
+
+/* ######################################################################### */
+/* tx.c / io.c - frames are escaped into a buffer by xbee_txSerialXBee(), and unescaped byte by byte by xbee_rxSerialXBee() */
+
+static void mb_escape(void) {
+	struct xbee xbee;
+	struct bufData *buf, *rBuf;
+	FILE *f;
+	char param[16];
+	long long t0;
+	int i;
+
+	if ((buf = calloc(1, sizeof(struct bufData) + MB_FRAME_LEN)) == NULL) return;
+	buf->len = MB_FRAME_LEN;
+	/* every value appears, so 4 in 256 bytes need escaping */
+	for (i = 0; i < MB_FRAME_LEN; i++) {
+		buf->buf[i] = (i * 37) & 0xFF;
+	}
+
+	memset(&xbee, 0, sizeof(xbee));
+	xbee.device.ready = 1;
+	if ((f = tmpfile()) == NULL) goto die1;
+	xbee.device.fd = fileno(f);
+
+	snprintf(param, sizeof(param), "bytes=%d", MB_FRAME_LEN);
+
+	t0 = mb_now();
+	for (i = 0; i < MB_FRAME_COUNT; i++) {
+		xbee_txSerialXBee(&xbee, buf);
+	}
+	mb_report("escape", param, MB_FRAME_COUNT, mb_now() - t0);
+
+	lseek(xbee.device.fd, 0, SEEK_SET);
+	t0 = mb_now();
+	for (i = 0; i < MB_FRAME_COUNT; i++) {
+		if (xbee_rxSerialXBee(&xbee, &rBuf, 1)) {
+			fprintf(stderr, "xbee_microbench: unescape: frame %d failed\n", i);
+			break;
+		}
+		free(rBuf);
+	}
+	mb_report("unescape", param, MB_FRAME_COUNT, mb_now() - t0);
+
+	fclose(f);
+die1:
+	free(buf);
+}
+
+/* ######################################################################### */
+/* escape.c - each kernel is checked against, and timed alongside, a byte at a time version (as tx.c / rx.c used to be) */
+
+static int mb_kernelEncodeBytewise(const unsigned char *in, int len, unsigned char *out, unsigned char *sum) {
+	unsigned char c;
+	int i, o;
+	*sum = 0;
+	for (i = o = 0; i < len; i++) {
+		c = in[i];
+		*sum += c;
+		if (c == 0x7E || c == 0x7D || c == 0x11 || c == 0x13) {
+			out[o++] = 0x7D;
+			c ^= 0x20;
+		}
+		out[o++] = c;
+	}
+	return o;
+}
+
+static int mb_kernelDecodeBytewise(const unsigned char *in, int len, unsigned char *out, unsigned char *sum) {
+	unsigned char c;
+	int i, o;
+	*sum = 0;
+	for (i = o = 0; i < len; i++) {
+		c = in[i];
+		if (c == 0x7E) break;
+		if (c == 0x7D) c = in[++i] ^ 0x20;
+		*sum += c;
+		out[o++] = c;
+	}
+	return o;
+}
+
+static void mb_kernels(void) {
+	static int sizes[] = { 16, 100, 256, 4096, 0 };
+	unsigned char *raw, *enc, *dec;
+	unsigned char sum, sumRef;
+	volatile unsigned char sink;
+	char escaped;
+	char param[16];
+	long long t0;
+	long iterations;
+	int encLen, decLen, len;
+	int i, o;
+
+	raw = malloc(4096);
+	enc = malloc(2 * 4096);
+	dec = malloc(2 * 4096); /* also holds the byte at a time encoding, to compare with */
+	if (!raw || !enc || !dec) goto done;
+	/* a fixed pseudo-random fill, about 1 byte in 64 needs escaping */
+	srandom(1);
+	for (i = 0; i < 4096; i++) {
+		raw[i] = random() & 0xFF;
+	}
+
+	for (i = 0; sizes[i]; i++) {
+		len = sizes[i];
+		iterations = MB_KERNEL_BYTES / len;
+		snprintf(param, sizeof(param), "bytes=%d", len);
+
+		/* check the kernels first */
+		encLen = xbee_escapeEncode(raw, len, enc);
+		if (encLen != mb_kernelEncodeBytewise(raw, len, dec, &sumRef) || memcmp(enc, dec, encLen) || xbee_escapeSum(raw, len) != sumRef) {
+			fprintf(stderr, "xbee_microbench: kernel_encode: %d bytes don't match\n", len);
+		}
+		escaped = 0;
+		if (xbee_escapeDecode(dec, len, enc, encLen, &decLen, &escaped) != encLen || decLen != len || memcmp(dec, raw, len)) {
+			fprintf(stderr, "xbee_microbench: kernel_decode: %d bytes don't match\n", len);
+		}
+
+		t0 = mb_now();
+		for (o = 0; o < iterations; o++) {
+			xbee_escapeEncode(raw, len, enc);
+			sink = xbee_escapeSum(raw, len);
+		}
+		mb_report("kernel_encode", param, iterations, mb_now() - t0);
+		t0 = mb_now();
+		for (o = 0; o < iterations; o++) {
+			mb_kernelEncodeBytewise(raw, len, enc, &sum);
+			sink = sum;
+		}
+		mb_report("kernel_encode_bytewise", param, iterations, mb_now() - t0);
+
+		t0 = mb_now();
+		for (o = 0; o < iterations; o++) {
+			escaped = 0;
+			xbee_escapeDecode(dec, len, enc, encLen, &decLen, &escaped);
+			sink = xbee_escapeSum(dec, decLen);
+		}
+		mb_report("kernel_decode", param, iterations, mb_now() - t0);
+		t0 = mb_now();
+		for (o = 0; o < iterations; o++) {
+			mb_kernelDecodeBytewise(enc, encLen, dec, &sum);
+			sink = sum;
+		}
+		mb_report("kernel_decode_bytewise", param, iterations, mb_now() - t0);
+
+		t0 = mb_now();
+		for (o = 0; o < iterations; o++) {
+			sink = xbee_escapeSum(raw, len);
+		}
+		mb_report("kernel_sum", param, iterations, mb_now() - t0);
+	}
+	(void)sink;
+
+done:
+	free(raw);
+	free(enc);
+	free(dec);
+}
+
+/* ######################################################################### */
+
+int main(int argc, char *argv[]) {
+	struct xbee *xbee;
+	char *pty;
+	int mfd;
+
+	/* a real instance is required for anything that calls xbee_validate(), nothing will talk to it */
+	if ((mfd = posix_openpt(O_RDWR | O_NOCTTY)) == -1 || grantpt(mfd) || unlockpt(mfd) || (pty = ptsname(mfd)) == NULL) {
+		perror("posix_openpt()");
+		return 1;
+	}
+	if (xbee_setup(pty, 57600, &xbee)) {
+		fprintf(stderr, "xbee_microbench: xbee_setup() failed\n");
+		return 1;
+	}
+
+	printf("# libxbee %s (%s)\n", libxbee_revision, libxbee_commit);
+	printf("# escape kernels: %s\n", xbee_escapeKernels);
+	printf("bench,param,iterations,ns_per_op\n");
+
+	mb_llAddExt();
+	mb_llGetNext();
+	mb_pktAnalog(xbee);
+	mb_frameId(xbee);
+	mb_conFromAddress(xbee);
+	mb_escape();
+	mb_kernels();
+
+	xbee_shutdown(xbee);
+	close(mfd);
+
+	return 0;
+}
@@ -0,0 +1,891 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* xbee_sim - a pseudo-terminal XBee module simulator
+
+   this opens a pty pair and speaks API mode (AP=2, or AP=1 with -A 1) framing on the master side,
+   the slave side can be handed to xbee_setup() just like a real serial port:
+
+     $ ./xbee_sim -m 1 -i 0x80:100 -a 5
+     /dev/pts/7
+
+   it will:
+     - answer local (0x08/0x09) and remote (0x17) AT commands
+     - generate Transmit Status frames (0x89 / 0x8B) for any transmit request
+       that has a non-zero frameID, with configurable latency and loss
+     - inject 0x80 / 0x81 / 0x83 / 0x90 traffic at configurable rates
+     - go away and come back (-U), like a USB adapter being unplugged - the pty is closed, the link removed, and then a
+       new pty is opened and linked
+
+   injected data frames carry a small header at the start of their payload, so
+   that a consumer on the same host can measure delivery latency:
+     bytes 0-3   sequence number (big endian)
+     bytes 4-11  CLOCK_MONOTONIC timestamp in nanoseconds (big endian)
+     bytes 12-   padding ('A', 'B', 'C'...)
+
+   statistics are written to stderr on SIGUSR1, and on exit (SIGINT / SIGTERM) */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <termios.h>
+
+#define SIM_MAX_FRAMELEN  256
+#define SIM_OUTBUF_LEN    65536
+#define SIM_MAX_INJECT    8
+#define SIM_MAX_ACKS      4096
+#define SIM_MAX_PARAMS    32
+
+/* ######################################################################### */
+
+struct sim_param {
+	char cmd[2];
+	int len;
+	unsigned char value[20];
+};
+
+struct sim_node {
+	unsigned char addr64[8];
+	unsigned char addr16[2];
+	struct sim_param params[SIM_MAX_PARAMS];
+	int paramCount;
+};
+
+struct sim_inject {
+	unsigned char id;
+	double rate;             /* frames per second, 0 = as fast as possible */
+	long long interval;      /* nanoseconds between frames */
+	long long next;          /* CLOCK_MONOTONIC nanoseconds */
+	unsigned long sent;
+};
+
+struct sim_pending {
+	long long due;
+	int len;
+	unsigned char buf[16];
+};
+
+struct sim_parser {
+	int pos;
+	int len;
+	int escaped;
+	unsigned char chksum;
+	unsigned char buf[SIM_MAX_FRAMELEN];
+};
+
+struct sim_stats {
+	unsigned long rxFrames;
+	unsigned long rxBadChecksum;
+	unsigned long rxByType[0x100];
+	unsigned long txFrames;
+	unsigned long acksSent;
+	unsigned long acksFailed;
+	unsigned long acksDropped;
+	unsigned long atResponses;
+	unsigned long injectDeferred;
+	unsigned long unplugs;
+};
+
+/* ######################################################################### */
+
+static int series = 1;
+static int verbose = 0;
+static int ackLatency = 0;    /* ms */
+static int ackFailPercent = 0;
+static int ackDropPercent = 0;
+static int payloadLen = 16;
+static long injectLimit = 0;
+static int waitForHost = 0;
+static int apiMode = 2;       /* the local node's AP, a new value takes effect once its response has been sent */
+static int unplugEvery = 0;   /* ms */
+static int unplugFor = 0;     /* ms */
+
+static int mfd = -1;
+static int sfd = -1;
+static char *linkPath = NULL;
+
+static struct sim_node localNode;
+static struct sim_node remoteNode;
+
+static struct sim_inject injects[SIM_MAX_INJECT];
+static int injectCount = 0;
+static unsigned long injectSeq = 0;
+
+/* constant latency means a simple ring is enough to keep the ACKs in order */
+static struct sim_pending acks[SIM_MAX_ACKS];
+static int ackHead = 0;
+static int ackTail = 0;
+
+static unsigned char outBuf[SIM_OUTBUF_LEN];
+static int outLen = 0;
+
+static struct sim_parser parser;
+static struct sim_stats stats;
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dumpStats = 0;
+static int hostSeen = 0;
+
+/* ######################################################################### */
+
+static long long sim_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+static void sim_signal(int sig) {
+	if (sig == SIGUSR1) {
+		dumpStats = 1;
+		return;
+	}
+	running = 0;
+}
+
+static void sim_printStats(void) {
+	int i;
+	fprintf(stderr, "xbee_sim: rx %lu frames (%lu bad checksum), tx %lu frames\n",
+	                stats.rxFrames, stats.rxBadChecksum, stats.txFrames);
+	for (i = 0; i < 0x100; i++) {
+		if (!stats.rxByType[i]) continue;
+		fprintf(stderr, "xbee_sim:   rx 0x%02X: %lu\n", i, stats.rxByType[i]);
+	}
+	fprintf(stderr, "xbee_sim: acks sent/failed/dropped %lu/%lu/%lu, AT responses %lu\n",
+	                stats.acksSent, stats.acksFailed, stats.acksDropped, stats.atResponses);
+	for (i = 0; i < injectCount; i++) {
+		fprintf(stderr, "xbee_sim: injected 0x%02X: %lu\n", injects[i].id, injects[i].sent);
+	}
+	if (stats.injectDeferred) fprintf(stderr, "xbee_sim: injection deferred %lu times (host not reading)\n", stats.injectDeferred);
+	if (stats.unplugs) fprintf(stderr, "xbee_sim: unplugged %lu times\n", stats.unplugs);
+}
+
+/* ######################################################################### */
+
+/* set a parameter on a simulated node */
+static void sim_paramSet(struct sim_node *node, char *cmd, unsigned char *value, int len) {
+	int i;
+	if (len > (int)sizeof(node->params[0].value)) len = sizeof(node->params[0].value);
+	for (i = 0; i < node->paramCount; i++) {
+		if (!memcmp(node->params[i].cmd, cmd, 2)) break;
+	}
+	if (i == node->paramCount) {
+		if (node->paramCount >= SIM_MAX_PARAMS) return;
+		node->paramCount++;
+		memcpy(node->params[i].cmd, cmd, 2);
+	}
+	node->params[i].len = len;
+	memcpy(node->params[i].value, value, len);
+}
+
+static struct sim_param *sim_paramGet(struct sim_node *node, unsigned char *cmd) {
+	int i;
+	for (i = 0; i < node->paramCount; i++) {
+		if (!memcmp(node->params[i].cmd, cmd, 2)) return &node->params[i];
+	}
+	return NULL;
+}
+
+static void sim_nodeInit(struct sim_node *node, unsigned int addrH, unsigned int addrL, unsigned short my, char *ni) {
+	unsigned char v[8];
+	memset(node, 0, sizeof(*node));
+
+	node->addr64[0] = (addrH >> 24) & 0xFF; node->addr64[1] = (addrH >> 16) & 0xFF;
+	node->addr64[2] = (addrH >>  8) & 0xFF; node->addr64[3] = (addrH      ) & 0xFF;
+	node->addr64[4] = (addrL >> 24) & 0xFF; node->addr64[5] = (addrL >> 16) & 0xFF;
+	node->addr64[6] = (addrL >>  8) & 0xFF; node->addr64[7] = (addrL      ) & 0xFF;
+	node->addr16[0] = (my >> 8) & 0xFF;
+	node->addr16[1] = (my     ) & 0xFF;
+
+	sim_paramSet(node, "SH", &node->addr64[0], 4);
+	sim_paramSet(node, "SL", &node->addr64[4], 4);
+	sim_paramSet(node, "MY", node->addr16, 2);
+	sim_paramSet(node, "NI", (unsigned char *)ni, strlen(ni));
+	v[0] = 0x33; v[1] = 0x32;
+	sim_paramSet(node, "ID", v, 2);
+	v[0] = 0x0C;
+	sim_paramSet(node, "CH", v, 1);
+	v[0] = apiMode;
+	sim_paramSet(node, "AP", v, 1);
+	v[0] = 0x06;
+	sim_paramSet(node, "BD", v, 1);
+	if (series == 1) {
+		v[0] = 0x10; v[1] = 0xE8;
+	} else {
+		v[0] = 0x21; v[1] = 0xA7;
+	}
+	sim_paramSet(node, "VR", v, 2);
+	v[0] = 0x17; v[1] = 0x42;
+	sim_paramSet(node, "HV", v, 2);
+}
+
+/* ######################################################################### */
+
+/* try to flush the output buffer */
+static int sim_flush(void) {
+	int ret;
+	while (outLen > 0) {
+		if ((ret = write(mfd, outBuf, outLen)) == -1) {
+			if (errno == EAGAIN || errno == EINTR) return 0;
+			perror("write()");
+			return -1;
+		}
+		memmove(outBuf, &outBuf[ret], outLen - ret);
+		outLen -= ret;
+	}
+	return 0;
+}
+
+/* the worst case for an escaped frame is double the length, plus the delimiter */
+static int sim_outSpace(int len) {
+	return ((SIM_OUTBUF_LEN - outLen) >= ((len + 3) * 2) + 1);
+}
+
+static void sim_outEscaped(unsigned char c) {
+	if (apiMode == 2 && (c == 0x7E || c == 0x7D || c == 0x11 || c == 0x13)) {
+		outBuf[outLen++] = 0x7D;
+		c ^= 0x20;
+	}
+	outBuf[outLen++] = c;
+}
+
+/* frame and queue the given API frame data (API identifier onwards) */
+static int sim_send(unsigned char *data, int len) {
+	unsigned char chksum;
+	int i;
+
+	if (!sim_outSpace(len)) {
+		/* try to make some room */
+		sim_flush();
+		if (!sim_outSpace(len)) return -1;
+	}
+
+	outBuf[outLen++] = 0x7E;
+	sim_outEscaped((len >> 8) & 0xFF);
+	sim_outEscaped((len     ) & 0xFF);
+	for (chksum = 0, i = 0; i < len; i++) {
+		chksum += data[i];
+		sim_outEscaped(data[i]);
+	}
+	sim_outEscaped(0xFF - chksum);
+
+	stats.txFrames++;
+	if (verbose > 1) fprintf(stderr, "xbee_sim: tx 0x%02X (%d bytes)\n", data[0], len);
+
+	return 0;
+}
+
+/* ######################################################################### */
+
+/* handle an AT command for the given node, and build the response status/data */
+static int sim_atCommand(struct sim_node *node, unsigned char *cmd, unsigned char *param, int paramLen, unsigned char *rData, int *rLen) {
+	struct sim_param *p;
+
+	*rLen = 0;
+
+	/* commands that are simply accepted */
+	if (!memcmp(cmd, "AC", 2) || !memcmp(cmd, "WR", 2) || !memcmp(cmd, "FR", 2) || !memcmp(cmd, "RE", 2)) return 0;
+
+	/* I/O sample - digital D0-D1 and analog A0 enabled */
+	if (!memcmp(cmd, "IS", 2)) {
+		if (series != 1) return 2;
+		rData[0] = 1;    /* sample count */
+		rData[1] = 0x02; /* A0 */
+		rData[2] = 0x03; /* D0, D1 */
+		rData[3] = 0x00;
+		rData[4] = 0x01; /* D0 high */
+		rData[5] = 0x01;
+		rData[6] = 0xFF; /* A0 = 0x1FF */
+		*rLen = 7;
+		return 0;
+	}
+
+	if (paramLen > 0) {
+		/* only known parameters can be set */
+		if (!sim_paramGet(node, cmd)) return 2;
+		sim_paramSet(node, (char *)cmd, param, paramLen);
+		return 0;
+	}
+
+	if ((p = sim_paramGet(node, cmd)) == NULL) return 2;
+	memcpy(rData, p->value, p->len);
+	*rLen = p->len;
+	return 0;
+}
+
+/* 0x08 / 0x09 - Local AT */
+static void sim_localAT(unsigned char *buf, int len) {
+	unsigned char r[SIM_MAX_FRAMELEN];
+	struct sim_param *p;
+	int rLen;
+
+	if (len < 4) return;
+
+	r[0] = 0x88;
+	r[1] = buf[1];
+	r[2] = buf[2];
+	r[3] = buf[3];
+	r[4] = sim_atCommand(&localNode, &buf[2], &buf[4], len - 4, &r[5], &rLen);
+
+	/* no frameID means no response */
+	if (buf[1] && sim_send(r, rLen + 5) == 0) stats.atResponses++;
+
+	if ((p = sim_paramGet(&localNode, (unsigned char *)"AP")) != NULL && (p->value[0] == 1 || p->value[0] == 2) && p->value[0] != apiMode) {
+		apiMode = p->value[0];
+		if (verbose) fprintf(stderr, "xbee_sim: now using AP=%d\n", apiMode);
+	}
+}
+
+/* 0x17 - Remote AT */
+static void sim_remoteAT(unsigned char *buf, int len) {
+	unsigned char r[SIM_MAX_FRAMELEN];
+	int rLen;
+
+	if (len < 15) return;
+
+	r[0] = 0x97;
+	r[1] = buf[1];
+	memcpy(&r[2], remoteNode.addr64, 8);
+	memcpy(&r[10], remoteNode.addr16, 2);
+	r[12] = buf[13];
+	r[13] = buf[14];
+	r[14] = sim_atCommand(&remoteNode, &buf[13], &buf[15], len - 15, &r[15], &rLen);
+
+	if (!buf[1]) return;
+	if (sim_send(r, rLen + 15) == 0) stats.atResponses++;
+}
+
+/* 0x00 / 0x01 / 0x10 / 0x11 - Transmit Request */
+static void sim_txRequest(unsigned char *buf, int len) {
+	struct sim_pending *p;
+	int next;
+
+	/* no frameID means no Transmit Status */
+	if (len < 2 || !buf[1]) return;
+
+	if (ackDropPercent && (rand() % 100) < ackDropPercent) {
+		stats.acksDropped++;
+		return;
+	}
+
+	next = (ackTail + 1) % SIM_MAX_ACKS;
+	if (next == ackHead) {
+		/* the queue is full, the host will see a timeout */
+		stats.acksDropped++;
+		return;
+	}
+	p = &acks[ackTail];
+
+	p->due = sim_now() + ((long long)ackLatency * 1000000LL);
+	if (buf[0] == 0x00 || buf[0] == 0x01) {
+		/* Series 1 - 0x89 */
+		p->buf[0] = 0x89;
+		p->buf[1] = buf[1];
+		p->buf[2] = 0x00;
+		p->len = 3;
+	} else {
+		/* Series 2 - 0x8B */
+		p->buf[0] = 0x8B;
+		p->buf[1] = buf[1];
+		p->buf[2] = buf[10];
+		p->buf[3] = buf[11];
+		p->buf[4] = 0x00; /* retry count */
+		p->buf[5] = 0x00;
+		p->buf[6] = 0x00; /* discovery status */
+		p->len = 7;
+	}
+
+	if (ackFailPercent && (rand() % 100) < ackFailPercent) {
+		/* 0x01 - No ACK received (Series 1) / MAC ACK failure (Series 2) */
+		if (p->len == 3) {
+			p->buf[2] = 0x01;
+		} else {
+			p->buf[5] = 0x01;
+		}
+		stats.acksFailed++;
+	}
+
+	ackTail = next;
+}
+
+/* send any Transmit Status frames that are due */
+static void sim_processAcks(long long now) {
+	struct sim_pending *p;
+	while (ackHead != ackTail) {
+		p = &acks[ackHead];
+		if (p->due > now) break;
+		if (sim_send(p->buf, p->len)) break;
+		stats.acksSent++;
+		ackHead = (ackHead + 1) % SIM_MAX_ACKS;
+	}
+}
+
+/* a complete frame has been received from the host */
+static void sim_frame(unsigned char *buf, int len) {
+	stats.rxFrames++;
+	stats.rxByType[buf[0]]++;
+	hostSeen = 1;
+
+	if (verbose > 1) fprintf(stderr, "xbee_sim: rx 0x%02X (%d bytes)\n", buf[0], len);
+
+	switch (buf[0]) {
+		case 0x08:
+		case 0x09:
+			sim_localAT(buf, len);
+			break;
+		case 0x17:
+			sim_remoteAT(buf, len);
+			break;
+		case 0x00:
+		case 0x01:
+		case 0x10:
+		case 0x11:
+			sim_txRequest(buf, len);
+			break;
+		default:
+			if (verbose) fprintf(stderr, "xbee_sim: ignored frame 0x%02X\n", buf[0]);
+	}
+}
+
+/* feed received bytes into the parser (handles the escaping, for AP=2) */
+static void sim_parse(unsigned char *data, int count) {
+	unsigned char c;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		c = data[i];
+
+		/* an unescaped start delimiter always restarts the frame - with AP=1 it is only looked for between frames */
+		if (c == 0x7E && (apiMode == 2 || parser.pos == -3)) {
+			parser.pos = -2;
+			parser.escaped = 0;
+			continue;
+		}
+		if (parser.pos == -3) continue;
+		if (apiMode == 2 && c == 0x7D) {
+			parser.escaped = 1;
+			continue;
+		}
+		if (parser.escaped) {
+			c ^= 0x20;
+			parser.escaped = 0;
+		}
+
+		switch (parser.pos) {
+			case -2:
+				parser.len = c << 8;
+				parser.pos++;
+				break;
+			case -1:
+				parser.len |= c;
+				parser.chksum = 0;
+				parser.pos++;
+				if (parser.len == 0 || parser.len > SIM_MAX_FRAMELEN) parser.pos = -3;
+				break;
+			default:
+				parser.chksum += c;
+				if (parser.pos == parser.len) {
+					if (parser.chksum == 0xFF) {
+						sim_frame(parser.buf, parser.len);
+					} else {
+						stats.rxBadChecksum++;
+					}
+					parser.pos = -3;
+					break;
+				}
+				parser.buf[parser.pos++] = c;
+		}
+	}
+}
+
+/* ######################################################################### */
+
+/* build and queue a single injected frame */
+static int sim_inject(struct sim_inject *inj) {
+	unsigned char buf[SIM_MAX_FRAMELEN];
+	unsigned char *payload;
+	long long ts;
+	int len;
+	int i;
+
+	buf[0] = inj->id;
+	switch (inj->id) {
+		case 0x80: /* 64-bit Rx */
+			memcpy(&buf[1], remoteNode.addr64, 8);
+			buf[9] = 0x28;  /* RSSI: -40dBm */
+			buf[10] = 0x00; /* options */
+			len = 11;
+			break;
+		case 0x81: /* 16-bit Rx */
+			memcpy(&buf[1], remoteNode.addr16, 2);
+			buf[3] = 0x28;
+			buf[4] = 0x00;
+			len = 5;
+			break;
+		case 0x83: /* 16-bit I/O: 1 sample, D0-D1 & A0 */
+			memcpy(&buf[1], remoteNode.addr16, 2);
+			buf[3] = 0x28;
+			buf[4] = 0x00;
+			buf[5] = 0x01;
+			buf[6] = 0x02;
+			buf[7] = 0x03;
+			buf[8] = 0x00;
+			buf[9] = (injectSeq & 0x01) ? 0x01 : 0x02;
+			buf[10] = (injectSeq >> 8) & 0x03;
+			buf[11] = (injectSeq     ) & 0xFF;
+			len = 12;
+			goto send;
+		case 0x90: /* ZigBee Receive Packet */
+			memcpy(&buf[1], remoteNode.addr64, 8);
+			memcpy(&buf[9], remoteNode.addr16, 2);
+			buf[11] = 0x01; /* options: packet acknowledged */
+			len = 12;
+			break;
+		default:
+			return -1;
+	}
+
+	/* add the payload - see the top of this file for its layout */
+	payload = &buf[len];
+	ts = sim_now();
+	for (i = 0; i < payloadLen; i++) {
+		if (i < 4) {
+			payload[i] = (injectSeq >> (8 * (3 - i))) & 0xFF;
+		} else if (i < 12) {
+			payload[i] = (ts >> (8 * (11 - i))) & 0xFF;
+		} else {
+			payload[i] = 'A' + ((i - 12) % 26);
+		}
+	}
+	len += payloadLen;
+
+send:
+	if (sim_send(buf, len)) return -1;
+	injectSeq++;
+	inj->sent++;
+	return 0;
+}
+
+/* inject any frames that are due, returns the time that the next one is due */
+static long long sim_processInjects(long long now) {
+	struct sim_inject *inj;
+	long long next;
+	int i;
+
+	next = -1;
+	if (waitForHost && !hostSeen) return next;
+
+	for (i = 0; i < injectCount; i++) {
+		inj = &injects[i];
+		if (injectLimit && inj->sent >= (unsigned long)injectLimit) continue;
+
+		if (inj->rate <= 0) {
+			/* flood - fill whatever space we have */
+			while (!injectLimit || inj->sent < (unsigned long)injectLimit) {
+				if (sim_inject(inj)) {
+					stats.injectDeferred++;
+					break;
+				}
+			}
+			continue;
+		}
+
+		while (inj->next <= now) {
+			if (injectLimit && inj->sent >= (unsigned long)injectLimit) break;
+			if (sim_inject(inj)) {
+				stats.injectDeferred++;
+				break;
+			}
+			inj->next += inj->interval;
+		}
+		if (next == -1 || inj->next < next) next = inj->next;
+	}
+
+	return next;
+}
+
+/* ######################################################################### */
+
+static int sim_openPty(void) {
+	struct termios tc;
+	char *name;
+
+	if ((mfd = posix_openpt(O_RDWR | O_NOCTTY)) == -1) {
+		perror("posix_openpt()");
+		return -1;
+	}
+	if (grantpt(mfd) || unlockpt(mfd)) {
+		perror("grantpt() / unlockpt()");
+		return -1;
+	}
+	if ((name = ptsname(mfd)) == NULL) {
+		perror("ptsname()");
+		return -1;
+	}
+
+	/* keep the slave open ourselves, so that the master never sees a hangup when the host re-opens the device */
+	if ((sfd = open(name, O_RDWR | O_NOCTTY)) == -1) {
+		perror("open(slave)");
+		return -1;
+	}
+	if (tcgetattr(sfd, &tc) == 0) {
+		cfmakeraw(&tc);
+		tcsetattr(sfd, TCSANOW, &tc);
+	}
+
+	if (fcntl(mfd, F_SETFL, fcntl(mfd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("fcntl()");
+		return -1;
+	}
+
+	if (linkPath) {
+		unlink(linkPath);
+		if (symlink(name, linkPath)) {
+			perror("symlink()");
+			return -1;
+		}
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	return 0;
+}
+
+/* go away, everything in flight is lost */
+static void sim_unplug(void) {
+	if (linkPath) unlink(linkPath);
+	close(sfd);
+	close(mfd);
+	sfd = -1;
+	mfd = -1;
+
+	outLen = 0;
+	ackHead = ackTail = 0;
+	parser.pos = -3;
+	stats.unplugs++;
+	if (verbose) fprintf(stderr, "xbee_sim: unplugged\n");
+}
+
+static void usage(char *argv0) {
+	fprintf(stderr, "usage: %s [options]\n", argv0);
+	fprintf(stderr, "  -m <1|2>         emulate a Series 1 or Series 2 module (default: 1)\n");
+	fprintf(stderr, "  -A <1|2>         start with AP=1 (unescaped) or AP=2 framing (default: 2)\n");
+	fprintf(stderr, "  -L <path>        create a symlink to the pty at <path>\n");
+	fprintf(stderr, "  -a <ms>          Transmit Status latency in milliseconds (default: 0)\n");
+	fprintf(stderr, "  -f <percent>     percentage of transmissions that report a delivery failure\n");
+	fprintf(stderr, "  -d <percent>     percentage of Transmit Status frames that are never sent\n");
+	fprintf(stderr, "  -i <id>[:<rate>] inject API frames of <id> (0x80, 0x81, 0x83, 0x90) at <rate> frames/s\n");
+	fprintf(stderr, "                   a rate of 0 (the default) injects as fast as the host will read\n");
+	fprintf(stderr, "  -n <count>       stop after injecting <count> frames of each type\n");
+	fprintf(stderr, "  -s <bytes>       payload length of injected data frames (default: 16)\n");
+	fprintf(stderr, "  -W               don't inject until the host has sent a frame\n");
+	fprintf(stderr, "  -U <ms>[:<ms>]   unplug every <ms>, for <ms> (default: 100) before coming back on a new pty\n");
+	fprintf(stderr, "  -v               be verbose (repeat for more)\n");
+}
+
+int main(int argc, char *argv[]) {
+	struct pollfd pfd;
+	unsigned char rbuf[4096];
+	long long now, next;
+	long long unplugAt, replugAt;
+	int timeout;
+	int ret;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:A:L:a:f:d:i:n:s:U:Wvh")) != -1) {
+		switch (c) {
+			case 'm':
+				series = atoi(optarg);
+				if (series != 1 && series != 2) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'A':
+				apiMode = atoi(optarg);
+				if (apiMode != 1 && apiMode != 2) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'L':
+				linkPath = optarg;
+				break;
+			case 'a':
+				ackLatency = atoi(optarg);
+				break;
+			case 'f':
+				ackFailPercent = atoi(optarg);
+				break;
+			case 'd':
+				ackDropPercent = atoi(optarg);
+				break;
+			case 'i': {
+				char *p;
+				struct sim_inject *inj;
+				if (injectCount >= SIM_MAX_INJECT) {
+					fprintf(stderr, "too many injection streams\n");
+					return 1;
+				}
+				inj = &injects[injectCount];
+				inj->id = strtoul(optarg, &p, 0);
+				if (inj->id != 0x80 && inj->id != 0x81 && inj->id != 0x83 && inj->id != 0x90) {
+					fprintf(stderr, "unsupported injection type: %s\n", optarg);
+					return 1;
+				}
+				inj->rate = (*p == ':') ? atof(&p[1]) : 0;
+				if (inj->rate > 0) inj->interval = 1000000000.0 / inj->rate;
+				injectCount++;
+				break;
+			}
+			case 'n':
+				injectLimit = atol(optarg);
+				break;
+			case 's':
+				payloadLen = atoi(optarg);
+				if (payloadLen < 0 || payloadLen > 100) {
+					fprintf(stderr, "payload length must be 0-100 bytes\n");
+					return 1;
+				}
+				break;
+			case 'W':
+				waitForHost = 1;
+				break;
+			case 'U': {
+				char *p;
+				unplugEvery = strtol(optarg, &p, 0);
+				unplugFor = (*p == ':') ? atoi(&p[1]) : 100;
+				if (unplugEvery <= 0 || unplugFor < 0) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			}
+			case 'v':
+				verbose++;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	srand(time(NULL));
+	sim_nodeInit(&localNode,  0x0013A200, 0x40000000, 0x0000, "sim-local");
+	sim_nodeInit(&remoteNode, 0x0013A200, 0x40000001, 0x0001, "sim-remote");
+	parser.pos = -3;
+
+	signal(SIGINT, sim_signal);
+	signal(SIGTERM, sim_signal);
+	signal(SIGUSR1, sim_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (sim_openPty()) return 1;
+
+	now = sim_now();
+	for (c = 0; c < injectCount; c++) {
+		injects[c].next = now;
+	}
+	unplugAt = now + unplugEvery * 1000000LL;
+	replugAt = 0;
+
+	while (running) {
+		if (dumpStats) {
+			dumpStats = 0;
+			sim_printStats();
+		}
+
+		now = sim_now();
+		if (unplugEvery) {
+			if (mfd != -1 && now >= unplugAt) {
+				sim_unplug();
+				replugAt = now + unplugFor * 1000000LL;
+			}
+			if (mfd == -1) {
+				if (now < replugAt) {
+					poll(NULL, 0, ((replugAt - now) + 999999) / 1000000);
+					continue;
+				}
+				if (sim_openPty()) break;
+				now = sim_now();
+				unplugAt = now + unplugEvery * 1000000LL;
+				/* nothing was sent while unplugged, and none of it is owed */
+				for (c = 0; c < injectCount; c++) {
+					injects[c].next = now;
+				}
+			}
+		}
+		sim_processAcks(now);
+		next = sim_processInjects(now);
+		if (sim_flush()) break;
+
+		/* work out how long we can sleep for */
+		if (ackHead != ackTail && (next == -1 || acks[ackHead].due < next)) next = acks[ackHead].due;
+		if (next == -1) {
+			timeout = 1000;
+		} else if (next <= now) {
+			timeout = 0;
+		} else {
+			timeout = ((next - now) + 999999) / 1000000;
+		}
+
+		pfd.fd = mfd;
+		pfd.events = POLLIN;
+		if (outLen > 0) {
+			pfd.events |= POLLOUT;
+			/* if we are blocked on the host, there is no point spinning */
+			if (timeout == 0) timeout = 1000;
+		}
+		/* don't sleep through an unplug */
+		if (unplugEvery && ((unplugAt - now) + 999999) / 1000000 < timeout) timeout = ((unplugAt - now) + 999999) / 1000000;
+		if (timeout < 0) timeout = 0;
+
+		if ((ret = poll(&pfd, 1, timeout)) == -1) {
+			if (errno == EINTR) continue;
+			perror("poll()");
+			break;
+		}
+		if (ret == 0) continue;
+
+		if (pfd.revents & POLLIN) {
+			if ((ret = read(mfd, rbuf, sizeof(rbuf))) > 0) {
+				sim_parse(rbuf, ret);
+			} else if (ret == -1 && errno != EAGAIN && errno != EINTR && errno != EIO) {
+				perror("read()");
+				break;
+			}
+		}
+	}
+
+	sim_printStats();
+
+	if (linkPath) unlink(linkPath);
+	close(sfd);
+	close(mfd);
+
+	return 0;
+}
@@ -0,0 +1,324 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* xbee_test - end-to-end checks of behaviour that the API doesn't make obvious
+
+   this plays the part of the XBee itself, on the master side of a pty, so that
+   it can see exactly what libxbee writes to the device. each test prints
+   'PASS <name>' or 'FAIL <name>: <why>', and the exit status is non-zero if any
+   of them failed
+
+     net_tx_order  a network client pipelines connTx requests on one connection
+                   (with waitForAck, so that the workers that run them contend for
+                   it), they must be written to the device in the order they were
+                   sent */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xbee.h"
+
+#define TEST_TX_COUNT 200
+
+/* ######################################################################### */
+
+/* the device's side of a pty, frames that libxbee writes are unescaped from here */
+struct test_dev {
+	int fd;
+	char path[64];
+	unsigned char buf[256];
+	int len;
+	int esc;
+	int want;
+};
+
+static int test_devOpen(struct test_dev *dev) {
+	char *p;
+
+	memset(dev, 0, sizeof(*dev));
+	if ((dev->fd = posix_openpt(O_RDWR | O_NOCTTY)) == -1) return -1;
+	if (grantpt(dev->fd) || unlockpt(dev->fd) || (p = ptsname(dev->fd)) == NULL) {
+		close(dev->fd);
+		return -1;
+	}
+	snprintf(dev->path, sizeof(dev->path), "%s", p);
+	dev->want = -1;
+	return 0;
+}
+
+/* wait up to 'timeout' ms for the next frame (AP=2), returns its length, 0 on timeout */
+static int test_devFrame(struct test_dev *dev, unsigned char *frame, int timeout) {
+	struct pollfd pfd;
+	unsigned char c;
+
+	pfd.fd = dev->fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (poll(&pfd, 1, timeout) <= 0) return 0;
+		if (read(dev->fd, &c, 1) != 1) return 0;
+
+		if (c == 0x7E) {
+			dev->len = 0;
+			dev->esc = 0;
+			dev->want = -3;
+			continue;
+		}
+		if (dev->want == -1) continue;
+		if (c == 0x7D) {
+			dev->esc = 1;
+			continue;
+		}
+		if (dev->esc) {
+			c ^= 0x20;
+			dev->esc = 0;
+		}
+
+		if (dev->want == -3) {
+			dev->want = c << 8;
+			dev->want |= 0x10000;
+		} else if (dev->want & 0x10000) {
+			dev->want = (dev->want & 0xFF00) | c;
+			if (dev->want > (int)sizeof(dev->buf)) dev->want = -1;
+		} else if (dev->len < dev->want) {
+			dev->buf[dev->len++] = c;
+		} else {
+			/* the checksum */
+			memcpy(frame, dev->buf, dev->len);
+			dev->want = -1;
+			return dev->len;
+		}
+	}
+}
+
+/* write a frame to libxbee (AP=2) */
+static int test_devWrite(struct test_dev *dev, unsigned char *data, int len) {
+	unsigned char out[520];
+	unsigned char raw[260];
+	unsigned char sum;
+	int o, i;
+
+	raw[0] = (len >> 8) & 0xFF;
+	raw[1] = len & 0xFF;
+	memcpy(&raw[2], data, len);
+	for (sum = 0, i = 0; i < len; i++) sum += data[i];
+	raw[2 + len] = 0xFF - sum;
+
+	o = 0;
+	out[o++] = 0x7E;
+	for (i = 0; i < len + 3; i++) {
+		if (raw[i] == 0x7E || raw[i] == 0x7D || raw[i] == 0x11 || raw[i] == 0x13) {
+			out[o++] = 0x7D;
+			out[o++] = raw[i] ^ 0x20;
+		} else {
+			out[o++] = raw[i];
+		}
+	}
+	return (write(dev->fd, out, o) == o) ? 0 : -1;
+}
+
+/* ######################################################################### */
+
+/* a raw client of the network server, see the protocol description above xbee_netClientRx() */
+static int test_netSend(int fd, unsigned char id, unsigned char reqID, unsigned char *data, int len) {
+	unsigned char msg[512];
+
+	msg[0] = '{';
+	msg[1] = (len >> 8) & 0xFF;
+	msg[2] = len & 0xFF;
+	msg[3] = '|';
+	msg[4] = id;
+	msg[5] = reqID;
+	memcpy(&msg[6], data, len);
+	msg[6 + len] = '}';
+	return (send(fd, msg, len + 7, MSG_NOSIGNAL) == len + 7) ? 0 : -1;
+}
+
+/* read the next response, returns its returnValue (and data), or -1 */
+static int test_netResponse(int fd, unsigned char *data, int *len) {
+	unsigned char hdr[7];
+	unsigned char msg[512];
+	int size;
+	int o, n;
+
+	for (o = 0; o < 7; o += n) {
+		if ((n = recv(fd, &hdr[o], 7 - o, 0)) <= 0) return -1;
+	}
+	size = ((hdr[1] << 8) | hdr[2]) + 1;
+	if (size > (int)sizeof(msg)) return -1;
+	for (o = 0; o < size; o += n) {
+		if ((n = recv(fd, &msg[o], size - o, 0)) <= 0) return -1;
+	}
+	/* the data, then '}' */
+	if (data) memcpy(data, msg, size - 1);
+	if (len) *len = size - 1;
+	return (signed char)hdr[6];
+}
+
+/* ######################################################################### */
+
+static int test_netTxOrder(struct test_dev *dev) {
+	struct xbee *xbee;
+	struct xbee_conAddress address;
+	struct xbee_conOptions options;
+	struct sockaddr_un sa;
+	unsigned char req[2 + sizeof(address) + sizeof(options)];
+	unsigned char frame[256];
+	unsigned char rsp[16];
+	unsigned char key[2];
+	unsigned char conType;
+	char name[64];
+	int expect;
+	int ret;
+	int len;
+	int fd;
+	int i;
+
+	ret = -1;
+	fd = -1;
+	if ((i = xbee_setup(dev->path, 9600, &xbee)) != XBEE_ENONE) {
+		printf("FAIL net_tx_order: xbee_setup() returned %d\n", i);
+		return -1;
+	}
+	if ((i = xbee_modeSet(xbee, "series1")) != XBEE_ENONE ||
+	    (i = xbee_conTypeIdFromName(xbee, "64-bit Data", &conType)) != XBEE_ENONE) {
+		printf("FAIL net_tx_order: couldn't set up the instance (%d)\n", i);
+		goto die1;
+	}
+	snprintf(name, sizeof(name), "@xbee_test_%d", getpid());
+	if ((i = xbee_netStartUnix(xbee, name, 0)) != XBEE_ENONE) {
+		printf("FAIL net_tx_order: xbee_netStartUnix() returned %d\n", i);
+		goto die1;
+	}
+
+	/* connect, and get a key for a 64-bit connection */
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(&sa.sun_path[1], &name[1]);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    connect(fd, (struct sockaddr *)&sa, offsetof(struct sockaddr_un, sun_path) + strlen(name)) == -1) {
+		printf("FAIL net_tx_order: couldn't connect to the server (%s)\n", strerror(errno));
+		goto die2;
+	}
+	if (test_netSend(fd, 0x7F, 0, (unsigned char *)libxbee_commit, strlen(libxbee_commit) + 1) ||
+	    test_netResponse(fd, NULL, NULL) != 0) {
+		printf("FAIL net_tx_order: the version check failed\n");
+		goto die2;
+	}
+	memset(&address, 0, sizeof(address));
+	address.addr64_enabled = 1;
+	memcpy(address.addr64, "\x00\x13\xA2\x00\x40\x00\x00\x01", 8);
+	req[0] = conType;
+	memcpy(&req[1], &address, sizeof(address));
+	if (test_netSend(fd, 0x03, 0, req, 1 + sizeof(address)) ||
+	    test_netResponse(fd, rsp, &len) != 0 || len != 4) {
+		printf("FAIL net_tx_order: conNew failed\n");
+		goto die2;
+	}
+	key[0] = rsp[2];
+	key[1] = rsp[3];
+	memset(&options, 0, sizeof(options));
+	options.waitForAck = 1;
+	req[0] = key[0];
+	req[1] = key[1];
+	memcpy(&req[2], &options, sizeof(options));
+	if (test_netSend(fd, 0x05, 0, req, 2 + sizeof(options)) ||
+	    test_netResponse(fd, NULL, NULL) != 0) {
+		printf("FAIL net_tx_order: conOptions failed\n");
+		goto die2;
+	}
+
+	/* send them all without waiting, each carries its sequence number */
+	for (i = 0; i < TEST_TX_COUNT; i++) {
+		req[0] = key[0];
+		req[1] = key[1];
+		req[2] = (i >> 8) & 0xFF;
+		req[3] = i & 0xFF;
+		if (test_netSend(fd, 0x01, i & 0xFF, req, 4)) {
+			printf("FAIL net_tx_order: send() failed\n");
+			goto die2;
+		}
+	}
+
+	/* the device sees them in that order, and ACKs each one (Transmit Status, success) */
+	for (expect = 0; expect < TEST_TX_COUNT; expect++) {
+		if ((len = test_devFrame(dev, frame, 2000)) == 0) {
+			printf("FAIL net_tx_order: only %d of %d frames were written\n", expect, TEST_TX_COUNT);
+			goto die2;
+		}
+		/* 0x00, FrameID, address (8), options, data */
+		if (frame[0] != 0x00 || len != 11 + 2) {
+			expect--;
+			continue;
+		}
+		if (((frame[11] << 8) | frame[12]) != expect) {
+			printf("FAIL net_tx_order: frame %d was written where frame %d should have been\n", (frame[11] << 8) | frame[12], expect);
+			goto die2;
+		}
+		rsp[0] = 0x89;
+		rsp[1] = frame[1];
+		rsp[2] = 0x00;
+		if (test_devWrite(dev, rsp, 3)) {
+			printf("FAIL net_tx_order: couldn't write the ACK\n");
+			goto die2;
+		}
+	}
+	for (i = 0; i < TEST_TX_COUNT; i++) {
+		if (test_netResponse(fd, NULL, NULL) != 0) {
+			printf("FAIL net_tx_order: connTx request %d failed\n", i);
+			goto die2;
+		}
+	}
+
+	printf("PASS net_tx_order\n");
+	ret = 0;
+die2:
+	if (fd != -1) close(fd);
+	xbee_netStop(xbee);
+die1:
+	xbee_shutdown(xbee);
+	return ret;
+}
+
+/* ######################################################################### */
+
+int main(int argc, char *argv[]) {
+	struct test_dev dev;
+	int failed;
+
+	if (test_devOpen(&dev)) {
+		perror("posix_openpt()");
+		return 1;
+	}
+
+	failed = 0;
+	if (test_netTxOrder(&dev)) failed++;
+
+	close(dev.fd);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+#ifndef __XBEE_TRACE_H
+#define __XBEE_TRACE_H
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* static tracepoints (USDT), enabled with OPTIONS+=XBEE_TRACEPOINTS
+
+   each probe is a single 'nop' in the code, and an entry in the ELF '.note.stapsdt' section that
+   describes where the nop is, and where its arguments can be found. perf, bpftrace and systemtap can
+   all attach to them, e.g:
+     $ perf probe -x libxbee.so sdt_libxbee:rx_frame
+     $ bpftrace -e 'usdt:./libxbee.so:libxbee:rx_frame { @[arg1] = count(); }'
+
+   all arguments are passed as 'long' - pointers are there to tie events together, not to be followed
+
+   provider 'libxbee':
+     rx_frame          (xbee, buf, apiIdentifier, length)   a frame was read from the device
+     rx_dispatch       (xbee, con, pkt)                     a packet was added to a connection's rxList
+     callback_begin    (xbee, con, pkt)                     a connection's callback is about to be run
+     callback_end      (xbee, con, pkt)                     ... and it has returned
+     tx_enqueue        (xbee, con, buf, length)             a frame was added to the txList
+     tx_dequeue        (xbee, buf, length)                  the tx thread took a frame from the txList
+     tx_written        (xbee, buf, ret)                     the tx function has returned
+     frameid_alloc     (xbee, con, frameID)                 a FrameID was allocated for a transmission
+     frameid_ack       (xbee, frameID, ack)                 an ACK arrived for a FrameID
+     frameid_timeout   (xbee, con, frameID)                 nobody ACK'd the FrameID in time */
+
+#ifdef XBEE_TRACEPOINTS
+
+#ifndef __ELF__
+#error XBEE_TRACEPOINTS is only supported for ELF targets
+#endif
+
+#if defined(__LP64__)
+#define _XBEE_TRACE_ADDR ".8byte"
+#else
+#define _XBEE_TRACE_ADDR ".4byte"
+#endif
+
+/* this is the layout that <sys/sdt.h> produces (note type 3), it is reproduced here so that the
+   systemtap headers aren't needed at build time. '%n[_s]' expands to '-sizeof(long)', meaning 'signed' */
+#define _XBEE_TRACE(name, args, ...) \
+	__asm__ __volatile__ ( \
+		"990:	nop\n" \
+		"	.pushsection .note.stapsdt,\"\",\"note\"\n" \
+		"	.balign 4\n" \
+		"	.4byte 992f-991f, 994f-993f, 3\n" \
+		"991:	.asciz \"stapsdt\"\n" \
+		"992:	.balign 4\n" \
+		"993:	" _XBEE_TRACE_ADDR " 990b\n" \
+		"	" _XBEE_TRACE_ADDR " _.stapsdt.base\n" \
+		"	" _XBEE_TRACE_ADDR " 0\n" \
+		"	.asciz \"libxbee\"\n" \
+		"	.asciz \"" #name "\"\n" \
+		"	.asciz \"" args "\"\n" \
+		"994:	.balign 4\n" \
+		"	.popsection\n" \
+		"	.ifndef _.stapsdt.base\n" \
+		"	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		"	.weak _.stapsdt.base\n" \
+		"	.hidden _.stapsdt.base\n" \
+		"_.stapsdt.base:	.space 1\n" \
+		"	.size _.stapsdt.base, 1\n" \
+		"	.popsection\n" \
+		"	.endif\n" \
+		:: [_s] "n" (sizeof(long)), __VA_ARGS__)
+
+#define _XBEE_TRACE_ARG(n) "%n[_s]@%[_a" #n "]"
+
+#define xbee_trace3(name, a1, a2, a3) \
+	_XBEE_TRACE(name, _XBEE_TRACE_ARG(1) " " _XBEE_TRACE_ARG(2) " " _XBEE_TRACE_ARG(3), \
+	            [_a1] "nor" ((long)(a1)), [_a2] "nor" ((long)(a2)), [_a3] "nor" ((long)(a3)))
+#define xbee_trace4(name, a1, a2, a3, a4) \
+	_XBEE_TRACE(name, _XBEE_TRACE_ARG(1) " " _XBEE_TRACE_ARG(2) " " _XBEE_TRACE_ARG(3) " " _XBEE_TRACE_ARG(4), \
+	            [_a1] "nor" ((long)(a1)), [_a2] "nor" ((long)(a2)), [_a3] "nor" ((long)(a3)), [_a4] "nor" ((long)(a4)))
+
+#else /* XBEE_TRACEPOINTS */
+
+#define xbee_trace3(name, a1, a2, a3)
+#define xbee_trace4(name, a1, a2, a3, a4)
+
+#endif /* XBEE_TRACEPOINTS */
+
+#endif /* __XBEE_TRACE_H */
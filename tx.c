@@ -20,37 +20,146 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "internal.h"
 #include "tx.h"
+#include "escape.h"
+#include "frame.h"
 #include "io.h"
 #include "log.h"
+#include "stats.h"
+#include "trace.h"
 
-/* send a buffer obeying the XBee interface rules (delimiter/length/checksum) */
+/* send a buffer obeying the XBee interface rules (delimiter/length/checksum)
+   the whole frame is built first, and given to the device in as few write()s as it will take */
 int xbee_txSerialXBee(struct xbee *xbee, struct bufData *buf) {
-	unsigned char chksum;
-	int i;
+	unsigned char local[XBEE_TX_ENCODEDLEN(XBEE_MAX_PACKETLEN)];
+	unsigned char *out;
+	struct timespec now;
+	int ret;
+	int len;
+	
+	/* don't send anything that nobody is waiting for any more */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (xbee_txExpired(buf, &now)) {
+		xbee_log(1,"A frame spent more than %dms in the txList, it was dropped", XBEE_TX_DEADLINE);
+		xbee_txDropped(xbee, buf);
+		return XBEE_ETIMEOUT;
+	}
 	
-	/* clear the checksum */
-	chksum = 0;
+	/* only the odd oversized frame needs the heap */
+	if (XBEE_TX_ENCODEDLEN(buf->len) <= sizeof(local)) {
+		out = local;
+	} else if ((out = malloc(XBEE_TX_ENCODEDLEN(buf->len))) == NULL) {
+		return XBEE_ENOMEM;
+	}
 	
-	/* start of packet */
-	xbee_io_writeRawByte(xbee, 0x7E);
+	len = xbee_txEncode(xbee, buf, out);
+	if ((ret = xbee_io_write(xbee, out, len, buf->deadline.tv_sec ? &buf->deadline : NULL)) == XBEE_ETIMEOUT) {
+		xbee_log(1,"The device wasn't ready for a frame within %dms, it was dropped", XBEE_TX_DEADLINE);
+		xbee_txDropped(xbee, buf);
+	} else if (ret == XBEE_ENONE) {
+		xbee_statsTx(xbee, 1, len);
+	}
 	
-	/* length of packet */
-	xbee_io_writeEscapedByte(xbee, ((buf->len >> 8) & 0xFF));
-	xbee_io_writeEscapedByte(xbee, ( buf->len       & 0xFF));
+	if (out != local) free(out);
 	
-	/* packet data (and building the checksum) */
-	for (i = 0; i < buf->len; i++) {
-		chksum += buf->buf[i];
-		xbee_io_writeEscapedByte(xbee, buf->buf[i]);
+	return ret;
+}
+
+/* give a buffer its deadline, as it is added to the txList - only for a sender that is waiting on 'frameID' */
+void xbee_txSetDeadline(struct bufData *buf, unsigned char frameID) {
+	buf->frameID = frameID;
+	clock_gettime(CLOCK_MONOTONIC, &buf->deadline);
+	buf->deadline.tv_sec += XBEE_TX_DEADLINE / 1000;
+	buf->deadline.tv_nsec += (XBEE_TX_DEADLINE % 1000) * 1000000;
+	if (buf->deadline.tv_nsec >= 1000000000) {
+		buf->deadline.tv_sec++;
+		buf->deadline.tv_nsec -= 1000000000;
 	}
+}
+
+/* has the buffer's deadline passed? buffers that never had one (tv_sec == 0) don't expire */
+int xbee_txExpired(struct bufData *buf, struct timespec *now) {
+	if (!buf->deadline.tv_sec) return 0;
+	if (now->tv_sec != buf->deadline.tv_sec) return (now->tv_sec > buf->deadline.tv_sec);
+	return (now->tv_nsec >= buf->deadline.tv_nsec);
+}
+
+/* a buffer missed its deadline and is being dropped - count it, and tell the sender straight away (as the FrameID's ACK),
+   rather than leaving it to time out. the caller frees the buffer */
+void xbee_txDropped(struct xbee *xbee, struct bufData *buf) {
+	struct timespec queued;
 	
-	/* checksum */
-	xbee_io_writeEscapedByte(xbee, 0xFF - chksum);
+	xbee_statsTxExpired(xbee);
+	if (!buf->frameID) return;
 	
-	return 0;
+	/* when it was queued, a FrameID that was given out after that has been given to somebody else */
+	queued = buf->deadline;
+	queued.tv_sec -= XBEE_TX_DEADLINE / 1000;
+	queued.tv_nsec -= (XBEE_TX_DEADLINE % 1000) * 1000000;
+	if (queued.tv_nsec < 0) {
+		queued.tv_sec--;
+		queued.tv_nsec += 1000000000;
+	}
+	xbee_frameIdGiveError(xbee, buf->frameID, &queued, XBEE_ETIMEOUT);
+}
+
+/* the device isn't there, put the buffer back at the head of the txList and wait for xbee_io_reconnect() (or anything
+   else) to prod txSem - returns 0 if the buffer missed its deadline instead, and should be dropped */
+int xbee_txWaitReady(struct xbee *xbee, struct bufData *buf) {
+	struct timespec now;
+	long long ns;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (xbee_txExpired(buf, &now)) {
+		xbee_log(1,"A frame spent more than %dms in the txList, it was dropped", XBEE_TX_DEADLINE);
+		xbee_txDropped(xbee, buf);
+		return 0;
+	}
+	ll_add_head(&xbee->txList, buf);
+	
+	if (!buf->deadline.tv_sec) {
+		xsys_sem_wait(&xbee->txSem);
+	} else {
+		ns = (buf->deadline.tv_sec - now.tv_sec) * 1000000000LL + (buf->deadline.tv_nsec - now.tv_nsec);
+		xsys_sem_timedwait(&xbee->txSem, ns / 1000000000, ns % 1000000000);
+	}
+	
+	return 1;
+}
+
+/* build the bytes that xbee_txSerialXBee() would write, 'out' must have room for XBEE_TX_ENCODEDLEN(buf->len)
+   returns the number of bytes used */
+int xbee_txEncode(struct xbee *xbee, struct bufData *buf, unsigned char *out) {
+	unsigned char hdr[2];
+	unsigned char chksum;
+	int o;
+	
+	o = 0;
+	out[o++] = 0x7E;
+	
+	/* API mode 1 - nothing is escaped */
+	if (xbee->device.apiMode == 1) {
+		out[o++] = (buf->len >> 8) & 0xFF;
+		out[o++] = buf->len & 0xFF;
+		memcpy(&out[o], buf->buf, buf->len);
+		o += buf->len;
+		out[o++] = 0xFF - xbee_escapeSum(buf->buf, buf->len);
+		return o;
+	}
+	
+	/* the length, data and checksum are escaped, the checksum is built from the data only */
+	hdr[0] = (buf->len >> 8) & 0xFF;
+	hdr[1] = buf->len & 0xFF;
+	o += xbee_escapeEncode(hdr, 2, &out[o]);
+	o += xbee_escapeEncode(buf->buf, buf->len, &out[o]);
+	chksum = 0xFF - xbee_escapeSum(buf->buf, buf->len);
+	o += xbee_escapeEncode(&chksum, 1, &out[o]);
+	
+	return o;
 }
 
 /* the bulk of the tx thread for libxbee */
@@ -86,10 +195,15 @@ int _xbee_tx(struct xbee *xbee) {
 		}
 		
 		/* send the buffer */
-		if ((ret = xbee->f->tx(xbee, buf)) != 0) {
+		xbee_trace3(tx_dequeue, xbee, buf, buf->len);
+		if ((ret = xbee->f->tx(xbee, buf)) == XBEE_ENOTREADY || ret == XBEE_EEOF) {
+			/* the device has gone, the rx thread is waiting for it to come back - keep the buffer until then */
+			if (xbee_txWaitReady(xbee, buf)) continue;
+		} else if (ret != 0) {
 			/* if xbee->f->tx() returned non-zero, then log the details */
 			xbee_log(1,"xbee->f->tx(): returned %d", ret);
 		}
+		xbee_trace3(tx_written, xbee, buf, ret);
 		
 		/* free the buffer, and continue */
 		free(buf);
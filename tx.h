@@ -23,7 +23,23 @@
 
 #define XBEE_TX_RESTART_DELAY 25
 
+/* how long (ms) a frame that is sent with waitForAck may spend in the txList and waiting for the device (e.g. held off by
+   CTS) before it is dropped - this matches the wait for an ACK in xbee_frameIdGetACK(), the sender has given up by then
+   frames without a FrameID never expire */
+#ifndef XBEE_TX_DEADLINE
+#define XBEE_TX_DEADLINE 1000
+#endif
+
 int xbee_tx(struct xbee *xbee);
 int xbee_txSerialXBee(struct xbee *xbee, struct bufData *buf);
 
+/* the most bytes that a frame of 'len' bytes can be encoded to - the start delimiter, then everything else escaped */
+#define XBEE_TX_ENCODEDLEN(len) (1 + (2 * ((len) + 3)))
+int xbee_txEncode(struct xbee *xbee, struct bufData *buf, unsigned char *out);
+
+void xbee_txSetDeadline(struct bufData *buf, unsigned char frameID);
+int xbee_txExpired(struct bufData *buf, struct timespec *now);
+void xbee_txDropped(struct xbee *xbee, struct bufData *buf);
+int xbee_txWaitReady(struct xbee *xbee, struct bufData *buf);
+
 #endif /* __XBEE_TX_H */
@@ -0,0 +1,608 @@
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "internal.h"
+#include "uring.h"
+#include "fmaps.h"
+#include "io.h"
+#include "tx.h"
+#include "ll.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifdef XBEE_HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* there is no liburing to lean on, these are the raw system calls */
+static int xbee_uringSysSetup(unsigned int entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+static int xbee_uringSysEnter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+static int xbee_uringSysRegister(int fd, unsigned int opcode, void *arg, unsigned int nrArgs) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/* ######################################################################### */
+
+static void xbee_uringRingFree(struct xbee_uringRing *ring) {
+	if (ring->sqes) munmap(ring->sqes, ring->sqesLen);
+	if (ring->cqMap && ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapLen);
+	if (ring->sqMap) munmap(ring->sqMap, ring->sqMapLen);
+	if (ring->fd != -1) xsys_close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/* create an io_uring instance and map its rings, errno is left set on failure */
+static int xbee_uringRingInit(struct xbee_uringRing *ring) {
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = xbee_uringSysSetup(XBEE_URING_ENTRIES, &p)) == -1) return -1;
+
+	ring->sqMapLen = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	ring->cqMapLen = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqMapLen > ring->sqMapLen) ring->sqMapLen = ring->cqMapLen;
+		ring->cqMapLen = ring->sqMapLen;
+	}
+	if ((ring->sqMap = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		ring->sqMap = NULL;
+		goto die;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cqMap = ring->sqMap;
+	} else if ((ring->cqMap = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		ring->cqMap = NULL;
+		goto die;
+	}
+	ring->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto die;
+	}
+
+	ring->sqHead = (void *)((char *)ring->sqMap + p.sq_off.head);
+	ring->sqTail = (void *)((char *)ring->sqMap + p.sq_off.tail);
+	ring->sqMask = (void *)((char *)ring->sqMap + p.sq_off.ring_mask);
+	ring->sqArray = (void *)((char *)ring->sqMap + p.sq_off.array);
+	ring->cqHead = (void *)((char *)ring->cqMap + p.cq_off.head);
+	ring->cqTail = (void *)((char *)ring->cqMap + p.cq_off.tail);
+	ring->cqMask = (void *)((char *)ring->cqMap + p.cq_off.ring_mask);
+	ring->cqes = (void *)((char *)ring->cqMap + p.cq_off.cqes);
+
+	return 0;
+die:
+	{
+		int e = errno;
+		xbee_uringRingFree(ring);
+		errno = e;
+	}
+	return -1;
+}
+
+/* get the next submission entry, it is given to the kernel by xbee_uringSubmit() - the rings are never allowed to fill */
+static struct io_uring_sqe *xbee_uringSqe(struct xbee_uringRing *ring, unsigned int *tail) {
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	i = *tail & *ring->sqMask;
+	sqe = &ring->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[i] = i;
+	(*tail)++;
+
+	return sqe;
+}
+
+/* hand the entries up to 'tail' to the kernel, and optionally wait for 'minComplete' completions
+   the wait is a cancellation point, so that xbee_shutdown() can stop the thread */
+static int xbee_uringSubmit(struct xbee_uringRing *ring, unsigned int tail, unsigned int minComplete) {
+	unsigned int toSubmit;
+	int oldType;
+	int ret;
+
+	__atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+	do {
+		/* anything that the kernel hasn't taken yet, e.g. if we were interrupted */
+		toSubmit = tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+		if (minComplete) xsys_thread_cancelAsync(&oldType);
+		ret = xbee_uringSysEnter(ring->fd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0);
+		if (minComplete) xsys_thread_cancelAsyncRestore(oldType);
+	} while (ret == -1 && errno == EINTR);
+
+	return (ret == -1) ? -1 : 0;
+}
+
+/* take the next completion, returns 0 if there aren't any */
+static int xbee_uringCqe(struct xbee_uringRing *ring, struct io_uring_cqe *cqe) {
+	unsigned int head;
+
+	head = *ring->cqHead;
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return 0;
+
+	memcpy(cqe, &ring->cqes[head & *ring->cqMask], sizeof(*cqe));
+	__atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+
+	/* a multishot request stays in flight until a completion without IORING_CQE_F_MORE */
+	if (!(cqe->flags & IORING_CQE_F_MORE)) ring->inflight--;
+
+	return 1;
+}
+
+/* cancel anything that is still in flight, and wait for it to finish - the kernel may otherwise still use our buffers */
+static void xbee_uringRingCancel(struct xbee_uringRing *ring) {
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	unsigned int tail;
+
+	if (ring->fd == -1) return;
+
+	/* drop anything that has already completed */
+	while (xbee_uringCqe(ring, &cqe));
+	if (ring->inflight <= 0) return;
+
+	tail = *ring->sqTail;
+	sqe = xbee_uringSqe(ring, &tail);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+	sqe->user_data = XBEE_URING_CANCEL;
+	ring->inflight++;
+	if (xbee_uringSubmit(ring, tail, 0)) return;
+
+	while (ring->inflight > 0) {
+		if (xbee_uringSysEnter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) return;
+		while (xbee_uringCqe(ring, &cqe));
+	}
+}
+
+/* ######################################################################### */
+
+/* give an rx buffer (back) to the kernel */
+static void xbee_uringBufAdd(struct xbee_uringInfo *info, unsigned short bid) {
+	struct io_uring_buf *b;
+
+	b = &info->bufRing->bufs[info->bufTail & (XBEE_URING_RXBUFS - 1)];
+	b->addr = (unsigned long)&info->bufs[bid * XBEE_IO_CHUNKLEN];
+	b->len = XBEE_IO_CHUNKLEN;
+	b->bid = bid;
+	info->bufTail++;
+	__atomic_store_n(&info->bufRing->tail, info->bufTail, __ATOMIC_RELEASE);
+}
+
+/* set up the rx ring for a freshly opened device */
+static int xbee_uringRxInit(struct xbee *xbee, struct xbee_uringInfo *info) {
+	struct io_uring_buf_reg reg;
+	int i;
+
+	if (xbee_uringRingInit(&info->rx)) {
+		xbee_perror(2,"io_uring_setup()");
+		goto die1;
+	}
+
+	/* the provided buffer ring must be page aligned */
+	info->bufRingLen = XBEE_URING_RXBUFS * sizeof(struct io_uring_buf);
+	if ((info->bufRing = mmap(NULL, info->bufRingLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		info->bufRing = NULL;
+		xbee_perror(1,"mmap()");
+		goto die2;
+	}
+	if ((info->bufs = malloc(XBEE_URING_RXBUFS * XBEE_IO_CHUNKLEN)) == NULL) goto die3;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)info->bufRing;
+	reg.ring_entries = XBEE_URING_RXBUFS;
+	reg.bgid = XBEE_URING_BGID;
+	if (xbee_uringSysRegister(info->rx.fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		xbee_perror(2,"io_uring_register(IORING_REGISTER_PBUF_RING)");
+		goto die4;
+	}
+	info->bufTail = 0;
+	for (i = 0; i < XBEE_URING_RXBUFS; i++) {
+		xbee_uringBufAdd(info, i);
+	}
+
+	info->rxArmed = 0;
+	info->rxGotData = 0;
+
+	return 0;
+die4:
+	free(info->bufs);
+	info->bufs = NULL;
+die3:
+	munmap(info->bufRing, info->bufRingLen);
+	info->bufRing = NULL;
+die2:
+	xbee_uringRingFree(&info->rx);
+die1:
+	return -1;
+}
+
+static void xbee_uringRxFree(struct xbee_uringInfo *info) {
+	xbee_uringRingCancel(&info->rx);
+	/* closing the ring unregisters the buffers */
+	xbee_uringRingFree(&info->rx);
+	if (info->bufRing) munmap(info->bufRing, info->bufRingLen);
+	info->bufRing = NULL;
+	free(info->bufs);
+	info->bufs = NULL;
+	info->rxArmed = 0;
+}
+
+/* open the device as normal, and then give it an rx ring - the device works without one */
+int xbee_uringIoOpen(struct xbee *xbee) {
+	struct xbee_uringInfo *info;
+	int ret;
+
+	if ((info = xbee->fmapData) == NULL) return XBEE_EINVAL;
+
+	if ((ret = xbee_io_open(xbee)) != 0) return ret;
+
+	if (xbee_uringRxInit(xbee, info)) {
+		xbee_log(1,"io_uring isn't available, '%s' will be read without it", xbee->device.path);
+		return XBEE_ENONE;
+	}
+	xbee->device.uring = info;
+
+	return XBEE_ENONE;
+}
+
+/* the rx thread has stopped (or is the caller, to reopen the device), the tx ring is kept until xbee_shutdown() */
+void xbee_uringIoClose(struct xbee *xbee) {
+	struct xbee_uringInfo *info;
+
+	if ((info = xbee->fmapData) == NULL) return;
+
+	xbee->device.uring = NULL;
+	xbee_uringRxFree(info);
+
+	if (!xbee->running && info->txReady) {
+		xbee_uringRingCancel(&info->tx);
+		xbee_uringRingFree(&info->tx);
+		info->txReady = 0;
+	}
+	if (!xbee->running && info->txBuf) {
+		free(info->txBuf);
+		info->txBuf = NULL;
+		ll_destroy(&info->txBatch, free);
+	}
+
+	xbee_io_close(xbee);
+}
+
+/* ######################################################################### */
+
+/* post a read on the device, multishot if the kernel will do it
+   a one-shot read of a tty returns 0 straight away if there is nothing waiting (VMIN is 0), so it follows a poll */
+static void xbee_uringRxArm(struct xbee *xbee, struct xbee_uringInfo *info, unsigned int *tail) {
+	struct io_uring_sqe *sqe;
+
+	if (!info->rxMultishot) {
+		sqe = xbee_uringSqe(&info->rx, tail);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = xbee->device.fd;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->poll32_events = XSYS_POLLIN;
+		sqe->user_data = XBEE_URING_POLL;
+		info->rx.inflight++;
+	}
+
+	sqe = xbee_uringSqe(&info->rx, tail);
+	sqe->opcode = info->rxMultishot ? XBEE_URING_OP_READ_MULTISHOT : IORING_OP_READ;
+	sqe->fd = xbee->device.fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = XBEE_URING_BGID;
+	sqe->len = info->rxMultishot ? 0 : XBEE_IO_CHUNKLEN;
+	sqe->user_data = XBEE_URING_READ;
+	info->rx.inflight++;
+	info->rxArmed = 1;
+}
+
+/* fill the device's rxChunk from the next completed read, waiting for one if needed - see xbee_io_getRawByte() */
+int xbee_uringRead(struct xbee *xbee) {
+	struct xbee_uringInfo *info;
+	struct io_uring_cqe cqe;
+	unsigned int tail;
+	unsigned short bid;
+	int len;
+
+	info = xbee->device.uring;
+
+	for (;;) {
+		while (xbee_uringCqe(&info->rx, &cqe)) {
+			if (cqe.user_data != XBEE_URING_READ) continue;
+			if (!(cqe.flags & IORING_CQE_F_MORE)) info->rxArmed = 0;
+
+			if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+				bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+				len = cqe.res;
+				if (len > XBEE_IO_CHUNKLEN) len = XBEE_IO_CHUNKLEN;
+				memcpy(xbee->device.rxChunk, &info->bufs[bid * XBEE_IO_CHUNKLEN], len);
+				xbee_uringBufAdd(info, bid);
+				xbee->device.rxChunkLen = len;
+				xbee->device.rxChunkPos = 0;
+				info->rxGotData = 1;
+				xbee_statsRxRead(xbee, len);
+				return XBEE_ENONE;
+			}
+
+			if (cqe.res == 0 || cqe.res == -EIO) {
+				/* may be seen when USB devices are unplugged */
+				xbee_logstderr(1,"EOF detected...");
+				return XBEE_EEOF;
+			}
+			if (cqe.res == -ENOBUFS || cqe.res == -EAGAIN || cqe.res == -EINTR || cqe.res == -ECANCELED) {
+				/* we fell behind with the buffers, or the read was stopped - it will be posted again */
+				continue;
+			}
+			if (info->rxMultishot && !info->rxGotData && (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP || cqe.res == -EBADFD)) {
+				xbee_log(2,"The kernel can't do multishot reads on '%s' (%d), using one-shot reads", xbee->device.path, cqe.res);
+				info->rxMultishot = 0;
+				continue;
+			}
+			errno = -cqe.res;
+			xbee_perror(1,"io_uring read");
+			return XBEE_EIO;
+		}
+
+		/* post a read if there isn't one, and wait for something to happen */
+		tail = *info->rx.sqTail;
+		if (!info->rxArmed) xbee_uringRxArm(xbee, info, &tail);
+		if (xbee_uringSubmit(&info->rx, tail, 1)) {
+			xbee_perror(1,"io_uring_enter()");
+			return XBEE_EIO;
+		}
+	}
+}
+
+/* ######################################################################### */
+
+/* the batch has gone (or has been given up on), free the frames after the first - the tx thread frees that one */
+static void xbee_uringTxBatchFree(struct xbee_uringInfo *info) {
+	struct bufData *next;
+	while ((next = ll_ext_head(&info->txBatch)) != NULL) free(next);
+}
+
+/* the device went before the batch was written, put the frames after the first back at the head of the txList, in
+   order - the tx thread puts the first in front of them, and they are all sent again once the device is back */
+static void xbee_uringTxBatchRequeue(struct xbee *xbee, struct xbee_uringInfo *info) {
+	struct bufData *next;
+	while ((next = ll_ext_tail(&info->txBatch)) != NULL) ll_add_head(&xbee->txList, next);
+}
+
+/* send everything that is queued as one write, the first frame's deadline applies to the lot - unless there is a frame in
+   it without one (nobody is waiting for its ACK), which must not be dropped, then the batch has no deadline
+   the deadline only applies until the first byte has been written, after that the batch is always finished
+   this is the tx function for xbee_fmap_uring, and is called by the tx thread with the first buffer */
+int xbee_uringTx(struct xbee *xbee, struct bufData *buf) {
+	struct xbee_uringInfo *info;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	struct __kernel_timespec ts;
+	struct timespec now, start;
+	struct bufData *next;
+	int haveDeadline;
+	int noDeadline;
+	unsigned int tail;
+	unsigned char *p;
+	int writeDone;
+	int writeRes;
+	int frames;
+	int need;
+	int len;
+	int off;
+	int ret;
+
+	if ((info = xbee->fmapData) == NULL) return XBEE_EINVAL;
+
+	/* the tx ring belongs to this thread, set it up on first use */
+	if (!info->txReady && !info->txFailed) {
+		if (xbee_uringRingInit(&info->tx)) {
+			xbee_perror(2,"io_uring_setup()");
+			xbee_log(1,"io_uring isn't available, '%s' will be written without it", xbee->device.path);
+			info->txFailed = 1;
+		} else {
+			info->txReady = 1;
+		}
+	}
+	if (info->txFailed) return xbee_txSerialXBee(xbee, buf);
+	/* the device has gone, leave everything in the txList until it is back */
+	if (!xbee->device.ready) return XBEE_ENOTREADY;
+
+	if (!info->txBuf) {
+		if ((info->txBuf = malloc(XBEE_URING_TXBUFLEN)) == NULL) return XBEE_ENOMEM;
+		if (ll_init(&info->txBatch)) {
+			free(info->txBuf);
+			info->txBuf = NULL;
+			return XBEE_ELINKEDLIST;
+		}
+		info->txSize = XBEE_URING_TXBUFLEN;
+	}
+
+	/* build the batch - this buffer, and whatever else is queued while it fits */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	haveDeadline = 0;
+	noDeadline = 0;
+	frames = 0;
+	len = 0;
+	for (next = buf; next; next = ll_ext_head(&xbee->txList)) {
+		if (xbee_txExpired(next, &now)) {
+			xbee_log(1,"A frame spent more than %dms in the txList, it was dropped", XBEE_TX_DEADLINE);
+			xbee_txDropped(xbee, next);
+			if (next != buf) free(next);
+			continue;
+		}
+		need = XBEE_TX_ENCODEDLEN(next->len);
+		if (len + need > info->txSize) {
+			if (len) {
+				/* it goes in the next batch */
+				ll_add_head(&xbee->txList, next);
+				break;
+			}
+			if ((p = realloc(info->txBuf, need)) == NULL) {
+				if (next != buf) free(next);
+				xbee_uringTxBatchFree(info);
+				return XBEE_ENOMEM;
+			}
+			info->txBuf = p;
+			info->txSize = need;
+		}
+		if (!next->deadline.tv_sec) {
+			noDeadline = 1;
+		} else if (!haveDeadline) {
+			ts.tv_sec = next->deadline.tv_sec;
+			ts.tv_nsec = next->deadline.tv_nsec;
+			haveDeadline = 1;
+		}
+		if (next != buf) xbee_trace3(tx_dequeue, xbee, next, next->len);
+		len += xbee_txEncode(xbee, next, &info->txBuf[len]);
+		frames++;
+		/* the tx thread frees the first buffer, the rest are ours - but they are kept until they have been written */
+		if (next != buf) ll_add_tail(&info->txBatch, next);
+	}
+	if (!frames) return XBEE_ETIMEOUT;
+	if (noDeadline) haveDeadline = 0;
+
+	xbee_log(20,"WRITE: %d bytes (%d frames)", len, frames);
+
+	ret = XBEE_ENONE;
+	for (off = 0; off < len;) {
+		/* the write, and a timeout that cancels it at the deadline */
+		tail = *info->tx.sqTail;
+		sqe = xbee_uringSqe(&info->tx, &tail);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = xbee->device.fd;
+		sqe->addr = (unsigned long)&info->txBuf[off];
+		sqe->len = len - off;
+		sqe->user_data = XBEE_URING_WRITE;
+		info->tx.inflight++;
+		/* once part of the batch has gone, the rest must follow - half a frame would corrupt the next */
+		if (haveDeadline && off == 0) {
+			sqe->flags = IOSQE_IO_LINK;
+			sqe = xbee_uringSqe(&info->tx, &tail);
+			sqe->opcode = IORING_OP_LINK_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (unsigned long)&ts;
+			sqe->len = 1;
+			sqe->timeout_flags = IORING_TIMEOUT_ABS;
+			sqe->user_data = XBEE_URING_TIMEOUT;
+			info->tx.inflight++;
+		}
+
+		/* most writes complete straight away, if not then the device is full and we wait */
+		if (xbee_uringSubmit(&info->tx, tail, 0)) {
+			xbee_perror(1,"io_uring_enter()");
+			ret = XBEE_EIO;
+			goto done;
+		}
+		writeDone = 0;
+		writeRes = 0;
+		start.tv_sec = 0;
+		for (;;) {
+			while (xbee_uringCqe(&info->tx, &cqe)) {
+				if (cqe.user_data != XBEE_URING_WRITE) continue;
+				writeDone = 1;
+				writeRes = cqe.res;
+			}
+			/* the timeout must have finished too, before the next write can be linked */
+			if (writeDone && info->tx.inflight <= 0) break;
+			if (!writeDone && !start.tv_sec) clock_gettime(CLOCK_MONOTONIC, &start);
+			if (xbee_uringSubmit(&info->tx, *info->tx.sqTail, 1)) {
+				xbee_perror(1,"io_uring_enter()");
+				ret = XBEE_EIO;
+				goto done;
+			}
+		}
+		if (start.tv_sec) xbee_statsTxStall(xbee, &start);
+
+		if (writeRes > 0) {
+			off += writeRes;
+			continue;
+		}
+		if (writeRes == -ECANCELED) {
+			/* only possible before anything was written */
+			xbee_log(1,"The device wasn't ready for %d frame(s) within %dms, they were dropped", frames, XBEE_TX_DEADLINE);
+			xbee_txDropped(xbee, buf);
+			while ((next = ll_ext_head(&info->txBatch)) != NULL) {
+				xbee_txDropped(xbee, next);
+				free(next);
+			}
+			ret = XBEE_ETIMEOUT;
+			goto done;
+		}
+		if (writeRes == -EINTR || writeRes == -EAGAIN) continue;
+		if (writeRes == 0 || writeRes == -EIO || writeRes == -ENXIO || writeRes == -ENODEV || writeRes == -EBADF) {
+			/* may be seen when USB devices are unplugged, the whole batch is sent again once it is back */
+			xbee_logstderr(1,"EOF detected...");
+			xbee_uringTxBatchRequeue(xbee, info);
+			return XBEE_EEOF;
+		}
+		errno = -writeRes;
+		xbee_perror(1,"io_uring write");
+		ret = XBEE_EIO;
+		goto done;
+	}
+
+	xbee_statsTx(xbee, frames, len);
+
+done:
+	xbee_uringTxBatchFree(info);
+	return ret;
+}
+
+/* ######################################################################### */
+
+EXPORT int xbee_setupUring(char *path, int baudrate, struct xbee **retXbee) {
+	struct xbee_uringInfo *info;
+
+	if (!path) return XBEE_EMISSINGPARAM;
+
+	if ((info = calloc(1, sizeof(struct xbee_uringInfo))) == NULL) return XBEE_ENOMEM;
+	info->rx.fd = -1;
+	info->tx.fd = -1;
+	info->rxMultishot = 1;
+
+	/* the instance now owns 'info', and will free it */
+	return _xbee_setup(&xbee_fmap_uring, path, baudrate, info, retXbee);
+}
+
+#else /* XBEE_HAVE_URING */
+
+/* built without the io_uring headers */
+EXPORT int xbee_setupUring(char *path, int baudrate, struct xbee **retXbee) {
+	return XBEE_ENOTIMPLEMENTED;
+}
+
+#endif /* XBEE_HAVE_URING */
@@ -0,0 +1,107 @@
+#ifndef __XBEE_URING_H
+#define __XBEE_URING_H
+
+/*
+  libxbee - a C library to aid the use of Digi's XBee wireless modules
+            running in API mode (AP=2).
+
+  Copyright (C) 2009  Attie Grande (attie@attie.co.uk)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* the io_uring function map is the serial function map, with the device read and written through io_uring
+   the rx thread keeps a multishot read posted on the device, taking each chunk from a ring of provided buffers, and
+   the tx thread writes everything that is queued as one batch, with a linked timeout for the first frame's deadline.
+   if the kernel (or the headers that we were built against) can't do it, the instance uses the normal paths instead */
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* IORING_SETUP_COOP_TASKRUN arrived with provided buffer rings (Linux 5.19) */
+#ifdef IORING_SETUP_COOP_TASKRUN
+#define XBEE_HAVE_URING
+#endif
+#endif
+#endif
+
+#ifdef XBEE_HAVE_URING
+
+/* IORING_OP_READ_MULTISHOT (Linux 6.7) is newer than some headers, older kernels refuse it and one-shot reads are used */
+#define XBEE_URING_OP_READ_MULTISHOT 49
+
+/* the size of each ring, and the number of rx buffers (a power of 2) of XBEE_IO_CHUNKLEN bytes */
+#define XBEE_URING_ENTRIES  8
+#define XBEE_URING_RXBUFS   16
+#define XBEE_URING_BGID     0
+/* the initial size of the tx batch buffer, it grows to fit a single large frame */
+#define XBEE_URING_TXBUFLEN 4096
+
+/* what each request is, in its user_data */
+#define XBEE_URING_READ     1
+#define XBEE_URING_WRITE    2
+#define XBEE_URING_TIMEOUT  3
+#define XBEE_URING_CANCEL   4
+#define XBEE_URING_POLL     5
+
+/* the mapped rings of one io_uring instance, each is only ever touched by one thread at a time */
+struct xbee_uringRing {
+	int fd;
+	int inflight; /* requests that will still produce a final completion */
+
+	void *sqMap;
+	xsys_size_t sqMapLen;
+	void *cqMap;
+	xsys_size_t cqMapLen;
+	struct io_uring_sqe *sqes;
+	xsys_size_t sqesLen;
+
+	unsigned int *sqHead;
+	unsigned int *sqTail;
+	unsigned int *sqMask;
+	unsigned int *sqArray;
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int *cqMask;
+	struct io_uring_cqe *cqes;
+};
+
+struct xbee_uringInfo {
+	/* used by the rx thread, and xbee_io_open() / xbee_io_close() */
+	struct xbee_uringRing rx;
+	char rxMultishot; /* cleared if the kernel refuses a multishot read */
+	char rxArmed;     /* a read is posted */
+	char rxGotData;   /* a read has returned data, so a refusal isn't about the opcode */
+	struct io_uring_buf_ring *bufRing;
+	xsys_size_t bufRingLen;
+	unsigned char *bufs;
+	unsigned short bufTail;
+
+	/* used by the tx thread, set up on the first transmission, and kept until the instance is shut down */
+	struct xbee_uringRing tx;
+	char txReady;
+	char txFailed; /* io_uring isn't available, xbee_txSerialXBee() is used instead */
+	unsigned char *txBuf;
+	int txSize;
+	struct ll_head txBatch; /* the frames after the first that are in txBuf, kept until they have been written */
+};
+
+int xbee_uringIoOpen(struct xbee *xbee);
+void xbee_uringIoClose(struct xbee *xbee);
+int xbee_uringRead(struct xbee *xbee);
+int xbee_uringTx(struct xbee *xbee, struct bufData *buf);
+
+#endif /* XBEE_HAVE_URING */
+
+#endif /* __XBEE_URING_H */
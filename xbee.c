@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "internal.h"
 #include "fmaps.h"
@@ -33,6 +34,8 @@
 #include "rx.h"
 #include "tx.h"
 #include "net.h"
+#include "replay.h"
+#include "reactor.h"
 
 /* these global variables contain information about the different active (and shutting down) libxbee instances */
 /* the most recently setup libxbee instance - many functions will default to it if you don't provide a NULL xbee parameter */
@@ -77,6 +80,12 @@ int _xbee_validate(struct xbee *xbee, int acceptShutdown) {
 
 /* setup a new lixbee instance */
 EXPORT int xbee_setup(char *path, int baudrate, struct xbee **retXbee) {
+	/* serial devices use the serial function map */
+	return _xbee_setup(&xbee_fmap_serial, path, baudrate, NULL, retXbee);
+}
+/* setup a new libxbee instance, using the given function map
+   'fmapData' is made avaliable to the function map (as xbee->fmapData) before io_open() is called */
+int _xbee_setup(const struct xbee_fmap *f, char *path, int baudrate, void *fmapData, struct xbee **retXbee) {
 	struct xbee *xbee;
 	int i;
 	int ret = XBEE_ENONE;
@@ -92,8 +101,9 @@ EXPORT int xbee_setup(char *path, int baudrate, struct xbee **retXbee) {
 		ret = XBEE_ENOMEM;
 		goto die1;
 	}
-	/* and for now, we will only be using the serial function map */
-	xbee->f = &xbee_fmap_serial;
+	/* use the function map we were given */
+	xbee->f = f;
+	xbee->fmapData = fmapData;
 	
 	/* if we dont have a function map, then we failed */
 	if (!xbee->f) {
@@ -101,14 +111,23 @@ EXPORT int xbee_setup(char *path, int baudrate, struct xbee **retXbee) {
 		goto die2;
 	}
 	
+	/* setup the recordMutex, this protects the device's capture file (see replay.c) */
+	if (xsys_mutex_init(&xbee->device.recordMutex)) {
+		ret = XBEE_EMUTEX;
+		goto die2;
+	}
+	
 	/* allocate storage for the path */
 	if ((xbee->device.path = calloc(1, sizeof(char) * (strlen(path) + 1))) == NULL) {
 		ret = XBEE_ENOMEM;
-		goto die2;
+		goto die2_5;
 	}
 	/* and copy the path and baudrate in */
 	strcpy(xbee->device.path, path);
 	xbee->device.baudrate = baudrate;
+	xbee->device.latencyTimer = -1;
+	xbee->device.watchFd = -1;
+	xbee->device.apiMode = 2;
 	
 	/* if we have no io_open(), then we can't do anything... so fail */
 	if (!xbee->f->io_open) {
@@ -142,6 +161,12 @@ EXPORT int xbee_setup(char *path, int baudrate, struct xbee **retXbee) {
 		goto die6;
 	}
 	
+	/* and the threadMutex, the monitor holds this while it joins / restarts threads */
+	if (xsys_mutex_init(&xbee->threadMutex)) {
+		ret = XBEE_EMUTEX;
+		goto die6_3;
+	}
+	
 	/* setup the plugin list */
 	if (ll_init(&xbee->pluginList)) {
 		ret = XBEE_ELINKEDLIST;
@@ -157,12 +182,7 @@ EXPORT int xbee_setup(char *path, int baudrate, struct xbee **retXbee) {
 	/* indicate that we are now happy to be running */
 	xbee->running = 1;
 	
-	/* start the thread monitor */
-	if (xsys_thread_create(&(xbee->threadMonitor), (void *(*)(void *))xbee_threadMonitor, xbee)) {
-		xbee_perror(1,"xsys_thread_create(joinThread)");
-		ret = XBEE_ETHREAD;
-		goto die8;
-	}
+	/* the thread monitor is started along with the first monitored thread */
 	
 	/* add the libxbee instance to the 'active' list */
 	if (ll_add_tail(&xbee_list, xbee)) {
@@ -170,8 +190,8 @@ EXPORT int xbee_setup(char *path, int baudrate, struct xbee **retXbee) {
 		goto die9;
 	}
 	
-	/* start the Rx thread */
-	if (xbee_threadStartMonitored(xbee, &(xbee->rxThread), xbee_rx, xbee)) {
+	/* start the Rx thread, unless something else reads the device (e.g. the reactor) */
+	if (xbee->f->rx && xbee_threadStartMonitored(xbee, &(xbee->rxThread), xbee_rx, xbee)) {
 		xbee_log(1,"xbee_threadStartMonitored(xbee_rx)");
 		ret = XBEE_ETHREAD;
 		goto die10;
@@ -186,8 +206,8 @@ EXPORT int xbee_setup(char *path, int baudrate, struct xbee **retXbee) {
 		ret = XBEE_ELINKEDLIST;
 		goto die12;
 	}
-	/* start the Tx thread */
-	if (xbee_threadStartMonitored(xbee, &(xbee->txThread), xbee_tx, xbee)) {
+	/* start the Tx thread, unless there is nothing for it to do */
+	if (xbee->f->tx && xbee_threadStartMonitored(xbee, &(xbee->txThread), xbee_tx, xbee)) {
 		xbee_log(1,"xbee_threadStartMonitored(xbee_tx)");
 		ret = XBEE_ETHREAD;
 		goto die13;
@@ -221,12 +241,13 @@ die10:
 die9:
 	/* no longer running */
 	xbee->running = 0;
-	xsys_thread_cancel(xbee->threadMonitor);
-die8:
+	xbee_threadMonitorStop(xbee);
 	ll_destroy(&xbee->threadList, xbee_threadKillMonitored);
 die7:
 	ll_destroy(&xbee->pluginList, NULL);
 die6_5:
+	xsys_mutex_destroy(&xbee->threadMutex);
+die6_3:
 	xsys_sem_destroy(&xbee->semMonitor);
 die6:
 	xsys_mutex_destroy(&xbee->frameIdMutex);
@@ -237,12 +258,18 @@ die4: /* this marker is where we jump to if an error occured while setting up th
 		xsys_sem_destroy(&xbee->frameIds[i - 1].sem);
 	}
 	if (xbee->f->io_close) xbee->f->io_close(xbee);
+	/* the rxThread may have been waiting for the device to come back */
+	if (xbee->device.watchFd != -1) xsys_close(xbee->device.watchFd);
 die3:
 	free(xbee->device.path);
+die2_5:
+	xsys_mutex_destroy(&xbee->device.recordMutex);
 die2:
 	free(xbee);
+	/* the instance owned this, even though it never got going */
+	if (fmapData) free(fmapData);
 die1:
-	*retXbee = NULL;
+	if (retXbee) *retXbee = NULL;
 done:
 	return ret;
 }
@@ -282,6 +309,18 @@ EXPORT void xbee_shutdown(struct xbee *xbee) {
 	/* cleanup networking */
 	if (xbee->net) xbee_netStop(xbee);
 	
+	/* connections that have already ended are free'd by their callback thread, which is still using the instance */
+	if (__atomic_load_n(&xbee->conEnding, __ATOMIC_ACQUIRE)) {
+		xbee_log(5,"- Waiting for ended connections' callbacks...");
+		while (__atomic_load_n(&xbee->conEnding, __ATOMIC_ACQUIRE)) usleep(1000);
+	}
+	
+	/* instances on the reactor have no rx or tx thread, this is where their I/O stops */
+	if (xbee->reactor) {
+		xbee_log(5,"- Leaving the reactor...");
+		xbee_reactorDetach(xbee);
+	}
+	
 	/* cleanup txThread */
 	xbee_log(5,"- Terminating txThread...");
 	xbee_threadStopMonitored(xbee, &xbee->txThread, NULL, NULL);
@@ -296,8 +335,9 @@ EXPORT void xbee_shutdown(struct xbee *xbee) {
 	
 	/* cleanup threadMonitor */
 	xbee_log(5,"- Terminating thread monitor and child threads...");
-	xsys_thread_cancel(xbee->threadMonitor);
+	xbee_threadMonitorStop(xbee);
 	ll_destroy(&xbee->threadList, xbee_threadKillMonitored);
+	xsys_mutex_destroy(&xbee->threadMutex);
 	xsys_sem_destroy(&xbee->semMonitor);
 	
 	/* cleanup plugins */
@@ -320,8 +360,14 @@ EXPORT void xbee_shutdown(struct xbee *xbee) {
 	}
 	
 	xbee_log(5,"- Cleanup I/O information...");
+	if (xbee->device.record) xbee_recordStop(xbee);
 	if (xbee->f->io_close) xbee->f->io_close(xbee);
+	/* the rxThread may have been waiting for the device to come back */
+	if (xbee->device.watchFd != -1) xsys_close(xbee->device.watchFd);
+	xsys_mutex_destroy(&xbee->device.recordMutex);
 	free(xbee->device.path);
+	/* the function map's private data is owned by the instance */
+	if (xbee->fmapData) free(xbee->fmapData);
 	
 	/* xbee_cleanupMode() prints it's own messages */
 	xbee_cleanupMode(xbee);
@@ -131,6 +131,8 @@ int xbee_validate(struct xbee *xbee);
  *-  'path' should be the path to a serial port that is connected to an XBee module
  *-  'baudrate' should be a standard baud rate, from the list below:
  *     1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200
+ *     230400, 460800, 500000, 921600 and 1000000 can also be used where the system supports them, and on Linux
+ *     any other rate will be asked of the serial driver (which may round it, or refuse)
  *-  'retXbee' is an optional field, that allows the developer to start multiple libxbee instances.
  *     this value should be used to identift which libxbee instance should be used
 ` */ 
@@ -141,6 +143,38 @@ int xbee_setup(char *path, int baudrate, struct xbee **retXbee);
  */
 void xbee_shutdown(struct xbee *xbee);
 
+/* ######################################################################### */
+/* ######################################################################### */
+/* ######################################################################### */
+/* --- io.c --- */
+/* this function will change the baud rate of a running instance, setting BD (and applying it with AC) on the module and
+   then following it with the serial port. if the module can't be heard at the new rate, the old rate is put back
+ *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
+ *-  'baudrate' can be any rate that xbee_setup() accepts, non-standard rates are given to the module as the rate itself
+ *     the 'Local AT' connection is used - if you have one open, its waitForAck option is briefly enabled
+ */
+int xbee_baudrateSet(struct xbee *xbee, int baudrate);
+
+/* this function will enable or disable low latency mode for the serial port, which is off by default.
+   the driver is asked to pass on data as soon as it arrives (ASYNC_LOW_LATENCY, and the latency timer of USB adapters
+   that have one, e.g. FTDI - normally 16ms)
+   the driver settings are best effort - not every driver has them, and some need permission to change them
+ *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
+ *-  'enable' should be 1 to enable low latency mode, or 0 to return to the defaults
+ */
+int xbee_lowLatencySet(struct xbee *xbee, int enable);
+
+/* this function will switch an instance between API mode 2 (escaped, the default) and API mode 1 framing.
+   API mode 1 frames are never escaped, so binary data costs less on the wire, and a bad frame is only found by its checksum
+   if the mode has been set with xbee_modeSet(), the module is given AP (and AC), and then checked - like xbee_baudrateSet()
+   before that only libxbee's framing is changed, for a module that already has that AP (e.g. saved with WR)
+   replay instances just parse the capture with the given framing
+ *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
+ *-  'apiMode' should be 1 or 2
+ *     the 'Local AT' connection is used - if you have one open, its waitForAck option is briefly enabled
+ */
+int xbee_apiModeSet(struct xbee *xbee, int apiMode);
+
 /* ######################################################################### */
 /* ######################################################################### */
 /* ######################################################################### */
@@ -310,6 +344,81 @@ int xbee_pluginLoad(char *filename, struct xbee *xbee, void *arg);
  */
 int xbee_pluginUnload(char *filename, struct xbee *xbee);
 
+/* ######################################################################### */
+/* ######################################################################### */
+/* ######################################################################### */
+/* --- replay.c --- */
+/* this function will setup a libxbee instance that replays a capture file instead of talking to an XBee module.
+   the capture is fed through the complete rx path (packet handlers, connection matching and callbacks)
+   anything that is transmitted is discarded
+ *-  'path' should be the path to a capture file, created by xbee_recordStart(). other files are replayed as a raw byte stream
+ *-  'realtime' should be non-zero to replay the capture with its original timing, or 0 to replay it as fast as possible
+ *-  'retXbee' is an optional field, see xbee_setup()
+ */
+int xbee_setupReplay(char *path, int realtime, struct xbee **retXbee);
+
+/* this function will block until the entire capture has been read by the given replay instance
+ *-  'xbee' should be an instance returned by xbee_setupReplay(). If this is NULL, then the most recent instance will be used
+ */
+int xbee_replayWait(struct xbee *xbee);
+
+/* this function will start capturing everything that is read from the device, to a file that can be given to xbee_setupReplay()
+ *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
+ *-  'path' is the file to write the capture to, it will be overwritten
+ */
+int xbee_recordStart(struct xbee *xbee, char *path);
+
+/* this function will stop a capture that was started by xbee_recordStart()
+ *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
+ */
+int xbee_recordStop(struct xbee *xbee);
+
+/* ######################################################################### */
+/* ######################################################################### */
+/* ######################################################################### */
+/* --- remote.c --- */
+/* this function will setup a libxbee instance that uses the XBee module of a libxbee network server (see xbee_netStart())
+ * connections made on this instance are made on the server, and their packets are forwarded back, so several processes
+ * can share one module through the normal API. the mode is taken from the server, which must be built from the same commit
+ *-  'host' is the server's host name or address, or the path of a Unix domain socket (see xbee_netStartUnix()) if it
+ *     starts with '/' or '@'
+ *-  'port' is the server's TCP port, it is ignored for a Unix domain socket
+ *-  'retXbee' is an optional field, see xbee_setup()
+ */
+int xbee_setupRemote(char *host, int port, struct xbee **retXbee);
+
+/* ######################################################################### */
+/* ######################################################################### */
+/* ######################################################################### */
+/* --- reactor.c --- */
+/* the reactor lets many instances share a small pool of event loop threads, instead of an rx and tx thread each
+ * this function will start the reactor, it is started with XBEE_REACTOR_THREADS thread(s) by xbee_setupReactor() if needed
+ *-  'threads' is the number of event loop threads, each instance is given to the least busy. 0 means the default
+ */
+int xbee_reactorStart(int threads);
+
+/* this function will stop the reactor's threads, it returns XBEE_EINUSE while any instances are using it
+ */
+int xbee_reactorStop(void);
+
+/* this function will setup a libxbee instance that is served by the reactor, see xbee_setup()
+ * packets are read and handled on the reactor's threads, but callbacks still run on their own thread as usual
+ *-  'path', 'baudrate' and 'retXbee' are the same as for xbee_setup()
+ */
+int xbee_setupReactor(char *path, int baudrate, struct xbee **retXbee);
+
+/* ######################################################################### */
+/* ######################################################################### */
+/* ######################################################################### */
+/* --- uring.c --- */
+/* this function will setup a libxbee instance whose device is read and written through io_uring (Linux 5.19 or later)
+ * the rx thread keeps a (multishot, on Linux 6.7 or later) read posted, and the tx thread writes everything that is
+ * queued in one go. if io_uring isn't available at run time then the instance works as if it came from xbee_setup()
+ * XBEE_ENOTIMPLEMENTED is returned if libxbee was built without the io_uring headers
+ *-  'path', 'baudrate' and 'retXbee' are the same as for xbee_setup()
+ */
+int xbee_setupUring(char *path, int baudrate, struct xbee **retXbee);
+
 /* ######################################################################### */
 /* ######################################################################### */
 /* ######################################################################### */
@@ -320,11 +429,75 @@ int xbee_pluginUnload(char *filename, struct xbee *xbee);
  */
 int xbee_netStart(struct xbee *xbee, int port);
 
+/* this function allows you to listen for libxbeed connections from the same machine, over a Unix domain socket
+ * the protocol is the same as xbee_netStart(), but clients are authorized by their credentials - root, the same
+ * user as this process, or a member of this process' group may connect
+ *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
+ *-  'path' is the socket's path, which is removed by xbee_netStop(). if it starts with '@' then the socket is in the
+ *     abstract namespace, and no file is created
+ *-  'type' should be SOCK_STREAM, or SOCK_SEQPACKET to receive each message in a single record. 0 means SOCK_STREAM
+ */
+int xbee_netStartUnix(struct xbee *xbee, char *path, int type);
+
 /* this function will close the existing listening connection, and all active connections
  *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
  */
 int xbee_netStop(struct xbee *xbee);
 
+/* ######################################################################### */
+/* ######################################################################### */
+/* ######################################################################### */
+/* --- stats.c --- */
+/* this struct holds a snapshot of an instance's counters, it is filled in by xbee_statsGet() */
+struct xbee_stats {
+	/* reads from the device - rxBytes / rxReads is the average read size */
+	unsigned long long rxReads;
+	unsigned long long rxBytes;
+	
+	/* the round trip time (microseconds) from xbee_connTx() to the module's ACK / response, with waitForAck enabled */
+	unsigned long long rttCount;
+	unsigned int rttLast;
+	unsigned int rttMin;
+	unsigned int rttMax;
+	unsigned int rttAvg;
+	
+	/* frames written to the device, and the bytes they took once escaped */
+	unsigned long long txFrames;
+	unsigned long long txBytes;
+	/* how often, and for how long in total (microseconds), the device wasn't ready for more (e.g. held off by CTS) */
+	unsigned long long txStalls;
+	unsigned long long txStallTime;
+	/* frames sent with waitForAck that were dropped, because they couldn't be written within XBEE_TX_DEADLINE (1 second) of
+	   xbee_connTx() - which returns XBEE_ETIMEOUT for them. other frames are kept for as long as it takes */
+	unsigned long long txExpired;
+	/* frames from the device that were discarded for a bad checksum or an impossible length, the parser carries on
+	   (with API mode 1 each false start that is rescanned counts too) */
+	unsigned long long rxCorrupt;
+	
+	/* how often the device has gone (e.g. a USB adapter was unplugged) and been opened again, and for how long (milliseconds)
+	   frames that are queued meanwhile are kept (those sent with waitForAck until XBEE_TX_DEADLINE) */
+	unsigned long long reconnects;
+	unsigned int reconnectLast;
+	unsigned int reconnectMax;
+	
+	/* how often a thread (e.g. rx or tx) died and was restarted, and how long (microseconds) it took to get going again
+	   a thread that goes within 100ms of being started is held off until then */
+	unsigned long long threadRestarts;
+	unsigned int threadRestartLast;
+	unsigned int threadRestartMax;
+};
+
+/* this function will take a snapshot of the instance's counters
+ *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
+ *-  'stats' is the struct that will be filled in
+ */
+int xbee_statsGet(struct xbee *xbee, struct xbee_stats *stats);
+
+/* this function will set all of the instance's counters back to 0
+ *-  'xbee' should be the libxbee instance that you wish to use. If this is NULL, then the most recent instance will be used
+ */
+int xbee_statsReset(struct xbee *xbee);
+
 /* ######################################################################### */
 /* ######################################################################### */
 /* ######################################################################### */
@@ -50,23 +50,29 @@ int xsys_fflush(FILE *stream);
 int xsys_ferror(FILE *stream);
 int xsys_feof(FILE *stream);
 
-int xsys_select(FILE *stream, struct timeval *timeout);
+int xsys_poll(int fd, int events, int timeout);    (events are XSYS_POLLIN / XSYS_POLLOUT, it may return XSYS_POLLHUP)
 
-int xsys_disableBuffer(FILE *stream);
+int xsys_watchOpen(char *path);                    (a handle that xsys_watchWait() can wait on for 'path' to appear, or -1)
+int xsys_watchWait(int fd, char *path, int timeout); (1 if something changed, 0 on timeout, or -1 - the handle is closed by xsys_close())
 */
 
 
 /* configuration */
+int xsys_checkBaudrate(int baudrate);
 int xsys_setupSerial(struct xbee *xbee);
+int xsys_setupLowLatency(struct xbee *xbee, int enable);
 
 
 /* threads --- needs the following functions:
 int xsys_thread_create(xsys_thread *thread, void*(*start_routine)(void*), void *arg);
 int xsys_thread_cancel(xsys_thread thread);
 int xsys_thread_join(xsys_thread thread, void **retval);
-int xsys_thread_tryjoin(xsys_thread thread, void **retval);
 int xsys_thread_detach_self(void);
 int xsys_thread_iAm(xsys_thread thread);
+int xsys_thread_cancelDisable(int *oldState);
+int xsys_thread_cancelRestore(int oldState);
+xsys_thread_cleanupPush(void (*routine)(void*), void *arg);  -- these must be paired within the same block
+xsys_thread_cleanupPop(int execute);
 */
 
 
@@ -76,6 +82,7 @@ int xsys_mutex_destroy(xsys_mutex *mutex);
 int xsys_mutex_lock(xsys_mutex *mutex);
 int xsys_mutex_trylock(xsys_mutex *mutex);
 int xsys_mutex_unlock(xsys_mutex *mutex);
+and a static initializer: XSYS_MUTEX_INITIALIZER
 */
 
 
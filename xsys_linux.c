@@ -25,10 +25,39 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <linux/serial.h>
+#include <sys/inotify.h>
 
 #include "log.h"
 
+/* arbitrary baud rates need termios2 and BOTHER, but <asm/termbits.h> can't be included alongside <termios.h>
+   this is the kernel's generic layout, which x86, ARM and RISC-V use - other architectures get the standard rates only */
+#if defined(TCGETS2) && (defined(__i386__) || defined(__x86_64__) || defined(__arm__) || defined(__aarch64__) || defined(__riscv))
+#define XSYS_TERMIOS2
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+#endif /* TCGETS2 */
+
 /* ######################################################################### */
 /* file I/O */
 
@@ -45,38 +74,160 @@ int xsys_lockf(int fd) {
 	return XBEE_ENONE;
 }
 
-int xsys_select(FILE *stream, struct timeval *timeout) {
-  fd_set fds;
-	int fd;
+/* wait for 'events' (XSYS_POLLIN / XSYS_POLLOUT) on the fd, for up to 'timeout' ms (-1 is forever)
+   returns the events that happened (which may be a hangup or error instead), 0 on timeout, or -1 */
+int xsys_poll(int fd, int events, int timeout) {
+	struct pollfd pfd;
+	int ret;
+	
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	
+	if ((ret = poll(&pfd, 1, timeout)) <= 0) return ret;
+	return pfd.revents;
+}
 
-	fd = fileno(stream);
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
+/* watch the directory that holds 'path' (or the nearest one above it, if that has gone too - e.g. /dev/serial/by-id is
+   removed along with the last adapter), returns 0 or -1 */
+static int xsys_watchAdd(int fd, char *path) {
+	char dir[PATH_MAX];
+	char *p;
+	
+	if (strlen(path) >= sizeof(dir)) return -1;
+	strcpy(dir, path);
+	
+	for (;;) {
+		if ((p = strrchr(dir, '/')) == NULL) {
+			strcpy(dir, ".");
+		} else if (p == dir) {
+			dir[1] = '\0';
+		} else {
+			*p = '\0';
+		}
+		/* udev creates the node and then sets its permissions, either may be what lets it be opened */
+		if (inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO | IN_ATTRIB) != -1) return 0;
+		if (errno != ENOENT || !strcmp(dir, "/") || !strcmp(dir, ".")) return -1;
+	}
+}
+
+/* watch for 'path' appearing, e.g. a USB adapter being plugged back in
+   returns an inotify fd for xsys_watchWait(), or -1 if the path can't be watched */
+int xsys_watchOpen(char *path) {
+	int fd;
+	
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) return -1;
+	if (xsys_watchAdd(fd, path)) {
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
 
-  return select(fd + 1, &fds, NULL, NULL, timeout);
+/* wait for up to 'timeout' ms (-1 is forever) for something to change where 'path' lives
+   returns 1 if something did, 0 on timeout, or -1. the handle is kept for the whole wait - closing it is slow */
+int xsys_watchWait(int fd, char *path, int timeout) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int ret;
+	
+	if ((ret = xsys_poll(fd, XSYS_POLLIN, timeout)) <= 0) return ret;
+	
+	/* the events themselves don't matter, the caller just tries again */
+	while (read(fd, buf, sizeof(buf)) > 0);
+	
+	/* a directory on the way may have appeared, watch the deepest one (watching a directory twice is harmless) */
+	xsys_watchAdd(fd, path);
+	
+	return 1;
 }
 
 
 /* ######################################################################### */
 /* configuration */
 
+/* the rates that termios has a constant for */
+static const struct {
+	int baudrate;
+	speed_t speed;
+} xsys_baudrates[] = {
+	{ 1200,    B1200    },
+	{ 2400,    B2400    },
+	{ 4800,    B4800    },
+	{ 9600,    B9600    },
+	{ 19200,   B19200   },
+	{ 38400,   B38400   },
+	{ 57600,   B57600   },
+	{ 115200,  B115200  },
+#ifdef B230400
+	{ 230400,  B230400  },
+#endif
+#ifdef B460800
+	{ 460800,  B460800  },
+#endif
+#ifdef B500000
+	{ 500000,  B500000  },
+#endif
+#ifdef B921600
+	{ 921600,  B921600  },
+#endif
+#ifdef B1000000
+	{ 1000000, B1000000 },
+#endif
+	{ 0, 0 }
+};
+
+/* returns 0 if the serial port can be set to the given baud rate (the driver may still refuse an unusual one) */
+int xsys_checkBaudrate(int baudrate) {
+	int i;
+	for (i = 0; xsys_baudrates[i].baudrate; i++) {
+		if (xsys_baudrates[i].baudrate == baudrate) return 0;
+	}
+#ifdef XSYS_TERMIOS2
+	if (baudrate > 0) return 0;
+#endif
+	return XBEE_EINVALBAUDRATE;
+}
+
+#ifdef XSYS_TERMIOS2
+/* set a rate that termios has no constant for, both directions */
+static int xsys_setCustomBaudrate(struct xbee *xbee, int fd, int baudrate) {
+	struct termios2 tc2;
+
+	if (ioctl(fd, TCGETS2, &tc2)) {
+		xbee_perror(1,"ioctl(TCGETS2)");
+		return XBEE_ESETUP;
+	}
+	tc2.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT)); /* no input rate means the same as the output */
+	tc2.c_cflag |= BOTHER;
+	tc2.c_ispeed = baudrate;
+	tc2.c_ospeed = baudrate;
+	if (ioctl(fd, TCSETS2, &tc2)) {
+		xbee_perror(1,"ioctl(TCSETS2)");
+		return XBEE_ESETUP;
+	}
+	
+	return 0;
+}
+#endif /* XSYS_TERMIOS2 */
+
+/* this may be called again while the instance is running, to change the baud rate */
 int xsys_setupSerial(struct xbee *xbee) {
   struct termios tc;
   speed_t chosenbaud;
+  int custom;
+  int i;
 	
   /* select the baud rate */
-  switch (xbee->device.baudrate) {
-  case 1200:  chosenbaud = B1200;   break;
-  case 2400:  chosenbaud = B2400;   break;
-  case 4800:  chosenbaud = B4800;   break;
-  case 9600:  chosenbaud = B9600;   break;
-  case 19200: chosenbaud = B19200;  break;
-  case 38400: chosenbaud = B38400;  break;
-  case 57600: chosenbaud = B57600;  break;
-  case 115200:chosenbaud = B115200; break;
-  default:
-    return XBEE_EINVALBAUDRATE;
-  };
+  if (xsys_checkBaudrate(xbee->device.baudrate)) return XBEE_EINVALBAUDRATE;
+  custom = 1;
+  chosenbaud = B38400; /* a placeholder, until the real rate is set */
+  for (i = 0; xsys_baudrates[i].baudrate; i++) {
+    if (xsys_baudrates[i].baudrate != xbee->device.baudrate) continue;
+    chosenbaud = xsys_baudrates[i].speed;
+    custom = 0;
+    break;
+  }
 	
   /* setup the baud rate and other io attributes */
   if (tcgetattr(xbee->device.fd, &tc)) {
@@ -116,15 +267,27 @@ int xsys_setupSerial(struct xbee *xbee) {
   tc.c_lflag &= ~ IEXTEN;           /* disable input processing */
   /* control characters */
   memset(tc.c_cc,0,sizeof(tc.c_cc));
+  /* read() never blocks (O_NONBLOCK), it is called after xsys_poll() and returns whatever is waiting (up to the chunk size)
+     with VMIN at 1 a read that finds nothing fails with EAGAIN, so 0 only ever means that the device has gone (with VMIN at 0
+     it would also mean 'nothing yet', which an io_uring read can't tell apart) */
+  tc.c_cc[VMIN] = 1;
+  tc.c_cc[VTIME] = 0;
 	/* set i/o baud rate */
   if (cfsetspeed(&tc, chosenbaud)) {
 		xbee_perror(1,"cfsetspeed()");
 		return XBEE_ESETUP;
 	}
-  if (tcsetattr(xbee->device.fd, TCSANOW, &tc)) {
+  /* anything that has already been written goes at the old rate */
+  if (tcsetattr(xbee->device.fd, TCSADRAIN, &tc)) {
 		xbee_perror(1,"tcsetattr()");
 		return XBEE_ESETUP;
 	}
+#ifdef XSYS_TERMIOS2
+  if (custom) {
+    int ret;
+    if ((ret = xsys_setCustomBaudrate(xbee, xbee->device.fd, xbee->device.baudrate)) != 0) return ret;
+  }
+#endif
 	
 	/* enable input & output transmission */
   if (tcflow(xbee->device.fd, TCOON | TCION)) {
@@ -136,6 +299,65 @@ int xsys_setupSerial(struct xbee *xbee) {
 }
 
 
+/* USB serial adapters that buffer received data (e.g. FTDI) have a 'latency_timer' in sysfs, in milliseconds
+   returns the old value, or -1 if there isn't one. if 'value' is -1 then nothing is written */
+static int xsys_latencyTimer(struct xbee *xbee, int value) {
+	char path[PATH_MAX];
+	char sysPath[PATH_MAX + 64];
+	FILE *f;
+	int old;
+	
+	/* the device may be a link, e.g. /dev/serial/by-id/... */
+	if (realpath(xbee->device.path, path) == NULL) return -1;
+	snprintf(sysPath, sizeof(sysPath), "/sys/class/tty/%s/device/latency_timer", basename(path));
+	
+	if ((f = fopen(sysPath, "r+")) == NULL) return -1;
+	if (fscanf(f, "%d", &old) != 1) old = -1;
+	if (old != -1 && value != -1) {
+		rewind(f);
+		if (fprintf(f, "%d\n", value) < 0 || fflush(f)) {
+			xbee_log(2,"Unable to write '%s'", sysPath);
+			old = -1;
+		}
+	}
+	fclose(f);
+	
+	return old;
+}
+
+/* ask the driver to pass received data on straight away, or put it back how it was
+   returns 0 if anything was changed, this isn't supported by all drivers (e.g. ptys) */
+int xsys_setupLowLatency(struct xbee *xbee, int enable) {
+	struct serial_struct ss;
+	int applied;
+	
+	applied = 0;
+	
+	if (ioctl(xbee->device.fd, TIOCGSERIAL, &ss) == 0) {
+		if (enable) {
+			ss.flags |= ASYNC_LOW_LATENCY;
+		} else {
+			ss.flags &= ~ASYNC_LOW_LATENCY;
+		}
+		if (ioctl(xbee->device.fd, TIOCSSERIAL, &ss) == 0) {
+			applied = 1;
+		} else {
+			xbee_log(2,"ioctl(TIOCSSERIAL) failed: %s", strerror(errno));
+		}
+	}
+	
+	/* some drivers don't tie the latency timer to ASYNC_LOW_LATENCY, so set it directly too */
+	if (enable) {
+		if (xbee->device.latencyTimer == -1 && (xbee->device.latencyTimer = xsys_latencyTimer(xbee, 1)) != -1) applied = 1;
+	} else if (xbee->device.latencyTimer != -1) {
+		if (xsys_latencyTimer(xbee, xbee->device.latencyTimer) != -1) applied = 1;
+		xbee->device.latencyTimer = -1;
+	}
+	
+	return applied ? 0 : XBEE_ENOTIMPLEMENTED;
+}
+
+
 /* ######################################################################### */
 /* semaphores */
 
@@ -26,11 +26,16 @@
 
 #include <unistd.h>
 #include <sys/time.h>
+#include <poll.h>
 
 #include <fcntl.h>
+#ifndef __USE_GNU /* _GNU_SOURCE gives us it anyway */
 #define __USE_GNU
 #include <pthread.h>
 #undef __USE_GNU
+#else
+#include <pthread.h>
+#endif
 #include <semaphore.h>
 
 
@@ -39,6 +44,7 @@
 typedef pthread_t         xsys_thread;
 
 typedef pthread_mutex_t   xsys_mutex;
+#define XSYS_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 
 typedef sem_t             xsys_sem;
 typedef size_t            xsys_size_t;
@@ -65,9 +71,13 @@ int xsys_lockf(int fd);
 #define xsys_ferror(stream)                   ferror((stream))
 #define xsys_feof(stream)                     feof((stream))
 
-int xsys_select(FILE *stream, struct timeval *timeout);
+#define XSYS_POLLIN                           POLLIN
+#define XSYS_POLLOUT                          POLLOUT
+#define XSYS_POLLHUP                          (POLLHUP | POLLERR | POLLNVAL)
+int xsys_poll(int fd, int events, int timeout);
 
-#define xsys_disableBuffer(stream)            setvbuf((stream), NULL, _IONBF, BUFSIZ)
+int xsys_watchOpen(char *path);
+int xsys_watchWait(int fd, char *path, int timeout);
 
 
 /* ######################################################################### */
@@ -77,9 +87,14 @@ int xsys_select(FILE *stream, struct timeval *timeout);
                                               pthread_create((pthread_t*)(thread), NULL, (start_routine), (arg))
 #define xsys_thread_cancel(thread)            pthread_cancel((pthread_t)(thread))
 #define xsys_thread_join(thread, retval)      pthread_join((pthread_t)(thread), (retval))
-#define xsys_thread_tryjoin(thread, retval)   pthread_tryjoin_np((pthread_t)(thread), (retval))
 #define xsys_thread_detach_self()             pthread_detach(pthread_self())
 #define xsys_thread_iAm(thread)               pthread_equal(pthread_self(), (thread))
+#define xsys_thread_cancelDisable(oldState)   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, (oldState))
+#define xsys_thread_cancelRestore(oldState)   pthread_setcancelstate((oldState), NULL)
+#define xsys_thread_cancelAsync(oldType)      pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, (oldType))
+#define xsys_thread_cancelAsyncRestore(oldType) pthread_setcanceltype((oldType), NULL)
+#define xsys_thread_cleanupPush(routine, arg) pthread_cleanup_push((routine), (arg))
+#define xsys_thread_cleanupPop(execute)       pthread_cleanup_pop((execute))
 
 
 /* ######################################################################### */